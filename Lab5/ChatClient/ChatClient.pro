@@ -1,27 +1,36 @@
-QT       += core gui network
-
-
-greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
-
-CONFIG += c++17
-
-# You can make your code fail to compile if it uses deprecated APIs.
-# In order to do so, uncomment the following line.
-#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
-
-SOURCES += \
-    chatclient.cpp \
-    main.cpp \
-    mainwindow.cpp
-
-HEADERS += \
-    chatclient.h \
-    mainwindow.h
-
-FORMS += \
-    mainwindow.ui
-
-# Default rules for deployment.
-qnx: target.path = /tmp/$${TARGET}/bin
-else: unix:!android: target.path = /opt/$${TARGET}/bin
-!isEmpty(target.path): INSTALLS += target
+QT       += core gui network sql
+
+
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+CONFIG += c++17
+
+# You can make your code fail to compile if it uses deprecated APIs.
+# In order to do so, uncomment the following line.
+#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
+
+# 文件块帧格式和压缩帧和服务端共用
+INCLUDEPATH += ../ChatServer
+include(../ChatServer/zlib.pri)
+
+SOURCES += \
+    ../ChatServer/framecompressor.cpp \
+    chatcache.cpp \
+    chatclient.cpp \
+    main.cpp \
+    mainwindow.cpp
+
+HEADERS += \
+    ../ChatServer/filechunk.h \
+    ../ChatServer/framecompressor.h \
+    chatcache.h \
+    chatclient.h \
+    mainwindow.h
+
+FORMS += \
+    mainwindow.ui
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
@@ -0,0 +1,402 @@
+#include "chatcache.h"
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QSet>
+#include <QUuid>
+#include <QDebug>
+
+// 每个房间保留的消息条数
+static const int MaxMessagesPerRoom = 500;
+// 攒批的最长时间和最大条数
+static const int BatchIntervalMs = 200;
+static const int MaxBatchSize = 256;
+// 同一个缓存文件最多给几个同时运行的客户端分配固定编号，再多的只用临时编号
+static const int MaxClientSlots = 16;
+
+ChatCache::ChatCache(QObject *parent)
+    : QThread{parent}, m_slotLock(nullptr), m_stopping(true)
+{
+    const QString id = QString::number(quintptr(this),16);
+    m_readConnection = "chatcache-read-" + id;
+    m_writeConnection = "chatcache-write-" + id;
+}
+
+ChatCache::~ChatCache()
+{
+    close();
+}
+
+static bool configure(QSqlDatabase &db)
+{
+    QSqlQuery query(db);
+    // WAL 模式下后台写入时主线程照样可以读
+    return query.exec("PRAGMA journal_mode=WAL")
+        && query.exec("PRAGMA synchronous=NORMAL")
+        && query.exec("PRAGMA busy_timeout=2000");
+}
+
+bool ChatCache::open(const QString &fileName)
+{
+    close();
+    m_fileName = fileName;
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE",m_readConnection);
+    db.setDatabaseName(fileName);
+    if(!db.open() || !configure(db)){
+        qWarning() << "无法打开聊天缓存" << fileName << db.lastError().text();
+        return false;
+    }
+    QSqlQuery query(db);
+    const bool created = query.exec("CREATE TABLE IF NOT EXISTS messages("
+                                    "server TEXT NOT NULL, room TEXT NOT NULL, epoch INTEGER NOT NULL, seq INTEGER NOT NULL, "
+                                    "json BLOB NOT NULL, PRIMARY KEY(server,room,epoch,seq)) WITHOUT ROWID")
+        && query.exec("CREATE TABLE IF NOT EXISTS rooms("
+                      "server TEXT NOT NULL, room TEXT NOT NULL, epoch INTEGER NOT NULL, last_seq INTEGER NOT NULL, "
+                      "PRIMARY KEY(server,room)) WITHOUT ROWID")
+        && query.exec("CREATE TABLE IF NOT EXISTS userlists(server TEXT PRIMARY KEY, users BLOB NOT NULL)")
+        && query.exec("CREATE TABLE IF NOT EXISTS client_outbox("
+                      "client_id TEXT NOT NULL, server TEXT NOT NULL, cseq INTEGER NOT NULL, room TEXT NOT NULL, text TEXT NOT NULL, "
+                      "PRIMARY KEY(client_id,server,cseq)) WITHOUT ROWID")
+        && query.exec("CREATE TABLE IF NOT EXISTS client_outbox_seq("
+                      "client_id TEXT NOT NULL, server TEXT NOT NULL, last_cseq INTEGER NOT NULL, "
+                      "PRIMARY KEY(client_id,server)) WITHOUT ROWID")
+        && query.exec("CREATE TABLE IF NOT EXISTS settings(key TEXT PRIMARY KEY, value TEXT NOT NULL)");
+    if(!created){
+        qWarning() << "无法创建聊天缓存表" << query.lastError().text();
+        return false;
+    }
+    if(!migrateOutbox(db) || !claimClientId(db))
+        return false;
+    m_stopping = false;
+    start(QThread::LowPriority);
+    return true;
+}
+
+// 以前的待发表按服务器共用一个序号，归到第一个编号槽（原来的 client_id）名下
+bool ChatCache::migrateOutbox(QSqlDatabase &db)
+{
+    QSqlQuery query(db);
+    if(!query.exec("SELECT 1 FROM sqlite_master WHERE type='table' AND name='outbox'") || !query.next())
+        return true;
+    // 更早的待发表没有房间列；列已经存在时这句会失败，不用管。旧记录的房间为空，登录后进的第一个房间就是它的房间
+    query.exec("ALTER TABLE outbox ADD COLUMN room TEXT NOT NULL DEFAULT ''");
+    const bool migrated = db.transaction()
+        && query.exec("INSERT OR IGNORE INTO client_outbox(client_id,server,cseq,room,text) "
+                      "SELECT s.value, o.server, o.cseq, o.room, o.text FROM outbox o JOIN settings s ON s.key='client_id'")
+        && query.exec("INSERT OR IGNORE INTO client_outbox_seq(client_id,server,last_cseq) "
+                      "SELECT s.value, q.server, q.last_cseq FROM outbox_seq q JOIN settings s ON s.key='client_id'")
+        && query.exec("DROP TABLE outbox")
+        && query.exec("DROP TABLE IF EXISTS outbox_seq")
+        && db.commit();
+    if(!migrated){
+        qWarning() << "无法迁移待发消息" << query.lastError().text();
+        db.rollback();
+    }
+    return migrated;
+}
+
+bool ChatCache::claimClientId(QSqlDatabase &db)
+{
+    QSqlQuery query(db);
+    for(int slot = 0; slot < MaxClientSlots; slot++){
+        QLockFile *lock = new QLockFile(QString("%1.client%2.lock").arg(m_fileName).arg(slot));
+        lock->setStaleLockTime(0);
+        if(!lock->tryLock(0)){
+            delete lock;
+            continue;
+        }
+        m_slotLock = lock;
+        // 第一个槽沿用以前的键，升级后服务器那边的去重窗口还认得
+        const QString key = slot == 0 ? QString("client_id") : QString("client_id.%1").arg(slot);
+        query.prepare("SELECT value FROM settings WHERE key=?");
+        query.addBindValue(key);
+        if(query.exec() && query.next()){
+            m_clientId = query.value(0).toString();
+            return true;
+        }
+        // 客户端编号要在用之前落盘，这里在主线程同步写
+        m_clientId = QUuid::createUuid().toString(QUuid::WithoutBraces);
+        query.prepare("INSERT INTO settings(key,value) VALUES(?,?)");
+        query.addBindValue(key);
+        query.addBindValue(m_clientId);
+        if(!query.exec()){
+            qWarning() << "无法保存客户端编号" << query.lastError().text();
+            return false;
+        }
+        return true;
+    }
+    // 槽都被占了：用一个不落盘的编号，这次写下的待发消息下次启动时不会再发
+    qWarning() << "同时运行的客户端太多，本次使用临时的客户端编号";
+    m_clientId = QUuid::createUuid().toString(QUuid::WithoutBraces);
+    return true;
+}
+
+void ChatCache::close()
+{
+    if(isRunning()){
+        {
+            QMutexLocker locker(&m_mutex);
+            m_stopping = true;
+            m_wakeUp.wakeOne();
+        }
+        wait();
+    }
+    if(QSqlDatabase::contains(m_readConnection)){
+        QSqlDatabase::database(m_readConnection,false).close();
+        QSqlDatabase::removeDatabase(m_readConnection);
+    }
+    delete m_slotLock;
+    m_slotLock = nullptr;
+}
+
+bool ChatCache::isOpen() const
+{
+    return QSqlDatabase::contains(m_readConnection) && QSqlDatabase::database(m_readConnection,false).isOpen();
+}
+
+QVector<QJsonObject> ChatCache::recentMessages(const QString &server, const QString &room, int limit) const
+{
+    QVector<QJsonObject> messages;
+    if(!isOpen())
+        return messages;
+    QSqlQuery query(QSqlDatabase::database(m_readConnection));
+    query.prepare("SELECT json FROM messages WHERE server=? AND room=? ORDER BY epoch DESC, seq DESC LIMIT ?");
+    query.addBindValue(server);
+    query.addBindValue(room);
+    query.addBindValue(limit);
+    if(!query.exec())
+        return messages;
+    while(query.next()){
+        const QJsonDocument jsonDoc = QJsonDocument::fromJson(query.value(0).toByteArray());
+        if(jsonDoc.isObject())
+            messages.prepend(jsonDoc.object());
+    }
+    return messages;
+}
+
+QStringList ChatCache::userList(const QString &server) const
+{
+    if(!isOpen())
+        return QStringList();
+    QSqlQuery query(QSqlDatabase::database(m_readConnection));
+    query.prepare("SELECT users FROM userlists WHERE server=?");
+    query.addBindValue(server);
+    if(!query.exec() || !query.next())
+        return QStringList();
+    QStringList users;
+    const QJsonArray array = QJsonDocument::fromJson(query.value(0).toByteArray()).array();
+    for(const QJsonValue &value : array)
+        users.append(value.toString());
+    return users;
+}
+
+bool ChatCache::roomState(const QString &server, const QString &room, qint64 &epoch, quint64 &lastSeq) const
+{
+    if(!isOpen())
+        return false;
+    QSqlQuery query(QSqlDatabase::database(m_readConnection));
+    query.prepare("SELECT epoch, last_seq FROM rooms WHERE server=? AND room=?");
+    query.addBindValue(server);
+    query.addBindValue(room);
+    if(!query.exec() || !query.next())
+        return false;
+    epoch = query.value(0).toLongLong();
+    lastSeq = query.value(1).toULongLong();
+    return true;
+}
+
+QString ChatCache::clientId() const
+{
+    return m_clientId;
+}
+
+QVector<ChatCache::OutboxEntry> ChatCache::outbox(const QString &server, quint64 &lastCseq) const
+{
+    QVector<OutboxEntry> entries;
+    lastCseq = 0;
+    if(!isOpen())
+        return entries;
+    QSqlQuery query(QSqlDatabase::database(m_readConnection));
+    query.prepare("SELECT last_cseq FROM client_outbox_seq WHERE client_id=? AND server=?");
+    query.addBindValue(m_clientId);
+    query.addBindValue(server);
+    if(query.exec() && query.next())
+        lastCseq = query.value(0).toULongLong();
+    query.prepare("SELECT cseq, room, text FROM client_outbox WHERE client_id=? AND server=? ORDER BY cseq");
+    query.addBindValue(m_clientId);
+    query.addBindValue(server);
+    if(!query.exec())
+        return entries;
+    while(query.next())
+        entries.append(OutboxEntry{query.value(0).toULongLong(),query.value(1).toString(),query.value(2).toString()});
+    if(!entries.isEmpty())
+        lastCseq = qMax(lastCseq,entries.last().cseq);
+    return entries;
+}
+
+void ChatCache::storeMessage(const QString &server, const QString &room, qint64 epoch, quint64 seq, const QJsonObject &message)
+{
+    PendingWrite write;
+    write.server = server;
+    write.room = room;
+    write.epoch = epoch;
+    write.seq = seq;
+    write.json = QJsonDocument(message).toJson(QJsonDocument::Compact);
+    enqueue(write);
+}
+
+void ChatCache::storeUserList(const QString &server, const QStringList &users)
+{
+    PendingWrite write;
+    write.server = server;
+    write.json = QJsonDocument(QJsonArray::fromStringList(users)).toJson(QJsonDocument::Compact);
+    write.kind = PendingWrite::UserList;
+    enqueue(write);
+}
+
+void ChatCache::storeOutbox(const QString &server, quint64 cseq, const QString &room, const QString &text)
+{
+    PendingWrite write;
+    write.kind = PendingWrite::OutboxAdd;
+    write.server = server;
+    write.room = room;
+    write.seq = cseq;
+    write.json = text.toUtf8();
+    enqueue(write);
+}
+
+void ChatCache::removeOutbox(const QString &server, quint64 cseq)
+{
+    PendingWrite write;
+    write.kind = PendingWrite::OutboxRemove;
+    write.server = server;
+    write.seq = cseq;
+    enqueue(write);
+}
+
+void ChatCache::enqueue(const PendingWrite &write)
+{
+    QMutexLocker locker(&m_mutex);
+    if(m_stopping)
+        return;
+    m_pending.append(write);
+    if(m_pending.size() >= MaxBatchSize)
+        m_wakeUp.wakeOne();
+}
+
+void ChatCache::run()
+{
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE",m_writeConnection);
+        db.setDatabaseName(m_fileName);
+        if(!db.open() || !configure(db)){
+            qWarning() << "聊天缓存写线程无法打开数据库" << db.lastError().text();
+        }else{
+            QVector<PendingWrite> batch;
+            for(;;){
+                bool stopping;
+                {
+                    QMutexLocker locker(&m_mutex);
+                    if(m_pending.isEmpty() && !m_stopping)
+                        m_wakeUp.wait(&m_mutex,BatchIntervalMs);
+                    // 没攒够一批时多等一会儿，凑成一次事务
+                    if(!m_stopping && m_pending.size() < MaxBatchSize && !m_pending.isEmpty())
+                        m_wakeUp.wait(&m_mutex,BatchIntervalMs);
+                    batch.swap(m_pending);
+                    stopping = m_stopping;
+                }
+                if(!batch.isEmpty() && !writeBatch(db,batch))
+                    qWarning() << "聊天缓存写入失败" << db.lastError().text();
+                batch.clear();
+                if(stopping){
+                    QMutexLocker locker(&m_mutex);
+                    if(m_pending.isEmpty())
+                        break;
+                }
+            }
+            db.close();
+        }
+    }
+    QSqlDatabase::removeDatabase(m_writeConnection);
+}
+
+bool ChatCache::writeBatch(QSqlDatabase &db, const QVector<PendingWrite> &batch)
+{
+    if(!db.transaction())
+        return false;
+    QSqlQuery insertMessage(db);
+    insertMessage.prepare("INSERT OR REPLACE INTO messages(server,room,epoch,seq,json) VALUES(?,?,?,?,?)");
+    QSqlQuery updateRoom(db);
+    updateRoom.prepare("INSERT INTO rooms(server,room,epoch,last_seq) VALUES(?,?,?,?) "
+                       "ON CONFLICT(server,room) DO UPDATE SET "
+                       "last_seq=CASE WHEN epoch=excluded.epoch THEN max(last_seq,excluded.last_seq) ELSE excluded.last_seq END, "
+                       "epoch=excluded.epoch");
+    QSqlQuery insertUsers(db);
+    insertUsers.prepare("INSERT OR REPLACE INTO userlists(server,users) VALUES(?,?)");
+    QSqlQuery insertOutbox(db);
+    insertOutbox.prepare("INSERT OR REPLACE INTO client_outbox(client_id,server,cseq,room,text) VALUES(?,?,?,?,?)");
+    QSqlQuery updateOutboxSeq(db);
+    updateOutboxSeq.prepare("INSERT INTO client_outbox_seq(client_id,server,last_cseq) VALUES(?,?,?) "
+                            "ON CONFLICT(client_id,server) DO UPDATE SET last_cseq=max(last_cseq,excluded.last_cseq)");
+    QSqlQuery deleteOutbox(db);
+    deleteOutbox.prepare("DELETE FROM client_outbox WHERE client_id=? AND server=? AND cseq=?");
+
+    QSet<QPair<QString,QString>> touched;
+    for(const PendingWrite &write : batch){
+        if(write.kind == PendingWrite::UserList){
+            insertUsers.addBindValue(write.server);
+            insertUsers.addBindValue(write.json);
+            if(!insertUsers.exec())
+                break;
+            continue;
+        }
+        if(write.kind == PendingWrite::OutboxAdd){
+            insertOutbox.addBindValue(m_clientId);
+            insertOutbox.addBindValue(write.server);
+            insertOutbox.addBindValue(qint64(write.seq));
+            insertOutbox.addBindValue(write.room);
+            insertOutbox.addBindValue(QString::fromUtf8(write.json));
+            updateOutboxSeq.addBindValue(m_clientId);
+            updateOutboxSeq.addBindValue(write.server);
+            updateOutboxSeq.addBindValue(qint64(write.seq));
+            if(!insertOutbox.exec() || !updateOutboxSeq.exec())
+                break;
+            continue;
+        }
+        if(write.kind == PendingWrite::OutboxRemove){
+            deleteOutbox.addBindValue(m_clientId);
+            deleteOutbox.addBindValue(write.server);
+            deleteOutbox.addBindValue(qint64(write.seq));
+            if(!deleteOutbox.exec())
+                break;
+            continue;
+        }
+        insertMessage.addBindValue(write.server);
+        insertMessage.addBindValue(write.room);
+        insertMessage.addBindValue(write.epoch);
+        insertMessage.addBindValue(qint64(write.seq));
+        insertMessage.addBindValue(write.json);
+        updateRoom.addBindValue(write.server);
+        updateRoom.addBindValue(write.room);
+        updateRoom.addBindValue(write.epoch);
+        updateRoom.addBindValue(qint64(write.seq));
+        if(!insertMessage.exec() || !updateRoom.exec())
+            break;
+        touched.insert(qMakePair(write.server,write.room));
+    }
+
+    // 每个房间只留最近的消息
+    QSqlQuery trim(db);
+    trim.prepare("DELETE FROM messages WHERE server=? AND room=? AND (epoch,seq) NOT IN "
+                 "(SELECT epoch,seq FROM messages WHERE server=? AND room=? ORDER BY epoch DESC, seq DESC LIMIT ?)");
+    for(const QPair<QString,QString> &room : std::as_const(touched)){
+        trim.addBindValue(room.first);
+        trim.addBindValue(room.second);
+        trim.addBindValue(room.first);
+        trim.addBindValue(room.second);
+        trim.addBindValue(MaxMessagesPerRoom);
+        trim.exec();
+    }
+    return db.commit();
+}
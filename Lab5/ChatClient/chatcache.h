@@ -0,0 +1,85 @@
+#ifndef CHATCACHE_H
+#define CHATCACHE_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QJsonObject>
+#include <QStringList>
+#include <QVector>
+#include <QSqlDatabase>
+#include <QLockFile>
+
+// 本地聊天缓存（SQLite，WAL 模式）：按服务器和房间保存最近的消息和用户列表，以及还没被服务器确认的待发消息
+// 启动时在主线程直接读出来显示，写入攒成批在后台线程里一次事务提交
+class ChatCache : public QThread
+{
+    Q_OBJECT
+
+public:
+    struct OutboxEntry
+    {
+        quint64 cseq = 0;
+        // 写下这条消息时所在的房间，只发到这个房间
+        QString room;
+        QString text;
+    };
+
+    explicit ChatCache(QObject *parent = nullptr);
+    ~ChatCache();
+
+    bool open(const QString &fileName);
+    void close();
+    bool isOpen() const;
+
+    // 最近的 limit 条消息，按时间顺序
+    QVector<QJsonObject> recentMessages(const QString &server,const QString &room,int limit) const;
+    QStringList userList(const QString &server) const;
+    // 缓存里这个房间的 epoch 和最后一条消息的序号，没有记录时返回 false
+    bool roomState(const QString &server,const QString &room,qint64 &epoch,quint64 &lastSeq) const;
+
+    // 本实例的客户端编号，服务器按它给离线消息去重。同一台机器上同时开的几个客户端
+    // 各占一个编号槽（靠锁文件占住），编号、待发消息和序号都互不相干
+    QString clientId() const;
+    // 本实例的待发消息按序号排好；lastCseq 是这个服务器用过的最大序号，队列空了也不会倒退
+    QVector<OutboxEntry> outbox(const QString &server,quint64 &lastCseq) const;
+
+    void storeMessage(const QString &server,const QString &room,qint64 epoch,quint64 seq,const QJsonObject &message);
+    void storeUserList(const QString &server,const QStringList &users);
+    void storeOutbox(const QString &server,quint64 cseq,const QString &room,const QString &text);
+    // 服务器确认了的消息
+    void removeOutbox(const QString &server,quint64 cseq);
+
+protected:
+    void run() override;
+
+private:
+    struct PendingWrite
+    {
+        enum Kind { Message, UserList, OutboxAdd, OutboxRemove };
+        Kind kind = Message;
+        QString server;
+        QString room;
+        qint64 epoch = 0;
+        quint64 seq = 0;
+        QByteArray json;
+    };
+
+    void enqueue(const PendingWrite &write);
+    bool writeBatch(QSqlDatabase &db,const QVector<PendingWrite> &batch);
+    bool claimClientId(QSqlDatabase &db);
+    bool migrateOutbox(QSqlDatabase &db);
+
+    QString m_fileName;
+    QString m_clientId;
+    // 占住编号槽的锁文件，关闭缓存时释放
+    QLockFile *m_slotLock;
+    QString m_readConnection;
+    QString m_writeConnection;
+    QMutex m_mutex;
+    QWaitCondition m_wakeUp;
+    QVector<PendingWrite> m_pending;
+    bool m_stopping;
+};
+
+#endif // CHATCACHE_H
@@ -1,61 +1,1021 @@
-#include "chatclient.h"
-#include <QDataStream>
-#include <QJsonObject>
-#include <QJsonDocument>
-
-ChatClient::ChatClient(QObject *parent)
-    : QObject{parent}
-{
-    m_clientSocket = new QTcpSocket(this);
-    connect(m_clientSocket,&QTcpSocket::connected,this,&ChatClient::connected);
-    connect(m_clientSocket,&QTcpSocket::readyRead,this,&ChatClient::onReadyRead);
-}
-
-void ChatClient::onReadyRead()
-{
-    QByteArray jsonData;
-    QDataStream socketStream(m_clientSocket);
-    socketStream.setVersion(QDataStream::Qt_5_12);
-    for(;;){
-        socketStream.startTransaction();
-        socketStream >> jsonData;
-        if(socketStream.commitTransaction()){
-            // emit messageReceived(QString::fromUtf8(jsonData));
-            QJsonParseError parseError;
-            const QJsonDocument jsonDoc = QJsonDocument::fromJson(jsonData,&parseError);
-            if(parseError.error == QJsonParseError::NoError){
-                if(jsonDoc.isObject()){
-                    // emit logMessage(QJsonDocument(jsonDoc).toJson(QJsonDocument::Compact));
-                    emit jsonReceived(jsonDoc.object());
-                }
-            }
-        }else{
-            break;
-        }
-    }
-}
-
-void ChatClient::sendMessage(const QString &text, const QString &type)
-{
-    if(m_clientSocket->state() != QAbstractSocket::ConnectedState)
-        return;
-
-    if(!text.isEmpty()){
-        QDataStream serverStream(m_clientSocket);
-        serverStream.setVersion(QDataStream::Qt_5_12);
-        QJsonObject message;
-        message["type"] = type;
-        message["text"] = text;
-        serverStream<< QJsonDocument(message).toJson();
-    }
-}
-
-void ChatClient::connectToServer(const QHostAddress &address, quint16 port)
-{
-    m_clientSocket->connectToHost(address,port);
-}
-
-void ChatClient::disconnectFromHost()
-{
-    m_clientSocket->disconnectFromHost();
-}
+#include "chatclient.h"
+#include <QDataStream>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QNetworkDatagram>
+#include <QFileInfo>
+#include <QDebug>
+#include <QHostInfo>
+#include <QRandomGenerator>
+#include <QRegularExpression>
+#include <QUuid>
+#include <limits>
+#include <algorithm>
+#include "filechunk.h"
+
+// 一次最多记录这么多条缺失的消息，再多就放弃补发
+static const quint64 MaxMissing = 1024;
+// 已读水位的上报间隔
+static const int ReadReportIntervalMs = 1000;
+// 往返时延的探测间隔
+static const int PingIntervalMs = 5000;
+// 解压后单帧的上限
+static const qint64 MaxFrameBytes = 64 * 1024 * 1024;
+// 竞速连接时相邻两次尝试的间隔（RFC 8305 的建议值）
+static const int AttemptDelayMs = 250;
+// 一轮竞速的总时限，超过就按连不上处理
+static const int RaceTimeoutMs = 10000;
+// 重连退避：上限从 500ms 开始翻倍到 30 秒，实际等待在 0 到上限之间随机取，
+// 服务器重启时所有客户端不会在同一时刻一起重连
+static const int ReconnectBaseMs = 500;
+static const int ReconnectMaxMs = 30000;
+// 重连后自动登录被拒时重试的间隔（同样翻倍，封顶 ReconnectMaxMs）和最多重试的次数，
+// 服务器要等旧连接超时断开才会放出名字
+static const int LoginRetryBaseMs = 1000;
+static const int MaxLoginRetries = 8;
+// 待发队列：一帧最多带的消息数，以及没确认时最多发出去的条数（要小于服务器的去重窗口）
+static const int OutboxBatchSize = 32;
+static const int MaxUnackedMessages = 128;
+// 发出去这么久还没确认就重发；服务器让稍后重发时等待的时间
+static const int AckTimeoutMs = 3000;
+static const int OutboxRetryMs = 1000;
+// 有消息在等确认时检查超时的间隔
+static const int OutboxCheckMs = 500;
+
+ChatClient::ChatClient(QObject *parent)
+    : QObject{parent}
+{
+    m_tls = false;
+    // 还没连接时的占位套接字，竞速赢了的套接字会替换它
+    m_clientSocket = new QSslSocket(this);
+    m_sslConfiguration = m_clientSocket->sslConfiguration();
+    m_pendingLookups = 0;
+    m_raceId = 0;
+    m_reconnectAttempt = 0;
+    m_autoReconnect = false;
+    m_attemptTimer = new QTimer(this);
+    m_attemptTimer->setSingleShot(true);
+    m_attemptTimer->setInterval(AttemptDelayMs);
+    connect(m_attemptTimer,&QTimer::timeout,this,&ChatClient::startNextAttempt);
+    m_raceTimer = new QTimer(this);
+    m_raceTimer->setSingleShot(true);
+    m_raceTimer->setInterval(RaceTimeoutMs);
+    connect(m_raceTimer,&QTimer::timeout,this,[this]{
+        abortAttempts();
+        m_candidates.clear();
+        m_raceId++;
+        scheduleReconnect();
+    });
+    m_reconnectTimer = new QTimer(this);
+    m_reconnectTimer->setSingleShot(true);
+    connect(m_reconnectTimer,&QTimer::timeout,this,&ChatClient::startRace);
+    m_loggedIn = false;
+    m_loginRetries = 0;
+    m_loginRetryTimer = new QTimer(this);
+    m_loginRetryTimer->setSingleShot(true);
+    connect(m_loginRetryTimer,&QTimer::timeout,this,[this]{
+        if(m_clientSocket->state() == QAbstractSocket::ConnectedState)
+            login(m_userName);
+    });
+
+    m_multicastSocket = new QUdpSocket(this);
+    m_multicastReady = false;
+    m_epoch = 0;
+    m_lastSeq = 0;
+    m_nextUploadId = 0;
+    m_cache = nullptr;
+    m_readReported = 0;
+    m_readTimer = new QTimer(this);
+    m_readTimer->setSingleShot(true);
+    m_readTimer->setInterval(ReadReportIntervalMs);
+    connect(m_readTimer,&QTimer::timeout,this,&ChatClient::reportRead);
+    connect(m_multicastSocket,&QUdpSocket::readyRead,this,&ChatClient::onMulticastReadyRead);
+
+    m_smoothedRttUs = 0;
+    m_clock.start();
+    m_pingTimer = new QTimer(this);
+    m_pingTimer->setInterval(PingIntervalMs);
+    connect(m_pingTimer,&QTimer::timeout,this,&ChatClient::sendPing);
+    // 连上就先测一次，不用等第一个间隔
+    connect(this,&ChatClient::connected,this,&ChatClient::sendPing);
+    connect(this,&ChatClient::connected,m_pingTimer,qOverload<>(&QTimer::start));
+
+    // 没有缓存时编号只在这次运行里有效
+    m_clientId = QUuid::createUuid().toString(QUuid::WithoutBraces);
+    m_lastCseq = 0;
+    m_outboxReady = false;
+    m_outboxTimer = new QTimer(this);
+    m_outboxTimer->setInterval(OutboxCheckMs);
+    connect(m_outboxTimer,&QTimer::timeout,this,&ChatClient::flushOutbox);
+    wireSocket(m_clientSocket);
+}
+
+ChatClient::~ChatClient()
+{
+    for(Upload &upload : m_uploads)
+        delete upload.file;
+    for(Download &download : m_downloads)
+        delete download.file;
+}
+
+void ChatClient::setTls(bool enabled, const QString &caFile)
+{
+    m_tls = enabled;
+    QSslConfiguration &config = m_sslConfiguration;
+    config.setProtocol(QSsl::TlsV1_2OrLater);
+    // 保留会话票据，断线重连时走简短握手
+    config.setSslOption(QSsl::SslOptionDisableSessionPersistence,false);
+    config.setSslOption(QSsl::SslOptionDisableSessionTickets,false);
+    if(!caFile.isEmpty()){
+        const QList<QSslCertificate> certificates = QSslCertificate::fromPath(caFile);
+        if(certificates.isEmpty())
+            qWarning() << "无法读取 CA 证书" << caFile;
+        config.setCaCertificates(certificates);
+    }
+    m_clientSocket->setSslConfiguration(config);
+}
+
+void ChatClient::wireSocket(QSslSocket *socket)
+{
+    // TLS 握手完成才算连上，登录消息不会明文发出去
+    connect(socket,&QSslSocket::encrypted,this,&ChatClient::saveSessionTicket);
+    connect(socket,&QSslSocket::encrypted,this,&ChatClient::connected);
+    connect(socket,&QSslSocket::newSessionTicketReceived,this,&ChatClient::saveSessionTicket);
+    connect(socket,&QSslSocket::sslErrors,this,[](const QList<QSslError> &errors){
+        for(const QSslError &error : errors)
+            qWarning() << "TLS 证书验证失败" << error.errorString();
+    });
+    connect(socket,&QTcpSocket::readyRead,this,&ChatClient::onReadyRead);
+    connect(socket,&QTcpSocket::disconnected,this,&ChatClient::socketDisconnected);
+    connect(socket,&QTcpSocket::disconnected,m_pingTimer,&QTimer::stop);
+}
+
+QString ChatClient::Candidate::key() const
+{
+    if(address.protocol() == QAbstractSocket::IPv6Protocol)
+        return QString("[%1]:%2").arg(address.toString()).arg(port);
+    return QString("%1:%2").arg(address.toString()).arg(port);
+}
+
+QList<ChatClient::Endpoint> ChatClient::parseEndpoints(const QString &text, quint16 defaultPort)
+{
+    QList<Endpoint> endpoints;
+    static const QRegularExpression separators("[,;\\s]+");
+    for(const QString &item : text.split(separators,Qt::SkipEmptyParts)){
+        Endpoint endpoint;
+        endpoint.port = defaultPort;
+        if(item.startsWith('[')){
+            // [IPv6 地址]:端口
+            const qsizetype close = item.indexOf(']');
+            if(close < 0)
+                continue;
+            endpoint.host = item.mid(1,close - 1);
+            if(item.mid(close + 1).startsWith(':'))
+                endpoint.port = item.mid(close + 2).toUShort();
+        }else if(item.count(':') == 1){
+            endpoint.host = item.section(':',0,0);
+            endpoint.port = item.section(':',1).toUShort();
+        }else{
+            // 主机名，或者不带端口的 IPv6 地址
+            endpoint.host = item;
+        }
+        if(!endpoint.host.isEmpty() && endpoint.port != 0)
+            endpoints.append(endpoint);
+    }
+    return endpoints;
+}
+
+void ChatClient::connectToServers(const QList<Endpoint> &endpoints)
+{
+    m_endpoints = endpoints;
+    m_autoReconnect = true;
+    m_reconnectAttempt = 0;
+    m_reconnectTimer->stop();
+    // 用户重新点登录，不是断线重连
+    m_loggedIn = false;
+    m_rejoinRoom.clear();
+    m_loginRetryTimer->stop();
+    startRace();
+}
+
+QString ChatClient::currentEndpoint() const
+{
+    return m_currentEndpoint;
+}
+
+void ChatClient::startRace()
+{
+    abortAttempts();
+    m_candidates.clear();
+    m_pendingLookups = 0;
+    const quint32 raceId = ++m_raceId;
+    if(m_endpoints.isEmpty())
+        return;
+    m_raceTimer->start();
+    for(const Endpoint &endpoint : std::as_const(m_endpoints)){
+        const QHostAddress address(endpoint.host);
+        if(!address.isNull()){
+            addCandidates(endpoint.host,endpoint.port,{address});
+            continue;
+        }
+        m_pendingLookups++;
+        const QString host = endpoint.host;
+        const quint16 port = endpoint.port;
+        QHostInfo::lookupHost(host,this,[this,raceId,host,port](const QHostInfo &info){
+            if(raceId != m_raceId)
+                return;
+            m_pendingLookups--;
+            if(info.error() != QHostInfo::NoError)
+                qWarning() << "无法解析服务器地址" << host << info.errorString();
+            addCandidates(host,port,info.addresses());
+            checkRaceFailed();
+        });
+    }
+    checkRaceFailed();
+}
+
+void ChatClient::addCandidates(const QString &host, quint16 port, const QList<QHostAddress> &addresses)
+{
+    // 同一个域名的 IPv6 和 IPv4 地址交替排，一种协议不通时很快就轮到另一种
+    QList<QHostAddress> v6;
+    QList<QHostAddress> v4;
+    for(const QHostAddress &address : addresses)
+        (address.protocol() == QAbstractSocket::IPv6Protocol ? v6 : v4).append(address);
+    QList<QHostAddress> ordered;
+    for(qsizetype i = 0; i < qMax(v6.size(),v4.size()); i++){
+        if(i < v6.size())
+            ordered.append(v6.at(i));
+        if(i < v4.size())
+            ordered.append(v4.at(i));
+    }
+    // 测过时延的按时延从低到高插到前面，没测过的排在后面
+    const auto rttOf = [this](const Candidate &candidate){
+        return m_endpointRtt.value(candidate.key(),std::numeric_limits<qint64>::max());
+    };
+    for(const QHostAddress &address : std::as_const(ordered)){
+        const Candidate candidate{host,address,port};
+        const qint64 rtt = rttOf(candidate);
+        qsizetype position = 0;
+        while(position < m_candidates.size() && rttOf(m_candidates.at(position)) <= rtt)
+            position++;
+        m_candidates.insert(position,candidate);
+    }
+    // 第一个地址马上开始，后面的由计时器错开
+    if(m_attempts.isEmpty())
+        startNextAttempt();
+}
+
+void ChatClient::startNextAttempt()
+{
+    if(m_candidates.isEmpty())
+        return;
+    const Candidate candidate = m_candidates.takeFirst();
+    QSslSocket *socket = new QSslSocket(this);
+    socket->setSslConfiguration(m_sslConfiguration);
+    connect(socket,&QSslSocket::connected,this,[this,socket]{ attemptConnected(socket); });
+    connect(socket,&QSslSocket::errorOccurred,this,[this,socket]{ attemptFailed(socket); });
+    m_attempts.append(Attempt{socket,candidate,m_clock.nsecsElapsed()});
+    // 竞速的只是 TCP 连接，TLS 握手只在赢了的连接上做
+    socket->connectToHost(candidate.address,candidate.port);
+    if(!m_candidates.isEmpty())
+        m_attemptTimer->start();
+}
+
+void ChatClient::attemptConnected(QSslSocket *socket)
+{
+    Candidate candidate;
+    for(qsizetype i = 0; i < m_attempts.size(); i++){
+        if(m_attempts.at(i).socket != socket)
+            continue;
+        const Attempt attempt = m_attempts.takeAt(i);
+        candidate = attempt.candidate;
+        const qint64 rttUs = (m_clock.nsecsElapsed() - attempt.startedNs) / 1000;
+        const qint64 previous = m_endpointRtt.value(candidate.key(),-1);
+        m_endpointRtt.insert(candidate.key(),previous < 0 ? rttUs : previous + (rttUs - previous) / 4);
+        break;
+    }
+    disconnect(socket,nullptr,this,nullptr);
+    // 其他还在连的都不要了
+    abortAttempts();
+    m_candidates.clear();
+    m_raceTimer->stop();
+    m_raceId++;
+    adoptSocket(socket,candidate);
+}
+
+void ChatClient::attemptFailed(QSslSocket *socket)
+{
+    for(qsizetype i = 0; i < m_attempts.size(); i++){
+        if(m_attempts.at(i).socket == socket){
+            m_attempts.removeAt(i);
+            break;
+        }
+    }
+    disconnect(socket,nullptr,this,nullptr);
+    socket->deleteLater();
+    // 失败了就不用等间隔，直接试下一个
+    m_attemptTimer->stop();
+    startNextAttempt();
+    checkRaceFailed();
+}
+
+void ChatClient::checkRaceFailed()
+{
+    if(!m_raceTimer->isActive() || !m_attempts.isEmpty() || !m_candidates.isEmpty() || m_pendingLookups > 0)
+        return;
+    m_raceTimer->stop();
+    scheduleReconnect();
+}
+
+void ChatClient::abortAttempts()
+{
+    m_attemptTimer->stop();
+    for(const Attempt &attempt : std::as_const(m_attempts)){
+        disconnect(attempt.socket,nullptr,this,nullptr);
+        attempt.socket->abort();
+        attempt.socket->deleteLater();
+    }
+    m_attempts.clear();
+}
+
+void ChatClient::adoptSocket(QSslSocket *socket, const Candidate &candidate)
+{
+    QSslSocket *old = m_clientSocket;
+    disconnect(old,nullptr,this,nullptr);
+    disconnect(old,nullptr,m_pingTimer,nullptr);
+    old->abort();
+    old->deleteLater();
+    m_clientSocket = socket;
+    wireSocket(socket);
+    m_currentEndpoint = candidate.key();
+    m_outboxReady = false;
+    m_smoothedRttUs = 0;
+    // 退避次数等登录成功了再清零，连上就被踢的服务器不会让客户端一直立刻重连
+    m_loginRetryTimer->stop();
+    m_loginRetries = 0;
+    if(m_loggedIn)
+        m_rejoinRoom = m_room;
+    if(!m_tls){
+        emit connected();
+        return;
+    }
+    if(!m_sessionTicket.isEmpty()){
+        QSslConfiguration config = socket->sslConfiguration();
+        config.setSessionTicket(m_sessionTicket);
+        socket->setSslConfiguration(config);
+    }
+    socket->setPeerVerifyName(candidate.host);
+    socket->startClientEncryption();
+}
+
+void ChatClient::socketDisconnected()
+{
+    leaveMulticast();
+    m_currentEndpoint.clear();
+    m_outboxReady = false;
+    m_outboxTimer->stop();
+    if(m_autoReconnect)
+        scheduleReconnect();
+}
+
+void ChatClient::scheduleReconnect()
+{
+    if(!m_autoReconnect || m_reconnectTimer->isActive())
+        return;
+    m_reconnectAttempt++;
+    const int ceiling = int(qMin(qint64(ReconnectMaxMs),qint64(ReconnectBaseMs) << qMin(m_reconnectAttempt - 1,16)));
+    const int delayMs = int(QRandomGenerator::global()->bounded(ceiling + 1));
+    emit reconnecting(m_reconnectAttempt,delayMs);
+    m_reconnectTimer->start(delayMs);
+}
+
+void ChatClient::saveSessionTicket()
+{
+    const QByteArray ticket = m_clientSocket->sslConfiguration().sessionTicket();
+    if(!ticket.isEmpty())
+        m_sessionTicket = ticket;
+}
+
+void ChatClient::setCache(ChatCache *cache, const QString &server)
+{
+    m_cache = cache;
+    m_server = server;
+    if(!cache)
+        return;
+    m_clientId = cache->clientId();
+    m_outbox.clear();
+    const QVector<ChatCache::OutboxEntry> entries = cache->outbox(server,m_lastCseq);
+    for(const ChatCache::OutboxEntry &entry : entries)
+        m_outbox.append(Outgoing{entry.cseq,entry.room,entry.text,-1});
+    emit pendingMessagesChanged(m_outbox.size());
+}
+
+int ChatClient::pendingMessages() const
+{
+    return m_outbox.size();
+}
+
+qsizetype ChatClient::findOutgoing(quint64 cseq) const
+{
+    // 队列按序号排好
+    const auto it = std::lower_bound(m_outbox.cbegin(),m_outbox.cend(),cseq,[](const Outgoing &entry,quint64 value){
+        return entry.cseq < value;
+    });
+    return it != m_outbox.cend() && it->cseq == cseq ? it - m_outbox.cbegin() : -1;
+}
+
+void ChatClient::flushOutbox()
+{
+    if(m_outbox.isEmpty())
+        m_outboxTimer->stop();
+    if(!m_outboxReady || m_outbox.isEmpty() || m_clientSocket->state() != QAbstractSocket::ConnectedState)
+        return;
+    QJsonArray items;
+    const auto sendItems = [&]{
+        if(items.size() == 1){
+            QJsonObject message = items.first().toObject();
+            message["type"] = "message";
+            sendJson(message);
+        }else if(items.size() > 1){
+            QJsonObject batchMessage;
+            batchMessage["type"] = "messages";
+            batchMessage["items"] = items;
+            sendJson(batchMessage);
+        }
+        items = QJsonArray();
+    };
+    // 只发当前房间队列前面的一段，还没发过的和等确认超时的一起成批发；其他房间的等回到那个房间再发
+    const qint64 now = m_clock.elapsed();
+    int window = 0;
+    for(Outgoing &entry : m_outbox){
+        if(entry.room != m_room)
+            continue;
+        if(++window > MaxUnackedMessages)
+            break;
+        if(entry.sentMs >= 0 && now - entry.sentMs < AckTimeoutMs)
+            continue;
+        entry.sentMs = now;
+        QJsonObject item;
+        item["room"] = entry.room;
+        item["text"] = entry.text;
+        item["cseq"] = QJsonValue(qint64(entry.cseq));
+        items.append(item);
+        if(items.size() >= OutboxBatchSize)
+            sendItems();
+    }
+    sendItems();
+    if(!m_outboxTimer->isActive())
+        m_outboxTimer->start();
+}
+
+void ChatClient::handleAck(const QJsonObject &docObj)
+{
+    bool removed = false;
+    for(const QJsonValue &value : docObj.value("cseqs").toArray()){
+        const quint64 cseq = quint64(value.toInteger());
+        const qsizetype index = findOutgoing(cseq);
+        if(index < 0)
+            continue;
+        m_outbox.removeAt(index);
+        if(m_cache)
+            m_cache->removeOutbox(m_server,cseq);
+        removed = true;
+    }
+    // 服务器没收下的（限流、繁忙），让它的超时提前到 OutboxRetryMs 之后
+    for(const QJsonValue &value : docObj.value("retry").toArray()){
+        const qsizetype index = findOutgoing(quint64(value.toInteger()));
+        if(index >= 0)
+            m_outbox[index].sentMs = m_clock.elapsed() - AckTimeoutMs + OutboxRetryMs;
+    }
+    // 序号落在服务器去重窗口后面了（在别的房间的队列里压太久）：换成新序号排到队尾，下次照常发
+    for(const QJsonValue &value : docObj.value("stale").toArray()){
+        const quint64 cseq = quint64(value.toInteger());
+        const qsizetype index = findOutgoing(cseq);
+        if(index < 0)
+            continue;
+        Outgoing entry = m_outbox.takeAt(index);
+        entry.cseq = ++m_lastCseq;
+        entry.sentMs = -1;
+        m_outbox.append(entry);
+        if(m_cache){
+            m_cache->removeOutbox(m_server,cseq);
+            m_cache->storeOutbox(m_server,entry.cseq,entry.room,entry.text);
+        }
+        removed = true;
+    }
+    if(!removed)
+        return;
+    emit pendingMessagesChanged(m_outbox.size());
+    // 窗口空出来了，接着发
+    flushOutbox();
+}
+
+void ChatClient::onReadyRead()
+{
+    QByteArray jsonData;
+    QDataStream socketStream(m_clientSocket);
+    socketStream.setVersion(QDataStream::Qt_5_12);
+    for(;;){
+        socketStream.startTransaction();
+        socketStream >> jsonData;
+        if(socketStream.commitTransaction()){
+            if(FrameCompressor::isCompressed(jsonData)){
+                QByteArray frame;
+                if(!m_decompressor.decompress(jsonData,MaxFrameBytes,frame)){
+                    // 带上下文的帧解错一帧后面的都解不出来，断开重连，新连接的压缩上下文从头开始
+                    qWarning() << "无法解压服务器发来的帧，重新连接";
+                    m_clientSocket->abort();
+                    return;
+                }
+                jsonData = frame;
+            }
+            if(FileChunk::isChunk(jsonData)){
+                receiveChunk(jsonData);
+                continue;
+            }
+            // emit messageReceived(QString::fromUtf8(jsonData));
+            QJsonParseError parseError;
+            const QJsonDocument jsonDoc = QJsonDocument::fromJson(jsonData,&parseError);
+            if(parseError.error == QJsonParseError::NoError){
+                if(jsonDoc.isObject()){
+                    // emit logMessage(QJsonDocument(jsonDoc).toJson(QJsonDocument::Compact));
+                    deliver(jsonDoc.object());
+                }
+            }
+        }else{
+            break;
+        }
+    }
+}
+
+void ChatClient::sendMessage(const QString &text, const QString &type)
+{
+    // 聊天消息不管连没连上都先进待发队列，断线期间写的重连后补发
+    if(type == "message"){
+        const QString trimmed = text.trimmed();
+        if(trimmed.isEmpty())
+            return;
+        m_outbox.append(Outgoing{++m_lastCseq,m_room,trimmed,-1});
+        if(m_cache)
+            m_cache->storeOutbox(m_server,m_lastCseq,m_room,trimmed);
+        emit pendingMessagesChanged(m_outbox.size());
+        flushOutbox();
+        return;
+    }
+    if(m_clientSocket->state() != QAbstractSocket::ConnectedState)
+        return;
+
+    if(!text.isEmpty()){
+        QDataStream serverStream(m_clientSocket);
+        serverStream.setVersion(QDataStream::Qt_5_12);
+        QJsonObject message;
+        message["type"] = type;
+        message["text"] = text;
+        serverStream<< QJsonDocument(message).toJson();
+    }
+}
+
+void ChatClient::sendJson(const QJsonObject &json)
+{
+    writeFrame(QJsonDocument(json).toJson(QJsonDocument::Compact));
+}
+
+void ChatClient::writeFrame(const QByteArray &frame)
+{
+    if(m_clientSocket->state() != QAbstractSocket::ConnectedState)
+        return;
+    QDataStream serverStream(m_clientSocket);
+    serverStream.setVersion(QDataStream::Qt_5_12);
+    serverStream << frame;
+}
+
+bool ChatClient::sendFile(const QString &fileName)
+{
+    QFile *file = new QFile(fileName);
+    if(!file->open(QIODevice::ReadOnly)){
+        delete file;
+        return false;
+    }
+    const int uploadId = ++m_nextUploadId;
+    Upload upload;
+    upload.file = file;
+    upload.size = file->size();
+    m_uploads.insert(uploadId,upload);
+
+    QJsonObject offerMessage;
+    offerMessage["type"] = "fileOffer";
+    offerMessage["id"] = uploadId;
+    offerMessage["name"] = QFileInfo(fileName).fileName();
+    offerMessage["size"] = QJsonValue(upload.size);
+    sendJson(offerMessage);
+    return true;
+}
+
+bool ChatClient::downloadFile(quint32 fileId, const QString &fileName)
+{
+    if(m_downloads.contains(fileId))
+        return false;
+    QFile *file = new QFile(fileName);
+    if(!file->open(QIODevice::WriteOnly | QIODevice::Truncate)){
+        delete file;
+        return false;
+    }
+    Download download;
+    download.file = file;
+    m_downloads.insert(fileId,download);
+
+    QJsonObject requestMessage;
+    requestMessage["type"] = "fileRequest";
+    requestMessage["file"] = QJsonValue(qint64(fileId));
+    sendJson(requestMessage);
+    return true;
+}
+
+void ChatClient::pumpUpload(int uploadId)
+{
+    auto it = m_uploads.find(uploadId);
+    if(it == m_uploads.end())
+        return;
+    // 在途数据不超过窗口，聊天消息最多排在几块数据后面
+    QByteArray buffer(FileChunk::ChunkSize,Qt::Uninitialized);
+    while(it->sent < it->size && it->sent - it->acked < qint64(it->window) * FileChunk::ChunkSize){
+        const qint64 length = it->file->read(buffer.data(),buffer.size());
+        if(length <= 0)
+            break;
+        writeFrame(FileChunk::encode(it->fileId,quint64(it->sent),buffer.constData(),length));
+        it->sent += length;
+    }
+}
+
+void ChatClient::receiveChunk(const QByteArray &frame)
+{
+    quint32 fileId;
+    quint64 offset;
+    if(!FileChunk::decode(frame,fileId,offset))
+        return;
+    auto it = m_downloads.find(fileId);
+    if(it == m_downloads.end())
+        return;
+    const qint64 length = frame.size() - FileChunk::HeaderSize;
+    // 中间缺了一块，后面的数据都接不上；协议里没有续传，直接放弃这次下载，
+    // 这个文件后面到的块和 fileEnd 找不到下载记录，都会被忽略
+    QString error;
+    if(qint64(offset) != it->received)
+        error = "文件数据不完整，下载已取消";
+    else if(it->file->write(frame.constData() + FileChunk::HeaderSize,length) != length)
+        error = "写文件失败，下载已取消";
+    if(!error.isEmpty()){
+        it->file->remove();
+        delete it->file;
+        m_downloads.erase(it);
+        QJsonObject errorMessage;
+        errorMessage["type"] = "fileError";
+        errorMessage["file"] = QJsonValue(qint64(fileId));
+        errorMessage["text"] = error;
+        emit jsonReceived(errorMessage);
+        return;
+    }
+    it->received += length;
+}
+
+bool ChatClient::handleFileMessage(QJsonObject &docObj)
+{
+    const QString type = docObj.value("type").toString();
+    const quint32 fileId = quint32(docObj.value("file").toInteger());
+    if(type == "fileUploadReady"){
+        const int uploadId = docObj.value("id").toInt();
+        auto it = m_uploads.find(uploadId);
+        if(it == m_uploads.end())
+            return false;
+        it->fileId = fileId;
+        it->window = qMax(1,docObj.value("window").toInt());
+        // 空文件没有数据块，也就等不到 fileAck，服务器收到 offer 时已经完成了
+        if(it->size == 0){
+            delete it->file;
+            m_uploads.erase(it);
+            return false;
+        }
+        m_uploadIds.insert(fileId,uploadId);
+        pumpUpload(uploadId);
+        return false;
+    }
+    if(type == "fileAck"){
+        const int uploadId = m_uploadIds.value(fileId);
+        auto it = m_uploads.find(uploadId);
+        if(it == m_uploads.end())
+            return false;
+        it->acked = docObj.value("offset").toInteger();
+        if(it->acked < it->size){
+            pumpUpload(uploadId);
+            return false;
+        }
+        delete it->file;
+        m_uploads.erase(it);
+        m_uploadIds.remove(fileId);
+        return false;
+    }
+    if(type == "fileEnd"){
+        Download download = m_downloads.take(fileId);
+        if(!download.file)
+            return false;
+        // 服务器内存紧张时会丢掉排队的数据块，丢在最后几块时只能靠大小发现
+        if(download.received != docObj.value("size").toInteger()){
+            download.file->remove();
+            delete download.file;
+            docObj["type"] = "fileError";
+            docObj["text"] = "文件数据不完整，下载已取消";
+            return true;
+        }
+        docObj["path"] = download.file->fileName();
+        download.file->close();
+        delete download.file;
+        return true;
+    }
+    if(type == "fileError"){
+        // 上传被拒绝时只带客户端的上传 id
+        const int uploadId = docObj.contains("id") ? docObj.value("id").toInt() : m_uploadIds.value(fileId);
+        auto upload = m_uploads.find(uploadId);
+        if(upload != m_uploads.end()){
+            delete upload->file;
+            m_uploadIds.remove(upload->fileId);
+            m_uploads.erase(upload);
+        }else{
+            Download download = m_downloads.take(fileId);
+            if(download.file){
+                download.file->remove();
+                delete download.file;
+            }
+        }
+        return true;
+    }
+    return true;
+}
+
+void ChatClient::login(const QString &userName)
+{
+    m_userName = userName;
+    QJsonObject message;
+    message["type"] = "login";
+    message["text"] = userName;
+    // 加密的连接不收明文组播
+    message["multicast"] = !m_tls;
+    // 大帧（用户列表、历史补发）让服务器压缩后再发
+    message["compress"] = QJsonArray{"deflate"};
+    message["clientId"] = m_clientId;
+    sendJson(message);
+}
+
+void ChatClient::onMulticastReadyRead()
+{
+    while(m_multicastSocket->hasPendingDatagrams()){
+        const QNetworkDatagram datagram = m_multicastSocket->receiveDatagram();
+        const QJsonDocument jsonDoc = QJsonDocument::fromJson(datagram.data());
+        if(!jsonDoc.isObject())
+            continue;
+        const QJsonObject docObj = jsonDoc.object();
+        // 组播是没有认证的 UDP，谁都能往组里发：只收聊天消息和序号心跳，
+        // 确认、文件、ping 这些只认 TCP 连接上来的
+        const QString type = docObj.value("type").toString();
+        if((type != "message" && type != "seq") || docObj.value("room").toString() != m_room)
+            continue;
+        // 第一次收到组播数据，告诉服务器以后不用再走 TCP
+        if(!m_multicastReady){
+            m_multicastReady = true;
+            QJsonObject readyMessage;
+            readyMessage["type"] = "multicastReady";
+            readyMessage["room"] = m_room;
+            sendJson(readyMessage);
+        }
+        deliver(docObj);
+    }
+}
+
+void ChatClient::deliver(const QJsonObject &docObj)
+{
+    const QString type = docObj.value("type").toString();
+    if(type.startsWith("file") && type != "file"){
+        QJsonObject fileMessage = docObj;
+        if(handleFileMessage(fileMessage))
+            emit jsonReceived(fileMessage);
+        return;
+    }
+    if(type == "multicast"){
+        joinMulticast(docObj);
+        return;
+    }
+    if(type == "multicastEnd"){
+        if(docObj.value("room").toString() == m_room)
+            leaveMulticast();
+        return;
+    }
+    if(type == "ping"){
+        // 服务器测往返时延，时间戳原样带回去
+        QJsonObject pongMessage;
+        pongMessage["type"] = "pong";
+        pongMessage["t"] = docObj.value("t");
+        sendJson(pongMessage);
+        return;
+    }
+    if(type == "pong"){
+        handlePong(docObj);
+        return;
+    }
+    if(type == "ack"){
+        handleAck(docObj);
+        return;
+    }
+    if(type == "joined"){
+        const QString room = docObj.value("room").toString();
+        m_reconnectAttempt = 0;
+        // 重新登录后服务器先把人放进大厅，断线前在别的房间就再进回去
+        if(!m_rejoinRoom.isEmpty()){
+            if(room != m_rejoinRoom)
+                sendMessage(m_rejoinRoom,"join");
+            m_rejoinRoom.clear();
+        }
+        if(room != m_room)
+            leaveMulticast();
+        m_room = room;
+        m_epoch = docObj.value("epoch").toInteger();
+        m_lastSeq = quint64(docObj.value("seq").toInteger());
+        m_readReported = m_lastSeq;
+        m_missing.clear();
+        syncWithCache(room,m_lastSeq);
+        // 进了房间才能在这个房间发言：还没进过房间时写的归到这个房间，
+        // 这个房间没确认的全部重发一遍，服务器会去重
+        m_outboxReady = true;
+        for(Outgoing &entry : m_outbox){
+            if(entry.room.isEmpty()){
+                entry.room = room;
+                if(m_cache)
+                    m_cache->storeOutbox(m_server,entry.cseq,room,entry.text);
+            }
+            if(entry.room == room)
+                entry.sentMs = -1;
+        }
+        flushOutbox();
+    }else if(type == "seq"){
+        // 组播心跳：发现尾部丢包
+        const quint64 seq = quint64(docObj.value("seq").toInteger());
+        if(docObj.value("room").toString() == m_room && seq > m_lastSeq){
+            requestMissing(m_lastSeq + 1,seq);
+            m_lastSeq = seq;
+        }
+        return;
+    }else if(docObj.contains("seq")){
+        const quint64 seq = quint64(docObj.value("seq").toInteger());
+        if(!acceptSeq(docObj.value("room").toString(),seq))
+            return;
+        if(!m_readTimer->isActive())
+            m_readTimer->start();
+        if(m_cache && (type == "message" || type == "file"))
+            m_cache->storeMessage(m_server,m_room,m_epoch,seq,docObj);
+    }else if(type == "loginError"){
+        // 断线重连后的自动登录：服务器上旧连接可能还没断，名字还被占着，等一会儿再登录，
+        // 不把错误交给界面（界面收到会断开连接让用户重新登录）
+        if(m_loggedIn && m_loginRetries < MaxLoginRetries){
+            m_loginRetries++;
+            const int delayMs = int(qMin(qint64(ReconnectMaxMs),qint64(LoginRetryBaseMs) << (m_loginRetries - 1)));
+            emit loginRetrying(docObj.value("text").toString(),delayMs);
+            m_loginRetryTimer->start(delayMs);
+            return;
+        }
+    }else if(type == "userlist"){
+        m_reconnectAttempt = 0;
+        m_loginRetries = 0;
+        m_loggedIn = true;
+        if(m_cache)
+            m_cache->storeUserList(m_server,docObj.value("userlist").toVariant().toStringList());
+    }
+    emit jsonReceived(docObj);
+}
+
+void ChatClient::sendPing()
+{
+    QJsonObject pingMessage;
+    pingMessage["type"] = "ping";
+    pingMessage["t"] = QJsonValue(m_clock.nsecsElapsed());
+    sendJson(pingMessage);
+}
+
+void ChatClient::handlePong(const QJsonObject &docObj)
+{
+    const qint64 sentNs = docObj.value("t").toInteger();
+    const qint64 nowNs = m_clock.nsecsElapsed();
+    if(sentNs <= 0 || sentNs > nowNs)
+        return;
+    const qint64 rttUs = (nowNs - sentNs) / 1000;
+    m_smoothedRttUs = m_smoothedRttUs == 0 ? rttUs : m_smoothedRttUs + (rttUs - m_smoothedRttUs) / 8;
+    // 下次重连时按这个值给地址排序
+    if(!m_currentEndpoint.isEmpty())
+        m_endpointRtt.insert(m_currentEndpoint,m_smoothedRttUs);
+    emit rttMeasured(rttUs,m_smoothedRttUs);
+}
+
+void ChatClient::reportRead()
+{
+    if(m_lastSeq <= m_readReported || m_room.isEmpty())
+        return;
+    m_readReported = m_lastSeq;
+    QJsonObject readMessage;
+    readMessage["type"] = "read";
+    readMessage["room"] = m_room;
+    readMessage["seq"] = QJsonValue(qint64(m_lastSeq));
+    sendJson(readMessage);
+}
+
+bool ChatClient::acceptSeq(const QString &room, quint64 seq)
+{
+    if(room != m_room)
+        return false;
+    if(seq > m_lastSeq){
+        if(seq > m_lastSeq + 1)
+            requestMissing(m_lastSeq + 1,seq - 1);
+        m_lastSeq = seq;
+        return true;
+    }
+    // 重复收到（组播和 TCP 各一份）时丢弃，补发回来的旧消息照常显示
+    return m_missing.remove(seq);
+}
+
+void ChatClient::syncWithCache(const QString &room, quint64 seq)
+{
+    if(!m_cache)
+        return;
+    qint64 cachedEpoch;
+    quint64 cachedSeq;
+    if(!m_cache->roomState(m_server,room,cachedEpoch,cachedSeq))
+        return;
+    // 房间没有重建过时只补缓存之后的消息，服务器重启过序号会从头开始，缓存作废
+    if(cachedEpoch == m_epoch && cachedSeq < seq)
+        requestMissing(cachedSeq + 1,seq);
+}
+
+void ChatClient::requestMissing(quint64 from, quint64 to)
+{
+    if(to - from >= MaxMissing)
+        from = to - MaxMissing + 1;
+    for(quint64 seq = from; seq <= to; seq++)
+        m_missing.insert(seq);
+    if(quint64(m_missing.size()) > MaxMissing)
+        m_missing.clear();
+
+    QJsonObject nackMessage;
+    nackMessage["type"] = "nack";
+    nackMessage["room"] = m_room;
+    nackMessage["from"] = QJsonValue(qint64(from));
+    nackMessage["to"] = QJsonValue(qint64(to));
+    sendJson(nackMessage);
+}
+
+void ChatClient::joinMulticast(const QJsonObject &docObj)
+{
+    if(docObj.value("room").toString() != m_room)
+        return;
+    const QHostAddress group(docObj.value("group").toString());
+    const quint16 port = quint16(docObj.value("port").toInt());
+    if(group.isNull() || port == 0)
+        return;
+    leaveMulticast();
+    if(!m_multicastSocket->bind(QHostAddress(QHostAddress::AnyIPv4),port,QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint))
+        return;
+    if(!m_multicastSocket->joinMulticastGroup(group)){
+        m_multicastSocket->close();
+        return;
+    }
+    m_multicastGroup = group;
+}
+
+void ChatClient::leaveMulticast()
+{
+    if(!m_multicastGroup.isNull())
+        m_multicastSocket->leaveMulticastGroup(m_multicastGroup);
+    m_multicastSocket->close();
+    m_multicastGroup.clear();
+    m_multicastReady = false;
+}
+
+void ChatClient::connectToServer(const QHostAddress &address, quint16 port)
+{
+    Endpoint endpoint;
+    endpoint.host = address.toString();
+    endpoint.port = port;
+    connectToServers({endpoint});
+}
+
+void ChatClient::disconnectFromHost()
+{
+    // 用户主动断开，不再自动重连
+    m_autoReconnect = false;
+    m_reconnectTimer->stop();
+    m_loginRetryTimer->stop();
+    m_loggedIn = false;
+    m_rejoinRoom.clear();
+    m_raceTimer->stop();
+    m_raceId++;
+    abortAttempts();
+    m_candidates.clear();
+    leaveMulticast();
+    m_clientSocket->disconnectFromHost();
+}
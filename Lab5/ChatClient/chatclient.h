@@ -1,30 +1,196 @@
-#ifndef CHATCLIENT_H
-#define CHATCLIENT_H
-
-#include <QObject>
-#include <qTcpSocket>
-
-
-class ChatClient : public QObject
-{
-    Q_OBJECT
-
-public:
-    explicit ChatClient(QObject *parent = nullptr);
-
-signals:
-    void connected();
-    void messageReceived(const QString &text);
-    void jsonReceived(const QJsonObject &docObj);
-
-private:
-    QTcpSocket *m_clientSocket;
-
-public slots:
-    void onReadyRead();
-    void sendMessage(const QString &text,const QString &type = "message");
-    void connectToServer(const QHostAddress &address, quint16 port);
-    void disconnectFromHost();
-};
-
-#endif // CHATCLIENT_H
+#ifndef CHATCLIENT_H
+#define CHATCLIENT_H
+
+#include <QObject>
+#include <qTcpSocket>
+#include <QSslSocket>
+#include <QUdpSocket>
+#include <QHostAddress>
+#include <QSet>
+#include <QHash>
+#include <QFile>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QSslConfiguration>
+#include "framecompressor.h"
+#include "chatcache.h"
+
+
+class ChatClient : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit ChatClient(QObject *parent = nullptr);
+    ~ChatClient();
+
+    // 本地缓存，server 用来区分不同服务器的缓存；上次没发出去的消息从缓存里读回待发队列
+    void setCache(ChatCache *cache,const QString &server);
+    // 还没被服务器确认的消息条数
+    int pendingMessages() const;
+    // 用 TLS 连接服务器，caFile 为空时用系统证书验证；重连时复用服务器给的会话票据
+    void setTls(bool enabled,const QString &caFile = QString());
+
+    struct Endpoint
+    {
+        QString host;
+        quint16 port = 0;
+    };
+    // "host1, host2:1968, [::1]:1967"，没写端口的用 defaultPort
+    static QList<Endpoint> parseEndpoints(const QString &text,quint16 defaultPort);
+    // 同时向多个服务器发起 TCP 连接（每隔一小段时间多开一个），最先连上的留下；
+    // 以前测过时延的地址排在前面。断线后按带随机抖动的指数退避自动重连，直到 disconnectFromHost
+    void connectToServers(const QList<Endpoint> &endpoints);
+    // 当前连着的地址，没连上时为空
+    QString currentEndpoint() const;
+
+signals:
+    void connected();
+    void messageReceived(const QString &text);
+    void jsonReceived(const QJsonObject &docObj);
+    // 每次收到 pong：这次的往返时延和平滑后的值，单位微秒
+    void rttMeasured(qint64 rttUs,qint64 smoothedUs);
+    // 连接断开或者所有地址都连不上，delayMs 之后第 attempt 次重连
+    void reconnecting(int attempt,int delayMs);
+    // 断线重连后自动登录失败（一般是服务器上旧连接还没超时，名字还占着），delayMs 之后再登录一次
+    void loginRetrying(const QString &reason,int delayMs);
+    void pendingMessagesChanged(int count);
+
+private:
+    QSslSocket *m_clientSocket;
+    bool m_tls;
+    QSslConfiguration m_sslConfiguration;
+    QByteArray m_sessionTicket;
+
+    // 多地址竞速连接
+    struct Candidate
+    {
+        QString host;
+        QHostAddress address;
+        quint16 port;
+        QString key() const;
+    };
+    struct Attempt
+    {
+        QSslSocket *socket;
+        Candidate candidate;
+        qint64 startedNs;
+    };
+    QList<Endpoint> m_endpoints;
+    QList<Candidate> m_candidates;
+    QList<Attempt> m_attempts;
+    int m_pendingLookups;
+    // 每开始一轮竞速加一，上一轮还没回来的域名解析结果直接丢掉
+    quint32 m_raceId;
+    QTimer *m_attemptTimer;
+    QTimer *m_raceTimer;
+    QTimer *m_reconnectTimer;
+    int m_reconnectAttempt;
+    bool m_autoReconnect;
+    // 登录成功过之后，重连时自动用同一个名字登录，再回到断线前的房间
+    QString m_userName;
+    bool m_loggedIn;
+    QString m_rejoinRoom;
+    QTimer *m_loginRetryTimer;
+    int m_loginRetries;
+    // 每个地址最近的往返时延（微秒），下次连接时低的先试
+    QHash<QString,qint64> m_endpointRtt;
+    QString m_currentEndpoint;
+    // 大房间的组播接收，丢包按房间序号通过 TCP 补发
+    QUdpSocket *m_multicastSocket;
+    QHostAddress m_multicastGroup;
+    bool m_multicastReady;
+    QString m_room;
+    qint64 m_epoch;
+    quint64 m_lastSeq;
+    QSet<quint64> m_missing;
+    // 已读水位合并后定时上报
+    QTimer *m_readTimer;
+    quint64 m_readReported;
+    ChatCache *m_cache;
+    QString m_server;
+    // 定时 ping 服务器测往返时延
+    QTimer *m_pingTimer;
+    QElapsedTimer m_clock;
+    qint64 m_smoothedRttUs;
+    // 服务器发来的压缩帧，带上下文的帧要按顺序解
+    FrameDecompressor m_decompressor;
+    // 待发队列：聊天消息先进队列（有缓存时同时落盘），登录进了写下时的房间后发出，服务器确认后删掉；
+    // 超时没确认的重发，服务器按序号去重，所以至少送达一次且不会重复广播
+    struct Outgoing
+    {
+        quint64 cseq;
+        // 写下时所在的房间，只在进了这个房间之后发出；为空表示还没进过房间
+        QString room;
+        QString text;
+        // 最近一次发出的时间（m_clock 的毫秒数），-1 表示这条连接上还没发过
+        qint64 sentMs;
+    };
+    QString m_clientId;
+    QList<Outgoing> m_outbox;
+    quint64 m_lastCseq;
+    bool m_outboxReady;
+    QTimer *m_outboxTimer;
+
+    // 文件传输：上传按服务器给的窗口发块，下载边收边写盘
+    struct Upload
+    {
+        QFile *file = nullptr;
+        quint32 fileId = 0;
+        qint64 size = 0;
+        qint64 sent = 0;
+        qint64 acked = 0;
+        int window = 0;
+    };
+    struct Download
+    {
+        QFile *file = nullptr;
+        qint64 received = 0;
+    };
+    int m_nextUploadId;
+    QHash<int,Upload> m_uploads;
+    QHash<quint32,int> m_uploadIds;
+    QHash<quint32,Download> m_downloads;
+
+    void deliver(const QJsonObject &docObj);
+    bool acceptSeq(const QString &room,quint64 seq);
+    void syncWithCache(const QString &room,quint64 seq);
+    void requestMissing(quint64 from,quint64 to);
+    void writeFrame(const QByteArray &frame);
+    void handlePong(const QJsonObject &docObj);
+    void pumpUpload(int uploadId);
+    void receiveChunk(const QByteArray &frame);
+    bool handleFileMessage(QJsonObject &docObj);
+    void joinMulticast(const QJsonObject &docObj);
+    void leaveMulticast();
+    void wireSocket(QSslSocket *socket);
+    void startRace();
+    void addCandidates(const QString &host,quint16 port,const QList<QHostAddress> &addresses);
+    void startNextAttempt();
+    void attemptConnected(QSslSocket *socket);
+    void attemptFailed(QSslSocket *socket);
+    void checkRaceFailed();
+    void abortAttempts();
+    void adoptSocket(QSslSocket *socket,const Candidate &candidate);
+    void socketDisconnected();
+    void scheduleReconnect();
+    void saveSessionTicket();
+    void flushOutbox();
+    void handleAck(const QJsonObject &docObj);
+    qsizetype findOutgoing(quint64 cseq) const;
+
+public slots:
+    void onReadyRead();
+    void onMulticastReadyRead();
+    void reportRead();
+    void sendPing();
+    void sendMessage(const QString &text,const QString &type = "message");
+    void sendJson(const QJsonObject &json);
+    void login(const QString &userName);
+    bool sendFile(const QString &fileName);
+    bool downloadFile(quint32 fileId,const QString &fileName);
+    void connectToServer(const QHostAddress &address, quint16 port);
+    void disconnectFromHost();
+};
+
+#endif // CHATCLIENT_H
@@ -1,11 +1,24 @@
-#include "mainwindow.h"
-
-#include <QApplication>
-
-int main(int argc, char *argv[])
-{
-    QApplication a(argc, argv);
-    MainWindow w;
-    w.show();
-    return a.exec();
-}
+#include "mainwindow.h"
+
+#include <QApplication>
+#include <QCommandLineParser>
+
+int main(int argc, char *argv[])
+{
+    QApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("聊天客户端");
+    parser.addHelpOption();
+    QCommandLineOption tlsOption("tls","用 TLS 连接服务器");
+    QCommandLineOption tlsCaOption("tls-ca","验证服务器证书用的 CA 证书（PEM），默认用系统证书","file");
+    parser.addOption(tlsOption);
+    parser.addOption(tlsCaOption);
+    parser.process(a);
+
+    MainWindow w;
+    if(parser.isSet(tlsOption) || parser.isSet(tlsCaOption))
+        w.client()->setTls(true,parser.value(tlsCaOption));
+    w.show();
+    return a.exec();
+}
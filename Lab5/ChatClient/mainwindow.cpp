@@ -1,151 +1,329 @@
-#include "mainwindow.h"
-#include "ui_mainwindow.h"
-#include <QHostAddress>
-#include <QJsonValue>
-#include <QJsonObject>
-#include <QMessageBox>
-
-MainWindow::MainWindow(QWidget *parent)
-    : QMainWindow(parent)
-    , ui(new Ui::MainWindow)
-{
-    ui->setupUi(this);
-    ui->stackedWidget->setCurrentWidget(ui->loginPage);
-    m_chatclient = new ChatClient(this);
-    connect(m_chatclient,&ChatClient::connected,this,&MainWindow::connectedToServer);
-    connect(m_chatclient,&ChatClient::jsonReceived,this,&MainWindow::jsonReceived);
-}
-
-MainWindow::~MainWindow()
-{
-    delete ui;
-}
-
-void MainWindow::on_loginButton_clicked()
-{
-    if(ui->userName->text().trimmed().isEmpty()) {
-        QMessageBox::warning(this, "登录失败", "用户名不能为空");
-        return;
-    }
-    m_chatclient->connectToServer(QHostAddress(ui->serverEdit->text()),1967);
-}
-
-
-void MainWindow::on_sayButton_clicked()
-{
-    if(!ui->sayLineEdit->text().isEmpty())
-        m_chatclient->sendMessage(ui->sayLineEdit->text());
-        ui->sayLineEdit->clear(); // 清空输入框
-}
-
-
-void MainWindow::on_logoutButton_clicked()
-{
-    m_chatclient->disconnectFromHost();
-    ui->stackedWidget->setCurrentWidget(ui->loginPage);
-    for(auto aItem : ui->userListWidget ->findItems(ui->userName->text(),Qt::MatchExactly)){
-        qDebug("remove");
-        ui->userListWidget->removeItemWidget(aItem);
-        delete aItem;
-    }
-}
-
-void MainWindow::connectedToServer()
-{
-    m_chatclient->sendMessage(ui->userName->text(),"login");
-}
-
-void MainWindow::messageReceived(const QString &sender, const QString &text)
-{
-    ui->roomTexitEdit->append(QString("%1 : %2").arg(sender).arg(text));
-}
-
-void MainWindow::jsonReceived(const QJsonObject &docObj)
-{
-    const QJsonValue typeVal = docObj.value("type");
-    if(typeVal.isNull() || !typeVal.isString())
-        return;
-
-    // 添加处理登录错误
-    if(typeVal.toString().compare("loginError",Qt::CaseInsensitive) == 0){
-        const QJsonValue textVal = docObj.value("text");
-        if(textVal.isNull() || !textVal.isString())
-            return;
-
-        const QString errorMsg = textVal.toString();
-        // 在客户端控制台输出错误信息
-        qDebug() << "登录失败：" << errorMsg;
-
-        // 显示错误消息给用户
-        QMessageBox::warning(this, "登录失败", errorMsg);
-
-        // 断开连接，让用户重新输入
-        m_chatclient->disconnectFromHost();
-        ui->stackedWidget->setCurrentWidget(ui->loginPage);
-        return;
-    }
-
-    if(typeVal.toString().compare("message",Qt::CaseInsensitive) == 0){
-        const QJsonValue textVal = docObj.value("text");
-        const QJsonValue senderVal = docObj.value("sender");
-        if(textVal.isNull() || !textVal.isString())
-            return;
-
-        if(senderVal.isNull() || !senderVal.isString())
-            return;
-
-        const QString text = textVal.toString().trimmed();
-        if(text.isEmpty())
-            return;
-        const QString sender = senderVal.toString().trimmed();
-        if(text.isEmpty())
-            return;
-
-        messageReceived(sender,text);
-
-    }else if(typeVal.toString().compare("newuser",Qt::CaseInsensitive) == 0){
-        const QJsonValue usernameVal = docObj.value("username");
-        if(usernameVal.isNull() || !usernameVal.isString())
-            return;
-        userJoined(usernameVal.toString());
-    }
-    else if (typeVal.toString().compare("userdisconnected",Qt::CaseInsensitive)==0){
-        const QJsonValue usernameVal = docObj.value("username");
-        if(usernameVal.isNull() || !usernameVal.isString())
-            return;
-        userLeft(usernameVal.toString());
-    }else if(typeVal.toString().compare("userlist",Qt::CaseInsensitive)==0){
-        // 收到用户列表，表示登录成功，切换页面
-        if(ui->stackedWidget->currentWidget() != ui->chatPage) {
-            ui->stackedWidget->setCurrentWidget(ui->chatPage);
-        }
-
-        const QJsonValue userlistVal = docObj.value("userlist");
-        if(userlistVal.isNull() || !userlistVal.isArray())
-            return;
-
-        qDebug()<<userlistVal.toVariant().toStringList();
-        userListReceived(userlistVal.toVariant().toStringList());
-    }
-}
-
-void MainWindow::userJoined(const QString &user)
-{
-    ui->userListWidget->addItem(user);
-}
-
-void MainWindow::userLeft(const QString &user)
-{
-    for(auto aItem : ui->userListWidget ->findItems(user,Qt::MatchExactly)){
-        qDebug("remove");
-        ui->userListWidget->removeItemWidget(aItem);
-        delete aItem;
-    }
-}
-
-void MainWindow::userListReceived(const QStringList &list)
-{
-    ui->userListWidget->clear();
-    ui->userListWidget->addItems(list);
-}
-
+#include "mainwindow.h"
+#include "ui_mainwindow.h"
+#include <QHostAddress>
+#include <QJsonValue>
+#include <QJsonObject>
+#include <QMessageBox>
+#include <QFileDialog>
+#include <QJsonArray>
+#include <QStatusBar>
+#include <QStandardPaths>
+#include <QDir>
+#include <QDateTime>
+
+MainWindow::MainWindow(QWidget *parent)
+    : QMainWindow(parent)
+    , ui(new Ui::MainWindow)
+{
+    ui->setupUi(this);
+    ui->stackedWidget->setCurrentWidget(ui->loginPage);
+    m_chatclient = new ChatClient(this);
+    connect(m_chatclient,&ChatClient::connected,this,&MainWindow::connectedToServer);
+    connect(m_chatclient,&ChatClient::jsonReceived,this,&MainWindow::jsonReceived);
+    connect(m_chatclient,&ChatClient::rttMeasured,this,&MainWindow::rttMeasured);
+    connect(m_chatclient,&ChatClient::reconnecting,this,[this](int attempt,int delayMs){
+        m_rttLabel->clear();
+        statusBar()->showMessage(QString("连接不上服务器，%1 秒后第 %2 次重连").arg(delayMs / 1000.0,0,'f',1).arg(attempt));
+    });
+    connect(m_chatclient,&ChatClient::loginRetrying,this,[this](const QString &reason,int delayMs){
+        statusBar()->showMessage(QString("重新登录失败：%1，%2 秒后再试").arg(reason).arg(delayMs / 1000.0,0,'f',1));
+    });
+    m_searchNext = -1;
+    m_rttLabel = new QLabel(this);
+    statusBar()->addPermanentWidget(m_rttLabel);
+    m_pendingLabel = new QLabel(this);
+    statusBar()->addPermanentWidget(m_pendingLabel);
+    connect(m_chatclient,&ChatClient::pendingMessagesChanged,this,[this](int count){
+        m_pendingLabel->setText(count > 0 ? QString("%1 条消息待发送").arg(count) : QString());
+    });
+
+    m_cache = new ChatCache(this);
+    const QString cacheDir = QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation);
+    if(!QDir().mkpath(cacheDir) || !m_cache->open(cacheDir + "/chatcache.db"))
+        qDebug() << "聊天缓存不可用，不影响正常聊天";
+}
+
+MainWindow::~MainWindow()
+{
+    delete ui;
+}
+
+ChatClient *MainWindow::client() const
+{
+    return m_chatclient;
+}
+
+void MainWindow::on_loginButton_clicked()
+{
+    if(ui->userName->text().trimmed().isEmpty()) {
+        QMessageBox::warning(this, "登录失败", "用户名不能为空");
+        return;
+    }
+    // 可以填多个服务器，用逗号分开，哪个先连上用哪个
+    const QList<ChatClient::Endpoint> endpoints = ChatClient::parseEndpoints(ui->serverEdit->text(),1967);
+    if(endpoints.isEmpty()){
+        QMessageBox::warning(this, "登录失败", "服务器地址不能为空");
+        return;
+    }
+    QStringList servers;
+    for(const ChatClient::Endpoint &endpoint : endpoints)
+        servers.append(QString("%1:%2").arg(endpoint.host).arg(endpoint.port));
+    m_server = servers.join(',');
+    m_chatclient->setCache(m_cache->isOpen() ? m_cache : nullptr,m_server);
+    m_chatclient->connectToServers(endpoints);
+
+    // 先显示缓存里的用户列表和大厅消息，服务器的数据到了再更新
+    ui->roomTexitEdit->clear();
+    userListReceived(m_cache->userList(m_server));
+    showCachedRoom("lobby");
+    ui->stackedWidget->setCurrentWidget(ui->chatPage);
+}
+
+void MainWindow::showCachedRoom(const QString &room)
+{
+    m_shownRoom = room;
+    const QVector<QJsonObject> messages = m_cache->recentMessages(m_server,room,100);
+    for(const QJsonObject &message : messages)
+        jsonReceived(message);
+    if(!messages.isEmpty())
+        ui->roomTexitEdit->append("[系统] 以上是本地缓存的消息");
+}
+
+
+void MainWindow::on_sayButton_clicked()
+{
+    // "/join 房间名" 切换房间
+    const QString text = ui->sayLineEdit->text();
+    if(text.startsWith("/join ")){
+        m_chatclient->sendMessage(text.mid(6).trimmed(),"join");
+        ui->sayLineEdit->clear();
+        return;
+    }
+    // "/search 关键词" 在当前房间的聊天记录里搜索，"/more" 看更早的结果
+    if(text.startsWith("/search ")){
+        m_searchQuery = text.mid(8).trimmed();
+        m_searchNext = -1;
+        if(!m_searchQuery.isEmpty())
+            m_chatclient->sendMessage(m_searchQuery,"search");
+        ui->sayLineEdit->clear();
+        return;
+    }
+    if(text.trimmed() == "/more"){
+        if(m_searchNext >= 0){
+            QJsonObject searchMessage;
+            searchMessage["type"] = "search";
+            searchMessage["text"] = m_searchQuery;
+            searchMessage["before"] = QJsonValue(m_searchNext);
+            m_chatclient->sendJson(searchMessage);
+        }
+        ui->sayLineEdit->clear();
+        return;
+    }
+    // "/get 文件编号" 下载房间里分享的文件
+    if(text.startsWith("/get ")){
+        const quint32 fileId = text.mid(5).trimmed().toUInt();
+        const QString fileName = QFileDialog::getSaveFileName(this,"保存文件",m_sharedFiles.value(fileId));
+        if(fileId != 0 && !fileName.isEmpty() && !m_chatclient->downloadFile(fileId,fileName))
+            QMessageBox::warning(this,"下载失败","无法创建文件或者正在下载");
+        ui->sayLineEdit->clear();
+        return;
+    }
+    if(!ui->sayLineEdit->text().isEmpty())
+        m_chatclient->sendMessage(ui->sayLineEdit->text());
+        ui->sayLineEdit->clear(); // 清空输入框
+}
+
+
+void MainWindow::on_logoutButton_clicked()
+{
+    m_chatclient->disconnectFromHost();
+    m_rttLabel->clear();
+    ui->stackedWidget->setCurrentWidget(ui->loginPage);
+    for(auto aItem : ui->userListWidget ->findItems(ui->userName->text(),Qt::MatchExactly)){
+        qDebug("remove");
+        ui->userListWidget->removeItemWidget(aItem);
+        delete aItem;
+    }
+}
+
+void MainWindow::on_fileButton_clicked()
+{
+    const QString fileName = QFileDialog::getOpenFileName(this,"发送文件");
+    if(fileName.isEmpty())
+        return;
+    if(!m_chatclient->sendFile(fileName))
+        QMessageBox::warning(this,"发送失败","无法读取文件");
+}
+
+void MainWindow::connectedToServer()
+{
+    statusBar()->showMessage(QString("已连接 %1").arg(m_chatclient->currentEndpoint()),3000);
+    m_chatclient->login(ui->userName->text());
+}
+
+void MainWindow::messageReceived(const QString &sender, const QString &text)
+{
+    ui->roomTexitEdit->append(QString("%1 : %2").arg(sender).arg(text));
+}
+
+void MainWindow::jsonReceived(const QJsonObject &docObj)
+{
+    const QJsonValue typeVal = docObj.value("type");
+    if(typeVal.isNull() || !typeVal.isString())
+        return;
+
+    // 添加处理登录错误
+    if(typeVal.toString().compare("loginError",Qt::CaseInsensitive) == 0){
+        const QJsonValue textVal = docObj.value("text");
+        if(textVal.isNull() || !textVal.isString())
+            return;
+
+        const QString errorMsg = textVal.toString();
+        // 在客户端控制台输出错误信息
+        qDebug() << "登录失败：" << errorMsg;
+
+        // 显示错误消息给用户
+        QMessageBox::warning(this, "登录失败", errorMsg);
+
+        // 断开连接，让用户重新输入
+        m_chatclient->disconnectFromHost();
+        ui->stackedWidget->setCurrentWidget(ui->loginPage);
+        return;
+    }
+
+    if(typeVal.toString().compare("message",Qt::CaseInsensitive) == 0){
+        const QJsonValue textVal = docObj.value("text");
+        const QJsonValue senderVal = docObj.value("sender");
+        if(textVal.isNull() || !textVal.isString())
+            return;
+
+        if(senderVal.isNull() || !senderVal.isString())
+            return;
+
+        const QString text = textVal.toString().trimmed();
+        if(text.isEmpty())
+            return;
+        const QString sender = senderVal.toString().trimmed();
+        if(text.isEmpty())
+            return;
+
+        messageReceived(sender,text);
+
+    }else if(typeVal.toString().compare("newuser",Qt::CaseInsensitive) == 0){
+        const QJsonValue usernameVal = docObj.value("username");
+        if(usernameVal.isNull() || !usernameVal.isString())
+            return;
+        userJoined(usernameVal.toString());
+    }
+    else if (typeVal.toString().compare("userdisconnected",Qt::CaseInsensitive)==0){
+        const QJsonValue usernameVal = docObj.value("username");
+        if(usernameVal.isNull() || !usernameVal.isString())
+            return;
+        userLeft(usernameVal.toString());
+    }else if(typeVal.toString().compare("presence",Qt::CaseInsensitive)==0){
+        // 服务器合并过的上下线通知，只带每个用户最后的状态
+        for(const QJsonValue &user : docObj.value("left").toArray())
+            userLeft(user.toString());
+        for(const QJsonValue &user : docObj.value("joined").toArray()){
+            const QString name = user.toString();
+            if(ui->userListWidget->findItems(name,Qt::MatchExactly).isEmpty()
+                    && ui->userListWidget->findItems(name + "*",Qt::MatchExactly).isEmpty())
+                userJoined(name);
+        }
+    }else if(typeVal.toString().compare("userlist",Qt::CaseInsensitive)==0){
+        // 收到用户列表，表示登录成功，切换页面
+        if(ui->stackedWidget->currentWidget() != ui->chatPage) {
+            ui->stackedWidget->setCurrentWidget(ui->chatPage);
+        }
+
+        const QJsonValue userlistVal = docObj.value("userlist");
+        if(userlistVal.isNull() || !userlistVal.isArray())
+            return;
+
+        qDebug()<<userlistVal.toVariant().toStringList();
+        userListReceived(userlistVal.toVariant().toStringList());
+    }else if(typeVal.toString().compare("joined",Qt::CaseInsensitive)==0){
+        const QJsonValue roomVal = docObj.value("room");
+        if(roomVal.isNull() || !roomVal.isString())
+            return;
+        if(roomVal.toString() != m_shownRoom){
+            ui->roomTexitEdit->clear();
+            showCachedRoom(roomVal.toString());
+        }
+        ui->roomTexitEdit->append(QString("[系统] 进入房间 %1").arg(roomVal.toString()));
+    }else if(typeVal.toString().compare("rejected",Qt::CaseInsensitive)==0){
+        // 消息被服务器过滤器拦截
+        const QJsonValue textVal = docObj.value("text");
+        if(textVal.isNull() || !textVal.isString())
+            return;
+        ui->roomTexitEdit->append(QString("[系统] %1").arg(textVal.toString()));
+    }else if(typeVal.toString().compare("file",Qt::CaseInsensitive)==0){
+        const quint32 fileId = quint32(docObj.value("file").toInteger());
+        const QString name = docObj.value("name").toString();
+        m_sharedFiles.insert(fileId,name);
+        ui->roomTexitEdit->append(QString("[文件] %1 分享了 %2 (%3 KB)，输入 /get %4 下载")
+                                      .arg(docObj.value("sender").toString(),name)
+                                      .arg((docObj.value("size").toInteger() + 1023) / 1024)
+                                      .arg(fileId));
+    }else if(typeVal.toString().compare("receipts",Qt::CaseInsensitive)==0){
+        // 只显示自己最新一条消息的已读情况
+        QJsonObject latest;
+        for(const QJsonValue &receipt : docObj.value("receipts").toArray()){
+            if(receipt.toObject().value("seq").toInteger() > latest.value("seq").toInteger())
+                latest = receipt.toObject();
+        }
+        if(latest.isEmpty())
+            return;
+        QString text = QString("你的消息已被 %1 人看到").arg(latest.value("count").toInt());
+        const QStringList readers = latest.value("readers").toVariant().toStringList();
+        if(!readers.isEmpty())
+            text += QString("：%1").arg(readers.join("、"));
+        statusBar()->showMessage(text);
+    }else if(typeVal.toString().compare("searchResults",Qt::CaseInsensitive)==0){
+        const QJsonArray results = docObj.value("results").toArray();
+        // 第一页先显示总数
+        if(m_searchNext < 0)
+            ui->roomTexitEdit->append(QString("[搜索] \"%1\" 共 %2 条").arg(docObj.value("query").toString())
+                                          .arg(docObj.value("total").toInt()));
+        for(const QJsonValue &result : results){
+            const QJsonObject item = result.toObject();
+            ui->roomTexitEdit->append(QString("[搜索] %1 %2 : %3")
+                                          .arg(QDateTime::fromMSecsSinceEpoch(item.value("time").toInteger()).toString("MM-dd hh:mm"),
+                                               item.value("sender").toString(),item.value("text").toString()));
+        }
+        m_searchNext = docObj.value("next").toInteger(-1);
+        if(m_searchNext >= 0)
+            ui->roomTexitEdit->append("[搜索] 输入 /more 查看更早的结果");
+    }else if(typeVal.toString().compare("fileEnd",Qt::CaseInsensitive)==0){
+        ui->roomTexitEdit->append(QString("[系统] 文件已保存到 %1").arg(docObj.value("path").toString()));
+    }else if(typeVal.toString().compare("fileError",Qt::CaseInsensitive)==0){
+        ui->roomTexitEdit->append(QString("[系统] 文件传输失败：%1").arg(docObj.value("text").toString()));
+    }
+}
+
+void MainWindow::userJoined(const QString &user)
+{
+    ui->userListWidget->addItem(user);
+}
+
+void MainWindow::userLeft(const QString &user)
+{
+    for(auto aItem : ui->userListWidget ->findItems(user,Qt::MatchExactly)){
+        qDebug("remove");
+        ui->userListWidget->removeItemWidget(aItem);
+        delete aItem;
+    }
+}
+
+void MainWindow::userListReceived(const QStringList &list)
+{
+    ui->userListWidget->clear();
+    ui->userListWidget->addItems(list);
+}
+
+void MainWindow::rttMeasured(qint64 rttUs, qint64 smoothedUs)
+{
+    m_rttLabel->setText(QString("延迟 %1 ms（平均 %2 ms）")
+                            .arg(double(rttUs) / 1000.0,0,'f',1)
+                            .arg(double(smoothedUs) / 1000.0,0,'f',1));
+}
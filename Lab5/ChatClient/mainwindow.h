@@ -1,39 +1,62 @@
-#ifndef MAINWINDOW_H
-#define MAINWINDOW_H
-
-#include <QMainWindow>
-#include "chatclient.h"
-
-QT_BEGIN_NAMESPACE
-namespace Ui {
-class MainWindow;
-}
-QT_END_NAMESPACE
-
-class MainWindow : public QMainWindow
-{
-    Q_OBJECT
-
-public:
-    MainWindow(QWidget *parent = nullptr);
-    ~MainWindow();
-
-private slots:
-    void on_loginButton_clicked();
-
-    void on_sayButton_clicked();
-
-    void on_logoutButton_clicked();
-
-    void connectedToServer();
-    void messageReceived(const QString &sender,const QString &text);
-    void jsonReceived(const QJsonObject &docObj);
-    void userJoined(const QString &user);
-    void userLeft(const QString &user);
-    void userListReceived(const QStringList &list);
-
-private:
-    Ui::MainWindow *ui;
-    ChatClient *m_chatclient;
-};
-#endif // MAINWINDOW_H
+#ifndef MAINWINDOW_H
+#define MAINWINDOW_H
+
+#include <QMainWindow>
+#include "chatclient.h"
+#include "chatcache.h"
+#include <QHash>
+#include <QLabel>
+
+QT_BEGIN_NAMESPACE
+namespace Ui {
+class MainWindow;
+}
+QT_END_NAMESPACE
+
+class MainWindow : public QMainWindow
+{
+    Q_OBJECT
+
+public:
+    MainWindow(QWidget *parent = nullptr);
+    ~MainWindow();
+
+    ChatClient *client() const;
+
+private slots:
+    void on_loginButton_clicked();
+
+    void on_sayButton_clicked();
+
+    void on_logoutButton_clicked();
+
+    void on_fileButton_clicked();
+
+    void connectedToServer();
+    void messageReceived(const QString &sender,const QString &text);
+    void jsonReceived(const QJsonObject &docObj);
+    void userJoined(const QString &user);
+    void userLeft(const QString &user);
+    void userListReceived(const QStringList &list);
+    void rttMeasured(qint64 rttUs,qint64 smoothedUs);
+
+private:
+    void showCachedRoom(const QString &room);
+
+    Ui::MainWindow *ui;
+    ChatClient *m_chatclient;
+    // 房间里分享过的文件，/get 下载时用作默认文件名
+    QHash<quint32,QString> m_sharedFiles;
+    // 上一次搜索的关键词和下一页的位置，/more 继续往前翻；-1 表示没有更多
+    QString m_searchQuery;
+    qint64 m_searchNext;
+    // 本地缓存，登录时先显示上次的消息，不用等服务器
+    ChatCache *m_cache;
+    QString m_server;
+    QString m_shownRoom;
+    // 状态栏右侧常驻显示往返时延
+    QLabel *m_rttLabel;
+    // 还没被服务器确认的消息条数
+    QLabel *m_pendingLabel;
+};
+#endif // MAINWINDOW_H
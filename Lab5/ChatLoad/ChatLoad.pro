@@ -0,0 +1,19 @@
+QT       += core network
+QT       -= gui
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+SOURCES += \
+    loadgenerator.cpp \
+    main.cpp \
+    soakrunner.cpp
+
+HEADERS += \
+    loadgenerator.h \
+    soakrunner.h
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
@@ -0,0 +1,39 @@
+#!/bin/sh
+# 启动一个 ChatRelay 和 N 个无界面 chatServer 节点，用 ChatLoad 压测，输出吞吐随节点数的变化
+# 用法：cluster_bench.sh <ChatRelay> <ChatServer> <ChatLoad> [节点数...]
+# 环境变量 CLIENTS、RATE、DURATION 调整压测参数
+RELAY=$1
+SERVER=$2
+LOAD=$3
+shift 3 || { echo "用法：$0 <ChatRelay> <ChatServer> <ChatLoad> [节点数...]"; exit 1; }
+[ $# -eq 0 ] && set -- 1 2 4
+CLIENTS=${CLIENTS:-400}
+RATE=${RATE:-2}
+DURATION=${DURATION:-10}
+RELAY_PORT=19690
+BASE_PORT=19700
+
+"$RELAY" --port $RELAY_PORT &
+RELAY_PID=$!
+trap 'kill $RELAY_PID 2>/dev/null' EXIT
+sleep 1
+
+echo "nodes,clients,sent_per_sec,received_per_sec,p50_ms,p99_ms,transport,connect_per_sec,connect_p50_ms,server_cpu_us,resume_probes,resumed"
+for NODES in "$@"; do
+    PIDS=""
+    ENDPOINTS=""
+    i=0
+    while [ $i -lt "$NODES" ]; do
+        PORT=$((BASE_PORT + i))
+        "$SERVER" --headless --port $PORT --local-name "chatbench-$i" \
+            --relay 127.0.0.1:$RELAY_PORT --node-id "bench-$i" &
+        PIDS="$PIDS $!"
+        ENDPOINTS="$ENDPOINTS${ENDPOINTS:+,}127.0.0.1:$PORT"
+        i=$((i + 1))
+    done
+    sleep 1
+    "$LOAD" --endpoints "$ENDPOINTS" --clients "$CLIENTS" --rate "$RATE" --duration "$DURATION" \
+        | sed -n 's/^csv,//p'
+    kill $PIDS 2>/dev/null
+    wait $PIDS 2>/dev/null
+done
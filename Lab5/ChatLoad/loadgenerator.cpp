@@ -0,0 +1,333 @@
+#include "loadgenerator.h"
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QJsonDocument>
+#include <QTextStream>
+#include <algorithm>
+
+// 每次定时器最多补发这么多条，机器跟不上时不会一直卡在循环里
+static const int MaxSendsPerTick = 10000;
+// 延迟样本上限，超过后不再记录
+static const int MaxLatencySamples = 1000000;
+// 结束时等服务器 stats 回复的最长时间
+static const int StatsTimeoutMs = 2000;
+// 结束时带着票据重连的连接数和最长等待时间
+static const int ResumeProbeClients = 50;
+static const int ResumeProbeTimeoutMs = 5000;
+
+LoadGenerator::LoadGenerator(const QVector<Endpoint> &endpoints, int clients, double rate, QObject *parent)
+    : QObject{parent}
+    , m_endpoints(endpoints)
+    , m_rate(rate)
+    , m_room("loadtest")
+    , m_measureStartNs(0)
+    , m_measureEndNs(0)
+    , m_scheduled(0)
+    , m_nextSender(0)
+    , m_sent(0)
+    , m_received(0)
+    , m_loginErrors(0)
+    , m_tls(false)
+    , m_lastConnectedNs(0)
+    , m_startSampled(false)
+    , m_finishing(false)
+    , m_reported(false)
+    , m_serverCpuStartUs(-1)
+    , m_serverCpuEndUs(-1)
+    , m_probeStarted(false)
+    , m_probed(0)
+    , m_probesPending(0)
+    , m_resumed(0)
+{
+    m_prefix = QString("load%1-").arg(QCoreApplication::applicationPid());
+    for(int i = 0; i < clients; i++){
+        Client *client = new Client;
+        client->name = m_prefix + QString::number(i);
+        m_clients.append(client);
+    }
+    m_timer.setInterval(10);
+    m_timer.setTimerType(Qt::PreciseTimer);
+    connect(&m_timer,&QTimer::timeout,this,&LoadGenerator::tick);
+}
+
+LoadGenerator::~LoadGenerator()
+{
+    qDeleteAll(m_clients);
+}
+
+void LoadGenerator::setRoom(const QString &room)
+{
+    m_room = room;
+}
+
+void LoadGenerator::setTls(bool enabled)
+{
+    m_tls = enabled;
+}
+
+void LoadGenerator::start(int warmup, int duration)
+{
+    m_clock.start();
+    m_measureStartNs = qint64(warmup) * 1000000000;
+    m_measureEndNs = m_measureStartNs + qint64(duration) * 1000000000;
+    for(int i = 0; i < m_clients.size(); i++){
+        Client *client = m_clients.at(i);
+        const Endpoint &endpoint = m_endpoints.at(i % m_endpoints.size());
+        client->socket = new QSslSocket(this);
+        client->connectStartNs = m_clock.nsecsElapsed();
+        connect(client->socket,&QSslSocket::readyRead,this,std::bind(&LoadGenerator::onReadyRead,this,client));
+        if(m_tls){
+            // 压测用自签名证书，不验证；留下服务器发的会话票据，结束时重连要用
+            QSslConfiguration config = client->socket->sslConfiguration();
+            config.setPeerVerifyMode(QSslSocket::VerifyNone);
+            config.setSslOption(QSsl::SslOptionDisableSessionPersistence,false);
+            client->socket->setSslConfiguration(config);
+            connect(client->socket,&QSslSocket::encrypted,this,std::bind(&LoadGenerator::connected,this,client));
+            connect(client->socket,&QSslSocket::newSessionTicketReceived,this,std::bind(&LoadGenerator::saveSessionTicket,this,client));
+            client->socket->connectToHostEncrypted(endpoint.host,endpoint.port);
+        }else{
+            connect(client->socket,&QSslSocket::connected,this,std::bind(&LoadGenerator::connected,this,client));
+            client->socket->connectToHost(endpoint.host,endpoint.port);
+        }
+    }
+    m_timer.start();
+}
+
+void LoadGenerator::connected(Client *client)
+{
+    if(client->probing){
+        // 复用会话时服务器不再发证书，OpenSSL 拿到的对端证书链是空的
+        if(client->socket->peerCertificateChain().isEmpty())
+            m_resumed++;
+        client->probing = false;
+        client->socket->disconnectFromHost();
+        if(--m_probesPending == 0)
+            report();
+        return;
+    }
+    if(m_tls)
+        saveSessionTicket(client);
+    const qint64 now = m_clock.nsecsElapsed();
+    m_connectNs.append(now - client->connectStartNs);
+    m_lastConnectedNs = now;
+    client->socket->setSocketOption(QAbstractSocket::LowDelayOption,1);
+    QJsonObject login;
+    login["type"] = "login";
+    login["text"] = client->name;
+    send(client,login);
+}
+
+void LoadGenerator::saveSessionTicket(Client *client)
+{
+    const QByteArray ticket = client->socket->sslConfiguration().sessionTicket();
+    if(!ticket.isEmpty())
+        client->sessionTicket = ticket;
+}
+
+void LoadGenerator::tick()
+{
+    const qint64 now = m_clock.nsecsElapsed();
+    if(now >= m_measureEndNs){
+        finish();
+        return;
+    }
+    // 预热为 0 时可能还没有人进房间，等有连接能发了再问
+    if(now >= m_measureStartNs && !m_startSampled)
+        m_startSampled = requestServerStats();
+
+    // 按总速率补齐应发的条数，发送者轮流选
+    const qint64 target = qint64(now / 1e9 * m_rate * m_clients.size());
+    int sends = 0;
+    while(m_scheduled < target && sends < MaxSendsPerTick){
+        m_scheduled++;
+        Client *client = m_clients.at(m_nextSender);
+        m_nextSender = (m_nextSender + 1) % m_clients.size();
+        if(!client->joined)
+            continue;
+        QJsonObject message;
+        message["type"] = "message";
+        message["text"] = QString("t%1").arg(m_clock.nsecsElapsed());
+        send(client,message);
+        if(now >= m_measureStartNs)
+            m_sent++;
+        sends++;
+    }
+}
+
+void LoadGenerator::send(Client *client, const QJsonObject &message)
+{
+    QDataStream socketStream(client->socket);
+    socketStream.setVersion(QDataStream::Qt_5_12);
+    socketStream << QJsonDocument(message).toJson(QJsonDocument::Compact);
+}
+
+void LoadGenerator::onReadyRead(Client *client)
+{
+    QByteArray jsonData;
+    QDataStream socketStream(client->socket);
+    socketStream.setVersion(QDataStream::Qt_5_12);
+    for(;;){
+        socketStream.startTransaction();
+        socketStream >> jsonData;
+        if(!socketStream.commitTransaction())
+            break;
+        const QJsonDocument jsonDoc = QJsonDocument::fromJson(jsonData);
+        if(jsonDoc.isObject())
+            handle(client,jsonDoc.object());
+    }
+}
+
+void LoadGenerator::handle(Client *client, const QJsonObject &message)
+{
+    const QString type = message.value("type").toString();
+    if(type == "message"){
+        const qint64 now = m_clock.nsecsElapsed();
+        if(now < m_measureStartNs || !message.value("sender").toString().startsWith(m_prefix))
+            return;
+        m_received++;
+        const QString text = message.value("text").toString();
+        if(text.startsWith('t') && m_latencyNs.size() < MaxLatencySamples)
+            m_latencyNs.append(now - text.mid(1).toLongLong());
+    }else if(type == "joined"){
+        if(message.value("room").toString() == m_room){
+            client->joined = true;
+        }else{
+            QJsonObject join;
+            join["type"] = "join";
+            join["text"] = m_room;
+            send(client,join);
+        }
+    }else if(type == "loginError"){
+        m_loginErrors++;
+    }else if(type == "stats"){
+        const qint64 cpuUs = message.value("process").toObject().value("cpuUs").toInteger(-1);
+        if(!m_finishing){
+            m_serverCpuStartUs = cpuUs;
+        }else{
+            m_serverCpuEndUs = cpuUs;
+            m_serverTls = message.value("tls").toObject();
+            // 回复是在这个连接的读循环里处理的，重连放到下一轮事件
+            QTimer::singleShot(0,this,&LoadGenerator::probeResumption);
+        }
+    }
+}
+
+bool LoadGenerator::requestServerStats()
+{
+    for(Client *client : std::as_const(m_clients)){
+        if(!client->joined)
+            continue;
+        QJsonObject request;
+        request["type"] = "stats";
+        send(client,request);
+        return true;
+    }
+    return false;
+}
+
+void LoadGenerator::finish()
+{
+    m_timer.stop();
+    if(m_finishing)
+        return;
+    m_finishing = true;
+    // 统计窗口开始时没拿到起点就不用再问了
+    if(m_serverCpuStartUs < 0){
+        probeResumption();
+        return;
+    }
+    if(!requestServerStats()){
+        probeResumption();
+        return;
+    }
+    QTimer::singleShot(StatsTimeoutMs,this,&LoadGenerator::probeResumption);
+}
+
+void LoadGenerator::probeResumption()
+{
+    if(m_probeStarted)
+        return;
+    m_probeStarted = true;
+    if(m_tls){
+        for(int i = 0; i < m_clients.size() && m_probesPending < ResumeProbeClients; i++){
+            Client *client = m_clients.at(i);
+            if(client->sessionTicket.isEmpty())
+                continue;
+            client->socket->abort();
+            QSslConfiguration config = client->socket->sslConfiguration();
+            config.setSessionTicket(client->sessionTicket);
+            client->socket->setSslConfiguration(config);
+            client->probing = true;
+            m_probesPending++;
+            const Endpoint &endpoint = m_endpoints.at(i % m_endpoints.size());
+            client->socket->connectToHostEncrypted(endpoint.host,endpoint.port);
+        }
+    }
+    m_probed = m_probesPending;
+    if(m_probesPending == 0){
+        report();
+        return;
+    }
+    QTimer::singleShot(ResumeProbeTimeoutMs,this,&LoadGenerator::report);
+}
+
+void LoadGenerator::report()
+{
+    if(m_reported)
+        return;
+    m_reported = true;
+    int joined = 0;
+    for(const Client *client : std::as_const(m_clients)){
+        if(client->joined)
+            joined++;
+    }
+    const double seconds = (m_measureEndNs - m_measureStartNs) / 1e9;
+    std::sort(m_latencyNs.begin(),m_latencyNs.end());
+    auto percentile = [this](double p) -> double {
+        if(m_latencyNs.isEmpty())
+            return 0;
+        return m_latencyNs.at(qMin(m_latencyNs.size() - 1,qsizetype(m_latencyNs.size() * p))) / 1e6;
+    };
+
+    QTextStream out(stdout);
+    out << "节点数: " << m_endpoints.size() << Qt::endl
+        << "连接数: " << m_clients.size() << " (进入房间 " << joined << ", 登录失败 " << m_loginErrors << ")" << Qt::endl
+        << "发送: " << m_sent / seconds << " 条/秒" << Qt::endl
+        << "收到: " << m_received / seconds << " 条/秒（含扇出）" << Qt::endl
+        << "延迟: p50 " << percentile(0.5) << " 毫秒, p99 " << percentile(0.99) << " 毫秒" << Qt::endl;
+    // 方便脚本汇总的一行
+    std::sort(m_connectNs.begin(),m_connectNs.end());
+    auto connectPercentile = [this](double p) -> double {
+        if(m_connectNs.isEmpty())
+            return 0;
+        return m_connectNs.at(qMin(m_connectNs.size() - 1,qsizetype(m_connectNs.size() * p))) / 1e6;
+    };
+    const double connectRate = m_lastConnectedNs > 0 ? m_connectNs.size() / (m_lastConnectedNs / 1e9) : 0;
+    out << (m_tls ? "TLS 握手: " : "建立连接: ") << connectRate << " 个/秒, p50 " << connectPercentile(0.5)
+        << " 毫秒, p99 " << connectPercentile(0.99) << " 毫秒" << Qt::endl;
+    double cpuPerMessage = -1;
+    if(m_serverCpuStartUs >= 0 && m_serverCpuEndUs >= m_serverCpuStartUs && m_sent > 0){
+        cpuPerMessage = double(m_serverCpuEndUs - m_serverCpuStartUs) / m_sent;
+        out << "服务器 CPU: " << cpuPerMessage << " 微秒/条" << Qt::endl;
+    }else{
+        out << "服务器 CPU: 没有拿到 stats" << Qt::endl;
+    }
+    if(m_serverTls.value("enabled").toBool()){
+        const QJsonObject handshakeTime = m_serverTls.value("handshakeTime").toObject();
+        out << "服务器握手: 完成 " << m_serverTls.value("handshakes").toInteger() << ", 失败 " << m_serverTls.value("failed").toInteger()
+            << ", p50 " << handshakeTime.value("p50Us").toDouble() / 1000 << " 毫秒, p99 "
+            << handshakeTime.value("p99Us").toDouble() / 1000 << " 毫秒" << Qt::endl;
+    }
+    if(m_tls)
+        out << "会话复用: 带票据重连 " << m_probed << " 次, 复用 " << m_resumed << " 次" << Qt::endl;
+    out << "csv," << m_endpoints.size() << ',' << m_clients.size() << ',' << m_sent / seconds << ','
+        << m_received / seconds << ',' << percentile(0.5) << ',' << percentile(0.99) << ','
+        << (m_tls ? "tls" : "tcp") << ',' << connectRate << ',' << connectPercentile(0.5) << ',' << cpuPerMessage << ','
+        << m_probed << ',' << m_resumed << Qt::endl;
+
+    for(Client *client : std::as_const(m_clients))
+        client->socket->disconnectFromHost();
+    QTimer::singleShot(500,this,[this]{
+        emit finished(0);
+    });
+}
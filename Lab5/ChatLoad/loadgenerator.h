@@ -0,0 +1,96 @@
+#ifndef LOADGENERATOR_H
+#define LOADGENERATOR_H
+
+#include <QObject>
+#include <QSslSocket>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QVector>
+#include <QJsonObject>
+
+// 压测客户端：按轮询把连接分到各个节点，所有人进同一个房间按固定速率发言，
+// 统计发送速率、实际收到的消息数（含扇出）和端到端延迟
+class LoadGenerator : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Endpoint
+    {
+        QString host;
+        quint16 port;
+    };
+
+    explicit LoadGenerator(const QVector<Endpoint> &endpoints,int clients,double rate,QObject *parent = nullptr);
+    ~LoadGenerator();
+
+    void setRoom(const QString &room);
+    // 用 TLS 连接，不验证证书，额外统计握手耗时和会话复用
+    void setTls(bool enabled);
+    // warmup 秒后开始计数，再跑 duration 秒
+    void start(int warmup,int duration);
+
+signals:
+    void finished(int exitCode);
+
+private slots:
+    void tick();
+
+private:
+    struct Client
+    {
+        QSslSocket *socket = nullptr;
+        QString name;
+        bool joined = false;
+        qint64 connectStartNs = 0;
+        QByteArray sessionTicket;
+        // 结束时正在用票据重连
+        bool probing = false;
+    };
+
+    void onReadyRead(Client *client);
+    void handle(Client *client,const QJsonObject &message);
+    void send(Client *client,const QJsonObject &message);
+    void connected(Client *client);
+    void saveSessionTicket(Client *client);
+    // 结束时挑一部分连接带着票据重连，数一下有几次握手复用了会话
+    void probeResumption();
+    // 向服务器要一次 stats，用首尾两次的 CPU 时间算每条消息的开销
+    bool requestServerStats();
+    void finish();
+    void report();
+
+    QVector<Endpoint> m_endpoints;
+    QVector<Client*> m_clients;
+    double m_rate;
+    QString m_room;
+    QString m_prefix;
+    QTimer m_timer;
+    QElapsedTimer m_clock;
+    qint64 m_measureStartNs;
+    qint64 m_measureEndNs;
+    qint64 m_scheduled;
+    int m_nextSender;
+
+    qint64 m_sent;
+    qint64 m_received;
+    qint64 m_loginErrors;
+    QVector<qint64> m_latencyNs;
+
+    bool m_tls;
+    // 每个连接从发起到可以发登录消息的耗时（TLS 时含握手）
+    QVector<qint64> m_connectNs;
+    qint64 m_lastConnectedNs;
+    bool m_startSampled;
+    bool m_finishing;
+    bool m_reported;
+    qint64 m_serverCpuStartUs;
+    qint64 m_serverCpuEndUs;
+    QJsonObject m_serverTls;
+    bool m_probeStarted;
+    int m_probed;
+    int m_probesPending;
+    int m_resumed;
+};
+
+#endif // LOADGENERATOR_H
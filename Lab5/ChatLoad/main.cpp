@@ -0,0 +1,82 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include "loadgenerator.h"
+#include "soakrunner.h"
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("chatServer 集群压测，连接按轮询分到各个节点；--soak 时做长时间的泄漏检查");
+    parser.addHelpOption();
+    QCommandLineOption endpointsOption("endpoints","节点地址，逗号分隔","host:port,...","127.0.0.1:1967");
+    QCommandLineOption clientsOption("clients","连接数","count","100");
+    QCommandLineOption rateOption("rate","每个连接每秒发送的消息数","rate","1");
+    QCommandLineOption roomOption("room","压测使用的房间","room","loadtest");
+    QCommandLineOption warmupOption("warmup","预热秒数，不计入统计","seconds","2");
+    QCommandLineOption durationOption("duration","统计秒数","seconds","10");
+    parser.addOption(endpointsOption);
+    parser.addOption(clientsOption);
+    parser.addOption(rateOption);
+    parser.addOption(roomOption);
+    parser.addOption(warmupOption);
+    parser.addOption(durationOption);
+    QCommandLineOption tlsOption("tls","用 TLS 连接（不验证证书），额外统计握手耗时和会话复用");
+    parser.addOption(tlsOption);
+    QCommandLineOption soakOption("soak","浸泡测试：反复建立短连接，检查服务器的内存、描述符和对象数量有没有持续增长");
+    QCommandLineOption sessionsOption("sessions","浸泡测试的会话总数","count","1000000");
+    QCommandLineOption concurrencyOption("concurrency","同时进行的会话数","count","50");
+    QCommandLineOption sampleEveryOption("sample-every","每隔多少次会话采样一次","count","10000");
+    QCommandLineOption rssGrowthOption("max-rss-growth","每百万次会话允许的常驻内存增长（MB）","MB","64");
+    QCommandLineOption fdGrowthOption("max-fd-growth","每百万次会话允许的描述符增长","count","16");
+    parser.addOption(soakOption);
+    parser.addOption(sessionsOption);
+    parser.addOption(concurrencyOption);
+    parser.addOption(sampleEveryOption);
+    parser.addOption(rssGrowthOption);
+    parser.addOption(fdGrowthOption);
+    parser.process(a);
+
+    QVector<LoadGenerator::Endpoint> endpoints;
+    for(const QString &address : parser.value(endpointsOption).split(',',Qt::SkipEmptyParts)){
+        const int colon = address.lastIndexOf(':');
+        LoadGenerator::Endpoint endpoint;
+        endpoint.host = colon > 0 ? address.left(colon) : QStringLiteral("127.0.0.1");
+        endpoint.port = address.mid(colon + 1).toUShort();
+        if(endpoint.port == 0){
+            qWarning() << "无效的节点地址" << address;
+            return 1;
+        }
+        endpoints.append(endpoint);
+    }
+    if(endpoints.isEmpty())
+        parser.showHelp(1);
+    if(parser.isSet(soakOption)){
+        // 浸泡测试只用第一个节点
+        SoakRunner runner(endpoints.first().host,endpoints.first().port);
+        runner.setSessions(parser.value(sessionsOption).toLongLong());
+        runner.setConcurrency(parser.value(concurrencyOption).toInt());
+        runner.setSampleEvery(parser.value(sampleEveryOption).toLongLong());
+        SoakRunner::Limits limits;
+        limits.rssMbPerMillion = parser.value(rssGrowthOption).toDouble();
+        limits.fdsPerMillion = parser.value(fdGrowthOption).toDouble();
+        runner.setLimits(limits);
+        QObject::connect(&runner,&SoakRunner::finished,&a,&QCoreApplication::exit);
+        runner.start();
+        return a.exec();
+    }
+
+    const int clients = parser.value(clientsOption).toInt();
+    const double rate = parser.value(rateOption).toDouble();
+    if(clients <= 0 || rate <= 0)
+        parser.showHelp(1);
+
+    LoadGenerator generator(endpoints,clients,rate);
+    generator.setRoom(parser.value(roomOption));
+    generator.setTls(parser.isSet(tlsOption));
+    QObject::connect(&generator,&LoadGenerator::finished,&a,&QCoreApplication::exit);
+    generator.start(parser.value(warmupOption).toInt(),parser.value(durationOption).toInt());
+    return a.exec();
+}
@@ -0,0 +1,21 @@
+#!/bin/sh
+# 浸泡测试：启动一个无界面 chatServer，用 ChatLoad --soak 反复连接、登录、聊天、断开，
+# 内存、描述符或连接对象持续增长时返回非 0
+# 用法：soak_test.sh <ChatServer> <ChatLoad>
+# 要先编好服务端和 ChatLoad 并占用本机端口，不在 make check 里，需要手动跑；
+# 默认两万次会话，几分钟跑完，SESSIONS=1000000 之类的值用来跑几个小时
+SERVER=$1
+LOAD=$2
+[ -n "$SERVER" ] && [ -n "$LOAD" ] || { echo "用法：$0 <ChatServer> <ChatLoad>"; exit 1; }
+SESSIONS=${SESSIONS:-20000}
+CONCURRENCY=${CONCURRENCY:-50}
+SAMPLE_EVERY=${SAMPLE_EVERY:-$((SESSIONS / 10))}
+PORT=${PORT:-19801}
+
+"$SERVER" --headless --port $PORT --local-name "chatsoak-$$" &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null' EXIT
+sleep 1
+
+"$LOAD" --soak --endpoints 127.0.0.1:$PORT --sessions "$SESSIONS" \
+    --concurrency "$CONCURRENCY" --sample-every "$SAMPLE_EVERY"
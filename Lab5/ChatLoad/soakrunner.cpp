@@ -0,0 +1,329 @@
+#include "soakrunner.h"
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QJsonDocument>
+#include <QTextStream>
+#include <QDebug>
+
+// 会话的模式数，按序号轮流使用
+static const int PatternCount = 5;
+// 单个会话的超时
+static const int SessionTimeoutMs = 10000;
+// 全部会话结束后等服务器释放连接的时间
+static const int DrainMs = 2000;
+// 第一个样本之前的预热会话数占总数的比例，内存池和哈希表先长到稳定大小
+static const double WarmupFraction = 0.1;
+
+SoakRunner::SoakRunner(const QString &host, quint16 port, QObject *parent)
+    : QObject{parent}
+    , m_host(host)
+    , m_port(port)
+    , m_sessions(1000000)
+    , m_concurrency(50)
+    , m_sampleEvery(10000)
+    , m_started(0)
+    , m_completed(0)
+    , m_failed(0)
+    , m_inFlight(0)
+    , m_nextSampleAt(0)
+    , m_sampling(false)
+    , m_draining(false)
+    , m_monitor(nullptr)
+{
+    m_prefix = QString("soak%1-").arg(QCoreApplication::applicationPid());
+}
+
+void SoakRunner::setSessions(qint64 sessions)
+{
+    m_sessions = qMax<qint64>(1,sessions);
+}
+
+void SoakRunner::setConcurrency(int concurrency)
+{
+    m_concurrency = qMax(1,concurrency);
+}
+
+void SoakRunner::setSampleEvery(qint64 sessions)
+{
+    m_sampleEvery = qMax<qint64>(1,sessions);
+}
+
+void SoakRunner::setLimits(const Limits &limits)
+{
+    m_limits = limits;
+}
+
+void SoakRunner::start()
+{
+    m_clock.start();
+    // 监视连接一直保持登录，只用来发 stats
+    m_monitor = new QTcpSocket(this);
+    connect(m_monitor,&QTcpSocket::connected,this,[this]{
+        QJsonObject login;
+        login["type"] = "login";
+        login["text"] = m_prefix + "monitor";
+        send(m_monitor,login);
+        requestSample();
+    });
+    connect(m_monitor,&QTcpSocket::readyRead,this,&SoakRunner::onMonitorReadyRead);
+    connect(m_monitor,&QTcpSocket::errorOccurred,this,[this]{
+        qWarning().noquote() << "监视连接出错：" << m_monitor->errorString();
+        emit finished(2);
+    });
+    m_monitor->connectToHost(m_host,m_port);
+
+    QTextStream(stdout) << "sample,sessions,seconds,rss_bytes,fds,workers,rooms" << Qt::endl;
+}
+
+void SoakRunner::launch()
+{
+    if(m_sampling)
+        return;
+    while(m_inFlight < m_concurrency && m_started < m_sessions){
+        // 到采样点时先停下来，等在途会话都结束再读 stats，样本里没有活着的会话
+        if(m_started >= m_nextSampleAt)
+            break;
+        Session *session = new Session;
+        session->index = m_started++;
+        session->pattern = int(session->index % PatternCount);
+        session->socket = new QTcpSocket(this);
+        session->timeout = new QTimer(session->socket);
+        session->timeout->setSingleShot(true);
+        connect(session->timeout,&QTimer::timeout,this,[this,session]{
+            finishSession(session,true,true);
+        });
+        connect(session->socket,&QTcpSocket::connected,this,std::bind(&SoakRunner::onConnected,this,session));
+        connect(session->socket,&QTcpSocket::readyRead,this,std::bind(&SoakRunner::onReadyRead,this,session));
+        connect(session->socket,&QTcpSocket::errorOccurred,this,[this,session](QAbstractSocket::SocketError error){
+            // 服务器正常关闭连接不算失败
+            finishSession(session,true,error != QAbstractSocket::RemoteHostClosedError);
+        });
+        m_inFlight++;
+        session->timeout->start(SessionTimeoutMs);
+        session->socket->connectToHost(m_host,m_port);
+    }
+    if(m_inFlight > 0)
+        return;
+    if(m_started >= m_sessions && !m_draining){
+        m_draining = true;
+        QTimer::singleShot(DrainMs,this,&SoakRunner::requestSample);
+    }else if(m_started >= m_nextSampleAt && m_started < m_sessions){
+        requestSample();
+    }
+}
+
+void SoakRunner::onConnected(Session *session)
+{
+    switch(session->pattern){
+    case 0:
+        // 连上就断，不登录
+        finishSession(session,true);
+        return;
+    case 4:{
+        // 只发半帧就断，服务器的接收缓冲区里留着没解析完的数据
+        QByteArray partial;
+        QDataStream out(&partial,QIODevice::WriteOnly);
+        out << quint32(100);
+        partial.append(10,'x');
+        session->socket->write(partial);
+        session->socket->flush();
+        finishSession(session,true);
+        return;
+    }
+    default:
+        break;
+    }
+    session->messagesLeft = session->pattern == 2 ? 3 : 1;
+    QJsonObject login;
+    login["type"] = "login";
+    login["text"] = m_prefix + QString::number(session->index);
+    send(session->socket,login);
+}
+
+void SoakRunner::onReadyRead(Session *session)
+{
+    QByteArray jsonData;
+    QDataStream socketStream(session->socket);
+    socketStream.setVersion(QDataStream::Qt_5_12);
+    for(;;){
+        socketStream.startTransaction();
+        socketStream >> jsonData;
+        if(!socketStream.commitTransaction())
+            break;
+        const QJsonDocument jsonDoc = QJsonDocument::fromJson(jsonData);
+        if(jsonDoc.isObject())
+            handle(session,jsonDoc.object());
+        if(!session->socket)
+            return;
+    }
+}
+
+void SoakRunner::handle(Session *session, const QJsonObject &message)
+{
+    const QString type = message.value("type").toString();
+    if(type == "loginError"){
+        finishSession(session,true,true);
+        return;
+    }
+    if(type == "joined"){
+        if(session->pattern == 1){
+            finishSession(session,false);
+            return;
+        }
+        if(session->pattern == 3 && message.value("room").toString() == "lobby"){
+            // 换到一个小房间再发言，房间会随最后一个成员离开而删除
+            QJsonObject join;
+            join["type"] = "join";
+            join["text"] = QString("soak-%1").arg(session->index % 8);
+            send(session->socket,join);
+            return;
+        }
+        while(session->messagesLeft > 0){
+            session->messagesLeft--;
+            QJsonObject chat;
+            chat["type"] = "message";
+            chat["text"] = QString("soak %1").arg(session->index);
+            send(session->socket,chat);
+        }
+        return;
+    }
+    // 收到自己发的消息就算这一轮结束
+    if(type == "message" && message.value("sender").toString() == m_prefix + QString::number(session->index))
+        finishSession(session,session->pattern == 3);
+}
+
+void SoakRunner::send(QTcpSocket *socket, const QJsonObject &message)
+{
+    QDataStream socketStream(socket);
+    socketStream.setVersion(QDataStream::Qt_5_12);
+    socketStream << QJsonDocument(message).toJson(QJsonDocument::Compact);
+}
+
+void SoakRunner::finishSession(Session *session, bool abort, bool failed)
+{
+    if(!session->socket)
+        return;
+    QTcpSocket *socket = session->socket;
+    session->socket = nullptr;
+    session->timeout->stop();
+    socket->disconnect(this);
+    if(abort)
+        socket->abort();
+    else
+        socket->disconnectFromHost();
+    socket->deleteLater();
+    // 同一次回调里可能还会用到 session，等回到事件循环再释放
+    QTimer::singleShot(0,this,[session]{ delete session; });
+
+    m_inFlight--;
+    m_completed++;
+    if(failed)
+        m_failed++;
+    QMetaObject::invokeMethod(this,&SoakRunner::launch,Qt::QueuedConnection);
+}
+
+void SoakRunner::requestSample()
+{
+    m_sampling = true;
+    QJsonObject statsRequest;
+    statsRequest["type"] = "stats";
+    send(m_monitor,statsRequest);
+}
+
+void SoakRunner::onMonitorReadyRead()
+{
+    QByteArray jsonData;
+    QDataStream socketStream(m_monitor);
+    socketStream.setVersion(QDataStream::Qt_5_12);
+    for(;;){
+        socketStream.startTransaction();
+        socketStream >> jsonData;
+        if(!socketStream.commitTransaction())
+            break;
+        const QJsonObject message = QJsonDocument::fromJson(jsonData).object();
+        if(message.value("type").toString() == "stats" && m_sampling)
+            recordSample(message.value("process").toObject());
+    }
+}
+
+void SoakRunner::recordSample(const QJsonObject &process)
+{
+    m_sampling = false;
+    Sample sample;
+    sample.sessions = m_completed;
+    sample.rssBytes = process.value("rssBytes").toInteger(-1);
+    sample.fds = process.value("fds").toInteger(-1);
+    sample.workers = process.value("workers").toInt();
+    sample.rooms = process.value("rooms").toInt();
+    // 第一个样本就提醒，不用跑完几百万次会话才发现白跑了
+    if(m_samples.isEmpty() && (sample.rssBytes < 0 || sample.fds < 0))
+        qWarning() << "警告：服务器没有报告常驻内存或描述符数（只在 Linux 上统计），这两项泄漏检查做不了，结果会判为失败";
+    m_samples.append(sample);
+    QTextStream(stdout) << "sample," << sample.sessions << ',' << m_clock.elapsed() / 1000 << ','
+                        << sample.rssBytes << ',' << sample.fds << ',' << sample.workers << ',' << sample.rooms << Qt::endl;
+
+    if(m_draining){
+        report();
+        return;
+    }
+    // 第一个样本在预热之后
+    if(m_nextSampleAt == 0)
+        m_nextSampleAt = qMax<qint64>(1,qint64(m_sessions * WarmupFraction));
+    else
+        m_nextSampleAt += m_sampleEvery;
+    launch();
+}
+
+void SoakRunner::report()
+{
+    QTextStream out(stdout);
+    // samples[0] 是开始前，samples[1] 是预热之后的基线
+    if(m_samples.size() < 3){
+        out << "样本不足，无法判断" << Qt::endl;
+        emit finished(2);
+        return;
+    }
+    const Sample &baseline = m_samples.at(1);
+    const Sample &last = m_samples.last();
+    const double millions = double(last.sessions - baseline.sessions) / 1e6;
+    const double rssGrowthMb = (last.rssBytes - baseline.rssBytes) / (1024.0 * 1024.0);
+    const qint64 fdGrowth = last.fds - baseline.fds;
+    const double rssLimitMb = m_limits.rssMbPerMillion * millions + m_limits.rssSlackMb;
+    const double fdLimit = m_limits.fdsPerMillion * millions + m_limits.fdSlack;
+    // 会话都结束之后只剩监视连接
+    const int leakedWorkers = last.workers - baseline.workers;
+
+    out << "会话: " << m_completed << " (失败 " << m_failed << ")，用时 " << m_clock.elapsed() / 1000 << " 秒" << Qt::endl
+        << "常驻内存增长: " << rssGrowthMb << " MB（上限 " << rssLimitMb << " MB）" << Qt::endl
+        << "描述符增长: " << fdGrowth << "（上限 " << fdLimit << "）" << Qt::endl
+        << "未释放的连接对象: " << leakedWorkers << "，房间: " << last.rooms << Qt::endl;
+
+    int exitCode = 0;
+    if(baseline.rssBytes >= 0 && rssGrowthMb > rssLimitMb){
+        out << "失败：常驻内存增长超过上限" << Qt::endl;
+        exitCode = 1;
+    }
+    if(baseline.fds >= 0 && fdGrowth > fdLimit){
+        out << "失败：描述符泄漏" << Qt::endl;
+        exitCode = 1;
+    }
+    if(leakedWorkers > 0 || last.rooms > baseline.rooms){
+        out << "失败：断开的连接或空房间没有释放" << Qt::endl;
+        exitCode = 1;
+    }
+    if(baseline.rssBytes < 0 || baseline.fds < 0){
+        out << "失败：服务器没有报告常驻内存或描述符数，无法检查这两项泄漏" << Qt::endl;
+        if(exitCode == 0)
+            exitCode = 3;
+    }
+    if(exitCode == 0 && m_failed * 100 > m_completed){
+        out << "失败：超过 1% 的会话出错" << Qt::endl;
+        exitCode = 2;
+    }
+    if(exitCode == 0)
+        out << "通过" << Qt::endl;
+    m_monitor->disconnectFromHost();
+    QTimer::singleShot(200,this,[this,exitCode]{
+        emit finished(exitCode);
+    });
+}
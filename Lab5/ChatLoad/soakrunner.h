@@ -0,0 +1,89 @@
+#ifndef SOAKRUNNER_H
+#define SOAKRUNNER_H
+
+#include <QObject>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QJsonObject>
+
+// 浸泡测试：不停地建立短连接，按几种模式登录、聊天、断开（包括不登录就断、发半帧就断），
+// 定期通过 stats 读服务器的常驻内存、描述符和对象数量，按每百万次会话的增长判断有没有泄漏
+class SoakRunner : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Limits
+    {
+        double rssMbPerMillion = 64;    // 常驻内存每百万次会话允许增长的 MB
+        double fdsPerMillion = 16;      // 描述符
+        double rssSlackMb = 8;          // 短跑时的噪声余量
+        int fdSlack = 2;
+    };
+
+    SoakRunner(const QString &host,quint16 port,QObject *parent = nullptr);
+
+    void setSessions(qint64 sessions);
+    void setConcurrency(int concurrency);
+    void setSampleEvery(qint64 sessions);
+    void setLimits(const Limits &limits);
+    void start();
+
+signals:
+    // 0 通过，1 超过增长上限，2 连不上服务器或会话大量出错，
+    // 3 服务器报告不了常驻内存或描述符数（目前只在 Linux 上统计），没法判断有没有泄漏
+    void finished(int exitCode);
+
+private:
+    struct Sample
+    {
+        qint64 sessions = 0;
+        qint64 rssBytes = -1;
+        qint64 fds = -1;
+        int workers = 0;
+        int rooms = 0;
+    };
+
+    struct Session
+    {
+        QTcpSocket *socket = nullptr;
+        qint64 index = 0;
+        int pattern = 0;
+        int messagesLeft = 0;
+        QTimer *timeout = nullptr;
+    };
+
+    void launch();
+    void onConnected(Session *session);
+    void onReadyRead(Session *session);
+    void handle(Session *session,const QJsonObject &message);
+    void send(QTcpSocket *socket,const QJsonObject &message);
+    void finishSession(Session *session,bool abort,bool failed = false);
+    void requestSample();
+    void onMonitorReadyRead();
+    void recordSample(const QJsonObject &process);
+    void report();
+
+    QString m_host;
+    quint16 m_port;
+    QString m_prefix;
+    qint64 m_sessions;
+    int m_concurrency;
+    qint64 m_sampleEvery;
+    Limits m_limits;
+
+    qint64 m_started;
+    qint64 m_completed;
+    qint64 m_failed;
+    int m_inFlight;
+    qint64 m_nextSampleAt;
+    bool m_sampling;
+    bool m_draining;
+    QElapsedTimer m_clock;
+
+    QTcpSocket *m_monitor;
+    QVector<Sample> m_samples;
+};
+
+#endif // SOAKRUNNER_H
@@ -0,0 +1,36 @@
+#!/bin/sh
+# 明文和 TLS 的对比压测：生成自签名证书，分别启动无界面 chatServer 跑一遍 ChatLoad，
+# 输出每种传输的吞吐、握手速率、延迟、服务器每条消息的 CPU 时间，TLS 时还有带票据重连的会话复用次数
+# 用法：tls_bench.sh <ChatServer> <ChatLoad>
+SERVER=$1
+LOAD=$2
+[ -n "$SERVER" ] && [ -n "$LOAD" ] || { echo "用法：$0 <ChatServer> <ChatLoad>"; exit 1; }
+CLIENTS=${CLIENTS:-500}
+RATE=${RATE:-5}
+DURATION=${DURATION:-20}
+PORT=${PORT:-19901}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 1 \
+    -subj "/CN=chatbench" -addext "subjectAltName=IP:127.0.0.1" \
+    -keyout "$WORK/key.pem" -out "$WORK/cert.pem" 2>/dev/null || { echo "无法生成证书"; exit 1; }
+
+run() {
+    NAME=$1
+    shift
+    "$SERVER" --headless --port $PORT --local-name "chattls-$$" "$@" &
+    SERVER_PID=$!
+    sleep 1
+    echo "== $NAME"
+    if [ "$NAME" = tcp ]; then
+        "$LOAD" --endpoints 127.0.0.1:$PORT --clients "$CLIENTS" --rate "$RATE" --duration "$DURATION"
+    else
+        "$LOAD" --tls --endpoints 127.0.0.1:$PORT --clients "$CLIENTS" --rate "$RATE" --duration "$DURATION"
+    fi
+    kill $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+}
+
+run tcp
+run tls --tls-cert "$WORK/cert.pem" --tls-key "$WORK/key.pem"
@@ -0,0 +1,23 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include "relayserver.h"
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("chatServer 集群中继");
+    parser.addHelpOption();
+    QCommandLineOption portOption("port","监听端口","port","1969");
+    parser.addOption(portOption);
+    parser.process(a);
+
+    RelayServer relay;
+    if(!relay.listen(QHostAddress::LocalHost,parser.value(portOption).toUShort())){
+        qWarning() << "无法监听端口" << parser.value(portOption);
+        return 1;
+    }
+    return a.exec();
+}
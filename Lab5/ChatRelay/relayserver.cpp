@@ -0,0 +1,141 @@
+#include "relayserver.h"
+#include <QDataStream>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QTextStream>
+
+RelayServer::RelayServer(QObject *parent)
+    : QTcpServer(parent), m_relayed(0)
+{
+}
+
+void RelayServer::incomingConnection(qintptr socketDescriptor)
+{
+    QTcpSocket *node = new QTcpSocket(this);
+    if(!node->setSocketDescriptor(socketDescriptor)){
+        delete node;
+        return;
+    }
+    node->setSocketOption(QAbstractSocket::LowDelayOption,1);
+    connect(node,&QTcpSocket::readyRead,this,std::bind(&RelayServer::onReadyRead,this,node));
+    connect(node,&QTcpSocket::disconnected,this,std::bind(&RelayServer::nodeDisconnected,this,node));
+    m_nodes.insert(node,Node());
+}
+
+void RelayServer::onReadyRead(QTcpSocket *node)
+{
+    QByteArray jsonData;
+    QDataStream socketStream(node);
+    socketStream.setVersion(QDataStream::Qt_5_12);
+    for(;;){
+        socketStream.startTransaction();
+        socketStream >> jsonData;
+        if(!socketStream.commitTransaction())
+            break;
+        const QJsonDocument jsonDoc = QJsonDocument::fromJson(jsonData);
+        if(jsonDoc.isObject())
+            handle(node,jsonDoc.object());
+    }
+}
+
+void RelayServer::handle(QTcpSocket *node, const QJsonObject &message)
+{
+    auto it = m_nodes.find(node);
+    if(it == m_nodes.end())
+        return;
+    const QString type = message.value("type").toString();
+
+    if(type == "relay"){
+        // 热路径：只转发给在这个房间有成员的节点，帧只编码一次
+        const QString room = message.value("room").toString();
+        const QByteArray frame = QJsonDocument(message).toJson(QJsonDocument::Compact);
+        for(auto nodeIt = m_nodes.begin(); nodeIt != m_nodes.end(); ++nodeIt){
+            if(nodeIt.key() != node && nodeIt->roomMembers.value(room) > 0){
+                sendFrame(nodeIt.key(),frame);
+                m_relayed++;
+            }
+        }
+    }else if(type == "room"){
+        const QString room = message.value("room").toString();
+        const int count = message.value("count").toInt();
+        if(count > 0)
+            it->roomMembers.insert(room,count);
+        else
+            it->roomMembers.remove(room);
+    }else if(type == "claim"){
+        const QString user = message.value("user").toString();
+        QTcpSocket *owner = m_users.value(user);
+        const bool ok = !user.isEmpty() && (owner == nullptr || owner == node);
+        if(ok)
+            m_users.insert(user,node);
+        QJsonObject result;
+        result["type"] = "claimResult";
+        result["req"] = message.value("req");
+        result["user"] = user;
+        result["ok"] = ok;
+        send(node,result);
+    }else if(type == "release"){
+        const QString user = message.value("user").toString();
+        if(m_users.value(user) == node)
+            m_users.remove(user);
+    }else if(type == "presence"){
+        const QString user = message.value("user").toString();
+        if(m_users.value(user) == node)
+            broadcastPresence(node,message.value("event").toString(),user);
+    }else if(type == "hello"){
+        it->id = message.value("node").toString();
+        // 新节点需要知道其他节点上已经在线的用户
+        QJsonArray users;
+        for(auto userIt = m_users.constBegin(); userIt != m_users.constEnd(); ++userIt){
+            if(userIt.value() != node)
+                users.append(userIt.key());
+        }
+        QJsonObject reply;
+        reply["type"] = "users";
+        reply["users"] = users;
+        send(node,reply);
+        QTextStream(stdout) << "节点加入: " << it->id << Qt::endl;
+    }
+}
+
+void RelayServer::send(QTcpSocket *node, const QJsonObject &message)
+{
+    sendFrame(node,QJsonDocument(message).toJson(QJsonDocument::Compact));
+}
+
+void RelayServer::sendFrame(QTcpSocket *node, const QByteArray &frame)
+{
+    QDataStream socketStream(node);
+    socketStream.setVersion(QDataStream::Qt_5_12);
+    socketStream << frame;
+}
+
+void RelayServer::broadcastPresence(QTcpSocket *origin, const QString &event, const QString &user)
+{
+    QJsonObject presence;
+    presence["type"] = "presence";
+    presence["event"] = event;
+    presence["user"] = user;
+    const QByteArray frame = QJsonDocument(presence).toJson(QJsonDocument::Compact);
+    for(auto it = m_nodes.constBegin(); it != m_nodes.constEnd(); ++it){
+        if(it.key() != origin)
+            sendFrame(it.key(),frame);
+    }
+}
+
+void RelayServer::nodeDisconnected(QTcpSocket *node)
+{
+    const QString id = m_nodes.value(node).id;
+    m_nodes.remove(node);
+    // 节点掉线，它上面的用户全部下线
+    for(auto it = m_users.begin(); it != m_users.end();){
+        if(it.value() == node){
+            broadcastPresence(node,"userdisconnected",it.key());
+            it = m_users.erase(it);
+        }else{
+            ++it;
+        }
+    }
+    node->deleteLater();
+    QTextStream(stdout) << "节点离开: " << id << "，累计转发 " << m_relayed << " 帧" << Qt::endl;
+}
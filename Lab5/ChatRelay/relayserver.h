@@ -0,0 +1,43 @@
+#ifndef RELAYSERVER_H
+#define RELAYSERVER_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QHash>
+#include <QJsonObject>
+
+// 集群中继：多个 chatServer 节点连到这里，
+// 用户名在这里统一登记保证全局唯一，房间消息只转发给有成员的节点
+class RelayServer : public QTcpServer
+{
+    Q_OBJECT
+
+public:
+    explicit RelayServer(QObject *parent = nullptr);
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override;
+
+private slots:
+    void onReadyRead(QTcpSocket *node);
+    void nodeDisconnected(QTcpSocket *node);
+
+private:
+    struct Node
+    {
+        QString id;
+        QHash<QString,int> roomMembers;
+    };
+
+    void handle(QTcpSocket *node,const QJsonObject &message);
+    void send(QTcpSocket *node,const QJsonObject &message);
+    void sendFrame(QTcpSocket *node,const QByteArray &frame);
+    void broadcastPresence(QTcpSocket *origin,const QString &event,const QString &user);
+
+    QHash<QTcpSocket*,Node> m_nodes;
+    QHash<QString,QTcpSocket*> m_users;
+    qint64 m_relayed;
+};
+
+#endif // RELAYSERVER_H
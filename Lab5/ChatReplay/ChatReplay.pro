@@ -0,0 +1,22 @@
+QT       += core network
+QT       -= gui
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+# 抓包格式和服务端共用一份代码
+INCLUDEPATH += ../ChatServer
+
+SOURCES += \
+    ../ChatServer/capturefile.cpp \
+    main.cpp \
+    replayer.cpp
+
+HEADERS += \
+    ../ChatServer/capturefile.h \
+    replayer.h
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
@@ -0,0 +1,43 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include "replayer.h"
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("按抓包文件回放流量到本地 chatServer");
+    parser.addHelpOption();
+    parser.addPositionalArgument("capture","chatServer --capture 生成的抓包文件");
+    QCommandLineOption hostOption("host","服务器地址","host","127.0.0.1");
+    QCommandLineOption portOption("port","服务器端口","port","1967");
+    QCommandLineOption speedOption("speed","回放倍速，例如 1、10，max 表示不等待","speed","1");
+    parser.addOption(hostOption);
+    parser.addOption(portOption);
+    parser.addOption(speedOption);
+    parser.process(a);
+
+    if(parser.positionalArguments().size() != 1)
+        parser.showHelp(1);
+
+    double speed = 0;
+    if(parser.value(speedOption) != "max"){
+        bool ok = false;
+        speed = parser.value(speedOption).toDouble(&ok);
+        if(!ok || speed <= 0){
+            qWarning() << "无效的倍速" << parser.value(speedOption);
+            return 1;
+        }
+    }
+
+    Replayer replayer(parser.value(hostOption),parser.value(portOption).toUShort(),speed);
+    if(!replayer.open(parser.positionalArguments().first())){
+        qWarning() << "无法读取抓包文件" << parser.positionalArguments().first();
+        return 1;
+    }
+    QObject::connect(&replayer,&Replayer::finished,&a,&QCoreApplication::exit);
+    replayer.start();
+    return a.exec();
+}
@@ -0,0 +1,142 @@
+#include "replayer.h"
+#include <QDataStream>
+#include <QHostAddress>
+#include <QTextStream>
+#include <QCoreApplication>
+
+// 尽快回放时每处理这么多条记录让出一次事件循环，让套接字把数据写出去
+static const int MaxRecordsPerStep = 1000;
+
+Replayer::Replayer(const QString &host, quint16 port, double speed, QObject *parent)
+    : QObject{parent}
+    , m_host(host)
+    , m_port(port)
+    , m_speed(speed)
+    , m_reader(nullptr)
+    , m_hasNext(false)
+    , m_firstNs(0)
+    , m_connections(0)
+    , m_frames(0)
+    , m_droppedFrames(0)
+    , m_bytes(0)
+    , m_maxLagNs(0)
+{
+    m_timer.setSingleShot(true);
+    m_timer.setTimerType(Qt::PreciseTimer);
+    connect(&m_timer,&QTimer::timeout,this,&Replayer::step);
+}
+
+Replayer::~Replayer()
+{
+    delete m_reader;
+}
+
+bool Replayer::open(const QString &fileName)
+{
+    m_file.setFileName(fileName);
+    if(!m_file.open(QIODevice::ReadOnly))
+        return false;
+    m_reader = new CaptureFile::Reader(&m_file);
+    if(!m_reader->readHeader())
+        return false;
+    m_hasNext = m_reader->next(m_next);
+    m_firstNs = m_next.timestampNs;
+    return true;
+}
+
+void Replayer::start()
+{
+    m_clock.start();
+    m_timer.start(0);
+}
+
+void Replayer::step()
+{
+    int processed = 0;
+    while(m_hasNext){
+        const qint64 elapsed = m_clock.nsecsElapsed();
+        if(m_speed > 0){
+            const qint64 target = qint64((m_next.timestampNs - m_firstNs) / m_speed);
+            if(target > elapsed){
+                m_timer.start(int((target - elapsed) / 1000000));
+                return;
+            }
+            m_maxLagNs = qMax(m_maxLagNs,elapsed - target);
+        }else if(processed >= MaxRecordsPerStep){
+            m_timer.start(0);
+            return;
+        }
+
+        apply(m_next);
+        processed++;
+        m_hasNext = m_reader->next(m_next);
+    }
+    finish();
+}
+
+QTcpSocket *Replayer::socketFor(quint32 connectionId)
+{
+    const auto it = m_sockets.constFind(connectionId);
+    if(it != m_sockets.constEnd())
+        return it->data();
+
+    QTcpSocket *socket = new QTcpSocket(this);
+    connect(socket,&QTcpSocket::readyRead,socket,[socket]{
+        socket->readAll();
+    });
+    connect(socket,&QTcpSocket::disconnected,socket,&QObject::deleteLater);
+    socket->connectToHost(m_host,m_port);
+    m_sockets.insert(connectionId,socket);
+    m_connections++;
+    return socket;
+}
+
+void Replayer::apply(const CaptureFile::Record &record)
+{
+    switch(record.type){
+    case CaptureFile::Connect:
+        socketFor(record.connectionId);
+        break;
+    case CaptureFile::Frame:{
+        QTcpSocket *socket = socketFor(record.connectionId);
+        if(!socket){
+            m_droppedFrames++;
+            break;
+        }
+        QDataStream socketStream(socket);
+        socketStream.setVersion(QDataStream::Qt_5_12);
+        socketStream << record.frame;
+        m_frames++;
+        m_bytes += record.frame.size();
+        break;
+    }
+    case CaptureFile::Disconnect:{
+        const QPointer<QTcpSocket> socket = m_sockets.take(record.connectionId);
+        if(socket)
+            socket->disconnectFromHost();
+        break;
+    }
+    }
+}
+
+void Replayer::finish()
+{
+    const double seconds = m_clock.nsecsElapsed() / 1e9;
+    QTextStream out(stdout);
+    out << "连接数: " << m_connections << Qt::endl
+        << "帧数: " << m_frames << " (" << m_bytes << " 字节)" << Qt::endl
+        << "连接已被服务器断开而丢弃的帧数: " << m_droppedFrames << Qt::endl
+        << "耗时: " << seconds << " 秒, " << (seconds > 0 ? m_frames / seconds : 0) << " 帧/秒" << Qt::endl;
+    if(m_speed > 0)
+        out << "最大落后: " << m_maxLagNs / 1e6 << " 毫秒" << Qt::endl;
+
+    for(const QPointer<QTcpSocket> &socket : std::as_const(m_sockets)){
+        if(socket)
+            socket->disconnectFromHost();
+    }
+    m_sockets.clear();
+    // 给套接字留一点时间把缓冲区写完
+    QTimer::singleShot(1000,this,[this]{
+        emit finished(m_file.error() == QFileDevice::NoError ? 0 : 1);
+    });
+}
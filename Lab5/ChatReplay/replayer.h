@@ -0,0 +1,58 @@
+#ifndef REPLAYER_H
+#define REPLAYER_H
+
+#include <QObject>
+#include <QFile>
+#include <QHash>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QTcpSocket>
+#include <QPointer>
+#include "capturefile.h"
+
+// 按抓包文件重新驱动服务端：还原连接的建立、发送和断开，时间轴可以按倍速缩放
+class Replayer : public QObject
+{
+    Q_OBJECT
+
+public:
+    // speed 为 0 表示不等待，尽可能快地回放
+    explicit Replayer(const QString &host,quint16 port,double speed,QObject *parent = nullptr);
+    ~Replayer();
+
+    bool open(const QString &fileName);
+    void start();
+
+signals:
+    void finished(int exitCode);
+
+private slots:
+    void step();
+
+private:
+    // 服务器已经断开的连接返回 nullptr，这个连接后面的帧都丢掉
+    QTcpSocket *socketFor(quint32 connectionId);
+    void apply(const CaptureFile::Record &record);
+    void finish();
+
+    QString m_host;
+    quint16 m_port;
+    double m_speed;
+    QFile m_file;
+    CaptureFile::Reader *m_reader;
+    CaptureFile::Record m_next;
+    bool m_hasNext;
+    qint64 m_firstNs;
+    QElapsedTimer m_clock;
+    QTimer m_timer;
+    // 服务器那边断开（比如登录超时）时套接字会被释放，这里留着空指针，不重新连接
+    QHash<quint32,QPointer<QTcpSocket>> m_sockets;
+
+    qint64 m_connections;
+    qint64 m_frames;
+    qint64 m_droppedFrames;
+    qint64 m_bytes;
+    qint64 m_maxLagNs;
+};
+
+#endif // REPLAYER_H
@@ -1,28 +1,78 @@
-QT       += core gui network
-
-greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
-
-CONFIG += c++17
-
-# You can make your code fail to compile if it uses deprecated APIs.
-# In order to do so, uncomment the following line.
-#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
-
-SOURCES += \
-    chatserver.cpp \
-    main.cpp \
-    mainwindow.cpp \
-    serverworker.cpp
-
-HEADERS += \
-    chatserver.h \
-    mainwindow.h \
-    serverworker.h
-
-FORMS += \
-    mainwindow.ui
-
-# Default rules for deployment.
-qnx: target.path = /tmp/$${TARGET}/bin
-else: unix:!android: target.path = /opt/$${TARGET}/bin
-!isEmpty(target.path): INSTALLS += target
+QT       += core gui network
+
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+CONFIG += c++17
+
+# You can make your code fail to compile if it uses deprecated APIs.
+# In order to do so, uncomment the following line.
+#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
+
+SOURCES += \
+    capturefile.cpp \
+    chatroom.cpp \
+    chatserver.cpp \
+    chattrace.cpp \
+    clusterlink.cpp \
+    configreloader.cpp \
+    filetransfer.cpp \
+    framecompressor.cpp \
+    filterpipeline.cpp \
+    handoff.cpp \
+    idempotencywindow.cpp \
+    ioshards.cpp \
+    main.cpp \
+    mainwindow.cpp \
+    memorybudget.cpp \
+    messagefilter.cpp \
+    multicastfanout.cpp \
+    rttstats.cpp \
+    searchindex.cpp \
+    serverconfig.cpp \
+    serverworker.cpp \
+    slotbitmap.cpp \
+    tlsacceptor.cpp \
+    trafficcapture.cpp \
+    userdirectory.cpp \
+    websocketcodec.cpp
+
+HEADERS += \
+    capturefile.h \
+    chatroom.h \
+    chatserver.h \
+    chattrace.h \
+    clusterlink.h \
+    configreloader.h \
+    filechunk.h \
+    filetransfer.h \
+    framecompressor.h \
+    filterpipeline.h \
+    handoff.h \
+    idempotencywindow.h \
+    ioshards.h \
+    mainwindow.h \
+    memorybudget.h \
+    messagefilter.h \
+    mpscqueue.h \
+    multicastfanout.h \
+    rttstats.h \
+    searchindex.h \
+    serverconfig.h \
+    serverworker.h \
+    slotbitmap.h \
+    tlsacceptor.h \
+    trafficcapture.h \
+    userdirectory.h \
+    websocketcodec.h
+
+include(zlib.pri)
+# Handoff::closeDescriptor 在 Windows 上用 closesocket
+win32: LIBS += -lws2_32
+
+FORMS += \
+    mainwindow.ui
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
@@ -0,0 +1,101 @@
+#include "capturefile.h"
+#include <QtEndian>
+
+namespace CaptureFile
+{
+
+const QByteArray Magic("CHATCAP1");
+
+static void appendVarint(QByteArray &out,quint64 value)
+{
+    while(value >= 0x80){
+        out.append(char((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.append(char(value));
+}
+
+QByteArray header(qint64 startMs)
+{
+    QByteArray out = Magic;
+    char buffer[8];
+    qToBigEndian<qint64>(startMs,buffer);
+    out.append(buffer,sizeof(buffer));
+    return out;
+}
+
+void appendRecord(QByteArray &out, const Record &record, qint64 &lastNs)
+{
+    out.append(char(record.type));
+    appendVarint(out,record.connectionId);
+    appendVarint(out,quint64(qMax<qint64>(0,record.timestampNs - lastNs)));
+    lastNs = qMax(lastNs,record.timestampNs);
+    if(record.type == Frame){
+        appendVarint(out,quint64(record.frame.size()));
+        out.append(record.frame);
+    }
+}
+
+Reader::Reader(QIODevice *device)
+    : m_device(device), m_startMs(0), m_lastNs(0)
+{
+}
+
+bool Reader::readHeader()
+{
+    const QByteArray head = m_device->read(Magic.size() + 8);
+    if(head.size() != Magic.size() + 8 || !head.startsWith(Magic))
+        return false;
+    m_startMs = qFromBigEndian<qint64>(head.constData() + Magic.size());
+    return true;
+}
+
+qint64 Reader::startMs() const
+{
+    return m_startMs;
+}
+
+bool Reader::readVarint(quint64 &value)
+{
+    value = 0;
+    for(int shift = 0; shift < 64; shift += 7){
+        char byte;
+        if(!m_device->getChar(&byte))
+            return false;
+        value |= quint64(quint8(byte) & 0x7f) << shift;
+        if((quint8(byte) & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool Reader::next(Record &record)
+{
+    char type;
+    if(!m_device->getChar(&type))
+        return false;
+    if(type < Connect || type > Disconnect)
+        return false;
+
+    quint64 connectionId;
+    quint64 deltaNs;
+    if(!readVarint(connectionId) || !readVarint(deltaNs))
+        return false;
+
+    record.type = RecordType(type);
+    record.connectionId = quint32(connectionId);
+    m_lastNs += qint64(deltaNs);
+    record.timestampNs = m_lastNs;
+    record.frame.clear();
+    if(record.type == Frame){
+        quint64 length;
+        if(!readVarint(length) || length > 64 * 1024 * 1024)
+            return false;
+        record.frame = m_device->read(qint64(length));
+        if(record.frame.size() != qsizetype(length))
+            return false;
+    }
+    return true;
+}
+
+}
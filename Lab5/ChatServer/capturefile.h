@@ -0,0 +1,50 @@
+#ifndef CAPTUREFILE_H
+#define CAPTUREFILE_H
+
+#include <QByteArray>
+#include <QIODevice>
+
+// 流量抓包文件格式，服务端写入，ChatReplay 读取
+// 文件头：8 字节魔数 + 8 字节开始时间（毫秒，UTC）
+// 每条记录：类型(1字节) + 连接id + 距上一条记录的纳秒数 [+ 帧长度 + 帧内容]，整数都用变长编码
+namespace CaptureFile
+{
+    enum RecordType : quint8 {
+        Connect = 1,
+        Frame = 2,
+        Disconnect = 3
+    };
+
+    struct Record
+    {
+        RecordType type = Frame;
+        quint32 connectionId = 0;
+        qint64 timestampNs = 0;
+        QByteArray frame;
+    };
+
+    extern const QByteArray Magic;
+
+    QByteArray header(qint64 startMs);
+    // lastNs 记录上一条的时间戳，用来计算增量
+    void appendRecord(QByteArray &out,const Record &record,qint64 &lastNs);
+
+    class Reader
+    {
+    public:
+        explicit Reader(QIODevice *device);
+        bool readHeader();
+        qint64 startMs() const;
+        // 文件结束或者数据损坏时返回 false
+        bool next(Record &record);
+
+    private:
+        bool readVarint(quint64 &value);
+
+        QIODevice *m_device;
+        qint64 m_startMs;
+        qint64 m_lastNs;
+    };
+}
+
+#endif // CAPTUREFILE_H
@@ -0,0 +1,262 @@
+#include "chatroom.h"
+#include "serverworker.h"
+#include <QDateTime>
+
+static const int RecentFrameCount = 1024;
+// 每个房间回执位图的内存上限，超过时最早的消息不再跟踪
+static const qsizetype ReceiptMemoryBudget = 1024 * 1024;
+// 回执里最多附带的已读人名
+static const int MaxReaderNames = 20;
+
+ChatRoom::ChatRoom(const QString &name)
+    : m_name(name), m_lastSeq(0), m_epoch(QDateTime::currentMSecsSinceEpoch()), m_historyBytes(0), m_receiptFloor(1), m_receiptBytes(0)
+{
+    m_recent.resize(RecentFrameCount);
+    m_receipts.resize(RecentFrameCount);
+}
+
+QString ChatRoom::name() const
+{
+    return m_name;
+}
+
+const QVector<ServerWorker*> &ChatRoom::members() const
+{
+    return m_members;
+}
+
+void ChatRoom::addMember(ServerWorker *worker)
+{
+    if(m_slots.contains(worker))
+        return;
+    m_members.append(worker);
+    // 槽位可以复用，离开的成员留下的位在 removeMember 里已经清掉
+    int slot;
+    if(m_freeSlots.isEmpty()){
+        slot = m_slotMembers.size();
+        m_slotMembers.append(worker);
+        m_watermarks.append(m_lastSeq);
+    }else{
+        slot = m_freeSlots.takeLast();
+        m_slotMembers[slot] = worker;
+        m_watermarks[slot] = m_lastSeq;
+    }
+    m_slots.insert(worker,slot);
+}
+
+void ChatRoom::removeMember(ServerWorker *worker)
+{
+    const int slot = m_slots.value(worker,-1);
+    if(slot < 0)
+        return;
+    m_members.removeAll(worker);
+    m_multicastReady.remove(worker);
+    m_slots.remove(worker);
+    m_slotMembers[slot] = nullptr;
+    m_freeSlots.append(slot);
+    for(Receipt &receipt : m_receipts){
+        if(!receipt.readers.contains(quint32(slot)))
+            continue;
+        const qsizetype before = receipt.readers.memoryUsage();
+        receipt.readers.remove(quint32(slot));
+        m_receiptBytes += receipt.readers.memoryUsage() - before;
+    }
+}
+
+bool ChatRoom::hasMember(ServerWorker *worker) const
+{
+    return m_slots.contains(worker);
+}
+
+bool ChatRoom::isEmpty() const
+{
+    return m_members.isEmpty();
+}
+
+qint64 ChatRoom::epoch() const
+{
+    return m_epoch;
+}
+
+void ChatRoom::setEpoch(qint64 epoch)
+{
+    m_epoch = epoch;
+}
+
+quint64 ChatRoom::lastSeq() const
+{
+    return m_lastSeq;
+}
+
+quint64 ChatRoom::nextSeq()
+{
+    return ++m_lastSeq;
+}
+
+void ChatRoom::setLastSeq(quint64 seq)
+{
+    m_lastSeq = seq;
+}
+
+void ChatRoom::remember(quint64 seq, const QByteArray &frame)
+{
+    RecentFrame &slot = m_recent[int(seq % RecentFrameCount)];
+    m_historyBytes += frame.size() - slot.frame.size();
+    slot.seq = seq;
+    slot.frame = frame;
+}
+
+QByteArray ChatRoom::recentFrame(quint64 seq) const
+{
+    const RecentFrame &slot = m_recent.at(int(seq % RecentFrameCount));
+    if(slot.seq != seq)
+        return QByteArray();
+    return slot.frame;
+}
+
+void ChatRoom::trimHistory(int keep)
+{
+    for(RecentFrame &slot : m_recent){
+        if(slot.frame.isEmpty() || slot.seq + quint64(qMax(0,keep)) > m_lastSeq)
+            continue;
+        m_historyBytes -= slot.frame.size();
+        slot.frame = QByteArray();
+        slot.seq = 0;
+    }
+}
+
+qsizetype ChatRoom::historyMemoryUsage() const
+{
+    return m_historyBytes;
+}
+
+bool ChatRoom::isTracked(quint64 seq) const
+{
+    return seq >= m_receiptFloor && seq <= m_lastSeq && m_receipts.at(int(seq % RecentFrameCount)).seq == seq;
+}
+
+void ChatRoom::dropReceipt(Receipt &receipt)
+{
+    m_receiptBytes -= receipt.readers.memoryUsage();
+    m_dirtyReceipts.remove(receipt.seq);
+    receipt.readers.clear();
+    receipt.seq = 0;
+    receipt.sender.clear();
+}
+
+void ChatRoom::trackReceipt(quint64 seq, const QString &sender)
+{
+    Receipt &receipt = m_receipts[int(seq % RecentFrameCount)];
+    dropReceipt(receipt);
+    receipt.seq = seq;
+    receipt.sender = sender;
+}
+
+bool ChatRoom::markRead(ServerWorker *worker, quint64 seq)
+{
+    const int slot = m_slots.value(worker,-1);
+    if(slot < 0)
+        return false;
+    seq = qMin(seq,m_lastSeq);
+    quint64 &watermark = m_watermarks[slot];
+    if(seq <= watermark)
+        return false;
+
+    // 水位之前的消息都算已读，只有还在跟踪范围内的才需要置位
+    const QString reader = worker->userName();
+    quint64 from = qMax(watermark + 1,m_receiptFloor);
+    if(seq >= RecentFrameCount)
+        from = qMax(from,seq - RecentFrameCount + 1);
+    watermark = seq;
+    bool changed = false;
+    for(quint64 s = from; s <= seq; s++){
+        if(!isTracked(s))
+            continue;
+        Receipt &receipt = m_receipts[int(s % RecentFrameCount)];
+        if(receipt.sender == reader)
+            continue;
+        const qsizetype before = receipt.readers.memoryUsage();
+        if(receipt.readers.add(quint32(slot))){
+            m_receiptBytes += receipt.readers.memoryUsage() - before;
+            m_dirtyReceipts.insert(s);
+            changed = true;
+        }
+    }
+
+    // 超出内存上限时放弃最早的消息，这部分只剩水位信息
+    while(m_receiptBytes > ReceiptMemoryBudget && m_receiptFloor <= m_lastSeq){
+        Receipt &oldest = m_receipts[int(m_receiptFloor % RecentFrameCount)];
+        if(oldest.seq == m_receiptFloor)
+            dropReceipt(oldest);
+        m_receiptFloor++;
+    }
+    return changed;
+}
+
+QVector<ChatRoom::ReceiptUpdate> ChatRoom::takeReceiptUpdates()
+{
+    QVector<ReceiptUpdate> updates;
+    updates.reserve(m_dirtyReceipts.size());
+    for(quint64 seq : std::as_const(m_dirtyReceipts)){
+        if(!isTracked(seq))
+            continue;
+        const Receipt &receipt = m_receipts.at(int(seq % RecentFrameCount));
+        ReceiptUpdate update;
+        update.seq = seq;
+        update.sender = receipt.sender;
+        update.count = receipt.readers.cardinality();
+        if(update.count <= MaxReaderNames){
+            for(quint32 slot : receipt.readers.values(MaxReaderNames)){
+                if(ServerWorker *member = m_slotMembers.value(int(slot)))
+                    update.readers.append(member->userName());
+            }
+        }
+        updates.append(update);
+    }
+    m_dirtyReceipts.clear();
+    return updates;
+}
+
+qsizetype ChatRoom::receiptMemoryUsage() const
+{
+    return m_receiptBytes;
+}
+
+bool ChatRoom::isMulticastActive() const
+{
+    return !m_multicastGroup.isNull();
+}
+
+QHostAddress ChatRoom::multicastGroup() const
+{
+    return m_multicastGroup;
+}
+
+void ChatRoom::setMulticastGroup(const QHostAddress &group)
+{
+    // 停用或者换组后，成员要重新确认能收到组播
+    if(group != m_multicastGroup)
+        m_multicastReady.clear();
+    m_multicastGroup = group;
+}
+
+bool ChatRoom::isMulticastReady(ServerWorker *worker) const
+{
+    return m_multicastReady.contains(worker);
+}
+
+void ChatRoom::setMulticastReady(ServerWorker *worker)
+{
+    if(m_slots.contains(worker))
+        m_multicastReady.insert(worker);
+}
+
+int ChatRoom::multicastCapableCount() const
+{
+    int count = 0;
+    for(ServerWorker *worker : m_members){
+        if(worker->isMulticastCapable())
+            count++;
+    }
+    return count;
+}
@@ -0,0 +1,99 @@
+#ifndef CHATROOM_H
+#define CHATROOM_H
+
+#include <QString>
+#include <QVector>
+#include <QSet>
+#include <QByteArray>
+#include <QHostAddress>
+#include <QHash>
+#include <QStringList>
+#include "slotbitmap.h"
+
+class ServerWorker;
+
+// 聊天室：成员列表、房间内消息序号，最近消息的环形缓存（用于补发），以及已读回执
+class ChatRoom
+{
+public:
+    explicit ChatRoom(const QString &name);
+
+    QString name() const;
+    const QVector<ServerWorker*> &members() const;
+    void addMember(ServerWorker *worker);
+    void removeMember(ServerWorker *worker);
+    bool hasMember(ServerWorker *worker) const;
+    bool isEmpty() const;
+
+    // 房间创建时间（毫秒），房间重建后序号从头开始，客户端缓存靠它判断序号是否还能对上
+    qint64 epoch() const;
+    void setEpoch(qint64 epoch);
+    quint64 lastSeq() const;
+    quint64 nextSeq();
+    void setLastSeq(quint64 seq);
+    void remember(quint64 seq,const QByteArray &frame);
+    // 已经被环形缓存覆盖时返回空
+    QByteArray recentFrame(quint64 seq) const;
+    // 内存紧张时只保留最近 keep 条，更早的补发请求拿不到数据
+    void trimHistory(int keep);
+    qsizetype historyMemoryUsage() const;
+
+    // 组播：激活后成员确认能收到组播数据，就不再单独走 TCP
+    bool isMulticastActive() const;
+    QHostAddress multicastGroup() const;
+    void setMulticastGroup(const QHostAddress &group);
+    bool isMulticastReady(ServerWorker *worker) const;
+    void setMulticastReady(ServerWorker *worker);
+    int multicastCapableCount() const;
+
+    // 已读回执：每个成员一个已读水位，最近的消息各有一个按成员槽位的压缩位图
+    struct ReceiptUpdate
+    {
+        quint64 seq = 0;
+        QString sender;
+        int count = 0;
+        QStringList readers;    // 人少时附带名字
+    };
+    void trackReceipt(quint64 seq,const QString &sender);
+    // 成员读到了 seq，有新的回执时返回 true
+    bool markRead(ServerWorker *worker,quint64 seq);
+    // 取出上次以来有变化的回执
+    QVector<ReceiptUpdate> takeReceiptUpdates();
+    qsizetype receiptMemoryUsage() const;
+
+private:
+    struct RecentFrame
+    {
+        quint64 seq = 0;
+        QByteArray frame;
+    };
+
+    QString m_name;
+    QVector<ServerWorker*> m_members;
+    quint64 m_lastSeq;
+    qint64 m_epoch;
+    QVector<RecentFrame> m_recent;
+    qsizetype m_historyBytes;
+    QHostAddress m_multicastGroup;
+    QSet<ServerWorker*> m_multicastReady;
+
+    struct Receipt
+    {
+        quint64 seq = 0;
+        QString sender;
+        SlotBitmap readers;
+    };
+    void dropReceipt(Receipt &receipt);
+    bool isTracked(quint64 seq) const;
+
+    QHash<ServerWorker*,int> m_slots;
+    QVector<ServerWorker*> m_slotMembers;
+    QVector<quint64> m_watermarks;
+    QVector<int> m_freeSlots;
+    QVector<Receipt> m_receipts;
+    quint64 m_receiptFloor;
+    qsizetype m_receiptBytes;
+    QSet<quint64> m_dirtyReceipts;
+};
+
+#endif // CHATROOM_H
@@ -1,136 +1,1558 @@
-#include "chatserver.h"
-#include "serverworker.h"
-#include <QJsonValue>
-#include <QJsonObject>
-#include <QJsonArray>
-#include <QDebug>  // 添加这个头文件
-
-
-chatServer::chatServer(QObject *parent):
-    QTcpServer(parent)
-{
-
-}
-
-// 添加检查用户名是否重复的方法
-bool chatServer::isUsernameTaken(const QString &username)
-{
-    for(ServerWorker *worker : m_clients){
-        if(worker->userName() == username){
-            return true;  // 用户名已存在
-        }
-    }
-    return false;  // 用户名可用
-}
-
-void chatServer::incomingConnection(qintptr socketDescriptor)
-{
-    ServerWorker *worker =new ServerWorker(this);
-    if(!worker->setSocketDescriptor(socketDescriptor)){
-        worker->deleteLater();
-        return;
-    }
-    connect(worker,&ServerWorker::logMessage,this,&chatServer::logMessage);
-    connect(worker,&ServerWorker::jsonReceived,this,&chatServer::jsonReceived);
-    connect(worker,&ServerWorker::disconnectedFromClient,this,std::bind(&chatServer::userDisconnected,this,worker));
-
-    m_clients.append(worker);
-    emit logMessage("新的用户连接上了");
-}
-
-void chatServer::broadcast(const QJsonObject &message, ServerWorker *exclude)
-{
-    for(ServerWorker *worker:m_clients){
-        worker->sendJson(message);
-    }
-}
-
-void chatServer::stopServer()
-{
-    close();
-}
-
-void chatServer::jsonReceived(ServerWorker *sender, const QJsonObject &docObj)
-{
-    const QJsonValue typeVal = docObj.value("type");
-    if(typeVal.isNull() || !typeVal.isString())
-        return;
-    if(typeVal.toString().compare("message",Qt::CaseInsensitive) == 0){
-        const QJsonValue textVal = docObj.value("text");
-        if(textVal.isNull() || !textVal.isString())
-            return;
-        const QString text = textVal.toString().trimmed();
-        if(text.isEmpty())
-            return;
-        QJsonObject message;
-        message["type"] = "message";
-        message["text"] = text;
-        message["sender"] = sender->userName();
-
-        broadcast(message,sender);
-    }else if(typeVal.toString().compare("login",Qt::CaseInsensitive) == 0){
-        const QJsonValue usernameVal = docObj.value("text");
-        if(usernameVal.isNull() || !usernameVal.isString())
-            return;
-
-        const QString username = usernameVal.toString().trimmed();
-        if(username.isEmpty()) {
-            // 用户名为空，发送错误信息
-            QJsonObject errorMessage;
-            errorMessage["type"] = "loginError";
-            errorMessage["text"] = "用户名不能为空";
-            sender->sendJson(errorMessage);
-            return;
-        }
-
-        // 检查用户名是否已存在
-        if(isUsernameTaken(username)) {
-            // 用户名重复，发送错误信息
-            QJsonObject errorMessage;
-            errorMessage["type"] = "loginError";
-            errorMessage["text"] = "用户名已存在，请选择其他用户名";
-            sender->sendJson(errorMessage);
-
-            // 在服务器控制台输出错误信息
-            qDebug() << "登录失败：用户名" << username << "已存在";
-            emit logMessage(QString("登录失败：用户名%1已存在").arg(username));
-            return;
-        }
-
-        sender->setUserName(username);
-        QJsonObject connectedMessage;
-        connectedMessage["type"] = "newuser";
-        connectedMessage["username"] = username;
-        broadcast(connectedMessage,sender);
-
-        QJsonObject userListMessage;
-        userListMessage["type"] = "userlist";
-        QJsonArray userlist;
-        for(ServerWorker *worker : m_clients){
-            if(worker == sender)
-                userlist.append(worker->userName() + "*");
-            else
-                userlist.append(worker->userName());
-        }
-        userListMessage["userlist"] = userlist;
-        sender->sendJson(userListMessage);
-
-        // 在服务器控制台输出成功信息
-        qDebug() << "用户" << username << "登录成功";
-        emit logMessage(QString("用户%1登录成功").arg(username));
-    }
-}
-
-void chatServer::userDisconnected(ServerWorker *sender)
-{
-    m_clients.removeAll(sender);
-    const QString userName = sender->userName();
-    if(!userName.isEmpty()){
-        QJsonObject disconnectedMessage;
-        disconnectedMessage["type"] = "userdisconnected";
-        disconnectedMessage["username"] = userName;
-        broadcast(disconnectedMessage,nullptr);
-        emit logMessage(userName + " disconnected");
-    }
-    sender->deleteLater();
-}
+#include "chatserver.h"
+#include "serverworker.h"
+#include <QJsonValue>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QDataStream>
+#include "handoff.h"
+#include "chattrace.h"
+#include "websocketcodec.h"
+#include "framecompressor.h"
+#include <QDebug>  // 添加这个头文件
+#include <algorithm>
+#include <utility>
+#include <QFile>
+#include <QDir>
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+// 探测本地套接字名有没有进程在监听的等待时间
+static const int LocalProbeTimeoutMs = 500;
+
+// 本地套接字名能连上说明另一个实例正在用，不能删；连不上才是异常退出留下的
+static bool isLocalServerLive(const QString &name)
+{
+    QLocalSocket probe;
+    probe.connectToServer(name);
+    return probe.waitForConnected(LocalProbeTimeoutMs);
+}
+
+// 登录后默认进入的房间
+static const QString DefaultRoom = QStringLiteral("lobby");
+// 一次 nack 最多补发的消息数
+static const quint64 MaxResendFrames = 1024;
+// 已读回执的合并间隔
+static const int ReceiptIntervalMs = 1000;
+// 交接状态的格式版本
+static const quint32 HandoffVersion = 6;
+// 往返时延的探测间隔
+static const int PingIntervalMs = 5000;
+// stats 里列出的最慢连接数
+static const int SlowClientCount = 5;
+// 连上之后这么久还没登录就断开，半开的连接不会一直占着描述符
+static const int LoginTimeoutMs = 30000;
+// 等中继确认用户名的最长时间，超时按登录失败处理
+static const int ClaimTimeoutMs = 5000;
+// 内存用量的检查间隔
+static const int MemoryCheckIntervalMs = 500;
+// 内存紧张时每个房间保留的补发历史条数
+static const int PressureHistoryFrames = 128;
+// 内存紧张时检索索引里每个房间保留的消息数
+static const int PressureSearchDocuments = 1000;
+// 已经断开的客户端最多留多少个去重窗口，超过时忘掉最早断开的；在线客户端的窗口不算在内
+static const int MaxIdleClientWindows = 4096;
+// 客户端编号的最大长度
+static const int MaxClientIdLength = 64;
+// 每次检查最多断开的连接数
+static const int MaxShedPerCheck = 8;
+
+
+chatServer::chatServer(QObject *parent):
+    QTcpServer(parent)
+{
+    m_filters = new FilterPipeline(this);
+    m_capture = new TrafficCapture(this);
+    m_localServer = new QLocalServer(this);
+    m_localServerName = "chatserver";
+    m_webServer = new QTcpServer(this);
+    m_webSocketPort = 0;
+    m_multicast = new MulticastFanout(this);
+    m_handoffServer = new QLocalServer(this);
+    m_cluster = nullptr;
+    m_files = new FileTransfer(this);
+    m_search = new SearchIndex(this);
+    m_nextSearchId = 0;
+    m_receiptTimer = new QTimer(this);
+    m_receiptTimer->setSingleShot(true);
+    m_receiptTimer->setInterval(ReceiptIntervalMs);
+    m_pingTimer = new QTimer(this);
+    m_pingTimer->setInterval(PingIntervalMs);
+    m_config = new ConfigReloader(this);
+    m_presenceTimer = new QTimer(this);
+    m_presenceTimer->setSingleShot(true);
+    m_tls = new TlsAcceptor(this);
+    m_shards = new IoShards(this);
+    // 子对象按创建顺序释放，目录必须在 I/O 线程停下之后才释放
+    m_directory = new UserDirectory(this);
+    m_memoryTimer = new QTimer(this);
+    m_memoryTimer->setInterval(MemoryCheckIntervalMs);
+    m_ackTimer = new QTimer(this);
+    m_ackTimer->setSingleShot(true);
+    m_ackTimer->setInterval(0);
+    m_capturing = false;
+    m_nextConnectionId = 0;
+    connect(m_filters,&FilterPipeline::messageAccepted,this,&chatServer::messageFiltered);
+    connect(m_filters,&FilterPipeline::messageRejected,this,&chatServer::messageRejected);
+    connect(m_localServer,&QLocalServer::newConnection,this,&chatServer::localConnection);
+    connect(m_webServer,&QTcpServer::newConnection,this,&chatServer::webSocketConnection);
+    connect(m_multicast,&MulticastFanout::heartbeatDue,this,&chatServer::multicastHeartbeat);
+    connect(m_handoffServer,&QLocalServer::newConnection,this,&chatServer::handoffRequested);
+    connect(m_files,&FileTransfer::logMessage,this,&chatServer::logMessage);
+    connect(m_files,&FileTransfer::fileReady,this,&chatServer::fileReady);
+    connect(m_search,&SearchIndex::searchFinished,this,&chatServer::searchFinished);
+    connect(m_search,&SearchIndex::logMessage,this,&chatServer::logMessage);
+    connect(m_receiptTimer,&QTimer::timeout,this,&chatServer::flushReceipts);
+    connect(m_pingTimer,&QTimer::timeout,this,&chatServer::pingClients);
+    connect(m_config,&ConfigReloader::logMessage,this,&chatServer::logMessage);
+    connect(m_config,&ConfigReloader::configChanged,this,&chatServer::applyConfig);
+    connect(m_presenceTimer,&QTimer::timeout,this,&chatServer::flushPresence);
+    connect(m_memoryTimer,&QTimer::timeout,this,&chatServer::checkMemory);
+    connect(m_ackTimer,&QTimer::timeout,this,&chatServer::flushAcks);
+    connect(m_tls,&TlsAcceptor::ready,this,&chatServer::tlsReady);
+    connect(m_tls,&TlsAcceptor::logMessage,this,&chatServer::logMessage);
+    m_memoryTimer->start();
+    m_pingTimer->start();
+}
+
+chatServer::~chatServer()
+{
+    qDeleteAll(m_rooms);
+}
+
+// 添加检查用户名是否重复的方法
+bool chatServer::isUsernameTaken(const QString &username)
+{
+    if(m_directory->containsUser(username))
+        return true;  // 用户名已存在
+    // 其他节点上的用户和正在等待中继确认的用户名也算占用
+    if(m_remoteUsers.contains(username))
+        return true;
+    return isClaimPending(username);  // 用户名可用
+}
+
+bool chatServer::isClaimPending(const QString &username) const
+{
+    for(const PendingLogin &pending : std::as_const(m_pendingLogins)){
+        if(pending.userName == username)
+            return true;
+    }
+    return false;
+}
+
+void chatServer::forgetPendingRequests(ServerWorker *worker)
+{
+    m_awaitingLogin.remove(worker);
+    m_pendingAcks.remove(worker);
+    for(auto it = m_pendingSearches.begin(); it != m_pendingSearches.end();){
+        if(it.value() == worker)
+            it = m_pendingSearches.erase(it);
+        else
+            ++it;
+    }
+    // 还在等中继确认的登录不再等了，确认回来时在 claimResult 里把名字还回去
+    for(auto it = m_pendingLogins.begin(); it != m_pendingLogins.end();){
+        if(it->worker == worker)
+            it = m_pendingLogins.erase(it);
+        else
+            ++it;
+    }
+}
+
+FilterPipeline *chatServer::filterPipeline() const
+{
+    return m_filters;
+}
+
+bool chatServer::startCapture(const QString &fileName)
+{
+    stopCapture();
+    if(!m_capture->open(fileName))
+        return false;
+    m_capturing = true;
+    for(ServerWorker *worker : m_clients){
+        m_capture->recordConnect(worker->connectionId());
+        worker->setCapture(m_capture);
+    }
+    emit logMessage(QString("开始记录流量到 %1").arg(fileName));
+    return true;
+}
+
+void chatServer::stopCapture()
+{
+    if(!m_capturing)
+        return;
+    for(ServerWorker *worker : m_clients)
+        worker->setCapture(nullptr);
+    m_capture->close();
+    m_capturing = false;
+    emit logMessage(QString("流量记录已保存到 %1").arg(m_capture->fileName()));
+}
+
+void chatServer::setLocalServerName(const QString &name)
+{
+    m_localServerName = name;
+}
+
+bool chatServer::listenLocal()
+{
+    if(m_localServerName.isEmpty())
+        return false;
+    if(isLocalServerLive(m_localServerName)){
+        emit logMessage(QString("本地套接字 %1 已经有其他进程在监听").arg(m_localServerName));
+        return false;
+    }
+    // 上次异常退出可能留下了套接字文件
+    QLocalServer::removeServer(m_localServerName);
+    return m_localServer->listen(m_localServerName);
+}
+
+void chatServer::setWebSocketPort(quint16 port)
+{
+    m_webSocketPort = port;
+}
+
+bool chatServer::listenWebSocket()
+{
+    if(m_webSocketPort == 0)
+        return false;
+    return m_webServer->listen(QHostAddress::Any,m_webSocketPort);
+}
+
+MulticastFanout *chatServer::multicast() const
+{
+    return m_multicast;
+}
+
+FileTransfer *chatServer::fileTransfer() const
+{
+    return m_files;
+}
+
+SearchIndex *chatServer::searchIndex() const
+{
+    return m_search;
+}
+
+void chatServer::joinCluster(const QString &relayAddress, const QString &nodeId)
+{
+    if(!m_cluster){
+        m_cluster = new ClusterLink(this);
+        connect(m_cluster,&ClusterLink::logMessage,this,&chatServer::logMessage);
+        connect(m_cluster,&ClusterLink::claimResult,this,&chatServer::claimResult);
+        connect(m_cluster,&ClusterLink::claimLost,this,&chatServer::claimLost);
+        connect(m_cluster,&ClusterLink::linkLost,this,&chatServer::clusterLinkLost);
+        connect(m_cluster,&ClusterLink::remotePresence,this,&chatServer::remotePresence);
+        connect(m_cluster,&ClusterLink::remoteUsers,this,&chatServer::remoteUsers);
+        connect(m_cluster,&ClusterLink::remoteMessage,this,&chatServer::remoteMessage);
+    }
+    m_cluster->connectToRelay(relayAddress,nodeId);
+}
+
+ConfigReloader *chatServer::configReloader() const
+{
+    return m_config;
+}
+
+void chatServer::setAdminToken(const QString &token)
+{
+    m_adminToken = token;
+}
+
+MemoryBudget *chatServer::memoryBudget()
+{
+    return &m_memory;
+}
+
+TlsAcceptor *chatServer::tls() const
+{
+    return m_tls;
+}
+
+IoShards *chatServer::ioShards() const
+{
+    return m_shards;
+}
+
+UserDirectory *chatServer::directory() const
+{
+    return m_directory;
+}
+
+void chatServer::applyConfig(quint64 version)
+{
+    Q_UNUSED(version);
+    // 连接上的参数各自按版本号取快照，这里只处理服务器级别的设置
+    const std::shared_ptr<const ServerConfig> config = ServerConfig::current();
+    if(config->filterThreads > 0)
+        m_filters->setMaxThreads(config->filterThreads);
+    if(config->filterMaxPending > 0)
+        m_filters->setMaxPending(config->filterMaxPending);
+    if(config->presenceCoalesceMs <= 0)
+        flushPresence();
+    m_memory.setLimit(config->memoryBudgetBytes);
+    checkMemory();
+}
+
+void chatServer::checkMemory()
+{
+    qint64 receiveBytes = 0;
+    qint64 socketBytes = 0;
+    qint64 outboundBytes = 0;
+    for(ServerWorker *worker : m_clients){
+        receiveBytes += worker->inboundBytes();
+        socketBytes += worker->socketBytes();
+        outboundBytes += worker->queuedBytes();
+    }
+    qint64 historyBytes = 0;
+    qint64 receiptBytes = 0;
+    for(ChatRoom *room : m_rooms){
+        historyBytes += room->historyMemoryUsage();
+        receiptBytes += room->receiptMemoryUsage();
+    }
+    m_memory.report(MemoryBudget::ReceiveBuffers,receiveBytes);
+    m_memory.report(MemoryBudget::SocketBuffers,socketBytes);
+    m_memory.report(MemoryBudget::OutboundQueues,outboundBytes);
+    m_memory.report(MemoryBudget::History,historyBytes);
+    m_memory.report(MemoryBudget::Receipts,receiptBytes);
+    m_memory.report(MemoryBudget::Search,m_search->memoryUsage());
+
+    const MemoryBudget::Tier previous = m_memory.tier();
+    const MemoryBudget::Tier tier = m_memory.update();
+    if(tier != previous)
+        emit logMessage(QString("内存用量 %1 MB / %2 MB，减负级别 %3")
+                            .arg(m_memory.total() / (1024 * 1024))
+                            .arg(m_memory.limit() / (1024 * 1024))
+                            .arg(MemoryBudget::tierName(tier)));
+
+    if(tier >= MemoryBudget::ShrinkHistory){
+        for(ChatRoom *room : m_rooms)
+            room->trimHistory(PressureHistoryFrames);
+        m_search->trim(PressureSearchDocuments);
+    }
+    m_files->setPaused(tier >= MemoryBudget::DropBulk);
+    if(tier >= MemoryBudget::DropBulk){
+        // 文件数据块占大头，丢掉不影响实时聊天；补发的历史消息不丢，客户端补齐之前一直在等。
+        // 下载取消时已经发出去一半的文件，客户端按 fileEnd 里的大小核对后自己丢掉
+        if(previous < MemoryBudget::DropBulk)
+            m_files->cancelDownloads("服务器内存紧张，下载已取消");
+        for(ServerWorker *worker : m_clients)
+            worker->dropFileChunks();
+    }
+    if(tier >= MemoryBudget::ShedConnections)
+        shedConnections();
+}
+
+void chatServer::shedConnections()
+{
+    // 从占用最多的连接开始断开，直到降回拒绝登录那一级
+    QVector<QPair<qint64,ServerWorker*>> consumers;
+    for(ServerWorker *worker : m_clients){
+        const qint64 bytes = worker->inboundBytes() + worker->socketBytes() + worker->queuedBytes();
+        if(bytes > 0)
+            consumers.append(qMakePair(bytes,worker));
+    }
+    std::sort(consumers.begin(),consumers.end(),[](const QPair<qint64,ServerWorker*> &a,const QPair<qint64,ServerWorker*> &b){
+        return a.first > b.first;
+    });
+    qint64 excess = m_memory.total() - m_memory.threshold(MemoryBudget::RefuseLogins);
+    for(int i = 0; i < consumers.size() && i < MaxShedPerCheck && excess > 0; i++){
+        consumers.at(i).second->abortConnection(QString("服务器内存紧张，这个连接占用了 %1 KB").arg(consumers.at(i).first / 1024));
+        excess -= consumers.at(i).first;
+    }
+}
+
+QJsonObject chatServer::processStats() const
+{
+    // 浸泡测试按这些数字判断有没有泄漏：常驻内存、打开的描述符和各类对象的数量
+    QJsonObject process;
+    qint64 rssBytes = -1;
+    qint64 fds = -1;
+#ifdef Q_OS_LINUX
+    QFile statm("/proc/self/statm");
+    if(statm.open(QIODevice::ReadOnly)){
+        const QList<QByteArray> fields = statm.readAll().split(' ');
+        if(fields.size() > 1)
+            rssBytes = fields.at(1).toLongLong() * sysconf(_SC_PAGESIZE);
+    }
+    fds = QDir("/proc/self/fd").entryList(QDir::AllEntries | QDir::NoDotAndDotDot | QDir::System).size();
+#endif
+    qint64 cpuUs = -1;
+#ifdef Q_OS_UNIX
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF,&usage) == 0)
+        cpuUs = qint64(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#endif
+    process["rssBytes"] = QJsonValue(rssBytes);
+    process["cpuUs"] = QJsonValue(cpuUs);
+    process["fds"] = QJsonValue(fds);
+    process["workers"] = ServerWorker::instanceCount();
+    process["clients"] = int(m_clients.size());
+    process["rooms"] = int(m_rooms.size());
+    process["pendingLogins"] = int(m_pendingLogins.size());
+    process["remoteUsers"] = int(m_remoteUsers.size());
+    return process;
+}
+
+QJsonObject chatServer::stats() const
+{
+    static const char *const laneNames[ServerWorker::LaneCount] = {"control","chat","bulk"};
+    QJsonObject lanes;
+    for(int lane = 0; lane < ServerWorker::LaneCount; lane++){
+        qint64 frames = 0;
+        qint64 bytes = 0;
+        qint64 sent = 0;
+        int maxDepth = 0;
+        for(ServerWorker *worker : m_clients){
+            const int depth = worker->laneDepth(ServerWorker::Lane(lane));
+            frames += depth;
+            bytes += worker->laneBytes(ServerWorker::Lane(lane));
+            sent += qint64(worker->laneSentFrames(ServerWorker::Lane(lane)));
+            maxDepth = qMax(maxDepth,depth);
+        }
+        QJsonObject laneStats;
+        laneStats["queuedFrames"] = QJsonValue(frames);
+        laneStats["queuedBytes"] = QJsonValue(bytes);
+        laneStats["maxDepth"] = maxDepth;
+        laneStats["sentFrames"] = QJsonValue(sent);
+        lanes[laneNames[lane]] = laneStats;
+    }
+
+    QJsonObject stats;
+    stats["type"] = "stats";
+    stats["clients"] = int(m_clients.size());
+    stats["rooms"] = int(m_rooms.size());
+    qint64 receiptBytes = 0;
+    for(ChatRoom *room : m_rooms)
+        receiptBytes += room->receiptMemoryUsage();
+    stats["receiptBytes"] = QJsonValue(receiptBytes);
+    stats["lanes"] = lanes;
+
+    // 往返时延分布，再列出最慢的几个连接和它们排队的数据量，方便找出堵住发送队列的慢链路
+    RttStats rtt = m_retiredRtt;
+    QVector<ServerWorker*> measured;
+    for(ServerWorker *worker : m_clients){
+        if(worker->rtt().count() == 0)
+            continue;
+        rtt.merge(worker->rtt());
+        measured.append(worker);
+    }
+    const int slowCount = qMin(SlowClientCount,int(measured.size()));
+    std::partial_sort(measured.begin(),measured.begin() + slowCount,measured.end(),[](ServerWorker *a,ServerWorker *b){
+        return a->rtt().smoothedUs() > b->rtt().smoothedUs();
+    });
+    QJsonArray slowClients;
+    for(int i = 0; i < slowCount; i++){
+        ServerWorker *worker = measured.at(i);
+        QJsonObject client = worker->rtt().toJson();
+        client["connection"] = QJsonValue(qint64(worker->connectionId()));
+        client["user"] = worker->userName();
+        qint64 queuedBytes = 0;
+        for(int lane = 0; lane < ServerWorker::LaneCount; lane++)
+            queuedBytes += worker->laneBytes(ServerWorker::Lane(lane));
+        client["queuedBytes"] = QJsonValue(queuedBytes);
+        slowClients.append(client);
+    }
+    stats["rtt"] = rtt.toJson();
+    stats["slowClients"] = slowClients;
+    stats["configVersion"] = QJsonValue(qint64(ServerConfig::currentVersion()));
+    stats["memory"] = m_memory.toJson();
+    stats["process"] = processStats();
+    stats["tls"] = m_tls->stats();
+    int webClients = 0;
+    int deflateClients = 0;
+    int compressedClients = 0;
+    for(const ServerWorker *worker : m_clients){
+        if(worker->isWebSocket())
+            webClients++;
+        if(worker->isDeflateEnabled())
+            deflateClients++;
+        if(worker->isCompressionEnabled())
+            compressedClients++;
+    }
+    QJsonObject webSocket = WebSocketCodec::stats();
+    webSocket["listening"] = m_webServer->isListening();
+    webSocket["clients"] = webClients;
+    webSocket["deflateClients"] = deflateClients;
+    stats["webSocket"] = webSocket;
+    QJsonObject compression = FrameCompressor::stats();
+    compression["clients"] = compressedClients;
+    stats["compression"] = compression;
+    stats["io"] = m_shards->stats();
+    stats["directory"] = m_directory->stats();
+    stats["search"] = m_search->stats();
+    stats["clientWindows"] = int(m_clientWindows.size());
+    return stats;
+}
+
+bool chatServer::enableHandoff(const QString &path)
+{
+    // TLS 会话状态在 OpenSSL 里、WebSocket 的解压上下文在 zlib 里，都没法随描述符交给新进程
+    if(!Handoff::isSupported() || m_tls->isEnabled() || m_webServer->isListening())
+        return false;
+    // 探测连接不发接管请求，旧进程不会因此开始交接
+    if(isLocalServerLive(path)){
+        emit logMessage(QString("交接路径 %1 已经有其他进程在监听").arg(path));
+        return false;
+    }
+    QLocalServer::removeServer(path);
+    return m_handoffServer->listen(path);
+}
+
+void chatServer::handoffRequested()
+{
+    QLocalSocket *peer = m_handoffServer->nextPendingConnection();
+    if(!peer)
+        return;
+    peer->setParent(nullptr);
+    // 只连上又断开的是别的进程在探测交接路径
+    if(!isListening() || !Handoff::waitForRequest(peer->socketDescriptor())){
+        delete peer;
+        return;
+    }
+
+    emit logMessage("新进程请求接管，开始交接连接");
+    pauseAccepting();
+    QVector<qintptr> descriptors;
+    QVector<ServerWorker*> workers;
+    const QByteArray state = saveHandoffState(descriptors,workers);
+    if(!Handoff::send(peer->socketDescriptor(),descriptors,state) || !Handoff::waitForAck(peer->socketDescriptor())){
+        emit logMessage("交接失败，继续由本进程服务");
+        delete peer;
+        for(ServerWorker *worker : std::as_const(workers))
+            worker->resume();
+        resumeAccepting();
+        return;
+    }
+
+    // 新进程已经接管：断开信号，关闭本进程的描述符副本，退出时不再广播下线消息
+    for(ServerWorker *worker : std::as_const(workers)){
+        disconnect(worker,nullptr,this,nullptr);
+        m_clients.removeAll(worker);
+        m_filters->forgetSender(worker);
+        m_files->forgetWorker(worker);
+        leaveRoom(worker);
+        forgetPendingRequests(worker);
+        m_directory->removeUser(worker,worker->userName());
+    }
+    for(ServerWorker *worker : std::as_const(workers)){
+        worker->detach();
+        worker->deleteLater();
+    }
+    close();
+    stopCapture();
+    // 关闭本地监听会删除套接字文件，必须在断开交接通道之前完成，新进程等通道关闭后再重新监听
+    m_localServer->close();
+    m_handoffServer->close();
+    delete peer;
+    emit logMessage(QString("已把%1个连接交给新进程").arg(workers.size()));
+    emit handoffCompleted();
+}
+
+QByteArray chatServer::saveHandoffState(QVector<qintptr> &descriptors, QVector<ServerWorker*> &workers)
+{
+    descriptors.append(socketDescriptor());
+    for(ServerWorker *worker : std::as_const(m_clients)){
+        if(worker->socketDescriptor() < 0)
+            continue;
+        worker->suspend();
+        workers.append(worker);
+        descriptors.append(worker->socketDescriptor());
+    }
+
+    QByteArray state;
+    QDataStream out(&state,QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_12);
+    out << HandoffVersion << m_nextConnectionId;
+    out << quint32(m_rooms.size());
+    for(ChatRoom *room : std::as_const(m_rooms))
+        out << room->name() << quint64(room->lastSeq()) << room->epoch();
+    out << quint32(workers.size());
+    for(ServerWorker *worker : std::as_const(workers)){
+        ChatRoom *room = m_rooms.value(worker->room());
+        out << worker->isLocal() << worker->connectionId() << worker->userName() << worker->room()
+            << worker->isMulticastCapable() << (room && room->isMulticastReady(worker))
+            << worker->isCompressionEnabled() << worker->clientId()
+            << worker->pendingInput()
+            << worker->unsentFrames();    // 还在发送通道里的帧，套接字缓冲区已经在 suspend() 里写完
+    }
+    // 还在过滤的消息不会带到新进程，按没收到保存，客户端重发时再收
+    out << quint32(m_clientWindows.size());
+    for(auto it = m_clientWindows.cbegin(); it != m_clientWindows.cend(); ++it){
+        out << it.key();
+        it->window.save(out);
+    }
+    return state;
+}
+
+bool chatServer::takeOver(const QString &path)
+{
+    const qintptr channel = Handoff::connectTo(path);
+    if(channel < 0)
+        return false;
+    QVector<qintptr> descriptors;
+    QByteArray state;
+    if(!Handoff::receive(channel,descriptors,state) || !restoreHandoffState(state,descriptors)){
+        for(qintptr descriptor : std::as_const(descriptors))
+            Handoff::closeDescriptor(descriptor);
+        Handoff::closeDescriptor(channel);
+        return false;
+    }
+    Handoff::ack(channel);
+    Handoff::waitForClose(channel);
+    Handoff::closeDescriptor(channel);
+    emit logMessage(QString("已从旧进程接管%1个连接").arg(descriptors.size() - 1));
+    return true;
+}
+
+bool chatServer::restoreHandoffState(const QByteArray &state, const QVector<qintptr> &descriptors)
+{
+    QDataStream in(state);
+    in.setVersion(QDataStream::Qt_5_12);
+    quint32 version;
+    quint32 roomCount;
+    in >> version >> m_nextConnectionId >> roomCount;
+    if(version != HandoffVersion || descriptors.isEmpty())
+        return false;
+
+    QHash<QString,QPair<quint64,qint64>> roomSeqs;
+    for(quint32 i = 0; i < roomCount; i++){
+        QString name;
+        quint64 lastSeq;
+        qint64 epoch;
+        in >> name >> lastSeq >> epoch;
+        roomSeqs.insert(name,qMakePair(lastSeq,epoch));
+    }
+    quint32 workerCount;
+    in >> workerCount;
+    if(in.status() != QDataStream::Ok || int(workerCount) != descriptors.size() - 1)
+        return false;
+    if(!setSocketDescriptor(descriptors.first()))
+        return false;
+
+    QVector<ServerWorker*> multicastReady;
+    for(quint32 i = 0; i < workerCount; i++){
+        bool local;
+        quint32 connectionId;
+        QString userName;
+        QString roomName;
+        bool multicastCapable;
+        bool ready;
+        bool compression;
+        QString clientId;
+        QByteArray pendingInput;
+        QList<QPair<quint8,QByteArray>> unsent;
+        in >> local >> connectionId >> userName >> roomName >> multicastCapable >> ready >> compression >> clientId >> pendingInput >> unsent;
+
+        const qintptr descriptor = descriptors.at(int(i) + 1);
+        ServerWorker *worker = new ServerWorker(this);
+        const bool adopted = local ? worker->setLocalSocketDescriptor(descriptor)
+                                   : worker->setSocketDescriptor(descriptor);
+        if(!adopted){
+            Handoff::closeDescriptor(descriptor);
+            delete worker;
+            continue;
+        }
+        worker->setConnectionId(connectionId);
+        worker->setUserName(userName);
+        worker->setMulticastCapable(multicastCapable);
+        worker->setClientId(clientId);
+        // 新进程的压缩上下文从头开始，第一帧会带上重置标志
+        worker->setCompression(compression);
+        addWorker(worker);
+        if(!userName.isEmpty())
+            m_directory->addUser(worker,userName);
+        if(!roomName.isEmpty()){
+            ChatRoom *room = m_rooms.value(roomName);
+            if(!room){
+                room = new ChatRoom(roomName);
+                room->setLastSeq(roomSeqs.value(roomName).first);
+                room->setEpoch(roomSeqs.value(roomName).second);
+                m_rooms.insert(roomName,room);
+            }
+            room->addMember(worker);
+            worker->setRoom(roomName);
+            m_directory->joinRoom(worker,roomName);
+            if(ready)
+                multicastReady.append(worker);
+        }
+        // 通道里的帧已经是要写出去的样子（广播帧可能已经压缩过），原样放回去，不能再压缩一次
+        for(const auto &frame : std::as_const(unsent)){
+            if(frame.first < ServerWorker::BulkLane)
+                worker->queueFrame(ServerWorker::Lane(frame.first),frame.second);
+        }
+        worker->restorePendingInput(pendingInput);
+    }
+    quint32 windowCount;
+    in >> windowCount;
+    for(quint32 i = 0; i < windowCount && in.status() == QDataStream::Ok; i++){
+        QString clientId;
+        in >> clientId;
+        ClientWindow &client = m_clientWindows[clientId];
+        client.window.load(in);
+        client.idle = m_idleWindows.insert(m_idleWindows.end(),clientId);
+    }
+    // 窗口先都按空闲放进来，接管过来的连接再把自己的窗口拿走
+    for(ServerWorker *worker : std::as_const(m_clients)){
+        if(!worker->clientId().isEmpty())
+            attachClientWindow(worker->clientId());
+    }
+
+    // 组地址由房间名决定，新进程算出来的和旧进程一样，客户端不用重新加入
+    if(m_multicast->isEnabled()){
+        for(ChatRoom *room : std::as_const(m_rooms)){
+            if(room->multicastCapableCount() >= m_multicast->threshold())
+                room->setMulticastGroup(m_multicast->groupFor(room->name()));
+        }
+        for(ServerWorker *worker : std::as_const(multicastReady))
+            m_rooms.value(worker->room())->setMulticastReady(worker);
+    }
+    return true;
+}
+
+void chatServer::incomingConnection(qintptr socketDescriptor)
+{
+    if(m_tls->isEnabled()){
+        // 握手完成后在 tlsReady 里创建 ServerWorker
+        m_tls->accept(socketDescriptor);
+        return;
+    }
+    ServerWorker *worker =new ServerWorker(this);
+    if(!worker->setSocketDescriptor(socketDescriptor)){
+        // 套接字没有接管描述符，要自己关掉，否则每次失败都漏一个 fd
+        Handoff::closeDescriptor(socketDescriptor);
+        delete worker;
+        return;
+    }
+    addWorker(worker);
+    emit logMessage("新的用户连接上了");
+}
+
+void chatServer::tlsReady(QSslSocket *socket)
+{
+    ServerWorker *worker = new ServerWorker(this);
+    worker->setSslSocket(socket);
+    addWorker(worker);
+    emit logMessage("新的 TLS 连接");
+}
+
+void chatServer::localConnection()
+{
+    while(m_localServer->hasPendingConnections()){
+        QLocalSocket *socket = m_localServer->nextPendingConnection();
+        ServerWorker *worker = new ServerWorker(this);
+        worker->setLocalSocket(socket);
+        addWorker(worker);
+        emit logMessage("新的本地连接");
+    }
+}
+
+void chatServer::webSocketConnection()
+{
+    while(m_webServer->hasPendingConnections()){
+        QTcpSocket *socket = m_webServer->nextPendingConnection();
+        ServerWorker *worker = new ServerWorker(this);
+        worker->setWebSocket(socket);
+        addWorker(worker);
+        emit logMessage("新的 WebSocket 连接");
+    }
+}
+
+void chatServer::addWorker(ServerWorker *worker)
+{
+    connect(worker,&ServerWorker::logMessage,this,&chatServer::logMessage);
+    connect(worker,&ServerWorker::jsonReceived,this,&chatServer::jsonReceived);
+    connect(worker,&ServerWorker::chunkReceived,this,&chatServer::chunkReceived);
+    connect(worker,&ServerWorker::disconnectedFromClient,this,std::bind(&chatServer::userDisconnected,this,worker));
+
+    if(worker->connectionId() == 0)
+        worker->setConnectionId(++m_nextConnectionId);
+    // 计时器挂在主线程上，连接可能已经交给了 I/O 线程，不能拿指针判断它还在不在，
+    // 只看它还在不在等登录的表里；abortConnection 转到连接自己的线程执行。
+    // 等中继确认的登录有自己的期限，到这里早就有结果了
+    if(worker->userName().isEmpty()){
+        const quint32 connectionId = worker->connectionId();
+        m_awaitingLogin.insert(worker,connectionId);
+        QTimer::singleShot(LoginTimeoutMs,this,[this,worker,connectionId]{
+            const auto it = m_awaitingLogin.constFind(worker);
+            if(it != m_awaitingLogin.constEnd() && it.value() == connectionId)
+                worker->abortConnection("登录超时");
+        });
+    }
+    if(m_capturing){
+        m_capture->recordConnect(worker->connectionId());
+        worker->setCapture(m_capture);
+    }
+    m_clients.append(worker);
+    m_shards->adopt(worker);
+}
+
+void chatServer::broadcast(const QJsonObject &message, ServerWorker *exclude)
+{
+    const QByteArray frame = QJsonDocument(message).toJson(QJsonDocument::Compact);
+    m_shards->sendFrame(m_clients,frame);
+}
+
+void chatServer::broadcastToRoom(const QString &roomName, QJsonObject message, quint64 traceId)
+{
+    ChatRoom *room = m_rooms.value(roomName);
+    if(!room)
+        return;
+
+    const qint64 serializeBeginNs = traceId ? ChatTrace::now() : 0;
+    const quint64 seq = room->nextSeq();
+    message["room"] = roomName;
+    message["seq"] = QJsonValue(qint64(seq));
+    const QByteArray frame = QJsonDocument(message).toJson(QJsonDocument::Compact);
+    room->remember(seq,frame);
+    if(message.contains("sender"))
+        room->trackReceipt(seq,message.value("sender").toString());
+    // 只是入队，分词和建索引在检索线程里做
+    if(message.value("type").toString() == "message")
+        m_search->add(roomName,seq,message.value("sender").toString(),message.value("text").toString());
+    if(traceId)
+        ChatTrace::complete(traceId,"serialize",serializeBeginNs,ChatTrace::now());
+
+    // 组播成功发出的帧，已经确认能收到组播的成员不再走 TCP。
+    // 组播没有认证，客户端只收聊天消息，其他帧（文件公告等）都走 TCP
+    const bool viaMulticast = room->isMulticastActive() && message.value("type").toString() == "message"
+        && m_multicast->fits(frame);
+    if(viaMulticast){
+        m_multicast->send(room->multicastGroup(),frame);
+        QVector<ServerWorker*> recipients;
+        recipients.reserve(room->members().size());
+        for(ServerWorker *worker : room->members()){
+            if(!room->isMulticastReady(worker))
+                recipients.append(worker);
+        }
+        m_shards->sendFrame(recipients,frame,traceId);
+    }else if(m_shards->isEnabled()){
+        // 目录里的成员按线程分好了，主线程只投递和线程数一样多的任务
+        m_shards->sendToRoom(m_directory,roomName,frame,traceId);
+    }else{
+        m_shards->sendFrame(room->members(),frame,traceId);
+    }
+}
+
+void chatServer::postToRoom(const QString &roomName, const QJsonObject &message, quint64 traceId)
+{
+    broadcastToRoom(roomName,message,traceId);
+    if(m_cluster)
+        m_cluster->relay(roomName,message);
+}
+
+void chatServer::roomMembershipChanged(const QString &roomName, int count)
+{
+    if(m_cluster)
+        m_cluster->updateRoom(roomName,count);
+}
+
+void chatServer::joinRoom(ServerWorker *worker, const QString &roomName)
+{
+    leaveRoom(worker);
+    ChatRoom *room = m_rooms.value(roomName);
+    if(!room){
+        room = new ChatRoom(roomName);
+        m_rooms.insert(roomName,room);
+    }
+    room->addMember(worker);
+    worker->setRoom(roomName);
+    m_directory->joinRoom(worker,roomName);
+    roomMembershipChanged(roomName,room->members().size());
+
+    QJsonObject joinedMessage;
+    joinedMessage["type"] = "joined";
+    joinedMessage["room"] = roomName;
+    joinedMessage["seq"] = QJsonValue(qint64(room->lastSeq()));
+    joinedMessage["epoch"] = QJsonValue(room->epoch());
+    worker->sendJson(joinedMessage);
+
+    if(!m_multicast->isEnabled() || !worker->isMulticastCapable())
+        return;
+    if(room->isMulticastActive()){
+        sendMulticastInvite(room,worker);
+    }else if(room->multicastCapableCount() >= m_multicast->threshold()){
+        room->setMulticastGroup(m_multicast->groupFor(roomName));
+        for(ServerWorker *member : room->members()){
+            if(member->isMulticastCapable())
+                sendMulticastInvite(room,member);
+        }
+        emit logMessage(QString("房间%1启用组播 %2").arg(roomName,room->multicastGroup().toString()));
+    }
+}
+
+void chatServer::leaveRoom(ServerWorker *worker)
+{
+    ChatRoom *room = m_rooms.value(worker->room());
+    worker->setRoom(QString());
+    if(!room)
+        return;
+    room->removeMember(worker);
+    m_directory->leaveRoom(worker,room->name());
+    roomMembershipChanged(room->name(),room->members().size());
+    if(room->isEmpty()){
+        m_rooms.remove(room->name());
+        delete room;
+        return;
+    }
+    // 能收组播的人不够了就停用，剩下的成员退出组播组，消息回到 TCP
+    if(room->isMulticastActive() && room->multicastCapableCount() < m_multicast->threshold()){
+        QJsonObject endMessage;
+        endMessage["type"] = "multicastEnd";
+        endMessage["room"] = room->name();
+        for(ServerWorker *member : room->members()){
+            if(member->isMulticastCapable())
+                member->sendJson(endMessage);
+        }
+        emit logMessage(QString("房间%1停用组播 %2").arg(room->name(),room->multicastGroup().toString()));
+        room->setMulticastGroup(QHostAddress());
+    }
+}
+
+void chatServer::sendMulticastInvite(ChatRoom *room, ServerWorker *worker)
+{
+    QJsonObject inviteMessage;
+    inviteMessage["type"] = "multicast";
+    inviteMessage["room"] = room->name();
+    inviteMessage["group"] = room->multicastGroup().toString();
+    inviteMessage["port"] = m_multicast->port();
+    worker->sendJson(inviteMessage);
+}
+
+void chatServer::resendFrames(ServerWorker *worker, const QJsonObject &docObj)
+{
+    ChatRoom *room = m_rooms.value(worker->room());
+    if(!room || docObj.value("room").toString() != room->name())
+        return;
+    quint64 from = quint64(docObj.value("from").toInteger());
+    const quint64 to = qMin(quint64(docObj.value("to").toInteger()),room->lastSeq());
+    if(from == 0 || to < from)
+        return;
+    if(to - from >= MaxResendFrames)
+        from = to - MaxResendFrames + 1;
+    for(quint64 seq = from; seq <= to; seq++){
+        const QByteArray frame = room->recentFrame(seq);
+        if(!frame.isEmpty())
+            worker->queueFrame(ServerWorker::BulkLane,frame);
+    }
+}
+
+void chatServer::multicastHeartbeat()
+{
+    for(ChatRoom *room : std::as_const(m_rooms)){
+        if(!room->isMulticastActive())
+            continue;
+        QJsonObject seqMessage;
+        seqMessage["type"] = "seq";
+        seqMessage["room"] = room->name();
+        seqMessage["seq"] = QJsonValue(qint64(room->lastSeq()));
+        m_multicast->send(room->multicastGroup(),QJsonDocument(seqMessage).toJson(QJsonDocument::Compact));
+    }
+}
+
+void chatServer::flushReceipts()
+{
+    for(ChatRoom *room : std::as_const(m_rooms)){
+        const QVector<ChatRoom::ReceiptUpdate> updates = room->takeReceiptUpdates();
+        if(updates.isEmpty())
+            continue;
+        // 同一个发送者的回执合成一条消息
+        QHash<QString,QJsonArray> bySender;
+        for(const ChatRoom::ReceiptUpdate &update : updates){
+            QJsonObject receipt;
+            receipt["seq"] = QJsonValue(qint64(update.seq));
+            receipt["count"] = update.count;
+            if(!update.readers.isEmpty())
+                receipt["readers"] = QJsonArray::fromStringList(update.readers);
+            bySender[update.sender].append(receipt);
+        }
+        for(ServerWorker *member : room->members()){
+            auto it = bySender.constFind(member->userName());
+            if(it == bySender.constEnd())
+                continue;
+            QJsonObject receiptsMessage;
+            receiptsMessage["type"] = "receipts";
+            receiptsMessage["room"] = room->name();
+            receiptsMessage["receipts"] = it.value();
+            member->queueFrame(ServerWorker::ChatLane,QJsonDocument(receiptsMessage).toJson(QJsonDocument::Compact));
+        }
+    }
+}
+
+void chatServer::stopServer()
+{
+    close();
+    m_localServer->close();
+    m_webServer->close();
+    const QString report = m_filters->latencyReport();
+    if(!report.isEmpty())
+        emit logMessage(report);
+}
+
+void chatServer::jsonReceived(ServerWorker *sender, const QJsonObject &docObj, quint64 traceId)
+{
+    const QJsonValue typeVal = docObj.value("type");
+    if(typeVal.isNull() || !typeVal.isString())
+        return;
+    if(typeVal.toString().compare("message",Qt::CaseInsensitive) == 0){
+        const QJsonValue textVal = docObj.value("text");
+        if(textVal.isNull() || !textVal.isString())
+            return;
+        const QString text = textVal.toString().trimmed();
+        if(text.isEmpty())
+            return;
+        QJsonObject message;
+        message["type"] = "message";
+        message["text"] = text;
+        message["sender"] = sender->userName();
+        // 还没有登录进房间的连接不能发言
+        if(sender->room().isEmpty())
+            return;
+        // 离线队列里的消息带着写下时的房间，只能发到那个房间；不带房间的老客户端发到当前房间
+        const QString roomName = docObj.contains("room") ? docObj.value("room").toString() : sender->room();
+        const quint64 cseq = quint64(docObj.value("cseq").toInteger());
+        if(cseq && !acceptClientSeq(sender,cseq))
+            return;
+        ChatRoom *room = m_rooms.value(roomName);
+        if(!room || !room->hasMember(sender)){
+            // 已经不在那个房间了：客户端留着这条，回到那个房间后再发
+            deferMessage(sender,QString("不在房间%1里，消息没有发出").arg(roomName),cseq);
+            return;
+        }
+        message["room"] = roomName;
+        if(!sender->takeMessageToken()){
+            deferMessage(sender,"发送太快，请稍后再发",cseq);
+            return;
+        }
+
+        // 没有配置过滤器时直接广播，不经过线程池
+        if(m_filters->isEmpty()){
+            postToRoom(roomName,message,traceId);
+            finishClientSeq(sender,cseq);
+        }else if(m_filters->isFull()){
+            deferMessage(sender,"服务器繁忙，请稍后再发",cseq);
+        }else{
+            // 序号跟着消息过一遍过滤器，处理完再确认
+            if(cseq)
+                message["cseq"] = QJsonValue(qint64(cseq));
+            m_filters->submit(sender,message,traceId);
+        }
+    }else if(typeVal.toString().compare("messages",Qt::CaseInsensitive) == 0){
+        // 客户端重连后成批补发离线队列，逐条按普通消息处理
+        const QJsonArray items = docObj.value("items").toArray();
+        for(const QJsonValue &item : items){
+            QJsonObject message = item.toObject();
+            message["type"] = "message";
+            jsonReceived(sender,message,traceId);
+        }
+    }else if(typeVal.toString().compare("login",Qt::CaseInsensitive) == 0){
+        const QJsonValue usernameVal = docObj.value("text");
+        if(usernameVal.isNull() || !usernameVal.isString())
+            return;
+
+        const QString username = usernameVal.toString().trimmed();
+        if(username.isEmpty()) {
+            // 用户名为空，发送错误信息
+            sendLoginError(sender,"用户名不能为空");
+            return;
+        }
+        if(!sender->userName().isEmpty())
+            return;
+        if(m_memory.tier() >= MemoryBudget::RefuseLogins){
+            sendLoginError(sender,"服务器繁忙，请稍后再登录");
+            return;
+        }
+
+        // 检查用户名是否已存在
+        if(isUsernameTaken(username)) {
+            // 用户名重复，发送错误信息
+            sendLoginError(sender,"用户名已存在，请选择其他用户名");
+
+            // 在服务器控制台输出错误信息
+            qDebug() << "登录失败：用户名" << username << "已存在";
+            emit logMessage(QString("登录失败：用户名%1已存在").arg(username));
+            return;
+        }
+
+        // 加密连接的房间消息不能再走明文组播
+        const bool multicastCapable = docObj.value("multicast").toBool() && !sender->isEncrypted();
+        // 客户端声明支持的压缩算法，目前只有 deflate
+        sender->setCompression(docObj.value("compress").toArray().contains(QJsonValue("deflate")));
+        QString clientId = docObj.value("clientId").toString();
+        if(clientId.size() > MaxClientIdLength)
+            clientId.clear();
+        if(m_cluster && m_cluster->isConnected()){
+            // 集群里用户名由中继统一登记，确认之后再完成登录
+            PendingLogin pending;
+            pending.worker = sender;
+            pending.userName = username;
+            pending.clientId = clientId;
+            pending.multicastCapable = multicastCapable;
+            const quint64 req = m_cluster->claim(username);
+            m_pendingLogins.insert(req,pending);
+            QTimer::singleShot(ClaimTimeoutMs,this,[this,req]{
+                // 中继一直没回，之后再回来的结果按没有等待的登录处理
+                const PendingLogin pending = m_pendingLogins.take(req);
+                if(pending.worker)
+                    sendLoginError(pending.worker,"集群中继没有响应，请稍后再登录");
+            });
+            return;
+        }
+        completeLogin(sender,username,multicastCapable,clientId);
+    }else if(typeVal.toString().compare("join",Qt::CaseInsensitive) == 0){
+        if(sender->userName().isEmpty())
+            return;
+        const QString roomName = docObj.value("text").toString().trimmed();
+        if(roomName.isEmpty() || roomName.size() > 64 || roomName == sender->room())
+            return;
+        joinRoom(sender,roomName);
+        emit logMessage(QString("%1进入房间%2").arg(sender->userName(),roomName));
+    }else if(typeVal.toString().compare("fileOffer",Qt::CaseInsensitive) == 0){
+        if(!sender->room().isEmpty())
+            m_files->offer(sender,docObj);
+    }else if(typeVal.toString().compare("fileRequest",Qt::CaseInsensitive) == 0){
+        if(!sender->userName().isEmpty())
+            m_files->request(sender,docObj);
+    }else if(typeVal.toString().compare("read",Qt::CaseInsensitive) == 0){
+        // 已读水位：客户端自己合并过，这里再按间隔合并后通知发送者
+        ChatRoom *room = m_rooms.value(sender->room());
+        if(room && docObj.value("room").toString() == room->name()
+                && room->markRead(sender,quint64(docObj.value("seq").toInteger()))
+                && !m_receiptTimer->isActive())
+            m_receiptTimer->start();
+    }else if(typeVal.toString().compare("search",Qt::CaseInsensitive) == 0){
+        // 只能搜自己所在的房间
+        const QString query = docObj.value("text").toString().trimmed();
+        if(sender->room().isEmpty() || query.isEmpty() || query.size() > 100)
+            return;
+        // 查询在后台线程里交倒排表，和聊天消息共用一个令牌桶，刷查询占不满检索线程
+        if(!sender->takeMessageToken()){
+            deferMessage(sender,"搜索太频繁，请稍后再试",0);
+            return;
+        }
+        const quint64 requestId = ++m_nextSearchId;
+        m_pendingSearches.insert(requestId,sender);
+        m_search->search(requestId,sender->room(),query,docObj.value("before").toInteger(-1),docObj.value("limit").toInt(20));
+    }else if(typeVal.toString().compare("stats",Qt::CaseInsensitive) == 0){
+        // 登录后才能查，和聊天消息共用令牌桶；用户名、时延和文件路径只给管理消息
+        if(sender->userName().isEmpty())
+            return;
+        if(!sender->takeMessageToken()){
+            deferMessage(sender,"查询太频繁，请稍后再试",0);
+            return;
+        }
+        QJsonObject publicStats = stats();
+        publicStats.remove("slowClients");
+        QJsonObject search = publicStats.value("search").toObject();
+        search.remove("logFile");
+        publicStats["search"] = search;
+        sender->sendJson(publicStats);
+    }else if(typeVal.toString().compare("admin",Qt::CaseInsensitive) == 0){
+        handleAdmin(sender,docObj);
+    }else if(typeVal.toString().compare("nack",Qt::CaseInsensitive) == 0){
+        resendFrames(sender,docObj);
+    }else if(typeVal.toString().compare("multicastReady",Qt::CaseInsensitive) == 0){
+        ChatRoom *room = m_rooms.value(sender->room());
+        if(room && docObj.value("room").toString() == room->name())
+            room->setMulticastReady(sender);
+    }
+}
+
+void chatServer::searchFinished(quint64 requestId, const QJsonObject &result)
+{
+    // 连接已经断开时 userDisconnected 把查询从表里去掉了
+    ServerWorker *worker = m_pendingSearches.take(requestId);
+    if(worker)
+        worker->sendJson(result,ServerWorker::ChatLane);
+}
+
+void chatServer::pingClients()
+{
+    for(ServerWorker *worker : m_clients)
+        worker->sendPing();
+}
+
+void chatServer::handleAdmin(ServerWorker *sender, const QJsonObject &docObj)
+{
+    QJsonObject resultMessage;
+    resultMessage["type"] = "adminResult";
+    // 逐字节比较完，不因为提前返回泄露口令长度之外的信息
+    const QByteArray token = docObj.value("token").toString().toUtf8();
+    const QByteArray expected = m_adminToken.toUtf8();
+    bool authorized = !expected.isEmpty() && token.size() == expected.size();
+    char difference = 0;
+    for(qsizetype i = 0; authorized && i < expected.size(); i++)
+        difference |= token.at(i) ^ expected.at(i);
+    authorized = authorized && difference == 0;
+    if(!authorized){
+        resultMessage["ok"] = false;
+        resultMessage["error"] = "没有权限";
+        sender->sendJson(resultMessage);
+        emit logMessage(QString("拒绝了连接 %1 的管理请求").arg(sender->connectionId()));
+        return;
+    }
+
+    const QString action = docObj.value("action").toString();
+    QString error;
+    bool ok = true;
+    if(action == "reload")
+        ok = m_config->reload(&error);
+    else if(action == "set")
+        ok = m_config->apply(docObj.value("config").toObject(),&error);
+    else if(action == "stats")
+        resultMessage["stats"] = stats();
+    else if(action != "get"){
+        ok = false;
+        error = QString("未知的操作 %1").arg(action);
+    }
+    resultMessage["ok"] = ok;
+    if(!ok)
+        resultMessage["error"] = error;
+    resultMessage["config"] = ServerConfig::current()->toJson();
+    sender->sendJson(resultMessage);
+}
+
+void chatServer::announcePresence(const QString &event, const QString &user)
+{
+    const int coalesceMs = ServerConfig::current()->presenceCoalesceMs;
+    if(coalesceMs <= 0 && m_pendingPresence.isEmpty()){
+        QJsonObject presenceMessage;
+        presenceMessage["type"] = event;
+        presenceMessage["username"] = user;
+        broadcast(presenceMessage,nullptr);
+        return;
+    }
+    // 重连风暴时每个上下线都广播给所有人是 O(N²) 帧，合并成一条只发最终状态
+    m_pendingPresence.insert(user,event == "newuser");
+    if(!m_presenceTimer->isActive())
+        m_presenceTimer->start(qMax(0,coalesceMs));
+}
+
+void chatServer::flushPresence()
+{
+    m_presenceTimer->stop();
+    if(m_pendingPresence.isEmpty())
+        return;
+    QJsonArray joined;
+    QJsonArray left;
+    for(auto it = m_pendingPresence.cbegin(); it != m_pendingPresence.cend(); ++it){
+        if(it.value())
+            joined.append(it.key());
+        else
+            left.append(it.key());
+    }
+    m_pendingPresence.clear();
+    QJsonObject presenceMessage;
+    presenceMessage["type"] = "presence";
+    presenceMessage["joined"] = joined;
+    presenceMessage["left"] = left;
+    broadcast(presenceMessage,nullptr);
+}
+
+void chatServer::sendLoginError(ServerWorker *worker, const QString &text)
+{
+    QJsonObject errorMessage;
+    errorMessage["type"] = "loginError";
+    errorMessage["text"] = text;
+    worker->sendJson(errorMessage);
+}
+
+void chatServer::completeLogin(ServerWorker *worker, const QString &username, bool multicastCapable, const QString &clientId)
+{
+    m_awaitingLogin.remove(worker);
+    worker->setClientId(clientWindowKey(worker,username,clientId));
+    attachClientWindow(worker->clientId());
+    worker->setUserName(username);
+    m_directory->addUser(worker,username);
+    worker->setMulticastCapable(multicastCapable);
+    announcePresence("newuser",username);
+    if(m_cluster){
+        m_cluster->addLocalUser(username);
+        m_cluster->publishPresence("newuser",username);
+    }
+
+    QJsonObject userListMessage;
+    userListMessage["type"] = "userlist";
+    QJsonArray userlist;
+    const QStringList localUsers = m_directory->userNames();
+    for(const QString &localUser : localUsers)
+        userlist.append(localUser == username ? localUser + "*" : localUser);
+    for(const QString &remoteUser : std::as_const(m_remoteUsers))
+        userlist.append(remoteUser);
+    userListMessage["userlist"] = userlist;
+    worker->sendJson(userListMessage);
+    joinRoom(worker,DefaultRoom);
+
+    // 在服务器控制台输出成功信息
+    qDebug() << "用户" << username << "登录成功";
+    emit logMessage(QString("用户%1登录成功").arg(username));
+}
+
+void chatServer::claimResult(quint64 req, const QString &user, bool ok)
+{
+    const auto it = m_pendingLogins.constFind(req);
+    if(it == m_pendingLogins.constEnd()){
+        m_pendingLogins.remove(req);
+        // 等待确认期间连接已经断开或者超时了；名字没被本节点的其他登录用上就还给中继
+        if(ok && !m_directory->containsUser(user) && !isClaimPending(user))
+            m_cluster->release(user);
+        return;
+    }
+    const PendingLogin pending = it.value();
+    m_pendingLogins.erase(it);
+    if(!ok){
+        sendLoginError(pending.worker,"用户名已存在，请选择其他用户名");
+        emit logMessage(QString("登录失败：用户名%1已在其他节点登录").arg(user));
+        return;
+    }
+    completeLogin(pending.worker,user,pending.multicastCapable,pending.clientId);
+}
+
+void chatServer::claimLost(const QString &user)
+{
+    // 链路断开期间两边都登录了这个名字，中继以先登记的节点为准，本节点的断开
+    for(ServerWorker *worker : std::as_const(m_clients)){
+        if(worker->userName() == user){
+            worker->abortConnection("用户名已在其他节点登录");
+            break;
+        }
+    }
+}
+
+void chatServer::clusterLinkLost()
+{
+    // 等中继确认的登录不会再有结果，让客户端稍后重试
+    const QHash<quint64,PendingLogin> pendingLogins = std::exchange(m_pendingLogins,QHash<quint64,PendingLogin>());
+    for(const PendingLogin &pending : pendingLogins)
+        sendLoginError(pending.worker,"集群中继连接断开，请稍后再登录");
+    // 其他节点的用户先按下线处理，重连后中继会重新发完整的在线列表
+    const QSet<QString> remoteUsers = std::exchange(m_remoteUsers,QSet<QString>());
+    for(const QString &user : remoteUsers){
+        if(!m_directory->containsUser(user))
+            announcePresence("userdisconnected",user);
+    }
+}
+
+void chatServer::remotePresence(const QString &event, const QString &user)
+{
+    if(event == "newuser")
+        m_remoteUsers.insert(user);
+    else if(event == "userdisconnected")
+        m_remoteUsers.remove(user);
+    else
+        return;
+    announcePresence(event,user);
+}
+
+void chatServer::remoteUsers(const QStringList &users)
+{
+    for(const QString &user : users){
+        if(!m_remoteUsers.contains(user))
+            remotePresence("newuser",user);
+    }
+}
+
+void chatServer::remoteMessage(const QString &roomName, const QJsonObject &message)
+{
+    // 其他节点转发来的消息只在本节点广播，不再转发
+    broadcastToRoom(roomName,message);
+}
+
+void chatServer::userDisconnected(ServerWorker *sender)
+{
+    m_clients.removeAll(sender);
+    m_retiredRtt.merge(sender->rtt());
+    m_filters->forgetSender(sender);
+    m_files->forgetWorker(sender);
+    if(m_capturing)
+        m_capture->recordDisconnect(sender->connectionId());
+    leaveRoom(sender);
+    forgetPendingRequests(sender);
+    // 还在过滤的消息随连接一起丢掉了，客户端重连后重发的要能再收下
+    const auto client = m_clientWindows.find(sender->clientId());
+    if(client != m_clientWindows.end())
+        client->window.dropInFlight();
+    if(!sender->clientId().isEmpty())
+        detachClientWindow(sender->clientId());
+    const QString userName = sender->userName();
+    m_directory->removeUser(sender,userName);
+    if(!userName.isEmpty()){
+        // 因为名字冲突被断开时，其他节点上的同名用户还在线
+        if(!m_remoteUsers.contains(userName))
+            announcePresence("userdisconnected",userName);
+        if(m_cluster){
+            m_cluster->publishPresence("userdisconnected",userName);
+            m_cluster->release(userName);
+        }
+        emit logMessage(userName + " disconnected");
+    }
+    sender->deleteLater();
+}
+
+void chatServer::messageFiltered(ServerWorker *sender, const QJsonObject &message, quint64 traceId)
+{
+    QJsonObject accepted = message;
+    const quint64 cseq = quint64(accepted.take("cseq").toInteger());
+    postToRoom(accepted.value("room").toString(),accepted,traceId);
+    finishClientSeq(sender,cseq);
+}
+
+void chatServer::chunkReceived(ServerWorker *sender, const QByteArray &frame)
+{
+    if(!sender->userName().isEmpty())
+        m_files->receiveChunk(sender,frame);
+}
+
+void chatServer::fileReady(ServerWorker *uploader, const QJsonObject &announcement)
+{
+    // 文件只存在本节点上，公告不转发到集群里的其他节点
+    broadcastToRoom(uploader->room(),announcement);
+}
+
+void chatServer::messageRejected(ServerWorker *sender, const QString &reason, const QJsonObject &message)
+{
+    QJsonObject rejectedMessage;
+    rejectedMessage["type"] = "rejected";
+    rejectedMessage["text"] = reason;
+    sender->sendJson(rejectedMessage);
+    // 被过滤器拦下也算处理完了，客户端不用再重发
+    finishClientSeq(sender,quint64(message.value("cseq").toInteger()));
+    emit logMessage(QString("%1 的消息被拦截：%2").arg(sender->userName(),reason));
+}
+
+void chatServer::deferMessage(ServerWorker *sender, const QString &reason, quint64 cseq)
+{
+    if(cseq){
+        // 客户端还留着这一条，在确认帧里告诉它稍后重发，不用每条都提示用户
+        const auto it = m_clientWindows.find(sender->clientId());
+        if(it != m_clientWindows.end())
+            it->window.forget(cseq);
+        queueAck(sender,cseq,Retry);
+        return;
+    }
+    QJsonObject rejectedMessage;
+    rejectedMessage["type"] = "rejected";
+    rejectedMessage["text"] = reason;
+    sender->sendJson(rejectedMessage);
+    emit logMessage(QString("%1 的消息被拦截：%2").arg(sender->userName(),reason));
+}
+
+bool chatServer::acceptClientSeq(ServerWorker *sender, quint64 cseq)
+{
+    // 登录时已经挂上了窗口，找不到只能是还没登录
+    const auto it = m_clientWindows.find(sender->clientId());
+    if(it == m_clientWindows.end())
+        return true;
+    switch(it->window.accept(cseq)){
+    case IdempotencyWindow::Fresh:
+        return true;
+    case IdempotencyWindow::Duplicate:
+        // 确认在路上丢了，客户端又发了一遍：再确认一次，不再广播
+        queueAck(sender,cseq,Acked);
+        return false;
+    case IdempotencyWindow::InFlight:
+        // 还在过滤，处理完会确认
+        return false;
+    case IdempotencyWindow::Stale:
+        // 分不清发没发过，不能当重复确认掉，让客户端换个新序号重发
+        queueAck(sender,cseq,Stale);
+        return false;
+    }
+    return false;
+}
+
+QString chatServer::clientWindowKey(ServerWorker *worker, const QString &username, const QString &clientId) const
+{
+    // 没带编号的客户端按连接去重，编号前加 # 不会和客户端生成的撞上；
+    // 用户名带上长度，名字和编号怎么拼都不会拼出同一个键
+    if(clientId.isEmpty())
+        return QString("#%1").arg(worker->connectionId());
+    return QString("%1:%2/%3").arg(username.size()).arg(username,clientId);
+}
+
+void chatServer::attachClientWindow(const QString &clientId)
+{
+    auto it = m_clientWindows.find(clientId);
+    if(it == m_clientWindows.end())
+        it = m_clientWindows.insert(clientId,ClientWindow());
+    else if(it->connections == 0)
+        m_idleWindows.erase(it->idle);
+    it->connections++;
+}
+
+void chatServer::detachClientWindow(const QString &clientId)
+{
+    const auto it = m_clientWindows.find(clientId);
+    if(it == m_clientWindows.end() || --it->connections > 0)
+        return;
+    // # 开头的是按连接分配的编号，连接断了就不会再有人用
+    if(clientId.startsWith('#')){
+        m_clientWindows.erase(it);
+        return;
+    }
+    it->idle = m_idleWindows.insert(m_idleWindows.end(),clientId);
+    while(int(m_idleWindows.size()) > MaxIdleClientWindows){
+        m_clientWindows.remove(m_idleWindows.front());
+        m_idleWindows.pop_front();
+    }
+}
+
+void chatServer::finishClientSeq(ServerWorker *sender, quint64 cseq)
+{
+    if(!cseq)
+        return;
+    const auto it = m_clientWindows.find(sender->clientId());
+    if(it == m_clientWindows.end())
+        return;
+    it->window.finish(cseq);
+    queueAck(sender,cseq,Acked);
+}
+
+void chatServer::queueAck(ServerWorker *sender, quint64 cseq, AckKind kind)
+{
+    PendingAck &ack = m_pendingAcks[sender];
+    switch(kind){
+    case Acked:
+        ack.acked.append(cseq);
+        break;
+    case Retry:
+        ack.retry.append(cseq);
+        break;
+    case Stale:
+        ack.stale.append(cseq);
+        break;
+    }
+    if(!m_ackTimer->isActive())
+        m_ackTimer->start();
+}
+
+void chatServer::flushAcks()
+{
+    // 断开的连接在 userDisconnected 里已经去掉了，表里的都还活着
+    for(auto it = m_pendingAcks.cbegin(); it != m_pendingAcks.cend(); ++it){
+        QJsonObject ackMessage;
+        ackMessage["type"] = "ack";
+        QJsonArray acked;
+        for(const quint64 cseq : it->acked)
+            acked.append(QJsonValue(qint64(cseq)));
+        ackMessage["cseqs"] = acked;
+        if(!it->retry.isEmpty()){
+            QJsonArray retry;
+            for(const quint64 cseq : it->retry)
+                retry.append(QJsonValue(qint64(cseq)));
+            ackMessage["retry"] = retry;
+        }
+        if(!it->stale.isEmpty()){
+            QJsonArray stale;
+            for(const quint64 cseq : it->stale)
+                stale.append(QJsonValue(qint64(cseq)));
+            ackMessage["stale"] = stale;
+        }
+        it.key()->sendJson(ackMessage);
+    }
+    m_pendingAcks.clear();
+}
@@ -1,33 +1,223 @@
-#ifndef CHATSERVER_H
-#define CHATSERVER_H
-
-#include <QObject>
-#include <QTcpServer>
-#include "serverworker.h"
-
-class chatServer :  public QTcpServer
-{
-    Q_OBJECT
-
-public:
-    explicit chatServer(QObject *parent = nullptr);
-
-    // 添加检查用户名是否重复的方法
-    bool isUsernameTaken(const QString &username);
-
-protected:
-    void incomingConnection(qintptr socketDescriptor) override;
-    QVector<ServerWorker*>m_clients;
-
-    void broadcast(const QJsonObject &message,ServerWorker *exclude);
-
-signals:
-    void logMessage(const QString& msg);
-
-public slots:
-    void stopServer();
-    void jsonReceived(ServerWorker *sender,const QJsonObject &docObj);
-    void userDisconnected(ServerWorker *sender);
-};
-
-#endif // CHATSERVER_H
+#ifndef CHATSERVER_H
+#define CHATSERVER_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QLocalServer>
+#include "serverworker.h"
+#include "filterpipeline.h"
+#include "trafficcapture.h"
+#include "chatroom.h"
+#include "multicastfanout.h"
+#include "clusterlink.h"
+#include "filetransfer.h"
+#include "configreloader.h"
+#include "memorybudget.h"
+#include "tlsacceptor.h"
+#include "ioshards.h"
+#include "userdirectory.h"
+#include "searchindex.h"
+#include "idempotencywindow.h"
+#include <QSet>
+#include <QMap>
+#include <QTimer>
+#include <list>
+
+class chatServer :  public QTcpServer
+{
+    Q_OBJECT
+
+public:
+    explicit chatServer(QObject *parent = nullptr);
+    ~chatServer();
+
+    // 添加检查用户名是否重复的方法
+    bool isUsernameTaken(const QString &username);
+    FilterPipeline *filterPipeline() const;
+    // 开始记录入站流量，供 ChatReplay 回放
+    bool startCapture(const QString &fileName);
+    void stopCapture();
+    // 同时监听本地套接字（Unix 域套接字 / Windows 命名管道）
+    void setLocalServerName(const QString &name);
+    bool listenLocal();
+    // 浏览器用的 WebSocket 端口，0 表示不监听；和 TCP 连接共用同一套分发和广播
+    void setWebSocketPort(quint16 port);
+    bool listenWebSocket();
+    MulticastFanout *multicast() const;
+    FileTransfer *fileTransfer() const;
+    // 聊天记录的全文检索，客户端发 {"type":"search"} 查询当前房间
+    SearchIndex *searchIndex() const;
+    // 运行指标快照。管理消息 {"action":"stats"} 收到完整的内容；登录后的客户端发 {"type":"stats"}
+    // 收到的去掉了慢连接名单和日志路径
+    QJsonObject stats() const;
+    // 进程级的资源占用，包含在 stats 里
+    QJsonObject processStats() const;
+    // 不停机重启：旧进程在 path 上等待新进程来接管所有连接
+    bool enableHandoff(const QString &path);
+    // 新进程：从旧进程接管监听套接字和所有连接
+    bool takeOver(const QString &path);
+    // 加入集群：通过 ChatRelay 和其他节点共享用户名和房间
+    void joinCluster(const QString &relayAddress,const QString &nodeId);
+    // 运行时参数：配置文件、SIGHUP 和管理消息都通过它修改
+    ConfigReloader *configReloader() const;
+    // 管理消息 {"type":"admin","token":...} 的口令，为空时不接受管理消息
+    void setAdminToken(const QString &token);
+    // 全局内存预算，日志窗口也往这里报告用量
+    MemoryBudget *memoryBudget();
+    // 设置了证书之后 TCP 连接都走 TLS
+    TlsAcceptor *tls() const;
+    // 连接的读写和广播分到几个 I/O 线程里，线程数为 0 时都在主线程
+    IoShards *ioShards() const;
+    // 在线用户和房间成员的目录
+    UserDirectory *directory() const;
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override;
+    QVector<ServerWorker*>m_clients;
+
+    void broadcast(const QJsonObject &message,ServerWorker *exclude);
+    // 房间内广播：分配房间序号，只编码一次
+    void broadcastToRoom(const QString &roomName,QJsonObject message,quint64 traceId = 0);
+
+private:
+    void addWorker(ServerWorker *worker);
+    void completeLogin(ServerWorker *worker,const QString &username,bool multicastCapable,const QString &clientId);
+    void sendLoginError(ServerWorker *worker,const QString &text);
+    bool isClaimPending(const QString &username) const;
+    // 连接断开或者交给新进程时，从所有还要回头找它的表里去掉
+    void forgetPendingRequests(ServerWorker *worker);
+    // 客户端消息带 cseq：按客户端编号的滑动窗口去重，已经处理完的重发再确认一次
+    bool acceptClientSeq(ServerWorker *sender,quint64 cseq);
+    // 去重窗口按用户名加客户端编号区分，登录成别人的名字用不到别人的窗口
+    QString clientWindowKey(ServerWorker *worker,const QString &username,const QString &clientId) const;
+    // 登录成功时给连接挂上它的去重窗口，断开时放回空闲链表
+    void attachClientWindow(const QString &clientId);
+    void detachClientWindow(const QString &clientId);
+    void finishClientSeq(ServerWorker *sender,quint64 cseq);
+    // 限流或者过滤队列满了，消息没有收下，客户端稍后重发这一条
+    void deferMessage(ServerWorker *sender,const QString &reason,quint64 cseq);
+    enum AckKind
+    {
+        Acked,          // 处理完了（包括重复的）
+        Retry,          // 没有收下，稍后原样重发
+        Stale           // 序号太旧，换一个新序号再发
+    };
+    void queueAck(ServerWorker *sender,quint64 cseq,AckKind kind);
+    // 本节点广播，同时转发给集群里有这个房间成员的其他节点
+    void postToRoom(const QString &roomName,const QJsonObject &message,quint64 traceId = 0);
+    void roomMembershipChanged(const QString &roomName,int count);
+    void joinRoom(ServerWorker *worker,const QString &roomName);
+    void leaveRoom(ServerWorker *worker);
+    void sendMulticastInvite(ChatRoom *room,ServerWorker *worker);
+    void resendFrames(ServerWorker *worker,const QJsonObject &docObj);
+    void handleAdmin(ServerWorker *sender,const QJsonObject &docObj);
+    // 上下线通知，按配置立即广播或者合并后广播
+    void announcePresence(const QString &event,const QString &user);
+    void shedConnections();
+    QByteArray saveHandoffState(QVector<qintptr> &descriptors,QVector<ServerWorker*> &workers);
+    bool restoreHandoffState(const QByteArray &state,const QVector<qintptr> &descriptors);
+
+    FilterPipeline *m_filters;
+    QLocalServer *m_localServer;
+    QString m_localServerName;
+    QTcpServer *m_webServer;
+    quint16 m_webSocketPort;
+    TrafficCapture *m_capture;
+    bool m_capturing;
+    quint32 m_nextConnectionId;
+    QHash<QString,ChatRoom*> m_rooms;
+    MulticastFanout *m_multicast;
+    QLocalServer *m_handoffServer;
+    ClusterLink *m_cluster;
+    FileTransfer *m_files;
+    SearchIndex *m_search;
+    // 下面几张表里的连接都活在 I/O 线程上，主线程只在它断开之前通过它的线程发消息；
+    // 断开时 forgetPendingRequests 把它从表里去掉，之后的结果和计时器都找不到它
+    // 还在后台线程里执行的查询
+    QHash<quint64,ServerWorker*> m_pendingSearches;
+    // 还没登录的连接和它的连接编号，超时计时器按编号核对，地址被新连接重用时不会误断
+    QHash<ServerWorker*,quint32> m_awaitingLogin;
+    quint64 m_nextSearchId;
+    // 已读回执合并后按固定间隔发给发送者
+    QTimer *m_receiptTimer;
+    // 定时探测每个连接的往返时延，已断开连接的样本并到 m_retiredRtt 里
+    QTimer *m_pingTimer;
+    RttStats m_retiredRtt;
+    ConfigReloader *m_config;
+    QString m_adminToken;
+    // 合并中的上下线通知，每个用户只保留最后的状态（true 表示在线）
+    QTimer *m_presenceTimer;
+    QMap<QString,bool> m_pendingPresence;
+    MemoryBudget m_memory;
+    TlsAcceptor *m_tls;
+    IoShards *m_shards;
+    // 在线用户和房间成员，广播时在主线程按 I/O 线程取出接收者
+    UserDirectory *m_directory;
+    QTimer *m_memoryTimer;
+    struct PendingLogin
+    {
+        ServerWorker *worker = nullptr;
+        QString userName;
+        QString clientId;
+        bool multicastCapable;
+    };
+    // 等待中继确认用户名的登录请求
+    QHash<quint64,PendingLogin> m_pendingLogins;
+    QSet<QString> m_remoteUsers;
+    // 每个客户端编号一个固定大小的去重窗口，断线重连后重发的消息还要靠它去重。
+    // 有连接在用的窗口不会被换出；没有连接的按断开先后排在 m_idleWindows 里，超过上限时丢掉最早的
+    struct ClientWindow
+    {
+        IdempotencyWindow window;
+        int connections = 0;
+        std::list<QString>::iterator idle;
+    };
+    QHash<QString,ClientWindow> m_clientWindows;
+    std::list<QString> m_idleWindows;
+    // 同一轮事件里处理完的和要客户端重发的序号合并成一帧，按连接合并：
+    // 同一个客户端编号重连时新旧两个连接可能同时在
+    struct PendingAck
+    {
+        QVector<quint64> acked;
+        QVector<quint64> retry;
+        QVector<quint64> stale;
+    };
+    QHash<ServerWorker*,PendingAck> m_pendingAcks;
+    QTimer *m_ackTimer;
+
+signals:
+    void logMessage(const QString& msg);
+    // 连接已经全部交给新进程，本进程可以退出
+    void handoffCompleted();
+
+public slots:
+    void stopServer();
+    void jsonReceived(ServerWorker *sender,const QJsonObject &docObj,quint64 traceId);
+    void userDisconnected(ServerWorker *sender);
+
+private slots:
+    void localConnection();
+    void webSocketConnection();
+    void multicastHeartbeat();
+    void flushReceipts();
+    void pingClients();
+    void flushPresence();
+    void applyConfig(quint64 version);
+    void checkMemory();
+    void tlsReady(QSslSocket *socket);
+    void handoffRequested();
+    void messageFiltered(ServerWorker *sender,const QJsonObject &message,quint64 traceId);
+    void messageRejected(ServerWorker *sender,const QString &reason,const QJsonObject &message);
+    void flushAcks();
+    void chunkReceived(ServerWorker *sender,const QByteArray &frame);
+    void fileReady(ServerWorker *uploader,const QJsonObject &announcement);
+    void searchFinished(quint64 requestId,const QJsonObject &result);
+    void claimResult(quint64 req,const QString &user,bool ok);
+    void claimLost(const QString &user);
+    void clusterLinkLost();
+    void remotePresence(const QString &event,const QString &user);
+    void remoteUsers(const QStringList &users);
+    void remoteMessage(const QString &roomName,const QJsonObject &message);
+};
+
+#endif // CHATSERVER_H
@@ -0,0 +1,160 @@
+#include "chattrace.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMutex>
+#include <QThread>
+#include <QVector>
+#include <algorithm>
+
+namespace ChatTrace
+{
+
+std::atomic<quint32> sampleEvery(0);
+
+// 每个线程最多缓存的事件数，满了以后丢弃新事件直到下次导出
+static const int MaxEventsPerThread = 200000;
+
+struct Event
+{
+    const char *name;
+    quint64 traceId;
+    qint64 beginNs;
+    qint64 endNs;
+    quint32 arg;
+};
+
+struct ThreadBuffer
+{
+    QMutex mutex;    // 只有导出时才会有竞争
+    QVector<Event> events;
+    quint64 threadId = 0;
+    QString threadName;
+};
+
+static std::atomic<quint64> frameCounter(0);
+static std::atomic<quint64> nextTraceId(0);
+static QMutex registryMutex;
+// 线程退出后缓冲区仍然保留到进程结束，导出时不会丢掉已经记录的事件
+static QVector<ThreadBuffer*> registry;
+
+static const QElapsedTimer &clock()
+{
+    static const QElapsedTimer timer = []{
+        QElapsedTimer t;
+        t.start();
+        return t;
+    }();
+    return timer;
+}
+
+static ThreadBuffer *threadBuffer()
+{
+    thread_local ThreadBuffer *buffer = nullptr;
+    if(!buffer){
+        buffer = new ThreadBuffer;
+        buffer->threadId = quint64(quintptr(QThread::currentThreadId()));
+        buffer->threadName = QThread::currentThread()->objectName();
+        buffer->events.reserve(1024);
+        QMutexLocker locker(&registryMutex);
+        registry.append(buffer);
+    }
+    return buffer;
+}
+
+void setSampleEvery(quint32 every)
+{
+    clock();
+    sampleEvery.store(every,std::memory_order_relaxed);
+}
+
+quint64 sample()
+{
+    const quint32 every = sampleEvery.load(std::memory_order_relaxed);
+    if(every == 0)
+        return 0;
+    if(frameCounter.fetch_add(1,std::memory_order_relaxed) % every != 0)
+        return 0;
+    return nextTraceId.fetch_add(1,std::memory_order_relaxed) + 1;
+}
+
+qint64 now()
+{
+    return clock().nsecsElapsed();
+}
+
+void complete(quint64 traceId, const char *name, qint64 beginNs, qint64 endNs, quint32 arg)
+{
+    ThreadBuffer *buffer = threadBuffer();
+    QMutexLocker locker(&buffer->mutex);
+    if(buffer->events.size() >= MaxEventsPerThread)
+        return;
+    buffer->events.append(Event{name,traceId,beginNs,endNs,arg});
+}
+
+static void appendEvent(QByteArray &out, const Event &event, quint64 pid, quint64 tid)
+{
+    out += "{\"name\":\"";
+    out += event.name;
+    out += "\",\"cat\":\"chat\",\"ph\":\"X\",\"ts\":";
+    out += QByteArray::number(event.beginNs / 1000.0,'f',3);
+    out += ",\"dur\":";
+    out += QByteArray::number(qMax<qint64>(0,event.endNs - event.beginNs) / 1000.0,'f',3);
+    out += ",\"pid\":";
+    out += QByteArray::number(pid);
+    out += ",\"tid\":";
+    out += QByteArray::number(tid);
+    out += ",\"args\":{\"trace\":";
+    out += QByteArray::number(event.traceId);
+    if(event.arg != 0){
+        out += ",\"conn\":";
+        out += QByteArray::number(event.arg);
+    }
+    out += "}}";
+}
+
+bool dump(const QString &fileName)
+{
+    QFile file(fileName);
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    QVector<ThreadBuffer*> buffers;
+    {
+        QMutexLocker locker(&registryMutex);
+        buffers = registry;
+    }
+    const quint64 pid = quint64(QCoreApplication::applicationPid());
+    QByteArray out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    bool first = true;
+    for(ThreadBuffer *buffer : std::as_const(buffers)){
+        QVector<Event> events;
+        {
+            QMutexLocker locker(&buffer->mutex);
+            events.swap(buffer->events);
+        }
+        if(!buffer->threadName.isEmpty()){
+            if(!first)
+                out += ",\n";
+            first = false;
+            out += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" + QByteArray::number(pid)
+                   + ",\"tid\":" + QByteArray::number(buffer->threadId)
+                   + ",\"args\":{\"name\":\"" + buffer->threadName.toUtf8().replace('"','\'') + "\"}}";
+        }
+        for(const Event &event : std::as_const(events)){
+            if(!first)
+                out += ",\n";
+            first = false;
+            appendEvent(out,event,pid,buffer->threadId);
+        }
+        if(out.size() > 1024 * 1024){
+            file.write(out);
+            out.clear();
+        }
+    }
+    out += "\n]}\n";
+    file.write(out);
+    return file.error() == QFileDevice::NoError;
+}
+
+}
@@ -0,0 +1,30 @@
+#ifndef CHATTRACE_H
+#define CHATTRACE_H
+
+#include <QString>
+#include <atomic>
+
+// 按消息采样的端到端追踪，导出为 Chrome / Perfetto 能打开的 JSON
+// 关闭时入站路径上只有 isEnabled() 这一次判断；事件写进各线程自己的缓冲区，导出时才汇总
+namespace ChatTrace
+{
+    extern std::atomic<quint32> sampleEvery;
+
+    inline bool isEnabled()
+    {
+        return sampleEvery.load(std::memory_order_relaxed) != 0;
+    }
+
+    // 0 关闭，N 表示每 N 个入站帧采样一个
+    void setSampleEvery(quint32 every);
+    // 给入站帧分配追踪 id，没被采样时返回 0
+    quint64 sample();
+    // 单调时钟，纳秒
+    qint64 now();
+    // 一个阶段的开始和结束，arg 一般是连接 id
+    void complete(quint64 traceId,const char *name,qint64 beginNs,qint64 endNs,quint32 arg = 0);
+    // 导出所有线程的事件并清空缓冲区
+    bool dump(const QString &fileName);
+}
+
+#endif // CHATTRACE_H
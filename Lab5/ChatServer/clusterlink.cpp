@@ -0,0 +1,186 @@
+#include "clusterlink.h"
+#include <QDataStream>
+#include <QJsonDocument>
+#include <QJsonArray>
+
+ClusterLink::ClusterLink(QObject *parent)
+    : QObject{parent}, m_port(0), m_nextReq(0)
+{
+    m_socket = new QTcpSocket(this);
+    m_reconnectTimer = new QTimer(this);
+    m_reconnectTimer->setInterval(2000);
+    m_reconnectTimer->setSingleShot(true);
+    connect(m_socket,&QTcpSocket::connected,this,&ClusterLink::onConnected);
+    connect(m_socket,&QTcpSocket::disconnected,this,&ClusterLink::onDisconnected);
+    connect(m_socket,&QTcpSocket::errorOccurred,this,[this](){
+        if(m_socket->state() != QAbstractSocket::ConnectedState)
+            m_reconnectTimer->start();
+    });
+    connect(m_socket,&QTcpSocket::readyRead,this,&ClusterLink::onReadyRead);
+    connect(m_reconnectTimer,&QTimer::timeout,this,&ClusterLink::reconnect);
+}
+
+void ClusterLink::connectToRelay(const QString &address, const QString &nodeId)
+{
+    const int colon = address.lastIndexOf(':');
+    m_host = colon > 0 ? address.left(colon) : QStringLiteral("127.0.0.1");
+    m_port = colon >= 0 ? address.mid(colon + 1).toUShort() : address.toUShort();
+    m_nodeId = nodeId;
+    reconnect();
+}
+
+bool ClusterLink::isConnected() const
+{
+    return m_socket->state() == QAbstractSocket::ConnectedState;
+}
+
+QString ClusterLink::nodeId() const
+{
+    return m_nodeId;
+}
+
+quint64 ClusterLink::claim(const QString &user)
+{
+    QJsonObject message;
+    message["type"] = "claim";
+    message["user"] = user;
+    message["req"] = QJsonValue(qint64(++m_nextReq));
+    send(message);
+    return m_nextReq;
+}
+
+void ClusterLink::addLocalUser(const QString &user)
+{
+    m_localUsers.insert(user);
+}
+
+void ClusterLink::release(const QString &user)
+{
+    m_localUsers.remove(user);
+    QJsonObject message;
+    message["type"] = "release";
+    message["user"] = user;
+    send(message);
+}
+
+void ClusterLink::publishPresence(const QString &event, const QString &user)
+{
+    QJsonObject message;
+    message["type"] = "presence";
+    message["event"] = event;
+    message["user"] = user;
+    send(message);
+}
+
+void ClusterLink::updateRoom(const QString &room, int count)
+{
+    if(count > 0)
+        m_rooms.insert(room,count);
+    else
+        m_rooms.remove(room);
+    QJsonObject message;
+    message["type"] = "room";
+    message["room"] = room;
+    message["count"] = count;
+    send(message);
+}
+
+void ClusterLink::relay(const QString &room, const QJsonObject &message)
+{
+    // 没有其他节点在这个房间时中继直接丢弃，这里不必判断
+    QJsonObject relayMessage;
+    relayMessage["type"] = "relay";
+    relayMessage["room"] = room;
+    relayMessage["message"] = message;
+    send(relayMessage);
+}
+
+void ClusterLink::send(const QJsonObject &message)
+{
+    if(!isConnected())
+        return;
+    QDataStream socketStream(m_socket);
+    socketStream.setVersion(QDataStream::Qt_5_12);
+    socketStream << QJsonDocument(message).toJson(QJsonDocument::Compact);
+}
+
+void ClusterLink::onConnected()
+{
+    m_socket->setSocketOption(QAbstractSocket::LowDelayOption,1);
+    QJsonObject hello;
+    hello["type"] = "hello";
+    hello["node"] = m_nodeId;
+    send(hello);
+    // 重连后把本节点的用户和房间重新登记一遍，冲突的用户名以先登记的节点为准；
+    // 中继断开时已经通知其他节点这些用户下线了，登记之后再通知一次上线，登记失败的上线通知中继会忽略
+    for(const QString &user : std::as_const(m_localUsers)){
+        QJsonObject message;
+        message["type"] = "claim";
+        message["user"] = user;
+        message["req"] = 0;
+        send(message);
+        publishPresence("newuser",user);
+    }
+    for(auto it = m_rooms.constBegin(); it != m_rooms.constEnd(); ++it){
+        QJsonObject message;
+        message["type"] = "room";
+        message["room"] = it.key();
+        message["count"] = it.value();
+        send(message);
+    }
+    emit logMessage(QString("已连接集群中继 %1:%2").arg(m_host).arg(m_port));
+}
+
+void ClusterLink::onDisconnected()
+{
+    emit logMessage("集群中继连接断开，稍后重连");
+    m_reconnectTimer->start();
+    emit linkLost();
+}
+
+void ClusterLink::reconnect()
+{
+    if(m_socket->state() != QAbstractSocket::UnconnectedState)
+        m_socket->abort();
+    // abort 触发的 disconnected 会重新启动定时器
+    m_reconnectTimer->stop();
+    m_socket->connectToHost(m_host,m_port);
+}
+
+void ClusterLink::onReadyRead()
+{
+    QByteArray jsonData;
+    QDataStream socketStream(m_socket);
+    socketStream.setVersion(QDataStream::Qt_5_12);
+    for(;;){
+        socketStream.startTransaction();
+        socketStream >> jsonData;
+        if(!socketStream.commitTransaction())
+            break;
+        const QJsonDocument jsonDoc = QJsonDocument::fromJson(jsonData);
+        if(!jsonDoc.isObject())
+            continue;
+        const QJsonObject message = jsonDoc.object();
+        const QString type = message.value("type").toString();
+        if(type == "relay"){
+            emit remoteMessage(message.value("room").toString(),message.value("message").toObject());
+        }else if(type == "presence"){
+            emit remotePresence(message.value("event").toString(),message.value("user").toString());
+        }else if(type == "claimResult"){
+            const quint64 req = quint64(message.value("req").toInteger());
+            const QString user = message.value("user").toString();
+            const bool ok = message.value("ok").toBool();
+            if(req != 0){
+                emit claimResult(req,user,ok);
+            }else if(!ok && m_localUsers.remove(user)){
+                emit logMessage(QString("用户名%1已在其他节点登录").arg(user));
+                emit claimLost(user);
+            }
+        }else if(type == "users"){
+            QStringList users;
+            for(const QJsonValue &user : message.value("users").toArray())
+                users.append(user.toString());
+            emit remoteUsers(users);
+        }
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef CLUSTERLINK_H
+#define CLUSTERLINK_H
+
+#include <QObject>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QJsonObject>
+#include <QHash>
+#include <QSet>
+
+// 连到 ChatRelay 的集群链路：用户名全局登记、跨节点上下线和房间消息转发
+// 链路断开时本节点照常服务自己的连接，每两秒重连一次
+class ClusterLink : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit ClusterLink(QObject *parent = nullptr);
+
+    // 地址格式 host:port
+    void connectToRelay(const QString &address,const QString &nodeId);
+    bool isConnected() const;
+    QString nodeId() const;
+
+    // 异步登记用户名，结果通过 claimResult 返回
+    quint64 claim(const QString &user);
+    // 本节点登录成功的用户，链路断开期间登录的也记下，重连后向中继重新登记
+    void addLocalUser(const QString &user);
+    void release(const QString &user);
+    void publishPresence(const QString &event,const QString &user);
+    // 本节点在这个房间的成员数，为 0 时中继不再把房间消息转发过来
+    void updateRoom(const QString &room,int count);
+    void relay(const QString &room,const QJsonObject &message);
+
+signals:
+    void logMessage(const QString &msg);
+    void claimResult(quint64 req,const QString &user,bool ok);
+    // 重连后重新登记时名字已经被其他节点占用，本节点的这个用户要下线
+    void claimLost(const QString &user);
+    // 链路断开：等待中的登记不会再有结果，其他节点的用户也看不到了
+    void linkLost();
+    void remotePresence(const QString &event,const QString &user);
+    void remoteUsers(const QStringList &users);
+    void remoteMessage(const QString &room,const QJsonObject &message);
+
+private slots:
+    void onConnected();
+    void onDisconnected();
+    void onReadyRead();
+    void reconnect();
+
+private:
+    void send(const QJsonObject &message);
+
+    QTcpSocket *m_socket;
+    QTimer *m_reconnectTimer;
+    QString m_host;
+    quint16 m_port;
+    QString m_nodeId;
+    quint64 m_nextReq;
+    // 重连后要重新登记的状态
+    QSet<QString> m_localUsers;
+    QHash<QString,int> m_rooms;
+};
+
+#endif // CLUSTERLINK_H
@@ -0,0 +1,125 @@
+#include "configreloader.h"
+#include <QFile>
+#include <QJsonDocument>
+#include <QSocketNotifier>
+#ifdef Q_OS_UNIX
+#include <csignal>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#ifdef Q_OS_UNIX
+// 信号处理函数里只能往管道里写一个字节，真正的重新加载在事件循环里做
+static int hangupPipe[2] = {-1,-1};
+
+static void hangupHandler(int)
+{
+    const char byte = 1;
+    const ssize_t written = ::write(hangupPipe[0],&byte,sizeof(byte));
+    Q_UNUSED(written);
+}
+#endif
+
+ConfigReloader::ConfigReloader(QObject *parent)
+    : QObject{parent}, m_hangupNotifier(nullptr)
+{
+}
+
+ConfigReloader::~ConfigReloader()
+{
+#ifdef Q_OS_UNIX
+    if(m_hangupNotifier){
+        ::signal(SIGHUP,SIG_DFL);
+        ::close(hangupPipe[0]);
+        ::close(hangupPipe[1]);
+        hangupPipe[0] = hangupPipe[1] = -1;
+    }
+#endif
+}
+
+void ConfigReloader::setFileName(const QString &fileName)
+{
+    m_fileName = fileName;
+}
+
+QString ConfigReloader::fileName() const
+{
+    return m_fileName;
+}
+
+bool ConfigReloader::reload(QString *error)
+{
+    if(m_fileName.isEmpty()){
+        if(error)
+            *error = "没有指定配置文件";
+        return false;
+    }
+    QFile file(m_fileName);
+    if(!file.open(QIODevice::ReadOnly)){
+        if(error)
+            *error = QString("无法读取配置文件 %1").arg(m_fileName);
+        return false;
+    }
+    QJsonParseError parseError;
+    const QJsonDocument jsonDoc = QJsonDocument::fromJson(file.readAll(),&parseError);
+    if(parseError.error != QJsonParseError::NoError || !jsonDoc.isObject()){
+        if(error)
+            *error = QString("配置文件格式错误：%1").arg(parseError.errorString());
+        return false;
+    }
+    ServerConfig config;
+    if(!ServerConfig::fromJson(jsonDoc.object(),ServerConfig(),config,error))
+        return false;
+    const quint64 version = ServerConfig::publish(config);
+    emit logMessage(QString("已加载配置文件 %1，版本 %2").arg(m_fileName).arg(version));
+    emit configChanged(version);
+    return true;
+}
+
+bool ConfigReloader::apply(const QJsonObject &changes, QString *error)
+{
+    ServerConfig config;
+    if(!ServerConfig::fromJson(changes,*ServerConfig::current(),config,error))
+        return false;
+    const quint64 version = ServerConfig::publish(config);
+    emit logMessage(QString("配置已修改，版本 %1").arg(version));
+    emit configChanged(version);
+    return true;
+}
+
+bool ConfigReloader::watchHangup()
+{
+#ifdef Q_OS_UNIX
+    if(m_hangupNotifier)
+        return true;
+    if(::socketpair(AF_UNIX,SOCK_STREAM,0,hangupPipe) != 0)
+        return false;
+    struct sigaction action = {};
+    action.sa_handler = hangupHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    if(::sigaction(SIGHUP,&action,nullptr) != 0){
+        ::close(hangupPipe[0]);
+        ::close(hangupPipe[1]);
+        hangupPipe[0] = hangupPipe[1] = -1;
+        return false;
+    }
+    m_hangupNotifier = new QSocketNotifier(hangupPipe[1],QSocketNotifier::Read,this);
+    connect(m_hangupNotifier,&QSocketNotifier::activated,this,&ConfigReloader::hangupReceived);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void ConfigReloader::hangupReceived()
+{
+#ifdef Q_OS_UNIX
+    char byte;
+    const ssize_t received = ::read(hangupPipe[1],&byte,sizeof(byte));
+    Q_UNUSED(received);
+#endif
+    QString error;
+    if(!reload(&error))
+        emit logMessage(QString("重新加载配置失败，继续使用版本 %1：%2").arg(ServerConfig::currentVersion()).arg(error));
+}
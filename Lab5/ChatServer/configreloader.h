@@ -0,0 +1,40 @@
+#ifndef CONFIGRELOADER_H
+#define CONFIGRELOADER_H
+
+#include <QObject>
+#include <QJsonObject>
+#include "serverconfig.h"
+
+class QSocketNotifier;
+
+// 从 JSON 文件加载运行时参数；收到 SIGHUP 或管理消息时重新加载，连接不断开
+class ConfigReloader : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit ConfigReloader(QObject *parent = nullptr);
+    ~ConfigReloader();
+
+    void setFileName(const QString &fileName);
+    QString fileName() const;
+    // 重新读文件，文件里没有的字段取默认值
+    bool reload(QString *error = nullptr);
+    // 在当前快照上修改部分字段
+    bool apply(const QJsonObject &changes,QString *error = nullptr);
+    // 收到 SIGHUP 时重新加载（只在 Unix 上有效）
+    bool watchHangup();
+
+signals:
+    void configChanged(quint64 version);
+    void logMessage(const QString &msg);
+
+private slots:
+    void hangupReceived();
+
+private:
+    QString m_fileName;
+    QSocketNotifier *m_hangupNotifier;
+};
+
+#endif // CONFIGRELOADER_H
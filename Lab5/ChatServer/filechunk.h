@@ -0,0 +1,42 @@
+#ifndef FILECHUNK_H
+#define FILECHUNK_H
+
+#include <QByteArray>
+#include <QtEndian>
+
+// 文件数据块帧，和 JSON 帧走同一条连接、同样的长度前缀
+// 内容以 0x01 开头（JSON 帧总是以 '{' 开头），后面是文件 id(4字节) + 偏移(8字节) + 数据，整数为大端
+namespace FileChunk
+{
+    const char Marker = 0x01;
+    const int HeaderSize = 13;
+    const int ChunkSize = 32 * 1024;
+    // 上传时允许同时在途的块数
+    const int UploadWindow = 8;
+
+    inline bool isChunk(const QByteArray &frame)
+    {
+        return !frame.isEmpty() && frame.at(0) == Marker;
+    }
+
+    inline QByteArray encode(quint32 fileId,quint64 offset,const char *data,qsizetype size)
+    {
+        QByteArray frame(HeaderSize + size,Qt::Uninitialized);
+        frame[0] = Marker;
+        qToBigEndian<quint32>(fileId,frame.data() + 1);
+        qToBigEndian<quint64>(offset,frame.data() + 5);
+        memcpy(frame.data() + HeaderSize,data,size_t(size));
+        return frame;
+    }
+
+    inline bool decode(const QByteArray &frame,quint32 &fileId,quint64 &offset)
+    {
+        if(frame.size() < HeaderSize || frame.size() > HeaderSize + ChunkSize || !isChunk(frame))
+            return false;
+        fileId = qFromBigEndian<quint32>(frame.constData() + 1);
+        offset = qFromBigEndian<quint64>(frame.constData() + 5);
+        return true;
+    }
+}
+
+#endif // FILECHUNK_H
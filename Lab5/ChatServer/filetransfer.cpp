@@ -0,0 +1,364 @@
+#include "filetransfer.h"
+#include "filechunk.h"
+#include "serverworker.h"
+#include <QDir>
+#include <QFileInfo>
+#include <QJsonDocument>
+
+// 每个连接同时进行的上传数和排队的下载数
+static const int MaxUploadsPerWorker = 4;
+static const int MaxQueuedDownloads = 16;
+
+FileTransfer::FileTransfer(QObject *parent)
+    : QObject{parent}
+    , m_tempDir(nullptr)
+    , m_maxFileSize(100 * 1024 * 1024)
+    , m_maxStoreSize(qint64(2) * 1024 * 1024 * 1024)
+    , m_storedBytes(0)
+    , m_nextFileId(0)
+    , m_paused(false)
+{
+}
+
+FileTransfer::~FileTransfer()
+{
+    for(auto &uploads : m_uploads){
+        for(Upload &upload : uploads){
+            upload.file->remove();
+            delete upload.file;
+        }
+    }
+    for(auto &downloads : m_downloads){
+        for(Download &download : downloads)
+            delete download.file;
+    }
+    delete m_tempDir;
+}
+
+bool FileTransfer::setDirectory(const QString &path)
+{
+    if(!QDir().mkpath(path))
+        return false;
+    m_directory = path;
+    return true;
+}
+
+void FileTransfer::setMaxFileSize(qint64 bytes)
+{
+    m_maxFileSize = bytes;
+}
+
+void FileTransfer::setMaxStoreSize(qint64 bytes)
+{
+    m_maxStoreSize = bytes;
+}
+
+QString FileTransfer::pathFor(quint32 fileId) const
+{
+    return QDir(m_directory).filePath(QString("file-%1.part").arg(fileId));
+}
+
+void FileTransfer::sendError(ServerWorker *worker, quint32 fileId, const QString &text, ServerWorker::Lane lane)
+{
+    QJsonObject errorMessage;
+    errorMessage["type"] = "fileError";
+    errorMessage["file"] = QJsonValue(qint64(fileId));
+    errorMessage["text"] = text;
+    worker->sendJson(errorMessage,lane);
+}
+
+void FileTransfer::offer(ServerWorker *worker, const QJsonObject &docObj)
+{
+    const QString name = QFileInfo(docObj.value("name").toString().trimmed()).fileName().left(255);
+    const qint64 size = docObj.value("size").toInteger(-1);
+    QString error;
+    if(m_paused)
+        error = "服务器繁忙，请稍后再传";
+    else if(name.isEmpty() || size < 0)
+        error = "文件信息不完整";
+    else if(size > m_maxFileSize)
+        error = QString("文件超过%1MB上限").arg(m_maxFileSize / (1024 * 1024));
+    else if(m_uploads.value(worker).size() >= MaxUploadsPerWorker)
+        error = "同时上传的文件太多";
+
+    if(error.isEmpty() && m_directory.isEmpty()){
+        m_tempDir = new QTemporaryDir;
+        if(m_tempDir->isValid())
+            m_directory = m_tempDir->path();
+        else
+            error = "服务器无法保存文件";
+    }
+
+    const quint32 fileId = ++m_nextFileId;
+    QFile *file = nullptr;
+    if(error.isEmpty()){
+        file = new QFile(pathFor(fileId));
+        if(!file->open(QIODevice::WriteOnly | QIODevice::Truncate)){
+            delete file;
+            error = "服务器无法保存文件";
+        }
+    }
+    if(!error.isEmpty()){
+        QJsonObject errorMessage;
+        errorMessage["type"] = "fileError";
+        errorMessage["id"] = docObj.value("id");
+        errorMessage["text"] = error;
+        worker->sendJson(errorMessage);
+        return;
+    }
+
+    Upload upload;
+    upload.file = file;
+    upload.name = name;
+    upload.size = size;
+    upload.clientId = docObj.value("id");
+    m_uploads[worker].insert(fileId,upload);
+
+    QJsonObject readyMessage;
+    readyMessage["type"] = "fileUploadReady";
+    readyMessage["id"] = upload.clientId;
+    readyMessage["file"] = QJsonValue(qint64(fileId));
+    readyMessage["chunk"] = FileChunk::ChunkSize;
+    readyMessage["window"] = FileChunk::UploadWindow;
+    worker->sendJson(readyMessage);
+    emit logMessage(QString("%1 开始上传 %2 (%3 字节)").arg(worker->userName(),name).arg(size));
+    if(size == 0)
+        finishUpload(worker,fileId);
+}
+
+void FileTransfer::receiveChunk(ServerWorker *worker, const QByteArray &frame)
+{
+    quint32 fileId;
+    quint64 offset;
+    if(!FileChunk::decode(frame,fileId,offset))
+        return;
+    auto uploads = m_uploads.find(worker);
+    if(uploads == m_uploads.end() || !uploads->contains(fileId))
+        return;
+    Upload &upload = (*uploads)[fileId];
+    const qint64 length = frame.size() - FileChunk::HeaderSize;
+    // 块必须按顺序到达，不能超过声明的大小
+    if(qint64(offset) != upload.received || upload.received + length > upload.size){
+        abortUpload(worker,fileId,"文件数据顺序错误");
+        return;
+    }
+    if(upload.file->write(frame.constData() + FileChunk::HeaderSize,length) != length){
+        abortUpload(worker,fileId,"服务器写文件失败");
+        return;
+    }
+    upload.received += length;
+
+    // 确认不经过 sendJson，免得每一块都写一行日志；走控制通道，不被下载的数据挡住
+    QJsonObject ackMessage;
+    ackMessage["type"] = "fileAck";
+    ackMessage["file"] = QJsonValue(qint64(fileId));
+    ackMessage["offset"] = QJsonValue(upload.received);
+    worker->queueFrame(ServerWorker::ControlLane,QJsonDocument(ackMessage).toJson(QJsonDocument::Compact));
+    if(upload.received == upload.size)
+        finishUpload(worker,fileId);
+}
+
+void FileTransfer::abortUpload(ServerWorker *worker, quint32 fileId, const QString &text)
+{
+    auto uploads = m_uploads.find(worker);
+    if(uploads == m_uploads.end())
+        return;
+    Upload upload = uploads->take(fileId);
+    if(uploads->isEmpty())
+        m_uploads.erase(uploads);
+    if(!upload.file)
+        return;
+    upload.file->remove();
+    delete upload.file;
+    sendError(worker,fileId,text);
+}
+
+void FileTransfer::finishUpload(ServerWorker *worker, quint32 fileId)
+{
+    auto uploads = m_uploads.find(worker);
+    Upload upload = uploads->take(fileId);
+    if(uploads->isEmpty())
+        m_uploads.erase(uploads);
+    upload.file->close();
+    delete upload.file;
+
+    StoredFile stored;
+    stored.name = upload.name;
+    stored.size = upload.size;
+    stored.path = pathFor(fileId);
+    stored.owner = worker->userName();
+    m_files.insert(fileId,stored);
+    m_order.append(fileId);
+    m_storedBytes += stored.size;
+    // 公告发出去之后要能下载到，腾地方只删别的文件
+    evict(fileId);
+
+    QJsonObject announcement;
+    announcement["type"] = "file";
+    announcement["file"] = QJsonValue(qint64(fileId));
+    announcement["name"] = stored.name;
+    announcement["size"] = QJsonValue(stored.size);
+    announcement["sender"] = stored.owner;
+    emit logMessage(QString("%1 上传完成 %2").arg(stored.owner,stored.name));
+    emit fileReady(worker,announcement);
+}
+
+void FileTransfer::evict(quint32 keep)
+{
+    // 正在被下载的文件先留着
+    for(int i = 0; i < m_order.size() && m_storedBytes > m_maxStoreSize;){
+        auto it = m_files.find(m_order.at(i));
+        if(it->readers > 0 || it.key() == keep){
+            i++;
+            continue;
+        }
+        QFile::remove(it->path);
+        m_storedBytes -= it->size;
+        m_files.erase(it);
+        m_order.removeAt(i);
+    }
+}
+
+void FileTransfer::request(ServerWorker *worker, const QJsonObject &docObj)
+{
+    const quint32 fileId = quint32(docObj.value("file").toInteger());
+    if(m_paused){
+        sendError(worker,fileId,"服务器繁忙，请稍后再下载");
+        return;
+    }
+    auto stored = m_files.find(fileId);
+    if(stored == m_files.end()){
+        sendError(worker,fileId,"文件不存在或已过期");
+        return;
+    }
+    auto downloads = m_downloads.find(worker);
+    if(downloads != m_downloads.end() && downloads->size() >= MaxQueuedDownloads){
+        sendError(worker,fileId,"排队下载的文件太多");
+        return;
+    }
+    QFile *file = new QFile(stored->path);
+    if(!file->open(QIODevice::ReadOnly)){
+        delete file;
+        sendError(worker,fileId,"服务器读文件失败");
+        return;
+    }
+    stored->readers++;
+
+    QJsonObject beginMessage;
+    beginMessage["type"] = "fileBegin";
+    beginMessage["file"] = QJsonValue(qint64(fileId));
+    beginMessage["name"] = stored->name;
+    beginMessage["size"] = QJsonValue(stored->size);
+    worker->sendJson(beginMessage);
+
+    Download download;
+    download.fileId = fileId;
+    download.file = file;
+    if(downloads == m_downloads.end()){
+        downloads = m_downloads.insert(worker,QQueue<Download>());
+        connect(worker,&ServerWorker::bulkWritable,this,std::bind(&FileTransfer::pump,this,worker));
+    }
+    downloads->enqueue(download);
+    if(downloads->size() == 1)
+        pump(worker);
+}
+
+void FileTransfer::pump(ServerWorker *worker)
+{
+    auto downloads = m_downloads.find(worker);
+    if(downloads == m_downloads.end())
+        return;
+    QByteArray buffer(FileChunk::ChunkSize,Qt::Uninitialized);
+    while(!downloads->isEmpty()){
+        // 大块通道排满时先停下，等通道写下去再读下一块
+        if(!worker->isBulkWritable()){
+            worker->waitForBulkWritable();
+            return;
+        }
+        Download &download = downloads->head();
+        const qint64 length = download.file->read(buffer.data(),buffer.size());
+        if(length > 0){
+            worker->queueFrame(ServerWorker::BulkLane,FileChunk::encode(download.fileId,quint64(download.sent),buffer.constData(),length));
+            download.sent += length;
+        }
+        if(length <= 0 || download.file->atEnd())
+            finishDownload(worker);
+    }
+    m_downloads.erase(downloads);
+    disconnect(worker,&ServerWorker::bulkWritable,this,nullptr);
+}
+
+void FileTransfer::finishDownload(ServerWorker *worker)
+{
+    Download download = m_downloads[worker].dequeue();
+    const bool complete = download.file->error() == QFileDevice::NoError;
+    delete download.file;
+    auto stored = m_files.find(download.fileId);
+    if(stored != m_files.end())
+        stored->readers--;
+    evict();
+
+    // 结束和出错的消息要排在这个文件的数据块后面
+    if(!complete){
+        sendError(worker,download.fileId,"服务器读文件失败",ServerWorker::BulkLane);
+        return;
+    }
+    QJsonObject endMessage;
+    endMessage["type"] = "fileEnd";
+    endMessage["file"] = QJsonValue(qint64(download.fileId));
+    endMessage["size"] = QJsonValue(download.sent);
+    worker->sendJson(endMessage,ServerWorker::BulkLane);
+}
+
+void FileTransfer::forgetWorker(ServerWorker *worker)
+{
+    const QList<quint32> uploads = m_uploads.value(worker).keys();
+    for(quint32 fileId : uploads){
+        Upload upload = m_uploads[worker].take(fileId);
+        upload.file->remove();
+        delete upload.file;
+    }
+    m_uploads.remove(worker);
+
+    auto downloads = m_downloads.find(worker);
+    if(downloads == m_downloads.end())
+        return;
+    for(Download &download : *downloads){
+        delete download.file;
+        auto stored = m_files.find(download.fileId);
+        if(stored != m_files.end())
+            stored->readers--;
+    }
+    m_downloads.erase(downloads);
+    disconnect(worker,&ServerWorker::bulkWritable,this,nullptr);
+    evict();
+}
+
+void FileTransfer::setPaused(bool paused)
+{
+    m_paused = paused;
+}
+
+bool FileTransfer::isPaused() const
+{
+    return m_paused;
+}
+
+void FileTransfer::cancelDownloads(const QString &reason)
+{
+    for(auto it = m_downloads.begin(); it != m_downloads.end(); ++it){
+        ServerWorker *worker = it.key();
+        // 先丢掉排队的数据块，出错消息走控制通道马上发出去
+        worker->dropFileChunks();
+        for(Download &download : *it){
+            delete download.file;
+            auto stored = m_files.find(download.fileId);
+            if(stored != m_files.end())
+                stored->readers--;
+            sendError(worker,download.fileId,reason);
+        }
+        disconnect(worker,&ServerWorker::bulkWritable,this,nullptr);
+    }
+    m_downloads.clear();
+    evict();
+}
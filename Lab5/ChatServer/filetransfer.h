@@ -0,0 +1,94 @@
+#ifndef FILETRANSFER_H
+#define FILETRANSFER_H
+
+#include <QObject>
+#include <QJsonObject>
+#include <QJsonValue>
+#include <QHash>
+#include <QQueue>
+#include <QFile>
+#include <QTemporaryDir>
+#include "serverworker.h"
+
+// 文件传输：上传按块写盘，完成后只存一份，下载按需从磁盘读块发送
+// 上传靠窗口限流，下载只在连接的发送缓冲区空下来时才读下一块，聊天消息不会排在大文件后面
+class FileTransfer : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit FileTransfer(QObject *parent = nullptr);
+    ~FileTransfer();
+
+    // 文件保存目录，默认用临时目录，退出时删除
+    bool setDirectory(const QString &path);
+    void setMaxFileSize(qint64 bytes);
+    // 所有文件总大小上限，超过时删除最早的文件
+    void setMaxStoreSize(qint64 bytes);
+
+    void offer(ServerWorker *worker,const QJsonObject &docObj);
+    void receiveChunk(ServerWorker *worker,const QByteArray &frame);
+    void request(ServerWorker *worker,const QJsonObject &docObj);
+    void forgetWorker(ServerWorker *worker);
+    // 内存紧张时暂停：不接受新的上传和下载
+    void setPaused(bool paused);
+    bool isPaused() const;
+    // 取消所有正在进行的下载，连同大块通道里排队的数据块一起丢掉
+    void cancelDownloads(const QString &reason);
+
+signals:
+    void logMessage(const QString &msg);
+    // 上传完成，公告发到上传者所在的房间
+    void fileReady(ServerWorker *uploader,const QJsonObject &announcement);
+
+private slots:
+    void pump(ServerWorker *worker);
+
+private:
+    struct StoredFile
+    {
+        QString name;
+        qint64 size = 0;
+        QString path;
+        QString owner;
+        int readers = 0;
+    };
+
+    struct Upload
+    {
+        QFile *file = nullptr;
+        QString name;
+        qint64 size = 0;
+        qint64 received = 0;
+        QJsonValue clientId;
+    };
+
+    struct Download
+    {
+        quint32 fileId = 0;
+        QFile *file = nullptr;
+        qint64 sent = 0;
+    };
+
+    QString pathFor(quint32 fileId) const;
+    void sendError(ServerWorker *worker,quint32 fileId,const QString &text,ServerWorker::Lane lane = ServerWorker::ControlLane);
+    void abortUpload(ServerWorker *worker,quint32 fileId,const QString &text);
+    void finishUpload(ServerWorker *worker,quint32 fileId);
+    void finishDownload(ServerWorker *worker);
+    // keep 是刚上传完、公告还没发出去的文件，这一次不删
+    void evict(quint32 keep = 0);
+
+    QTemporaryDir *m_tempDir;
+    QString m_directory;
+    qint64 m_maxFileSize;
+    qint64 m_maxStoreSize;
+    qint64 m_storedBytes;
+    quint32 m_nextFileId;
+    bool m_paused;
+    QHash<quint32,StoredFile> m_files;
+    QList<quint32> m_order;
+    QHash<ServerWorker*,QHash<quint32,Upload>> m_uploads;
+    QHash<ServerWorker*,QQueue<Download>> m_downloads;
+};
+
+#endif // FILETRANSFER_H
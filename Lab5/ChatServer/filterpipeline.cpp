@@ -0,0 +1,206 @@
+#include "filterpipeline.h"
+#include "serverworker.h"
+#include "chattrace.h"
+#include <QThread>
+#include <algorithm>
+
+static const int LatencySampleCount = 1024;
+
+FilterPipeline::FilterPipeline(QObject *parent)
+    : QObject{parent}
+    , m_maxPending(10000)
+    , m_pending(0)
+    , m_generation(0)
+    , m_drainScheduled(false)
+{
+    m_pool.setMaxThreadCount(qBound(1,QThread::idealThreadCount(),4));
+    m_clock.start();
+}
+
+FilterPipeline::~FilterPipeline()
+{
+    m_pool.waitForDone();
+    Job *job = nullptr;
+    while(m_results.pop(job))
+        delete job;
+    for(SenderState &state : m_senders)
+        qDeleteAll(state.waiting);
+}
+
+void FilterPipeline::addFilter(MessageFilter *filter)
+{
+    if(filter)
+        m_filters.append(QSharedPointer<MessageFilter>(filter));
+}
+
+void FilterPipeline::clearFilters()
+{
+    m_filters.clear();
+}
+
+bool FilterPipeline::isEmpty() const
+{
+    return m_filters.isEmpty();
+}
+
+bool FilterPipeline::isFull() const
+{
+    return m_pending >= m_maxPending;
+}
+
+void FilterPipeline::setMaxThreads(int count)
+{
+    m_pool.setMaxThreadCount(qMax(1,count));
+}
+
+void FilterPipeline::setMaxPending(int count)
+{
+    m_maxPending = qMax(1,count);
+}
+
+void FilterPipeline::submit(ServerWorker *sender, const QJsonObject &message, quint64 traceId)
+{
+    if(isFull()){
+        emit messageRejected(sender,"服务器繁忙，请稍后再发",message);
+        return;
+    }
+
+    Job *job = new Job;
+    job->sender = sender;
+    job->key = sender;
+    job->senderName = sender->userName();
+    job->message = message;
+    job->filters = m_filters;
+    job->submittedNs = m_clock.nsecsElapsed();
+    if(traceId){
+        job->traceId = traceId;
+        job->traceSubmittedNs = ChatTrace::now();
+    }
+    m_pending++;
+
+    auto it = m_senders.find(sender);
+    if(it == m_senders.end()){
+        it = m_senders.insert(sender,SenderState());
+        it->generation = ++m_generation;
+    }
+    job->generation = it->generation;
+    if(it->busy){
+        it->waiting.enqueue(job);
+        return;
+    }
+    start(job);
+}
+
+void FilterPipeline::forgetSender(ServerWorker *sender)
+{
+    auto it = m_senders.find(sender);
+    if(it == m_senders.end())
+        return;
+    m_pending -= it->waiting.size();
+    qDeleteAll(it->waiting);
+    m_senders.erase(it);
+}
+
+void FilterPipeline::start(Job *job)
+{
+    m_senders[job->key].busy = true;
+    m_pool.start([this,job]{
+        runJob(job);
+    });
+}
+
+void FilterPipeline::runJob(Job *job)
+{
+    // 线程池线程：只读 job，不碰 m_senders 等主线程状态
+    const qint64 traceBeginNs = job->traceId ? ChatTrace::now() : 0;
+    QString text = job->message.value("text").toString();
+    job->filterNs.reserve(job->filters.size());
+    for(const QSharedPointer<MessageFilter> &filter : job->filters){
+        const qint64 begin = m_clock.nsecsElapsed();
+        const MessageFilter::Verdict verdict = filter->filter(job->senderName,text,job->reason);
+        job->filterNs.append(m_clock.nsecsElapsed() - begin);
+        if(verdict == MessageFilter::Reject){
+            job->accepted = false;
+            break;
+        }
+    }
+    if(job->accepted)
+        job->message["text"] = text;
+    if(job->traceId)
+        ChatTrace::complete(job->traceId,"filter",traceBeginNs,ChatTrace::now());
+
+    m_results.push(job);
+    if(!m_drainScheduled.exchange(true))
+        QMetaObject::invokeMethod(this,&FilterPipeline::drainResults,Qt::QueuedConnection);
+}
+
+void FilterPipeline::drainResults()
+{
+    m_drainScheduled.store(false);
+    Job *job = nullptr;
+    while(m_results.pop(job)){
+        const qint64 now = m_clock.nsecsElapsed();
+        m_totalLatency.add(now - job->submittedNs);
+        for(int i = 0; i < job->filterNs.size(); i++)
+            m_filterLatency[job->filters.at(i)->name()].add(job->filterNs.at(i));
+
+        m_pending--;
+        if(job->traceId)
+            ChatTrace::complete(job->traceId,"filterQueue",job->traceSubmittedNs,ChatTrace::now());
+        auto it = m_senders.find(job->key);
+        if(it != m_senders.end() && it->generation == job->generation){
+            if(!job->sender.isNull()){
+                if(job->accepted)
+                    emit messageAccepted(job->sender,job->message,job->traceId);
+                else
+                    emit messageRejected(job->sender,job->reason,job->message);
+                // 信号处理中发送者可能已经被移除
+                it = m_senders.find(job->key);
+            }
+            if(it != m_senders.end() && it->generation == job->generation){
+                if(it->waiting.isEmpty())
+                    m_senders.erase(it);
+                else
+                    start(it->waiting.dequeue());
+            }
+        }
+        delete job;
+    }
+}
+
+void FilterPipeline::LatencySamples::add(qint64 ns)
+{
+    if(samples.size() < LatencySampleCount){
+        samples.append(ns);
+    }else{
+        samples[next] = ns;
+        next = (next + 1) % LatencySampleCount;
+    }
+    count++;
+}
+
+QString FilterPipeline::LatencySamples::summary(const QString &label) const
+{
+    if(samples.isEmpty())
+        return QString();
+    QVector<qint64> sorted = samples;
+    std::sort(sorted.begin(),sorted.end());
+    const qint64 p50 = sorted.at(sorted.size() / 2);
+    const qint64 p99 = sorted.at(qMin(sorted.size() - 1,sorted.size() * 99 / 100));
+    return QString("%1: p50 %2us, p99 %3us (%4 条)")
+        .arg(label)
+        .arg(p50 / 1000.0,0,'f',1)
+        .arg(p99 / 1000.0,0,'f',1)
+        .arg(count);
+}
+
+QString FilterPipeline::latencyReport() const
+{
+    QStringList lines;
+    const QString total = m_totalLatency.summary("过滤流水线");
+    if(!total.isEmpty())
+        lines.append(total);
+    for(auto it = m_filterLatency.constBegin(); it != m_filterLatency.constEnd(); ++it)
+        lines.append(it.value().summary("  " + it.key()));
+    return lines.join('\n');
+}
@@ -0,0 +1,96 @@
+#ifndef FILTERPIPELINE_H
+#define FILTERPIPELINE_H
+
+#include <QObject>
+#include <QJsonObject>
+#include <QHash>
+#include <QQueue>
+#include <QPointer>
+#include <QSharedPointer>
+#include <QThreadPool>
+#include <QElapsedTimer>
+#include <atomic>
+#include "messagefilter.h"
+#include "mpscqueue.h"
+
+class ServerWorker;
+
+// 消息过滤流水线：位于解帧和广播之间，过滤器在有界线程池中执行，
+// 结果通过无锁队列交回主线程；同一个发送者的消息按顺序逐条处理
+class FilterPipeline : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit FilterPipeline(QObject *parent = nullptr);
+    ~FilterPipeline();
+
+    void addFilter(MessageFilter *filter);
+    void clearFilters();
+    bool isEmpty() const;
+    // 排队中的消息已经到上限，再提交会被拒绝
+    bool isFull() const;
+    void setMaxThreads(int count);
+    void setMaxPending(int count);
+
+    void submit(ServerWorker *sender,const QJsonObject &message,quint64 traceId = 0);
+    void forgetSender(ServerWorker *sender);
+
+    // 每个过滤器以及整条流水线增加的延迟（p50/p99）
+    QString latencyReport() const;
+
+signals:
+    void messageAccepted(ServerWorker *sender,const QJsonObject &message,quint64 traceId);
+    void messageRejected(ServerWorker *sender,const QString &reason,const QJsonObject &message);
+
+private:
+    struct Job
+    {
+        QPointer<ServerWorker> sender;
+        ServerWorker *key = nullptr;
+        QString senderName;
+        QJsonObject message;
+        QList<QSharedPointer<MessageFilter>> filters;
+        quint64 generation = 0;
+        qint64 submittedNs = 0;
+        quint64 traceId = 0;
+        qint64 traceSubmittedNs = 0;
+        bool accepted = true;
+        QString reason;
+        QVector<qint64> filterNs;
+    };
+
+    struct SenderState
+    {
+        quint64 generation = 0;
+        bool busy = false;
+        QQueue<Job*> waiting;
+    };
+
+    struct LatencySamples
+    {
+        QVector<qint64> samples;
+        int next = 0;
+        qint64 count = 0;
+        void add(qint64 ns);
+        QString summary(const QString &label) const;
+    };
+
+    void start(Job *job);
+    void runJob(Job *job);
+    void drainResults();
+
+    QList<QSharedPointer<MessageFilter>> m_filters;
+    QThreadPool m_pool;
+    int m_maxPending;
+    int m_pending;
+    quint64 m_generation;
+    QHash<ServerWorker*,SenderState> m_senders;
+    MpscQueue<Job*> m_results;
+    std::atomic<bool> m_drainScheduled;
+    QElapsedTimer m_clock;
+    QHash<QString,LatencySamples> m_filterLatency;
+    LatencySamples m_totalLatency;
+};
+
+#endif // FILTERPIPELINE_H
@@ -0,0 +1,200 @@
+#include "framecompressor.h"
+#include <atomic>
+#include <zlib.h>
+
+// 每个连接的压缩上下文：4K 窗口加小哈希表，约 24KB，连接多的时候内存可控
+static const int StreamWindowBits = 12;
+static const int StreamMemLevel = 4;
+static const qint64 StreamStateBytes = (qint64(1) << (StreamWindowBits + 2)) + (qint64(1) << (StreamMemLevel + 9));
+static const int HeaderSize = 2;
+
+static std::atomic<quint64> sharedCompressions{0};
+static std::atomic<quint64> sharedReuses{0};
+static std::atomic<quint64> streamCompressions{0};
+static std::atomic<quint64> inputBytes{0};
+static std::atomic<quint64> outputBytes{0};
+
+static z_stream *newDeflate(int windowBits,int memLevel)
+{
+    z_stream *stream = new z_stream;
+    memset(stream,0,sizeof(z_stream));
+    if(deflateInit2(stream,Z_DEFAULT_COMPRESSION,Z_DEFLATED,-windowBits,memLevel,Z_DEFAULT_STRATEGY) != Z_OK){
+        delete stream;
+        return nullptr;
+    }
+    return stream;
+}
+
+static void deleteDeflate(z_stream *stream)
+{
+    if(stream){
+        deflateEnd(stream);
+        delete stream;
+    }
+}
+
+static z_stream *newInflate()
+{
+    z_stream *stream = new z_stream;
+    memset(stream,0,sizeof(z_stream));
+    if(inflateInit2(stream,-15) != Z_OK){
+        delete stream;
+        return nullptr;
+    }
+    return stream;
+}
+
+static void deleteInflate(z_stream *stream)
+{
+    if(stream){
+        inflateEnd(stream);
+        delete stream;
+    }
+}
+
+// 压缩一帧，结果前面留出帧头；stream 的状态由调用方决定是否保留
+static QByteArray deflateFrame(z_stream *stream,const QByteArray &frame,char flags)
+{
+    QByteArray compressed(HeaderSize + qsizetype(deflateBound(stream,uLong(frame.size()))) + 16,Qt::Uninitialized);
+    compressed[0] = FrameCompressor::Marker;
+    compressed[1] = flags;
+    stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(frame.constData()));
+    stream->avail_in = uInt(frame.size());
+    stream->next_out = reinterpret_cast<Bytef*>(compressed.data() + HeaderSize);
+    stream->avail_out = uInt(compressed.size() - HeaderSize);
+    if(deflate(stream,Z_SYNC_FLUSH) != Z_OK || stream->avail_in != 0)
+        return QByteArray();
+    compressed.resize(compressed.size() - qsizetype(stream->avail_out));
+    if(compressed.endsWith(QByteArrayLiteral("\x00\x00\xff\xff")))
+        compressed.chop(4);
+    inputBytes += quint64(frame.size());
+    outputBytes += quint64(compressed.size());
+    return compressed;
+}
+
+// 广播帧的压缩器和最近一次的结果，每个线程一份
+struct SharedCompressor
+{
+    z_stream *stream = nullptr;
+    QByteArray frame;
+    QByteArray compressed;
+
+    ~SharedCompressor()
+    {
+        deleteDeflate(stream);
+    }
+};
+
+static thread_local SharedCompressor sharedCompressor;
+
+FrameCompressor::FrameCompressor()
+    : m_stream(nullptr)
+    , m_reset(true)
+{
+}
+
+FrameCompressor::~FrameCompressor()
+{
+    deleteDeflate(m_stream);
+}
+
+bool FrameCompressor::isCompressed(const QByteArray &frame)
+{
+    return frame.size() >= HeaderSize && frame.at(0) == Marker;
+}
+
+QByteArray FrameCompressor::compress(const QByteArray &frame)
+{
+    // 第一次用到时才分配，不压缩的连接不占内存
+    if(!m_stream && !(m_stream = newDeflate(StreamWindowBits,StreamMemLevel)))
+        return frame;
+    const QByteArray compressed = deflateFrame(m_stream,frame,char(StreamFlag | (m_reset ? ResetFlag : 0)));
+    if(compressed.isEmpty()){
+        // 上下文已经不可信，下一帧从头开始
+        deflateReset(m_stream);
+        m_reset = true;
+        return frame;
+    }
+    m_reset = false;
+    streamCompressions++;
+    return compressed;
+}
+
+QByteArray FrameCompressor::compressShared(const QByteArray &frame)
+{
+    SharedCompressor &shared = sharedCompressor;
+    // 缓存里留着一份 frame 的引用，数据指针相同就一定是同一份内容
+    if(!shared.compressed.isEmpty() && shared.frame.constData() == frame.constData() && shared.frame.size() == frame.size()){
+        sharedReuses++;
+        return shared.compressed;
+    }
+    if(!shared.stream && !(shared.stream = newDeflate(15,8)))
+        return frame;
+    deflateReset(shared.stream);
+    const QByteArray compressed = deflateFrame(shared.stream,frame,0);
+    if(compressed.isEmpty())
+        return frame;
+    sharedCompressions++;
+    shared.frame = frame;
+    shared.compressed = compressed;
+    return compressed;
+}
+
+qint64 FrameCompressor::memoryUsage() const
+{
+    return m_stream ? StreamStateBytes : 0;
+}
+
+QJsonObject FrameCompressor::stats()
+{
+    QJsonObject json;
+    json["sharedCompressions"] = QJsonValue(qint64(sharedCompressions.load()));
+    json["sharedReuses"] = QJsonValue(qint64(sharedReuses.load()));
+    json["streamCompressions"] = QJsonValue(qint64(streamCompressions.load()));
+    json["inBytes"] = QJsonValue(qint64(inputBytes.load()));
+    json["outBytes"] = QJsonValue(qint64(outputBytes.load()));
+    return json;
+}
+
+FrameDecompressor::FrameDecompressor()
+    : m_stream(nullptr)
+    , m_shared(nullptr)
+{
+}
+
+FrameDecompressor::~FrameDecompressor()
+{
+    deleteInflate(m_stream);
+    deleteInflate(m_shared);
+}
+
+bool FrameDecompressor::decompress(const QByteArray &frame, qint64 maxBytes, QByteArray &result)
+{
+    if(!FrameCompressor::isCompressed(frame))
+        return false;
+    const char flags = frame.at(1);
+    z_stream *&stream = (flags & FrameCompressor::StreamFlag) ? m_stream : m_shared;
+    if(!stream && !(stream = newInflate()))
+        return false;
+    // 独立的帧每次从头解，连接上下文只在服务端要求时重置
+    if(!(flags & FrameCompressor::StreamFlag) || (flags & FrameCompressor::ResetFlag))
+        inflateReset(stream);
+
+    const QByteArray input = frame.mid(HeaderSize) + QByteArrayLiteral("\x00\x00\xff\xff");
+    stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.constData()));
+    stream->avail_in = uInt(input.size());
+    result.clear();
+    char buffer[16 * 1024];
+    int status = Z_OK;
+    do{
+        stream->next_out = reinterpret_cast<Bytef*>(buffer);
+        stream->avail_out = sizeof(buffer);
+        status = inflate(stream,Z_SYNC_FLUSH);
+        if(status != Z_OK && status != Z_BUF_ERROR)
+            return false;
+        result.append(buffer,qsizetype(sizeof(buffer) - stream->avail_out));
+        if(result.size() > maxBytes)
+            return false;
+    }while(status == Z_OK && (stream->avail_in > 0 || stream->avail_out == 0));
+    return true;
+}
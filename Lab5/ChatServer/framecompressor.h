@@ -0,0 +1,59 @@
+#ifndef FRAMECOMPRESSOR_H
+#define FRAMECOMPRESSOR_H
+
+#include <QByteArray>
+#include <QJsonObject>
+
+typedef struct z_stream_s z_stream;
+
+// 压缩帧，和 JSON 帧、文件块帧走同一条连接、同样的长度前缀，客户端和服务端共用
+// 内容以 0x02 开头，后面是标志字节和裸 deflate 数据（去掉了同步刷新结尾的 00 00 ff ff）
+// 带 StreamFlag 的帧用连接自己的压缩上下文，前面的帧就是字典，必须按顺序解压；
+// 不带的帧各自独立，广播时所有接收者共用同一份压缩结果
+class FrameCompressor
+{
+public:
+    static const char Marker = 0x02;
+    enum Flags {
+        StreamFlag = 0x01,
+        // 压缩上下文重新开始（新连接或者交接到新进程），解压端先重置
+        ResetFlag = 0x02
+    };
+
+    FrameCompressor();
+    ~FrameCompressor();
+    FrameCompressor(const FrameCompressor &) = delete;
+    FrameCompressor &operator=(const FrameCompressor &) = delete;
+
+    static bool isCompressed(const QByteArray &frame);
+    // 用本连接的上下文压缩，只能在帧真正写出去的时候调用
+    QByteArray compress(const QByteArray &frame);
+    // 不依赖上下文的压缩，同一个 QByteArray 连续传进来时只压缩一次
+    static QByteArray compressShared(const QByteArray &frame);
+    // 压缩上下文占用的内存，没压缩过时为 0
+    qint64 memoryUsage() const;
+
+    static QJsonObject stats();
+
+private:
+    z_stream *m_stream;
+    bool m_reset;
+};
+
+class FrameDecompressor
+{
+public:
+    FrameDecompressor();
+    ~FrameDecompressor();
+    FrameDecompressor(const FrameDecompressor &) = delete;
+    FrameDecompressor &operator=(const FrameDecompressor &) = delete;
+
+    // 解出原来的帧，解出来超过 maxBytes 当作出错
+    bool decompress(const QByteArray &frame,qint64 maxBytes,QByteArray &result);
+
+private:
+    z_stream *m_stream;
+    z_stream *m_shared;
+};
+
+#endif // FRAMECOMPRESSOR_H
@@ -0,0 +1,288 @@
+#include "handoff.h"
+
+#ifdef Q_OS_UNIX
+#include <QtEndian>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#endif
+#ifdef Q_OS_WIN
+#include <winsock2.h>
+#endif
+
+namespace Handoff
+{
+
+#ifdef Q_OS_UNIX
+
+static const char Magic[4] = {'C','H','H','O'};
+// 每条 sendmsg 附带的描述符数量，Linux 上限是 253
+static const int DescriptorsPerMessage = 200;
+static const int TimeoutSeconds = 5;
+
+static void prepareChannel(int fd)
+{
+    const int flags = ::fcntl(fd,F_GETFL);
+    if(flags >= 0)
+        ::fcntl(fd,F_SETFL,flags & ~O_NONBLOCK);
+    timeval timeout;
+    timeout.tv_sec = TimeoutSeconds;
+    timeout.tv_usec = 0;
+    ::setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+    ::setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&timeout,sizeof(timeout));
+}
+
+static bool writeAll(int fd,const char *data,qint64 size)
+{
+    while(size > 0){
+        const ssize_t written = ::write(fd,data,size_t(size));
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written <= 0)
+            return false;
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+static bool readAll(int fd,char *data,qint64 size)
+{
+    while(size > 0){
+        const ssize_t received = ::read(fd,data,size_t(size));
+        if(received < 0 && errno == EINTR)
+            continue;
+        if(received <= 0)
+            return false;
+        data += received;
+        size -= received;
+    }
+    return true;
+}
+
+static bool sendDescriptors(int fd,const int *descriptors,int count)
+{
+    char byte = 'F';
+    iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    QByteArray control(int(CMSG_SPACE(sizeof(int) * count)),'\0');
+    msghdr message;
+    memset(&message,0,sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+    cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(header),descriptors,sizeof(int) * count);
+
+    ssize_t sent;
+    do{
+        sent = ::sendmsg(fd,&message,0);
+    }while(sent < 0 && errno == EINTR);
+    return sent == 1;
+}
+
+static bool receiveDescriptors(int fd,int *descriptors,int count)
+{
+    char byte;
+    iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    QByteArray control(int(CMSG_SPACE(sizeof(int) * count)),'\0');
+    msghdr message;
+    memset(&message,0,sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+
+    ssize_t received;
+    do{
+        received = ::recvmsg(fd,&message,0);
+    }while(received < 0 && errno == EINTR);
+    if(received != 1 || (message.msg_flags & MSG_CTRUNC))
+        return false;
+    cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if(!header || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS
+        || header->cmsg_len != CMSG_LEN(sizeof(int) * count))
+        return false;
+    memcpy(descriptors,CMSG_DATA(header),sizeof(int) * count);
+    for(int i = 0; i < count; i++)
+        ::fcntl(descriptors[i],F_SETFD,FD_CLOEXEC);
+    return true;
+}
+
+bool isSupported()
+{
+    return true;
+}
+
+bool waitForRequest(qintptr channel)
+{
+    prepareChannel(int(channel));
+    char byte = 0;
+    return readAll(int(channel),&byte,1) && byte == 'R';
+}
+
+bool send(qintptr channel, const QVector<qintptr> &descriptors, const QByteArray &state)
+{
+    const int fd = int(channel);
+    prepareChannel(fd);
+
+    char header[12];
+    memcpy(header,Magic,4);
+    qToBigEndian<quint32>(quint32(descriptors.size()),header + 4);
+    qToBigEndian<quint32>(quint32(state.size()),header + 8);
+    if(!writeAll(fd,header,sizeof(header)))
+        return false;
+
+    QVector<int> batch;
+    for(int i = 0; i < descriptors.size(); i += DescriptorsPerMessage){
+        batch.clear();
+        for(int j = i; j < qMin(int(descriptors.size()),i + DescriptorsPerMessage); j++)
+            batch.append(int(descriptors.at(j)));
+        if(!sendDescriptors(fd,batch.constData(),int(batch.size())))
+            return false;
+    }
+    return writeAll(fd,state.constData(),state.size());
+}
+
+bool waitForAck(qintptr channel)
+{
+    char byte = 0;
+    return readAll(int(channel),&byte,1) && byte == 'K';
+}
+
+qintptr connectTo(const QString &path)
+{
+    const QByteArray encoded = path.toLocal8Bit();
+    sockaddr_un address;
+    memset(&address,0,sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(size_t(encoded.size()) >= sizeof(address.sun_path))
+        return -1;
+    memcpy(address.sun_path,encoded.constData(),size_t(encoded.size()));
+
+    const int fd = ::socket(AF_UNIX,SOCK_STREAM,0);
+    if(fd < 0)
+        return -1;
+    if(::connect(fd,reinterpret_cast<sockaddr*>(&address),sizeof(address)) < 0){
+        ::close(fd);
+        return -1;
+    }
+    prepareChannel(fd);
+    const char request = 'R';
+    if(!writeAll(fd,&request,1)){
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool receive(qintptr channel, QVector<qintptr> &descriptors, QByteArray &state)
+{
+    const int fd = int(channel);
+    char header[12];
+    if(!readAll(fd,header,sizeof(header)) || memcmp(header,Magic,4) != 0)
+        return false;
+    const quint32 count = qFromBigEndian<quint32>(header + 4);
+    const quint32 stateSize = qFromBigEndian<quint32>(header + 8);
+
+    QVector<int> batch;
+    for(quint32 i = 0; i < count; i += DescriptorsPerMessage){
+        batch.resize(int(qMin<quint32>(DescriptorsPerMessage,count - i)));
+        if(!receiveDescriptors(fd,batch.data(),int(batch.size()))){
+            for(qintptr descriptor : std::as_const(descriptors))
+                ::close(int(descriptor));
+            descriptors.clear();
+            return false;
+        }
+        for(int descriptor : std::as_const(batch))
+            descriptors.append(descriptor);
+    }
+
+    state.resize(int(stateSize));
+    return readAll(fd,state.data(),stateSize);
+}
+
+void ack(qintptr channel)
+{
+    const char byte = 'K';
+    writeAll(int(channel),&byte,1);
+}
+
+void waitForClose(qintptr channel)
+{
+    char byte;
+    ssize_t received;
+    do{
+        received = ::read(int(channel),&byte,1);
+    }while(received > 0 || (received < 0 && errno == EINTR));
+}
+
+void closeDescriptor(qintptr descriptor)
+{
+    ::close(int(descriptor));
+}
+
+#else
+
+bool isSupported()
+{
+    return false;
+}
+
+bool waitForRequest(qintptr)
+{
+    return false;
+}
+
+bool send(qintptr, const QVector<qintptr> &, const QByteArray &)
+{
+    return false;
+}
+
+bool waitForAck(qintptr)
+{
+    return false;
+}
+
+qintptr connectTo(const QString &)
+{
+    return -1;
+}
+
+bool receive(qintptr, QVector<qintptr> &, QByteArray &)
+{
+    return false;
+}
+
+void ack(qintptr)
+{
+}
+
+void waitForClose(qintptr)
+{
+}
+
+void closeDescriptor(qintptr descriptor)
+{
+#ifdef Q_OS_WIN
+    // Windows 上 QTcpServer 交出来的是 SOCKET 句柄，要用 closesocket 关
+    ::closesocket(SOCKET(descriptor));
+#else
+    Q_UNUSED(descriptor);
+#endif
+}
+
+#endif
+
+}
@@ -0,0 +1,29 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+// 不停机重启：旧进程通过 Unix 域套接字（SCM_RIGHTS）把监听套接字、
+// 所有连接的描述符和序列化后的连接状态交给新进程
+namespace Handoff
+{
+    bool isSupported();
+
+    // 旧进程：等新进程发来接管请求（只连上又断开的是在探测路径有没有人用），
+    // 然后发送描述符和状态，再等新进程确认
+    bool waitForRequest(qintptr channel);
+    bool send(qintptr channel,const QVector<qintptr> &descriptors,const QByteArray &state);
+    bool waitForAck(qintptr channel);
+
+    // 新进程：连接旧进程并发出接管请求，接收描述符和状态，全部接管后确认
+    qintptr connectTo(const QString &path);
+    bool receive(qintptr channel,QVector<qintptr> &descriptors,QByteArray &state);
+    void ack(qintptr channel);
+    // 等旧进程关闭通道，说明它已经释放了本地套接字路径
+    void waitForClose(qintptr channel);
+    void closeDescriptor(qintptr descriptor);
+}
+
+#endif // HANDOFF_H
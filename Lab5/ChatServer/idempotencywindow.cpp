@@ -0,0 +1,102 @@
+#include "idempotencywindow.h"
+#include <QDataStream>
+#include <cstring>
+
+IdempotencyWindow::IdempotencyWindow()
+    : m_highest(0)
+{
+    std::memset(m_seen,0,sizeof(m_seen));
+    std::memset(m_inFlight,0,sizeof(m_inFlight));
+}
+
+bool IdempotencyWindow::locate(quint64 seq, int &word, quint64 &mask) const
+{
+    if(seq == 0 || seq > m_highest || m_highest - seq >= quint64(WindowSize))
+        return false;
+    const int bit = int(seq % WindowSize);
+    word = bit >> 6;
+    mask = quint64(1) << (bit & 63);
+    return true;
+}
+
+IdempotencyWindow::Result IdempotencyWindow::accept(quint64 seq)
+{
+    if(seq == 0)
+        return Duplicate;
+    if(seq > m_highest){
+        // 窗口往前滑：新进来的位置清零。每个位置滑过一次只清一次，均摊常数时间，最坏也只清一整个窗口
+        if(seq - m_highest >= quint64(WindowSize)){
+            std::memset(m_seen,0,sizeof(m_seen));
+            std::memset(m_inFlight,0,sizeof(m_inFlight));
+        }else{
+            for(quint64 next = m_highest + 1; next < seq; next++){
+                const int bit = int(next % WindowSize);
+                m_seen[bit >> 6] &= ~(quint64(1) << (bit & 63));
+                m_inFlight[bit >> 6] &= ~(quint64(1) << (bit & 63));
+            }
+        }
+        m_highest = seq;
+        const int bit = int(seq % WindowSize);
+        m_seen[bit >> 6] |= quint64(1) << (bit & 63);
+        m_inFlight[bit >> 6] |= quint64(1) << (bit & 63);
+        return Fresh;
+    }
+    int word;
+    quint64 mask;
+    if(!locate(seq,word,mask))
+        return Stale;
+    if(m_inFlight[word] & mask)
+        return InFlight;
+    if(m_seen[word] & mask)
+        return Duplicate;
+    m_seen[word] |= mask;
+    m_inFlight[word] |= mask;
+    return Fresh;
+}
+
+void IdempotencyWindow::finish(quint64 seq)
+{
+    int word;
+    quint64 mask;
+    if(locate(seq,word,mask))
+        m_inFlight[word] &= ~mask;
+}
+
+void IdempotencyWindow::forget(quint64 seq)
+{
+    int word;
+    quint64 mask;
+    if(locate(seq,word,mask)){
+        m_seen[word] &= ~mask;
+        m_inFlight[word] &= ~mask;
+    }
+}
+
+void IdempotencyWindow::dropInFlight()
+{
+    for(int i = 0; i < Words; i++){
+        m_seen[i] &= ~m_inFlight[i];
+        m_inFlight[i] = 0;
+    }
+}
+
+quint64 IdempotencyWindow::highest() const
+{
+    return m_highest;
+}
+
+void IdempotencyWindow::save(QDataStream &out) const
+{
+    out << m_highest;
+    for(int i = 0; i < Words; i++)
+        out << (m_seen[i] & ~m_inFlight[i]);
+}
+
+void IdempotencyWindow::load(QDataStream &in)
+{
+    in >> m_highest;
+    for(int i = 0; i < Words; i++){
+        in >> m_seen[i];
+        m_inFlight[i] = 0;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef IDEMPOTENCYWINDOW_H
+#define IDEMPOTENCYWINDOW_H
+
+#include <QtGlobal>
+
+class QDataStream;
+
+// 按客户端序号去重的滑动位图（和 IPsec 的防重放窗口一样）：记住见过的最大序号，
+// 以及它和它前面 WindowSize - 1 个序号各自的状态；位图按序号取模当环形缓冲用，大小固定
+// 比窗口还旧的序号分不清是重发还是一直没发出来（比如在别的房间的离线队列里压了很久），
+// 单独报告出来，由调用方让客户端换一个新序号再发
+class IdempotencyWindow
+{
+public:
+    static const int WindowSize = 1024;
+
+    enum Result
+    {
+        Fresh,          // 新消息，已经登记为处理中
+        Duplicate,      // 已经处理完的重发，要再确认一次
+        InFlight,       // 还在处理（过滤中），处理完自然会确认
+        Stale           // 比窗口还旧，没有记录
+    };
+
+    IdempotencyWindow();
+
+    // 检查并登记，常数时间
+    Result accept(quint64 seq);
+    // 广播了或者被过滤器拦下了
+    void finish(quint64 seq);
+    // 没有收下（限流、过滤队列满），之后重发的当作新消息
+    void forget(quint64 seq);
+    // 处理中的全部作废：连接断开时还在过滤的消息跟着丢了，重发的要能再收下
+    void dropInFlight();
+    quint64 highest() const;
+
+    // 交接时带到新进程，处理中的按没收到保存
+    void save(QDataStream &out) const;
+    void load(QDataStream &in);
+
+private:
+    static const int Words = WindowSize / 64;
+
+    bool locate(quint64 seq,int &word,quint64 &mask) const;
+
+    quint64 m_highest;
+    quint64 m_seen[Words];
+    quint64 m_inFlight[Words];
+};
+
+#endif // IDEMPOTENCYWINDOW_H
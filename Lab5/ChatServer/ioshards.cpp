@@ -0,0 +1,202 @@
+#include "ioshards.h"
+#include "serverworker.h"
+#include "chattrace.h"
+#include "userdirectory.h"
+#include <QThread>
+#include <QJsonArray>
+
+IoShard::IoShard(int index, QObject *parent)
+    : QObject{parent}
+    , workers(0)
+    , tasks(0)
+    , frames(0)
+    , lastFanoutNs(0)
+    , maxFanoutNs(0)
+    , m_index(index)
+    , m_drainScheduled(false)
+{
+}
+
+IoShard::~IoShard()
+{
+    Task *task;
+    while(m_tasks.pop(task))
+        delete task;
+}
+
+int IoShard::index() const
+{
+    return m_index;
+}
+
+void IoShard::push(Task *task)
+{
+    m_tasks.push(task);
+    // 和过滤线程池的结果队列一样：已经安排了一次 drain 就不再重复投递事件
+    if(!m_drainScheduled.exchange(true))
+        QMetaObject::invokeMethod(this,&IoShard::drain,Qt::QueuedConnection);
+}
+
+void IoShard::drain()
+{
+    m_drainScheduled.store(false);
+    Task *task;
+    while(m_tasks.pop(task)){
+        tasks++;
+        if(task->run){
+            task->run();
+        }else{
+            const qint64 beginNs = ChatTrace::now();
+            for(ServerWorker *worker : std::as_const(task->workers))
+                worker->sendFrame(task->frame,task->traceId);
+            const qint64 elapsedNs = ChatTrace::now() - beginNs;
+            frames += quint64(task->workers.size());
+            lastFanoutNs.store(elapsedNs);
+            if(elapsedNs > maxFanoutNs.load())
+                maxFanoutNs.store(elapsedNs);
+        }
+        delete task;
+    }
+}
+
+IoShards::IoShards(QObject *parent)
+    : QObject{parent}
+{
+}
+
+IoShards::~IoShards()
+{
+    for(int i = 0; i < m_threads.size(); i++){
+        m_threads.at(i)->quit();
+        m_threads.at(i)->wait();
+    }
+    // 线程都停了，剩下的连接和分片对象在这里删掉；连接析构时要更新分片的计数，所以先删连接
+    for(IoShard *shard : std::as_const(m_shards)){
+        qDeleteAll(shard->findChildren<ServerWorker*>(QString(),Qt::FindDirectChildrenOnly));
+        delete shard;
+    }
+    qDeleteAll(m_threads);
+}
+
+void IoShards::setThreadCount(int count)
+{
+    if(!m_threads.isEmpty() || count <= 0)
+        return;
+    for(int i = 0; i < count; i++){
+        QThread *thread = new QThread;
+        thread->setObjectName(QString("io-%1").arg(i));
+        IoShard *shard = new IoShard(i);
+        shard->moveToThread(thread);
+        thread->start();
+        m_threads.append(thread);
+        m_shards.append(shard);
+    }
+}
+
+int IoShards::threadCount() const
+{
+    return m_threads.size();
+}
+
+bool IoShards::isEnabled() const
+{
+    return !m_shards.isEmpty();
+}
+
+void IoShards::adopt(ServerWorker *worker)
+{
+    if(m_shards.isEmpty())
+        return;
+    IoShard *target = m_shards.first();
+    for(IoShard *shard : std::as_const(m_shards)){
+        if(shard->workers.load() < target->workers.load())
+            target = shard;
+    }
+    target->workers++;
+    // 带父对象的 QObject 不能换线程；连接挂在分片对象下面，线程退出时统一清理
+    worker->setParent(nullptr);
+    worker->setShard(target);
+    worker->moveToThread(target->thread());
+    IoShard::Task *task = new IoShard::Task;
+    task->run = [target,worker]{
+        worker->setParent(target);
+    };
+    target->push(task);
+}
+
+void IoShards::post(ServerWorker *worker, std::function<void()> task)
+{
+    IoShard *shard = worker->shard();
+    if(!shard){
+        task();
+        return;
+    }
+    IoShard::Task *queued = new IoShard::Task;
+    queued->run = std::move(task);
+    shard->push(queued);
+}
+
+void IoShards::sendFrame(const QVector<ServerWorker*> &workers, const QByteArray &frame, quint64 traceId)
+{
+    if(m_shards.isEmpty()){
+        for(ServerWorker *worker : workers)
+            worker->sendFrame(frame,traceId);
+        return;
+    }
+    // 主线程只做分组，真正的写在各个 I/O 线程里并行进行
+    QVector<IoShard::Task*> tasks(m_shards.size(),nullptr);
+    for(ServerWorker *worker : workers){
+        IoShard *shard = worker->shard();
+        if(!shard){
+            worker->sendFrame(frame,traceId);
+            continue;
+        }
+        IoShard::Task *&task = tasks[shard->index()];
+        if(!task){
+            task = new IoShard::Task;
+            task->frame = frame;
+            task->traceId = traceId;
+            task->workers.reserve(shard->workers.load());
+        }
+        task->workers.append(worker);
+    }
+    for(int i = 0; i < tasks.size(); i++){
+        if(tasks.at(i))
+            m_shards.at(i)->push(tasks.at(i));
+    }
+}
+
+void IoShards::sendToRoom(const UserDirectory *directory, const QString &room, const QByteArray &frame, quint64 traceId)
+{
+    // 成员列表在投递时就从目录里取出来，和帧的房间序号对应同一时刻；
+    // 等到 I/O 线程执行时再查，中间进来的人会收到比他的 joined 还早的帧。
+    // 每个线程的成员本来就是单独的一份，拷贝只是加引用计数
+    for(IoShard *shard : std::as_const(m_shards)){
+        const QVector<ServerWorker*> &members = directory->members(room,shard->index());
+        if(members.isEmpty())
+            continue;
+        IoShard::Task *task = new IoShard::Task;
+        task->frame = frame;
+        task->traceId = traceId;
+        task->workers = members;
+        shard->push(task);
+    }
+}
+
+QJsonObject IoShards::stats() const
+{
+    QJsonObject json;
+    json["threads"] = int(m_shards.size());
+    QJsonArray shards;
+    for(const IoShard *shard : m_shards){
+        QJsonObject item;
+        item["workers"] = shard->workers.load();
+        item["tasks"] = QJsonValue(qint64(shard->tasks.load()));
+        item["frames"] = QJsonValue(qint64(shard->frames.load()));
+        item["lastFanoutUs"] = QJsonValue(shard->lastFanoutNs.load() / 1000);
+        item["maxFanoutUs"] = QJsonValue(shard->maxFanoutNs.load() / 1000);
+        shards.append(item);
+    }
+    json["shards"] = shards;
+    return json;
+}
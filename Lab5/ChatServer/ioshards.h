@@ -0,0 +1,86 @@
+#ifndef IOSHARDS_H
+#define IOSHARDS_H
+
+#include <QObject>
+#include <QVector>
+#include <QByteArray>
+#include <QJsonObject>
+#include <atomic>
+#include <functional>
+#include "mpscqueue.h"
+
+class QThread;
+class ServerWorker;
+class UserDirectory;
+
+// 一个 I/O 线程：线程里的连接自己读、自己写，主线程通过无锁队列把要做的事交过来
+class IoShard : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Task
+    {
+        // 广播：同一份帧发给这个线程里的一批连接
+        QVector<ServerWorker*> workers;
+        QByteArray frame;
+        quint64 traceId = 0;
+        // 其他操作（单发、断开、交接……）
+        std::function<void()> run;
+    };
+
+    explicit IoShard(int index,QObject *parent = nullptr);
+    ~IoShard();
+
+    int index() const;
+    // 任意线程调用；同一个线程提交的任务按顺序执行
+    void push(Task *task);
+
+    std::atomic<int> workers;
+    std::atomic<quint64> tasks;
+    std::atomic<quint64> frames;
+    // 最近一次广播在这个线程里写完所有连接用的时间
+    std::atomic<qint64> lastFanoutNs;
+    std::atomic<qint64> maxFanoutNs;
+
+private:
+    void drain();
+
+    int m_index;
+    MpscQueue<Task*> m_tasks;
+    std::atomic<bool> m_drainScheduled;
+};
+
+// 连接按线程分片：每个连接固定在一个 I/O 线程里，广播时每个线程只收到一个任务，
+// 各自写自己的套接字；主线程发给同一个连接的东西都走同一个队列，顺序不会乱
+class IoShards : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit IoShards(QObject *parent = nullptr);
+    ~IoShards();
+
+    // 在第一个连接进来之前设置，0 表示所有连接都留在主线程（原来的单线程模式）
+    void setThreadCount(int count);
+    int threadCount() const;
+    bool isEnabled() const;
+
+    // 把新连接交给连接数最少的线程，之后它的读写都在那个线程里
+    void adopt(ServerWorker *worker);
+    // 在 worker 所在的线程里执行
+    void post(ServerWorker *worker,std::function<void()> task);
+    // 同一份帧发给一批连接，按线程分组后每个线程一个任务
+    void sendFrame(const QVector<ServerWorker*> &workers,const QByteArray &frame,quint64 traceId = 0);
+    // 发给房间里的所有成员，只给有成员的线程各投一个任务，在主线程调用。
+    // 接收者是调用这一刻目录里的成员，之后才进房间的人不会先于自己的 joined 收到这个房间的帧
+    void sendToRoom(const UserDirectory *directory,const QString &room,const QByteArray &frame,quint64 traceId = 0);
+
+    QJsonObject stats() const;
+
+private:
+    QVector<QThread*> m_threads;
+    QVector<IoShard*> m_shards;
+};
+
+#endif // IOSHARDS_H
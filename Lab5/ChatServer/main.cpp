@@ -1,11 +1,201 @@
-#include "mainwindow.h"
-
-#include <QApplication>
-
-int main(int argc, char *argv[])
-{
-    QApplication a(argc, argv);
-    MainWindow w;
-    w.show();
-    return a.exec();
-}
+#include "mainwindow.h"
+
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QScopedPointer>
+#include <QThread>
+#include "chattrace.h"
+#include <cstring>
+
+static bool hasArgument(int argc, char *argv[], const char *name)
+{
+    for(int i = 1; i < argc; i++){
+        if(std::strcmp(argv[i],name) == 0)
+            return true;
+    }
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    // 无界面模式不创建 QApplication，没有显示器的机器上也能跑多个节点
+    const bool headless = hasArgument(argc,argv,"--headless");
+    QScopedPointer<QCoreApplication> app(headless ? new QCoreApplication(argc, argv)
+                                                  : new QApplication(argc, argv));
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption wordsOption("filter-words","敏感词列表文件，每行一个词","file");
+    QCommandLineOption linksOption("filter-links","拦截链接");
+    QCommandLineOption allowHostsOption("allow-hosts","允许发送链接的域名，逗号分隔","hosts");
+    QCommandLineOption duplicatesOption("filter-duplicates","拦截10秒内重复发送超过N次的消息","count");
+    QCommandLineOption threadsOption("filter-threads","过滤线程池大小","count");
+    QCommandLineOption localNameOption("local-name","本地套接字名称，为空时不监听","name","chatserver");
+    QCommandLineOption multicastOption("multicast","大房间启用局域网组播");
+    QCommandLineOption multicastThresholdOption("multicast-threshold","房间内支持组播的成员达到多少人时启用组播","count","50");
+    QCommandLineOption multicastPortOption("multicast-port","组播端口","port","1968");
+    QCommandLineOption handoffOption("handoff-path","在这个 Unix 套接字路径上等待新进程接管连接","path");
+    QCommandLineOption takeoverOption("takeover","启动时从这个路径上的旧进程接管所有连接","path");
+    QCommandLineOption headlessOption("headless","不显示界面，启动后直接监听");
+    QCommandLineOption verboseOption("verbose","无界面模式下把日志打印到控制台");
+    QCommandLineOption portOption("port","监听端口","port","1967");
+    QCommandLineOption webSocketPortOption("ws-port","浏览器用的 WebSocket 端口，0 表示不监听","port","0");
+    QCommandLineOption relayOption("relay","加入集群，ChatRelay 的地址","host:port");
+    QCommandLineOption nodeIdOption("node-id","集群里的节点名称","name");
+    QCommandLineOption traceOption("trace","每 N 个入站帧采样一个做端到端追踪","N");
+    QCommandLineOption traceFileOption("trace-file","退出时把追踪写到这个文件（Chrome / Perfetto 格式）","file","chattrace.json");
+    QCommandLineOption fileDirOption("file-dir","上传文件的保存目录，默认使用临时目录","dir");
+    QCommandLineOption maxFileSizeOption("max-file-size","单个上传文件的大小上限（MB）","MB","100");
+    QCommandLineOption configOption("config","运行时参数的 JSON 文件，收到 SIGHUP 时重新加载","file");
+    QCommandLineOption adminTokenOption("admin-token","管理消息的口令，可以远程重新加载或修改参数","token");
+    QCommandLineOption tlsCertOption("tls-cert","TLS 证书（PEM），设置后 TCP 连接都走 TLS","file");
+    QCommandLineOption tlsKeyOption("tls-key","TLS 私钥（PEM）","file");
+    QCommandLineOption tlsThreadsOption("tls-threads","TLS 握手线程数","count");
+    QCommandLineOption ioThreadsOption("io-threads","连接读写和广播用的 I/O 线程数，0 表示都在主线程","N","0");
+    QCommandLineOption searchLogOption("search-log","聊天消息日志，启动时在后台读进检索索引，之后的消息追加在后面","file");
+    QCommandLineOption captureOption("capture","把所有入站帧记录到抓包文件，供 ChatReplay 回放","file");
+    parser.addOption(wordsOption);
+    parser.addOption(linksOption);
+    parser.addOption(allowHostsOption);
+    parser.addOption(duplicatesOption);
+    parser.addOption(threadsOption);
+    parser.addOption(captureOption);
+    parser.addOption(searchLogOption);
+    parser.addOption(localNameOption);
+    parser.addOption(multicastOption);
+    parser.addOption(multicastThresholdOption);
+    parser.addOption(multicastPortOption);
+    parser.addOption(handoffOption);
+    parser.addOption(takeoverOption);
+    parser.addOption(headlessOption);
+    parser.addOption(verboseOption);
+    parser.addOption(portOption);
+    parser.addOption(webSocketPortOption);
+    parser.addOption(relayOption);
+    parser.addOption(nodeIdOption);
+    parser.addOption(traceOption);
+    parser.addOption(traceFileOption);
+    parser.addOption(fileDirOption);
+    parser.addOption(maxFileSizeOption);
+    parser.addOption(configOption);
+    parser.addOption(adminTokenOption);
+    parser.addOption(tlsCertOption);
+    parser.addOption(tlsKeyOption);
+    parser.addOption(tlsThreadsOption);
+    parser.addOption(ioThreadsOption);
+    parser.process(*app);
+
+    if(parser.isSet(traceOption)){
+        QThread::currentThread()->setObjectName("main");
+        ChatTrace::setSampleEvery(qMax(1,parser.value(traceOption).toInt()));
+    }
+
+    QScopedPointer<MainWindow> w;
+    chatServer *server;
+    if(headless){
+        server = new chatServer(app.data());
+        if(parser.isSet(verboseOption))
+            QObject::connect(server,&chatServer::logMessage,[](const QString &msg){ qInfo().noquote() << msg; });
+    }else{
+        w.reset(new MainWindow);
+        w->setPort(parser.value(portOption).toUShort());
+        server = w->server();
+    }
+    FilterPipeline *filters = server->filterPipeline();
+    if(parser.isSet(wordsOption)){
+        WordListFilter *filter = WordListFilter::fromFile(parser.value(wordsOption));
+        if(filter)
+            filters->addFilter(filter);
+        else
+            qWarning() << "无法读取敏感词文件" << parser.value(wordsOption);
+    }
+    if(parser.isSet(linksOption))
+        filters->addFilter(new LinkFilter(parser.value(allowHostsOption).split(',',Qt::SkipEmptyParts)));
+    if(parser.isSet(duplicatesOption))
+        filters->addFilter(new DuplicateFilter(parser.value(duplicatesOption).toInt()));
+    if(parser.isSet(threadsOption))
+        filters->setMaxThreads(parser.value(threadsOption).toInt());
+    if(parser.isSet(configOption)){
+        ConfigReloader *config = server->configReloader();
+        config->setFileName(parser.value(configOption));
+        QString error;
+        if(!config->reload(&error)){
+            qWarning().noquote() << error;
+            return 1;
+        }
+        if(!config->watchHangup())
+            qWarning() << "无法监听 SIGHUP，只能通过管理消息重新加载配置";
+    }
+    if(parser.isSet(tlsCertOption)){
+        // 组播和 WebSocket 都是明文，房间消息会绕过 TLS 发出去
+        if(parser.isSet(multicastOption) || parser.value(webSocketPortOption).toUShort() != 0){
+            qWarning() << "启用 TLS 时不能同时使用 --multicast 和 --ws-port";
+            return 1;
+        }
+        TlsAcceptor *tls = server->tls();
+        QString error;
+        if(!tls->setCertificate(parser.value(tlsCertOption),parser.value(tlsKeyOption),&error)){
+            qWarning().noquote() << error;
+            return 1;
+        }
+        if(parser.isSet(tlsThreadsOption))
+            tls->setThreadCount(parser.value(tlsThreadsOption).toInt());
+    }
+    server->ioShards()->setThreadCount(parser.value(ioThreadsOption).toInt());
+    if(parser.isSet(adminTokenOption))
+        server->setAdminToken(parser.value(adminTokenOption));
+    server->setLocalServerName(parser.value(localNameOption));
+    server->setWebSocketPort(parser.value(webSocketPortOption).toUShort());
+    MulticastFanout *multicast = server->multicast();
+    multicast->setThreshold(parser.value(multicastThresholdOption).toInt());
+    multicast->setPort(parser.value(multicastPortOption).toUShort());
+    multicast->setEnabled(parser.isSet(multicastOption));
+    FileTransfer *files = server->fileTransfer();
+    files->setMaxFileSize(parser.value(maxFileSizeOption).toLongLong() * 1024 * 1024);
+    if(parser.isSet(fileDirOption) && !files->setDirectory(parser.value(fileDirOption)))
+        qWarning() << "无法创建文件目录" << parser.value(fileDirOption);
+    if(parser.isSet(searchLogOption) && !server->searchIndex()->setLogFile(parser.value(searchLogOption)))
+        qWarning() << "无法打开消息日志" << parser.value(searchLogOption);
+    if(parser.isSet(captureOption) && !server->startCapture(parser.value(captureOption)))
+        qWarning() << "无法创建抓包文件" << parser.value(captureOption);
+
+    if(parser.isSet(relayOption)){
+        const QString nodeId = parser.isSet(nodeIdOption) ? parser.value(nodeIdOption)
+                                                          : QString("node-%1").arg(QCoreApplication::applicationPid());
+        server->joinCluster(parser.value(relayOption),nodeId);
+    }
+
+    if(parser.isSet(takeoverOption)){
+        const bool tookOver = headless ? server->takeOver(parser.value(takeoverOption))
+                                       : w->takeOver(parser.value(takeoverOption));
+        if(!tookOver)
+            qWarning() << "无法从旧进程接管连接" << parser.value(takeoverOption);
+        else if(headless){
+            server->listenLocal();
+            server->listenWebSocket();
+        }
+    }
+    if(headless && !server->isListening()){
+        if(!server->listen(QHostAddress::Any,parser.value(portOption).toUShort())){
+            qWarning() << "无法监听端口" << parser.value(portOption);
+            return 1;
+        }
+        server->listenLocal();
+        if(server->listenWebSocket())
+            qInfo() << "WebSocket 端口" << parser.value(webSocketPortOption);
+    }
+    if(parser.isSet(handoffOption)){
+        if(server->enableHandoff(parser.value(handoffOption)))
+            QObject::connect(server,&chatServer::handoffCompleted,app.data(),&QCoreApplication::quit);
+        else
+            qWarning() << "无法监听交接路径" << parser.value(handoffOption);
+    }
+
+    if(!headless)
+        w->show();
+    const int exitCode = app->exec();
+    if(ChatTrace::isEnabled() && !ChatTrace::dump(parser.value(traceFileOption)))
+        qWarning() << "无法写入追踪文件" << parser.value(traceFileOption);
+    return exitCode;
+}
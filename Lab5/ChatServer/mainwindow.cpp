@@ -1,45 +1,96 @@
-#include "mainwindow.h"
-#include "ui_mainwindow.h"
-#include <QMessageBox>
-
-
-MainWindow::MainWindow(QWidget *parent)
-    : QMainWindow(parent)
-    , ui(new Ui::MainWindow)
-{
-    ui->setupUi(this);
-    m_chatServer = new chatServer(this);
-
-    connect(m_chatServer,&chatServer::logMessage,this,&MainWindow::logMessage);
-}
-
-MainWindow::~MainWindow()
-{
-    delete ui;
-}
-
-void MainWindow::on_startStopButton_clicked()
-{
-    if(m_chatServer->isListening()){
-        m_chatServer->stopServer();
-        ui->startStopButton->setText("启动服务器");
-        logMessage("服务器已经停止");
-    }
-    else
-    {
-        if(!m_chatServer->listen(QHostAddress::Any,1967)){
-            QMessageBox::critical(this,"错误","无法启动服务器");
-            return;
-        }
-        logMessage("服务器已经启动");
-        ui->startStopButton->setText("停止服务器");
-    }
-}
-
-void MainWindow::logMessage(const QString &msg)
-{
-    ui->logEditor->appendPlainText(msg);
-}
-
-
-
+#include "mainwindow.h"
+#include "ui_mainwindow.h"
+#include <QMessageBox>
+#include <QFileDialog>
+#include <QTextDocument>
+#include "chattrace.h"
+
+// 日志窗口最多保留的行数，更早的日志自动丢掉
+static const int MaxLogLines = 5000;
+
+
+MainWindow::MainWindow(QWidget *parent)
+    : QMainWindow(parent)
+    , ui(new Ui::MainWindow)
+    , m_port(1967)
+{
+    ui->setupUi(this);
+    ui->logEditor->setMaximumBlockCount(MaxLogLines);
+    m_chatServer = new chatServer(this);
+
+    connect(m_chatServer,&chatServer::logMessage,this,&MainWindow::logMessage);
+}
+
+MainWindow::~MainWindow()
+{
+    delete ui;
+}
+
+chatServer *MainWindow::server() const
+{
+    return m_chatServer;
+}
+
+bool MainWindow::takeOver(const QString &path)
+{
+    if(!m_chatServer->takeOver(path))
+        return false;
+    if(m_chatServer->listenLocal())
+        logMessage("本地套接字已经启动");
+    if(m_chatServer->listenWebSocket())
+        logMessage("WebSocket 端口已经启动");
+    logMessage("服务器已经从旧进程接管");
+    ui->startStopButton->setText("停止服务器");
+    return true;
+}
+
+void MainWindow::setPort(quint16 port)
+{
+    m_port = port;
+}
+
+void MainWindow::on_startStopButton_clicked()
+{
+    if(m_chatServer->isListening()){
+        m_chatServer->stopServer();
+        ui->startStopButton->setText("启动服务器");
+        logMessage("服务器已经停止");
+    }
+    else
+    {
+        if(!m_chatServer->listen(QHostAddress::Any,m_port)){
+            QMessageBox::critical(this,"错误","无法启动服务器");
+            return;
+        }
+        if(m_chatServer->listenLocal())
+            logMessage("本地套接字已经启动");
+        if(m_chatServer->listenWebSocket())
+            logMessage("WebSocket 端口已经启动");
+        logMessage("服务器已经启动");
+        ui->startStopButton->setText("停止服务器");
+    }
+}
+
+void MainWindow::on_traceButton_clicked()
+{
+    if(!ChatTrace::isEnabled()){
+        QMessageBox::information(this,"追踪","追踪没有开启，启动时加上 --trace N 参数");
+        return;
+    }
+    const QString fileName = QFileDialog::getSaveFileName(this,"导出追踪","chattrace.json","追踪文件 (*.json)");
+    if(fileName.isEmpty())
+        return;
+    if(ChatTrace::dump(fileName))
+        logMessage(QString("追踪已导出到 %1，可以用 chrome://tracing 或 Perfetto 打开").arg(fileName));
+    else
+        QMessageBox::critical(this,"错误","无法写入追踪文件");
+}
+
+void MainWindow::logMessage(const QString &msg)
+{
+    ui->logEditor->appendPlainText(msg);
+    m_chatServer->memoryBudget()->report(MemoryBudget::Log,ui->logEditor->document()->characterCount() * qint64(sizeof(QChar)));
+}
+
+
+
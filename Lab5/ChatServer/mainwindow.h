@@ -1,32 +1,38 @@
-#ifndef MAINWINDOW_H
-#define MAINWINDOW_H
-
-#include <QMainWindow>
-#include "chatserver.h"
-
-QT_BEGIN_NAMESPACE
-namespace Ui {
-class MainWindow;
-}
-QT_END_NAMESPACE
-
-class MainWindow : public QMainWindow
-{
-    Q_OBJECT
-
-public:
-    MainWindow(QWidget *parent = nullptr);
-    ~MainWindow();
-
-private slots:
-    void on_startStopButton_clicked();
-
-
-public slots:
-    void logMessage(const QString & msg);
-
-private:
-    Ui::MainWindow *ui;
-    chatServer *m_chatServer;
-};
-#endif // MAINWINDOW_H
+#ifndef MAINWINDOW_H
+#define MAINWINDOW_H
+
+#include <QMainWindow>
+#include "chatserver.h"
+
+QT_BEGIN_NAMESPACE
+namespace Ui {
+class MainWindow;
+}
+QT_END_NAMESPACE
+
+class MainWindow : public QMainWindow
+{
+    Q_OBJECT
+
+public:
+    MainWindow(QWidget *parent = nullptr);
+    ~MainWindow();
+    chatServer *server() const;
+    // 不停机重启：从旧进程接管连接，成功后界面显示为已启动
+    bool takeOver(const QString &path);
+    void setPort(quint16 port);
+
+private slots:
+    void on_startStopButton_clicked();
+    void on_traceButton_clicked();
+
+
+public slots:
+    void logMessage(const QString & msg);
+
+private:
+    Ui::MainWindow *ui;
+    chatServer *m_chatServer;
+    quint16 m_port;
+};
+#endif // MAINWINDOW_H
@@ -0,0 +1,96 @@
+#include "memorybudget.h"
+
+// 各级开始生效时占上限的百分比
+static const int TierPercent[] = {0,60,75,85,95};
+// 降级时要低于阈值这么多个百分点
+static const int HysteresisPercent = 5;
+
+MemoryBudget::MemoryBudget()
+    : m_limit(0), m_tier(Normal)
+{
+    for(qint64 &usage : m_usage)
+        usage = 0;
+}
+
+void MemoryBudget::setLimit(qint64 bytes)
+{
+    m_limit = qMax<qint64>(0,bytes);
+}
+
+qint64 MemoryBudget::limit() const
+{
+    return m_limit;
+}
+
+void MemoryBudget::report(Account account, qint64 bytes)
+{
+    m_usage[account] = qMax<qint64>(0,bytes);
+}
+
+qint64 MemoryBudget::usage(Account account) const
+{
+    return m_usage[account];
+}
+
+qint64 MemoryBudget::total() const
+{
+    qint64 total = 0;
+    for(qint64 usage : m_usage)
+        total += usage;
+    return total;
+}
+
+MemoryBudget::Tier MemoryBudget::update()
+{
+    if(m_limit <= 0){
+        m_tier = Normal;
+        return m_tier;
+    }
+    const qint64 used = total();
+    Tier tier = Normal;
+    for(int level = ShedConnections; level > Normal; level--){
+        // 已经在这一级或更高时，用量降到阈值以下一点才退回去
+        const int percent = level <= m_tier ? TierPercent[level] - HysteresisPercent : TierPercent[level];
+        if(used * 100 >= m_limit * percent){
+            tier = Tier(level);
+            break;
+        }
+    }
+    m_tier = tier;
+    return m_tier;
+}
+
+MemoryBudget::Tier MemoryBudget::tier() const
+{
+    return m_tier;
+}
+
+qint64 MemoryBudget::threshold(Tier tier) const
+{
+    return m_limit * TierPercent[tier] / 100;
+}
+
+QJsonObject MemoryBudget::toJson() const
+{
+    QJsonObject accounts;
+    for(int account = 0; account < AccountCount; account++)
+        accounts[accountName(Account(account))] = QJsonValue(m_usage[account]);
+    QJsonObject json;
+    json["limit"] = QJsonValue(m_limit);
+    json["total"] = QJsonValue(total());
+    json["tier"] = tierName(m_tier);
+    json["accounts"] = accounts;
+    return json;
+}
+
+const char *MemoryBudget::accountName(Account account)
+{
+    static const char *const names[AccountCount] = {"receive","socket","outbound","history","receipts","log","search"};
+    return names[account];
+}
+
+const char *MemoryBudget::tierName(Tier tier)
+{
+    static const char *const names[] = {"normal","shrinkHistory","dropBulk","refuseLogins","shedConnections"};
+    return names[tier];
+}
@@ -0,0 +1,55 @@
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+#include <QJsonObject>
+#include <QtGlobal>
+
+// 全局内存预算：各子系统定时报告自己占用的字节数，总量越接近上限，服务器的应对越激进
+class MemoryBudget
+{
+public:
+    enum Account {
+        ReceiveBuffers,     // 连接上还没解析完的入站数据
+        SocketBuffers,      // 已经交给套接字还没写进内核的数据
+        OutboundQueues,     // 各发送通道里排队的帧
+        History,            // 房间补发用的最近消息
+        Receipts,           // 已读回执位图
+        Log,                // 日志窗口
+        Search,             // 聊天记录的检索索引
+        AccountCount
+    };
+
+    // 逐级加重：缩短补发历史、丢掉大块通道、拒绝新登录、断开占用最多的连接
+    enum Tier {
+        Normal,
+        ShrinkHistory,
+        DropBulk,
+        RefuseLogins,
+        ShedConnections
+    };
+
+    MemoryBudget();
+
+    // 0 表示不限
+    void setLimit(qint64 bytes);
+    qint64 limit() const;
+    void report(Account account,qint64 bytes);
+    qint64 usage(Account account) const;
+    qint64 total() const;
+    // 按当前用量重新计算级别；降级时留 5% 的余量，避免在阈值附近来回切换
+    Tier update();
+    Tier tier() const;
+    // 某一级开始生效时的用量
+    qint64 threshold(Tier tier) const;
+    QJsonObject toJson() const;
+
+    static const char *accountName(Account account);
+    static const char *tierName(Tier tier);
+
+private:
+    qint64 m_limit;
+    qint64 m_usage[AccountCount];
+    Tier m_tier;
+};
+
+#endif // MEMORYBUDGET_H
@@ -0,0 +1,117 @@
+#include "messagefilter.h"
+#include <QFile>
+#include <QTextStream>
+#include <QDateTime>
+#include <QUrl>
+
+WordListFilter::WordListFilter(const QStringList &words)
+{
+    for(const QString &word : words){
+        const QString trimmed = word.trimmed();
+        if(!trimmed.isEmpty())
+            m_words.append(trimmed);
+    }
+}
+
+WordListFilter *WordListFilter::fromFile(const QString &fileName)
+{
+    QFile file(fileName);
+    if(!file.open(QIODevice::ReadOnly | QIODevice::Text))
+        return nullptr;
+    QStringList words;
+    QTextStream in(&file);
+    while(!in.atEnd())
+        words.append(in.readLine());
+    return new WordListFilter(words);
+}
+
+QString WordListFilter::name() const
+{
+    return QStringLiteral("words");
+}
+
+MessageFilter::Verdict WordListFilter::filter(const QString &sender, QString &text, QString &reason)
+{
+    Q_UNUSED(sender);
+    Q_UNUSED(reason);
+    for(const QString &word : m_words){
+        qsizetype pos = 0;
+        while((pos = text.indexOf(word,pos,Qt::CaseInsensitive)) >= 0){
+            text.replace(pos,word.size(),QString(word.size(),QLatin1Char('*')));
+            pos += word.size();
+        }
+    }
+    return Accept;
+}
+
+LinkFilter::LinkFilter(const QStringList &allowedHosts)
+    : m_allowedHosts(allowedHosts)
+    , m_linkPattern(QStringLiteral("(?:https?://|www\\.)[^\\s]+"),QRegularExpression::CaseInsensitiveOption)
+{
+}
+
+QString LinkFilter::name() const
+{
+    return QStringLiteral("links");
+}
+
+MessageFilter::Verdict LinkFilter::filter(const QString &sender, QString &text, QString &reason)
+{
+    Q_UNUSED(sender);
+    QRegularExpressionMatchIterator it = m_linkPattern.globalMatch(text);
+    while(it.hasNext()){
+        QString link = it.next().captured(0);
+        if(!link.contains(QLatin1String("://")))
+            link.prepend(QLatin1String("http://"));
+        const QString host = QUrl(link).host().toLower();
+        bool allowed = false;
+        for(const QString &allowedHost : m_allowedHosts){
+            if(host == allowedHost || host.endsWith(QLatin1Char('.') + allowedHost)){
+                allowed = true;
+                break;
+            }
+        }
+        if(!allowed){
+            reason = QString("不允许发送链接：%1").arg(host);
+            return Reject;
+        }
+    }
+    return Accept;
+}
+
+DuplicateFilter::DuplicateFilter(int maxRepeats, int windowMs)
+    : m_maxRepeats(maxRepeats), m_windowMs(windowMs)
+{
+}
+
+QString DuplicateFilter::name() const
+{
+    return QStringLiteral("duplicates");
+}
+
+MessageFilter::Verdict DuplicateFilter::filter(const QString &sender, QString &text, QString &reason)
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QMutexLocker locker(&m_mutex);
+    if(m_history.size() > 4096){
+        for(auto it = m_history.begin(); it != m_history.end();){
+            if(now - it->lastMs >= m_windowMs)
+                it = m_history.erase(it);
+            else
+                ++it;
+        }
+    }
+    History &history = m_history[sender];
+    if(history.lastText == text && now - history.lastMs < m_windowMs){
+        history.repeats++;
+    }else{
+        history.lastText = text;
+        history.repeats = 1;
+    }
+    history.lastMs = now;
+    if(history.repeats > m_maxRepeats){
+        reason = "请不要重复发送相同的消息";
+        return Reject;
+    }
+    return Accept;
+}
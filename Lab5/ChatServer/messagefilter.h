@@ -0,0 +1,76 @@
+#ifndef MESSAGEFILTER_H
+#define MESSAGEFILTER_H
+
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QMutex>
+#include <QRegularExpression>
+
+// 消息过滤器接口，filter() 在过滤线程池中调用，实现必须是线程安全的
+class MessageFilter
+{
+public:
+    enum Verdict {
+        Accept,
+        Reject
+    };
+
+    virtual ~MessageFilter() = default;
+    virtual QString name() const = 0;
+    // 可以直接修改 text；返回 Reject 时通过 reason 说明原因
+    virtual Verdict filter(const QString &sender, QString &text, QString &reason) = 0;
+};
+
+// 敏感词过滤：把命中的词替换成 *
+class WordListFilter : public MessageFilter
+{
+public:
+    explicit WordListFilter(const QStringList &words);
+    static WordListFilter *fromFile(const QString &fileName);
+
+    QString name() const override;
+    Verdict filter(const QString &sender, QString &text, QString &reason) override;
+
+private:
+    QStringList m_words;
+};
+
+// 链接检查：只允许白名单里的域名
+class LinkFilter : public MessageFilter
+{
+public:
+    explicit LinkFilter(const QStringList &allowedHosts = QStringList());
+
+    QString name() const override;
+    Verdict filter(const QString &sender, QString &text, QString &reason) override;
+
+private:
+    QStringList m_allowedHosts;
+    QRegularExpression m_linkPattern;
+};
+
+// 刷屏检测：同一个用户在时间窗口内重复发送相同内容
+class DuplicateFilter : public MessageFilter
+{
+public:
+    explicit DuplicateFilter(int maxRepeats = 3, int windowMs = 10000);
+
+    QString name() const override;
+    Verdict filter(const QString &sender, QString &text, QString &reason) override;
+
+private:
+    struct History
+    {
+        QString lastText;
+        int repeats = 0;
+        qint64 lastMs = 0;
+    };
+
+    int m_maxRepeats;
+    int m_windowMs;
+    QMutex m_mutex;
+    QHash<QString, History> m_history;
+};
+
+#endif // MESSAGEFILTER_H
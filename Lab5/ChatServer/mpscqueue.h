@@ -0,0 +1,86 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+// 无锁多生产者单消费者队列（Vyukov 侵入式链表）
+// push 可以在任意线程调用，pop 只能由同一个消费者线程调用
+template <typename T>
+class MpscQueue
+{
+public:
+    MpscQueue()
+        : m_head(&m_stub), m_tail(&m_stub)
+    {
+        m_stub.next.store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~MpscQueue()
+    {
+        T value;
+        while(pop(value)){
+        }
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    void push(T value)
+    {
+        pushNode(new Node(std::move(value)));
+    }
+
+    // 生产者正在写入时可能暂时返回 false，调用方需要在下一次唤醒时重试
+    bool pop(T &out)
+    {
+        Node *tail = m_tail;
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if(tail == &m_stub){
+            if(next == nullptr)
+                return false;
+            m_tail = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if(next != nullptr){
+            m_tail = next;
+            out = std::move(tail->value);
+            delete tail;
+            return true;
+        }
+        if(tail != m_head.load(std::memory_order_acquire))
+            return false;
+        pushNode(&m_stub);
+        next = tail->next.load(std::memory_order_acquire);
+        if(next != nullptr){
+            m_tail = next;
+            out = std::move(tail->value);
+            delete tail;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    struct Node
+    {
+        Node() = default;
+        explicit Node(T &&v) : value(std::move(v)) {}
+        std::atomic<Node*> next{nullptr};
+        T value{};
+    };
+
+    void pushNode(Node *node)
+    {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        Node *prev = m_head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    std::atomic<Node*> m_head;
+    Node *m_tail;
+    Node m_stub;
+};
+
+#endif // MPSCQUEUE_H
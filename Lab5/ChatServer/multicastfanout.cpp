@@ -0,0 +1,83 @@
+#include "multicastfanout.h"
+
+static const int MaxDatagramSize = 1400;
+
+MulticastFanout::MulticastFanout(QObject *parent)
+    : QObject{parent}
+    , m_enabled(false)
+    , m_threshold(50)
+    , m_port(1968)
+{
+    m_socket = new QUdpSocket(this);
+    m_socket->bind(QHostAddress(QHostAddress::AnyIPv4),0);
+    // 只在本网段内传播；打开回环以便在同一台机器上测试
+    m_socket->setSocketOption(QAbstractSocket::MulticastTtlOption,1);
+    m_socket->setSocketOption(QAbstractSocket::MulticastLoopbackOption,1);
+
+    m_heartbeat = new QTimer(this);
+    m_heartbeat->setInterval(1000);
+    connect(m_heartbeat,&QTimer::timeout,this,&MulticastFanout::heartbeatDue);
+}
+
+bool MulticastFanout::isEnabled() const
+{
+    return m_enabled;
+}
+
+void MulticastFanout::setEnabled(bool enabled)
+{
+    m_enabled = enabled;
+    if(enabled)
+        m_heartbeat->start();
+    else
+        m_heartbeat->stop();
+}
+
+int MulticastFanout::threshold() const
+{
+    return m_threshold;
+}
+
+void MulticastFanout::setThreshold(int threshold)
+{
+    m_threshold = qMax(1,threshold);
+}
+
+quint16 MulticastFanout::port() const
+{
+    return m_port;
+}
+
+void MulticastFanout::setPort(quint16 port)
+{
+    m_port = port;
+}
+
+void MulticastFanout::setInterface(const QNetworkInterface &iface)
+{
+    m_socket->setMulticastInterface(iface);
+}
+
+QHostAddress MulticastFanout::groupFor(const QString &room) const
+{
+    // FNV-1a，保证不同进程对同一个房间算出相同的组地址
+    quint32 hash = 2166136261u;
+    for(const char c : room.toUtf8()){
+        hash ^= quint8(c);
+        hash *= 16777619u;
+    }
+    quint32 low = hash & 0xffff;
+    if(low == 0 || low == 0xffff)
+        low = 1;
+    return QHostAddress(quint32(0xefff0000u) | low);   // 239.255.x.y
+}
+
+bool MulticastFanout::fits(const QByteArray &frame) const
+{
+    return frame.size() <= MaxDatagramSize;
+}
+
+void MulticastFanout::send(const QHostAddress &group, const QByteArray &frame)
+{
+    m_socket->writeDatagram(frame,group,m_port);
+}
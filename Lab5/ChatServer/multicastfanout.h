@@ -0,0 +1,45 @@
+#ifndef MULTICASTFANOUT_H
+#define MULTICASTFANOUT_H
+
+#include <QObject>
+#include <QUdpSocket>
+#include <QHostAddress>
+#include <QTimer>
+#include <QNetworkInterface>
+
+// 大房间的局域网组播：每条消息只发一次 UDP 数据报，
+// 客户端按房间序号发现丢包后通过原有 TCP 连接补发（nack）
+class MulticastFanout : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit MulticastFanout(QObject *parent = nullptr);
+
+    bool isEnabled() const;
+    void setEnabled(bool enabled);
+    // 房间里支持组播的成员达到这个数量才启用组播
+    int threshold() const;
+    void setThreshold(int threshold);
+    quint16 port() const;
+    void setPort(quint16 port);
+    void setInterface(const QNetworkInterface &iface);
+
+    QHostAddress groupFor(const QString &room) const;
+    // 超过一个 MTU 的帧不走组播，避免 IP 分片
+    bool fits(const QByteArray &frame) const;
+    void send(const QHostAddress &group,const QByteArray &frame);
+
+signals:
+    // 定时发送房间最新序号，客户端据此发现尾部丢包
+    void heartbeatDue();
+
+private:
+    QUdpSocket *m_socket;
+    QTimer *m_heartbeat;
+    bool m_enabled;
+    int m_threshold;
+    quint16 m_port;
+};
+
+#endif // MULTICASTFANOUT_H
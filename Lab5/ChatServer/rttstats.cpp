@@ -0,0 +1,120 @@
+#include "rttstats.h"
+#include <QtAlgorithms>
+#include <cstring>
+
+RttStats::RttStats()
+{
+    clear();
+}
+
+void RttStats::add(qint64 rttUs)
+{
+    rttUs = qMax<qint64>(rttUs,0);
+    m_buckets[bucketFor(rttUs)]++;
+    if(m_count == 0){
+        m_smoothedUs = rttUs;
+        m_minUs = rttUs;
+        m_maxUs = rttUs;
+    }else{
+        m_smoothedUs += (rttUs - m_smoothedUs) / 8;
+        m_minUs = qMin(m_minUs,rttUs);
+        m_maxUs = qMax(m_maxUs,rttUs);
+    }
+    m_count++;
+}
+
+void RttStats::merge(const RttStats &other)
+{
+    if(other.m_count == 0)
+        return;
+    for(int i = 0; i < BucketCount; i++)
+        m_buckets[i] += other.m_buckets[i];
+    if(m_count == 0){
+        m_smoothedUs = other.m_smoothedUs;
+        m_minUs = other.m_minUs;
+        m_maxUs = other.m_maxUs;
+    }else{
+        // 汇总时按样本数加权
+        m_smoothedUs = qint64((double(m_smoothedUs) * m_count + double(other.m_smoothedUs) * other.m_count)
+                              / double(m_count + other.m_count));
+        m_minUs = qMin(m_minUs,other.m_minUs);
+        m_maxUs = qMax(m_maxUs,other.m_maxUs);
+    }
+    m_count += other.m_count;
+}
+
+void RttStats::clear()
+{
+    std::memset(m_buckets,0,sizeof(m_buckets));
+    m_count = 0;
+    m_smoothedUs = 0;
+    m_minUs = 0;
+    m_maxUs = 0;
+}
+
+quint64 RttStats::count() const
+{
+    return m_count;
+}
+
+qint64 RttStats::smoothedUs() const
+{
+    return m_smoothedUs;
+}
+
+qint64 RttStats::minUs() const
+{
+    return m_minUs;
+}
+
+qint64 RttStats::maxUs() const
+{
+    return m_maxUs;
+}
+
+qint64 RttStats::percentileUs(double p) const
+{
+    if(m_count == 0)
+        return 0;
+    const quint64 target = qMax<quint64>(1,quint64(double(m_count) * qBound(0.0,p,100.0) / 100.0 + 0.5));
+    quint64 seen = 0;
+    for(int i = 0; i < BucketCount; i++){
+        seen += m_buckets[i];
+        if(seen >= target)
+            return qMin(bucketUpperBound(i),m_maxUs);
+    }
+    return m_maxUs;
+}
+
+QJsonObject RttStats::toJson() const
+{
+    QJsonObject json;
+    json["count"] = QJsonValue(qint64(m_count));
+    json["srttUs"] = QJsonValue(m_smoothedUs);
+    json["minUs"] = QJsonValue(m_minUs);
+    json["maxUs"] = QJsonValue(m_maxUs);
+    json["p50Us"] = QJsonValue(percentileUs(50));
+    json["p90Us"] = QJsonValue(percentileUs(90));
+    json["p99Us"] = QJsonValue(percentileUs(99));
+    return json;
+}
+
+int RttStats::bucketFor(qint64 us)
+{
+    // 小于 SubBuckets 的值直接落在前几个桶里
+    if(us < SubBuckets)
+        return int(us);
+    const int exponent = 63 - int(qCountLeadingZeroBits(quint64(us)));
+    const int sub = int((us >> (exponent - 2)) & (SubBuckets - 1));
+    const int bucket = (exponent - 1) * SubBuckets + sub;
+    return qMin(bucket,BucketCount - 1);
+}
+
+qint64 RttStats::bucketUpperBound(int bucket)
+{
+    if(bucket < SubBuckets)
+        return bucket;
+    const int exponent = bucket / SubBuckets + 1;
+    const int sub = bucket % SubBuckets;
+    return ((qint64(SubBuckets + sub + 1)) << (exponent - 2)) - 1;
+}
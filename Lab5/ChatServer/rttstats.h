@@ -0,0 +1,40 @@
+#ifndef RTTSTATS_H
+#define RTTSTATS_H
+
+#include <QtGlobal>
+#include <QJsonObject>
+
+// 往返时延统计：EWMA 加对数分桶直方图（每个 2 的幂再分 4 档，误差在 25% 以内）
+// 每个连接一份，服务器再汇总一份总的分布
+class RttStats
+{
+public:
+    RttStats();
+
+    void add(qint64 rttUs);
+    void merge(const RttStats &other);
+    void clear();
+
+    quint64 count() const;
+    // 平滑后的往返时延，和 TCP 的 SRTT 一样取 1/8 的权重
+    qint64 smoothedUs() const;
+    qint64 minUs() const;
+    qint64 maxUs() const;
+    // p 取 0~100，返回所在分桶的上界
+    qint64 percentileUs(double p) const;
+    QJsonObject toJson() const;
+
+private:
+    static const int SubBuckets = 4;
+    static const int BucketCount = 40 * SubBuckets;
+    static int bucketFor(qint64 us);
+    static qint64 bucketUpperBound(int bucket);
+
+    quint32 m_buckets[BucketCount];
+    quint64 m_count;
+    qint64 m_smoothedUs;
+    qint64 m_minUs;
+    qint64 m_maxUs;
+};
+
+#endif // RTTSTATS_H
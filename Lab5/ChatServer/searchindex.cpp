@@ -0,0 +1,401 @@
+#include "searchindex.h"
+#include "chattrace.h"
+#include <QThread>
+#include <QFile>
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <algorithm>
+#include <limits>
+
+// 单个词最长的字符数，更长的截断
+static const int MaxWordLength = 64;
+// 一页最多返回的条数
+static const int MaxPageSize = 50;
+// 每个房间在内存里最多留的消息数，到了上限丢掉较早的一半
+static const int MaxDocumentsPerRoom = 200000;
+// 词典里每个词除了倒排表之外的开销（键、哈希节点），估算内存用
+static const int TermOverheadBytes = 64;
+
+static qint64 documentBytes(const QString &sender,const QString &text)
+{
+    return qint64(sizeof(quint64) * 2 + sizeof(QString) * 2) + (sender.size() + text.size()) * qint64(sizeof(QChar));
+}
+
+static bool isCjk(char32_t c)
+{
+    return (c >= 0x3040 && c <= 0x30ff)      // 平假名、片假名
+        || (c >= 0x3400 && c <= 0x4dbf)
+        || (c >= 0x4e00 && c <= 0x9fff)
+        || (c >= 0xac00 && c <= 0xd7af)      // 谚文音节
+        || (c >= 0xf900 && c <= 0xfaff)
+        || (c >= 0x20000 && c <= 0x2fa1f);
+}
+
+static void appendVarint(QByteArray &out, quint32 value)
+{
+    while(value >= 0x80){
+        out.append(char((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.append(char(value));
+}
+
+void SearchIndex::Postings::append(quint32 doc)
+{
+    appendVarint(deltas,count == 0 ? doc : doc - last);
+    last = doc;
+    count++;
+}
+
+QVector<quint32> SearchIndex::Postings::decode() const
+{
+    QVector<quint32> docs;
+    docs.reserve(count);
+    quint32 doc = 0;
+    quint32 value = 0;
+    int shift = 0;
+    for(const char byte : deltas){
+        value |= quint32(quint8(byte) & 0x7f) << shift;
+        if(quint8(byte) & 0x80){
+            shift += 7;
+            continue;
+        }
+        doc = docs.isEmpty() ? value : doc + value;
+        docs.append(doc);
+        value = 0;
+        shift = 0;
+    }
+    return docs;
+}
+
+SearchIndex::SearchIndex(QObject *parent)
+    : QObject{parent}
+    , m_thread(nullptr)
+    , m_context(nullptr)
+    , m_drainScheduled(false)
+    , m_log(nullptr)
+    , m_documents(0)
+    , m_terms(0)
+    , m_postingBytes(0)
+    , m_documentBytes(0)
+    , m_queries(0)
+    , m_lastQueryUs(0)
+{
+}
+
+SearchIndex::~SearchIndex()
+{
+    if(m_thread){
+        m_thread->quit();
+        m_thread->wait();
+        delete m_context;
+        delete m_thread;
+    }
+    Task *task;
+    while(m_tasks.pop(task))
+        delete task;
+    delete m_log;
+}
+
+bool SearchIndex::setLogFile(const QString &fileName)
+{
+    if(m_thread)
+        return false;
+    // 先在这里试一下能不能写，读旧记录和追加都在后台线程里做
+    QFile file(fileName);
+    if(!file.open(QIODevice::Append))
+        return false;
+    file.close();
+    m_logFileName = fileName;
+    start();
+    return true;
+}
+
+void SearchIndex::start()
+{
+    m_thread = new QThread;
+    m_thread->setObjectName("search");
+    m_context = new QObject;
+    m_context->moveToThread(m_thread);
+    m_thread->start();
+    // 在任何任务之前执行，查询总能看到日志里的旧消息
+    QMetaObject::invokeMethod(m_context,[this]{ loadLog(); },Qt::QueuedConnection);
+}
+
+void SearchIndex::add(const QString &room, quint64 seq, const QString &sender, const QString &text)
+{
+    Task *task = new Task;
+    task->room = room;
+    task->seq = seq;
+    task->sender = sender;
+    task->text = text;
+    task->time = QDateTime::currentMSecsSinceEpoch();
+    push(task);
+}
+
+void SearchIndex::search(quint64 requestId, const QString &room, const QString &query, qint64 before, int limit)
+{
+    Task *task = new Task;
+    task->kind = QueryTask;
+    task->requestId = requestId;
+    task->room = room;
+    task->text = query;
+    task->before = before;
+    task->limit = qBound(1,limit,MaxPageSize);
+    push(task);
+}
+
+void SearchIndex::trim(int maxDocuments)
+{
+    Task *task = new Task;
+    task->kind = TrimTask;
+    task->limit = qMax(0,maxDocuments);
+    push(task);
+}
+
+qint64 SearchIndex::memoryUsage() const
+{
+    return m_documentBytes.load() + m_postingBytes.load() + qint64(m_terms.load()) * TermOverheadBytes;
+}
+
+void SearchIndex::push(Task *task)
+{
+    if(!m_thread)
+        start();
+    m_tasks.push(task);
+    if(!m_drainScheduled.exchange(true))
+        QMetaObject::invokeMethod(m_context,[this]{ drain(); },Qt::QueuedConnection);
+}
+
+void SearchIndex::drain()
+{
+    m_drainScheduled.store(false);
+    Task *task;
+    while(m_tasks.pop(task)){
+        if(task->kind == QueryTask){
+            const qint64 beginNs = ChatTrace::now();
+            const QJsonObject result = query(*task);
+            m_lastQueryUs.store((ChatTrace::now() - beginNs) / 1000);
+            m_queries++;
+            const quint64 requestId = task->requestId;
+            QMetaObject::invokeMethod(this,[this,requestId,result]{
+                emit searchFinished(requestId,result);
+            },Qt::QueuedConnection);
+        }else if(task->kind == TrimTask){
+            for(RoomIndex &room : m_rooms)
+                trimRoom(room,task->limit);
+        }else{
+            index(*task);
+        }
+        delete task;
+    }
+    // 一批消息写完再刷一次盘
+    if(m_log)
+        m_log->flush();
+}
+
+void SearchIndex::loadLog()
+{
+    if(m_logFileName.isEmpty())
+        return;
+    QFile file(m_logFileName);
+    int loaded = 0;
+    if(file.open(QIODevice::ReadOnly)){
+        while(!file.atEnd()){
+            const QJsonObject record = QJsonDocument::fromJson(file.readLine()).object();
+            if(record.isEmpty())
+                continue;
+            Task task;
+            task.room = record.value("room").toString();
+            task.seq = quint64(record.value("seq").toInteger());
+            task.sender = record.value("sender").toString();
+            task.text = record.value("text").toString();
+            task.time = record.value("time").toInteger();
+            index(task);
+            loaded++;
+        }
+        file.close();
+    }
+    // 读完之后才打开追加，旧记录不会再写一遍
+    m_log = new QFile(m_logFileName);
+    if(!m_log->open(QIODevice::Append)){
+        delete m_log;
+        m_log = nullptr;
+    }
+    const QString message = QString("检索索引从日志读入%1条消息").arg(loaded);
+    QMetaObject::invokeMethod(this,[this,message]{
+        emit logMessage(message);
+    },Qt::QueuedConnection);
+}
+
+void SearchIndex::index(const Task &task)
+{
+    if(task.room.isEmpty() || task.text.isEmpty())
+        return;
+    RoomIndex &room = m_rooms[task.room];
+    if(room.documents.size() >= MaxDocumentsPerRoom)
+        trimRoom(room,MaxDocumentsPerRoom / 2);
+    const quint32 doc = room.base + quint32(room.documents.size());
+    room.documents.append(Document{task.seq,task.time,task.sender,task.text});
+    m_documents++;
+    m_documentBytes += documentBytes(task.sender,task.text);
+    addPostings(room,doc,task.text);
+
+    if(m_log){
+        QJsonObject record;
+        record["room"] = task.room;
+        record["seq"] = QJsonValue(qint64(task.seq));
+        record["sender"] = task.sender;
+        record["text"] = task.text;
+        record["time"] = QJsonValue(task.time);
+        m_log->write(QJsonDocument(record).toJson(QJsonDocument::Compact) + '\n');
+    }
+}
+
+void SearchIndex::addPostings(RoomIndex &room, quint32 doc, const QString &text)
+{
+    for(const QString &term : tokenize(text)){
+        auto it = room.postings.find(term);
+        if(it == room.postings.end()){
+            it = room.postings.insert(term,Postings());
+            m_terms++;
+        }
+        const qsizetype before = it->deltas.size();
+        it->append(doc);
+        m_postingBytes += it->deltas.size() - before;
+    }
+}
+
+void SearchIndex::trimRoom(RoomIndex &room, int keep)
+{
+    const qsizetype drop = room.documents.size() - keep;
+    if(drop <= 0)
+        return;
+    for(qsizetype i = 0; i < drop; i++)
+        m_documentBytes -= documentBytes(room.documents.at(i).sender,room.documents.at(i).text);
+    room.documents.remove(0,drop);
+    room.base += quint32(drop);
+    m_documents -= quint64(drop);
+    for(const Postings &postings : std::as_const(room.postings))
+        m_postingBytes -= postings.deltas.size();
+    m_terms -= quint64(room.postings.size());
+    room.postings.clear();
+    for(qsizetype i = 0; i < room.documents.size(); i++)
+        addPostings(room,room.base + quint32(i),room.documents.at(i).text);
+}
+
+QJsonObject SearchIndex::query(const Task &task) const
+{
+    QJsonObject result;
+    result["type"] = "searchResults";
+    result["room"] = task.room;
+    result["query"] = task.text;
+
+    // 所有词都出现的消息；先从最短的倒排表开始交
+    QVector<quint32> matches;
+    const auto room = m_rooms.constFind(task.room);
+    const QStringList terms = tokenize(task.text,true);
+    if(room != m_rooms.constEnd() && !terms.isEmpty()){
+        QVector<const Postings*> lists;
+        for(const QString &term : terms){
+            const auto it = room->postings.constFind(term);
+            if(it == room->postings.constEnd()){
+                lists.clear();
+                break;
+            }
+            lists.append(&it.value());
+        }
+        std::sort(lists.begin(),lists.end(),[](const Postings *a,const Postings *b){
+            return a->count < b->count;
+        });
+        for(int i = 0; i < lists.size(); i++){
+            if(i == 0){
+                matches = lists.at(i)->decode();
+                continue;
+            }
+            const QVector<quint32> docs = lists.at(i)->decode();
+            QVector<quint32> common;
+            std::set_intersection(matches.cbegin(),matches.cend(),docs.cbegin(),docs.cend(),std::back_inserter(common));
+            matches.swap(common);
+            if(matches.isEmpty())
+                break;
+        }
+    }
+
+    // 编号越大越新，从 before 往前取一页
+    auto end = matches.cend();
+    if(task.before >= 0)
+        end = std::lower_bound(matches.cbegin(),matches.cend(),quint32(qMin(task.before,qint64(std::numeric_limits<quint32>::max()))));
+    QJsonArray results;
+    auto it = end;
+    while(it != matches.cbegin() && results.size() < task.limit){
+        --it;
+        const Document &document = room->documents.at(*it - room->base);
+        QJsonObject item;
+        item["seq"] = QJsonValue(qint64(document.seq));
+        item["sender"] = document.sender;
+        item["text"] = document.text;
+        item["time"] = QJsonValue(document.time);
+        results.append(item);
+    }
+    result["total"] = int(matches.size());
+    result["results"] = results;
+    if(it != matches.cbegin())
+        result["next"] = QJsonValue(qint64(*it));
+    return result;
+}
+
+QStringList SearchIndex::tokenize(const QString &text, bool forQuery)
+{
+    QStringList terms;
+    QString word;
+    QVector<char32_t> run;
+    const auto flushWord = [&]{
+        if(!word.isEmpty())
+            terms.append(word);
+        word.clear();
+    };
+    const auto flushRun = [&]{
+        // 查询时单字只在整段只有一个字的时候需要
+        if(!forQuery || run.size() == 1){
+            for(const char32_t c : std::as_const(run))
+                terms.append(QString::fromUcs4(&c,1));
+        }
+        for(qsizetype i = 0; i + 1 < run.size(); i++)
+            terms.append(QString::fromUcs4(run.constData() + i,2));
+        run.clear();
+    };
+    for(const char32_t c : text.toUcs4()){
+        if(isCjk(c)){
+            flushWord();
+            run.append(c);
+        }else if(QChar::isLetterOrNumber(c)){
+            flushRun();
+            if(word.size() < MaxWordLength){
+                const char32_t lower = QChar::toLower(c);
+                word.append(QString::fromUcs4(&lower,1));
+            }
+        }else{
+            flushWord();
+            flushRun();
+        }
+    }
+    flushWord();
+    flushRun();
+    terms.removeDuplicates();
+    return terms;
+}
+
+QJsonObject SearchIndex::stats() const
+{
+    QJsonObject json;
+    json["documents"] = QJsonValue(qint64(m_documents.load()));
+    json["terms"] = QJsonValue(qint64(m_terms.load()));
+    json["postingBytes"] = QJsonValue(m_postingBytes.load());
+    json["memoryBytes"] = QJsonValue(memoryUsage());
+    json["queries"] = QJsonValue(qint64(m_queries.load()));
+    json["lastQueryUs"] = QJsonValue(m_lastQueryUs.load());
+    json["logFile"] = m_logFileName;
+    return json;
+}
@@ -0,0 +1,117 @@
+#ifndef SEARCHINDEX_H
+#define SEARCHINDEX_H
+
+#include <QObject>
+#include <QHash>
+#include <QVector>
+#include <QStringList>
+#include <QJsonObject>
+#include <atomic>
+#include "mpscqueue.h"
+
+class QThread;
+class QFile;
+
+// 聊天记录的全文检索：每个房间一份倒排索引，在后台线程里增量建立
+// 中文、日文、韩文按相邻两个字切词（单字也进索引），其他文字按字母数字连续的词切并转小写
+// 倒排表里的消息编号递增，存相邻编号的差值，用变长整数编码
+// 每个房间只在内存里留最近的一批消息，更早的只在日志文件里
+class SearchIndex : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit SearchIndex(QObject *parent = nullptr);
+    ~SearchIndex();
+
+    // 消息日志文件，每行一条 JSON；在第一次 add 之前设置，已有的记录在后台线程里读进索引
+    bool setLogFile(const QString &fileName);
+    // 以下两个在主线程调用，只是入队，不会阻塞广播；查询能看到在它之前加进来的所有消息
+    void add(const QString &room,quint64 seq,const QString &sender,const QString &text);
+    // before 是上一页返回的 next，-1 表示从最新的开始
+    void search(quint64 requestId,const QString &room,const QString &query,qint64 before,int limit);
+    // 内存紧张时每个房间只留最近 maxDocuments 条，同样只是入队
+    void trim(int maxDocuments);
+    // 消息正文、倒排表和词典大约占的字节数，报给内存预算
+    qint64 memoryUsage() const;
+
+    QJsonObject stats() const;
+    // 查询时去掉已经被相邻两字覆盖的单字，结果不变但要求交的倒排表少
+    static QStringList tokenize(const QString &text,bool forQuery = false);
+
+signals:
+    void searchFinished(quint64 requestId,const QJsonObject &result);
+    void logMessage(const QString &msg);
+
+private:
+    enum TaskKind
+    {
+        AddTask,
+        QueryTask,
+        TrimTask
+    };
+    struct Task
+    {
+        TaskKind kind = AddTask;
+        QString room;
+        QString sender;
+        QString text;
+        quint64 seq = 0;
+        qint64 time = 0;
+        quint64 requestId = 0;
+        qint64 before = -1;
+        int limit = 0;
+    };
+    struct Document
+    {
+        quint64 seq;
+        qint64 time;
+        QString sender;
+        QString text;
+    };
+    struct Postings
+    {
+        QByteArray deltas;
+        quint32 last = 0;
+        quint32 count = 0;
+
+        void append(quint32 doc);
+        QVector<quint32> decode() const;
+    };
+    // 消息编号从 base 开始，documents 的第 i 条编号是 base + i；丢掉旧消息时 base 往后移，
+    // 翻页用的编号不受影响
+    struct RoomIndex
+    {
+        quint32 base = 0;
+        QVector<Document> documents;
+        QHash<QString,Postings> postings;
+    };
+
+    void start();
+    void push(Task *task);
+    void drain();
+    void loadLog();
+    void index(const Task &task);
+    void addPostings(RoomIndex &room,quint32 doc,const QString &text);
+    // 只留最近 keep 条，倒排表按剩下的重建
+    void trimRoom(RoomIndex &room,int keep);
+    QJsonObject query(const Task &task) const;
+
+    QThread *m_thread;
+    QObject *m_context;
+    MpscQueue<Task*> m_tasks;
+    std::atomic<bool> m_drainScheduled;
+    QString m_logFileName;
+    // 以下只在后台线程里用
+    QFile *m_log;
+    QHash<QString,RoomIndex> m_rooms;
+
+    std::atomic<quint64> m_documents;
+    std::atomic<quint64> m_terms;
+    std::atomic<qint64> m_postingBytes;
+    std::atomic<qint64> m_documentBytes;
+    std::atomic<quint64> m_queries;
+    std::atomic<qint64> m_lastQueryUs;
+};
+
+#endif // SEARCHINDEX_H
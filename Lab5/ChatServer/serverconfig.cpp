@@ -0,0 +1,132 @@
+#include "serverconfig.h"
+#include <QJsonValue>
+#include <QMutex>
+#include <atomic>
+
+namespace {
+
+std::shared_ptr<const ServerConfig> &storage()
+{
+    static std::shared_ptr<const ServerConfig> config = std::make_shared<const ServerConfig>();
+    return config;
+}
+
+std::atomic<quint64> &versionCounter()
+{
+    static std::atomic<quint64> version{0};
+    return version;
+}
+
+QMutex &publishMutex()
+{
+    static QMutex mutex;
+    return mutex;
+}
+
+bool readInteger(const QJsonObject &json,const char *key,qint64 minimum,qint64 maximum,qint64 &value,QString *error)
+{
+    const QJsonValue jsonValue = json.value(QLatin1String(key));
+    if(jsonValue.isUndefined())
+        return true;
+    if(!jsonValue.isDouble() || jsonValue.toDouble() != double(jsonValue.toInteger())
+            || jsonValue.toInteger() < minimum || jsonValue.toInteger() > maximum){
+        if(error)
+            *error = QString("%1 必须是 %2 到 %3 之间的整数").arg(QLatin1String(key)).arg(minimum).arg(maximum);
+        return false;
+    }
+    value = jsonValue.toInteger();
+    return true;
+}
+
+bool readInteger(const QJsonObject &json,const char *key,int minimum,int maximum,int &value,QString *error)
+{
+    qint64 wide = value;
+    if(!readInteger(json,key,qint64(minimum),qint64(maximum),wide,error))
+        return false;
+    value = int(wide);
+    return true;
+}
+
+}
+
+QJsonObject ServerConfig::toJson() const
+{
+    QJsonObject json;
+    json["version"] = QJsonValue(qint64(version));
+    json["maxFrameBytes"] = QJsonValue(maxFrameBytes);
+    json["maxQueuedBytes"] = QJsonValue(maxQueuedBytes);
+    json["bulkLaneBytes"] = QJsonValue(bulkLaneBytes);
+    json["messagesPerSecond"] = messagesPerSecond;
+    json["messageBurst"] = messageBurst;
+    json["logSampleEvery"] = logSampleEvery;
+    json["filterThreads"] = filterThreads;
+    json["filterMaxPending"] = filterMaxPending;
+    json["presenceCoalesceMs"] = presenceCoalesceMs;
+    json["memoryBudgetBytes"] = QJsonValue(memoryBudgetBytes);
+    json["compressMinBytes"] = compressMinBytes;
+    return json;
+}
+
+bool ServerConfig::fromJson(const QJsonObject &json, const ServerConfig &base, ServerConfig &result, QString *error)
+{
+    static const char *const knownKeys[] = {
+        "version","maxFrameBytes","maxQueuedBytes","bulkLaneBytes","messagesPerSecond","messageBurst",
+        "logSampleEvery","filterThreads","filterMaxPending","presenceCoalesceMs","memoryBudgetBytes",
+        "compressMinBytes"
+    };
+    for(auto it = json.begin(); it != json.end(); ++it){
+        bool known = false;
+        for(const char *key : knownKeys)
+            known = known || it.key() == QLatin1String(key);
+        if(!known){
+            if(error)
+                *error = QString("未知的配置项 %1").arg(it.key());
+            return false;
+        }
+    }
+
+    ServerConfig config = base;
+    const bool ok = readInteger(json,"maxFrameBytes",qint64(1024),qint64(1024) * 1024 * 1024,config.maxFrameBytes,error)
+        && readInteger(json,"maxQueuedBytes",qint64(0),qint64(1) << 40,config.maxQueuedBytes,error)
+        && readInteger(json,"bulkLaneBytes",qint64(16 * 1024),qint64(1) << 32,config.bulkLaneBytes,error)
+        && readInteger(json,"messagesPerSecond",0,100000,config.messagesPerSecond,error)
+        && readInteger(json,"messageBurst",1,100000,config.messageBurst,error)
+        && readInteger(json,"logSampleEvery",0,1000000,config.logSampleEvery,error)
+        && readInteger(json,"filterThreads",0,256,config.filterThreads,error)
+        && readInteger(json,"filterMaxPending",0,10000000,config.filterMaxPending,error)
+        && readInteger(json,"presenceCoalesceMs",0,60000,config.presenceCoalesceMs,error)
+        && readInteger(json,"memoryBudgetBytes",qint64(0),qint64(1) << 44,config.memoryBudgetBytes,error)
+        && readInteger(json,"compressMinBytes",64,1 << 30,config.compressMinBytes,error);
+    if(!ok)
+        return false;
+    result = config;
+    return true;
+}
+
+std::shared_ptr<const ServerConfig> ServerConfig::current()
+{
+    return std::atomic_load_explicit(&storage(),std::memory_order_acquire);
+}
+
+quint64 ServerConfig::currentVersion()
+{
+    return versionCounter().load(std::memory_order_acquire);
+}
+
+quint64 ServerConfig::publish(ServerConfig config)
+{
+    // 发布很少发生，加锁保证版本号和快照一起更新
+    QMutexLocker locker(&publishMutex());
+    config.version = versionCounter().load(std::memory_order_relaxed) + 1;
+    std::atomic_store_explicit(&storage(),std::shared_ptr<const ServerConfig>(std::make_shared<const ServerConfig>(config)),
+                               std::memory_order_release);
+    versionCounter().store(config.version,std::memory_order_release);
+    return config.version;
+}
+
+const ServerConfig &ServerConfig::refresh(std::shared_ptr<const ServerConfig> &cached)
+{
+    if(!cached || cached->version != currentVersion())
+        cached = current();
+    return *cached;
+}
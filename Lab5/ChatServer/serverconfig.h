@@ -0,0 +1,47 @@
+#ifndef SERVERCONFIG_H
+#define SERVERCONFIG_H
+
+#include <QJsonObject>
+#include <QString>
+#include <memory>
+
+// 运行时可调的参数。每次修改都生成一份新的只读快照并递增版本号，
+// 各线程持有自己的快照，版本号变了才重新取，读参数不用加锁
+struct ServerConfig
+{
+    quint64 version = 0;
+    // 入站单帧上限
+    qint64 maxFrameBytes = 16 * 1024 * 1024;
+    // 每个连接出站排队的上限，超过就断开这个慢连接；0 表示不限
+    qint64 maxQueuedBytes = 0;
+    // 大块通道排队超过这个值时文件传输暂停读盘
+    qint64 bulkLaneBytes = 256 * 1024;
+    // 每个连接每秒可以发的聊天消息数（令牌桶），0 表示不限
+    int messagesPerSecond = 0;
+    int messageBurst = 10;
+    // 每 N 条收发的帧记一条日志，0 表示不记
+    int logSampleEvery = 1;
+    // 过滤线程池大小和排队上限，0 表示不改
+    int filterThreads = 0;
+    int filterMaxPending = 0;
+    // 上下线通知合并成一条广播的间隔，0 表示立即逐条发送
+    int presenceCoalesceMs = 0;
+    // 全局内存预算，接近上限时逐级减负，0 表示不限
+    qint64 memoryBudgetBytes = 0;
+    // 协商了压缩的连接上，超过这个大小的帧才压缩
+    int compressMinBytes = 512;
+
+    QJsonObject toJson() const;
+    // 在 base 的基础上应用 json 里出现的字段，类型或取值不对时返回 false
+    static bool fromJson(const QJsonObject &json,const ServerConfig &base,ServerConfig &result,QString *error = nullptr);
+
+    // 当前快照
+    static std::shared_ptr<const ServerConfig> current();
+    static quint64 currentVersion();
+    // 发布新的快照，版本号自动递增，返回新的版本号
+    static quint64 publish(ServerConfig config);
+    // cached 的版本落后时换成最新的快照，平时只多一次原子读
+    static const ServerConfig &refresh(std::shared_ptr<const ServerConfig> &cached);
+};
+
+#endif // SERVERCONFIG_H
@@ -1,75 +1,804 @@
-#include "serverworker.h"
-#include <QDataStream>
-#include <QJsonObject>
-#include <QJsonDocument>
-
-ServerWorker::ServerWorker(QObject *parent)
-    : QObject{parent}
-{
-    m_serverSocket = new QTcpSocket(this);
-    connect(m_serverSocket,&QTcpSocket::readyRead,this,&ServerWorker::onReadyRead);
-    connect(m_serverSocket,&QTcpSocket::disconnected,this,&ServerWorker::disconnectedFromClient);
-}
-
-bool ServerWorker::setSocketDescriptor(qintptr socketDescriptor)
-{
-    return m_serverSocket->setSocketDescriptor(socketDescriptor);
-}
-
-QString ServerWorker::userName()
-{
-    return m_userName;
-}
-
-void ServerWorker::setUserName(QString user)
-{
-    m_userName=user;
-}
-
-void ServerWorker::onReadyRead()
-{
-    QByteArray jsonData;
-    QDataStream socketStream(m_serverSocket);
-    socketStream.setVersion(QDataStream::Qt_5_12);
-    for(;;){
-        socketStream.startTransaction();
-        socketStream >> jsonData;
-        if(socketStream.commitTransaction()){
-
-            QJsonParseError parseError;
-            const QJsonDocument jsonDoc = QJsonDocument::fromJson(jsonData,&parseError);
-            if(parseError.error == QJsonParseError::NoError){
-                if(jsonDoc.isObject()){
-                    emit logMessage(QJsonDocument(jsonDoc).toJson(QJsonDocument::Compact));
-                    emit jsonReceived(this,jsonDoc.object());
-                }
-            }
-        }else{
-            break;
-        }
-    }
-}
-
-void ServerWorker::sendMessage(const QString &text, const QString &type)
-{
-    if(m_serverSocket->state() != QAbstractSocket::ConnectedState)
-        return;
-
-    if(!text.isEmpty()){
-        QDataStream serverStream(m_serverSocket);
-        serverStream.setVersion(QDataStream::Qt_5_12);
-        QJsonObject message;
-        message["type"] = type;
-        message["text"] = text;
-        serverStream<< QJsonDocument(message).toJson();
-    }
-}
-
-void ServerWorker::sendJson(const QJsonObject &json)
-{
-    const QByteArray jsonData = QJsonDocument(json).toJson(QJsonDocument::Compact);
-    emit logMessage(QLatin1String("Sending to") + userName() + QLatin1String(" - ")+QString::fromUtf8(jsonData));
-    QDataStream socketStream(m_serverSocket);
-    socketStream.setVersion(QDataStream::Qt_5_12);
-    socketStream << jsonData;
-}
+#include "serverworker.h"
+#include "trafficcapture.h"
+#include "chattrace.h"
+#include "filechunk.h"
+#include "websocketcodec.h"
+#include "framecompressor.h"
+#include "ioshards.h"
+#include <QThread>
+#include <QDataStream>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QtEndian>
+#include <atomic>
+
+// 套接字发送缓冲区超过这个值时新帧先留在通道里
+static const qint64 SocketHighWatermark = 64 * 1024;
+// 每轮轮询各通道可以写出的字节数，聊天和大块数据约 3:1
+static const int LaneQuantum[ServerWorker::LaneCount] = {0,48 * 1024,16 * 1024};
+
+static std::atomic<int> liveWorkers{0};
+
+ServerWorker::ServerWorker(QObject *parent)
+    : QObject{parent}
+    , m_connectionId(0)
+    , m_capture(nullptr)
+    , m_multicastCapable(false)
+    , m_suspended(false)
+    , m_readBeginNs(0)
+    , m_readEndNs(0)
+    , m_watchingWrites(false)
+    , m_bulkWaiting(false)
+    , m_bulkPosted(0)
+    , m_queuedBytes(0)
+    , m_inboundBytes(0)
+    , m_socketBytes(0)
+    , m_logCounter(0)
+    , m_messageTokens(-1)
+    , m_tokensUpdatedNs(0)
+    , m_dropping(false)
+{
+    m_serverSocket = nullptr;
+    m_webSocket = nullptr;
+    m_compressor = nullptr;
+    m_compressionEnabled = false;
+    m_deflateEnabled = false;
+    m_shard = nullptr;
+    liveWorkers++;
+}
+
+ServerWorker::~ServerWorker()
+{
+    delete m_webSocket;
+    delete m_compressor;
+    if(m_shard)
+        m_shard->workers--;
+    liveWorkers--;
+}
+
+int ServerWorker::instanceCount()
+{
+    return liveWorkers.load();
+}
+
+IoShard *ServerWorker::shard() const
+{
+    return m_shard;
+}
+
+void ServerWorker::setShard(IoShard *shard)
+{
+    m_shard = shard;
+}
+
+bool ServerWorker::deferToIoThread(std::function<void()> task)
+{
+    if(!m_shard || QThread::currentThread() == thread())
+        return false;
+    IoShard::Task *queued = new IoShard::Task;
+    queued->run = std::move(task);
+    m_shard->push(queued);
+    return true;
+}
+
+void ServerWorker::runInIoThread(const std::function<void()> &task)
+{
+    if(!m_shard || QThread::currentThread() == thread()){
+        task();
+        return;
+    }
+    // 之前交给这个线程的任务已经在它的事件队列里排在前面，会先执行完
+    QMetaObject::invokeMethod(m_shard,task,Qt::BlockingQueuedConnection);
+}
+
+void ServerWorker::publishCounters()
+{
+    m_inboundBytes.store(m_inbound.size() + (m_webSocket ? m_webSocket->bufferedBytes() : 0)
+                         + (m_compressor ? m_compressor->memoryUsage() : 0),std::memory_order_relaxed);
+    m_socketBytes.store(m_serverSocket ? m_serverSocket->bytesToWrite() : 0,std::memory_order_relaxed);
+}
+
+bool ServerWorker::setSocketDescriptor(qintptr socketDescriptor)
+{
+    QTcpSocket *socket = new QTcpSocket(this);
+    if(!socket->setSocketDescriptor(socketDescriptor)){
+        delete socket;
+        return false;
+    }
+    connect(socket,&QTcpSocket::disconnected,this,&ServerWorker::disconnectedFromClient);
+    setDevice(socket);
+    return true;
+}
+
+void ServerWorker::setLocalSocket(QLocalSocket *socket)
+{
+    socket->setParent(this);
+    connect(socket,&QLocalSocket::disconnected,this,&ServerWorker::disconnectedFromClient);
+    setDevice(socket);
+}
+
+bool ServerWorker::setLocalSocketDescriptor(qintptr socketDescriptor)
+{
+    QLocalSocket *socket = new QLocalSocket(this);
+    if(!socket->setSocketDescriptor(socketDescriptor)){
+        delete socket;
+        return false;
+    }
+    setLocalSocket(socket);
+    return true;
+}
+
+void ServerWorker::setSslSocket(QSslSocket *socket)
+{
+    socket->setParent(this);
+    connect(socket,&QSslSocket::disconnected,this,&ServerWorker::disconnectedFromClient);
+    setDevice(socket);
+}
+
+bool ServerWorker::isEncrypted() const
+{
+    const QSslSocket *socket = qobject_cast<const QSslSocket*>(m_serverSocket);
+    return socket && socket->isEncrypted();
+}
+
+void ServerWorker::setWebSocket(QTcpSocket *socket)
+{
+    socket->setParent(this);
+    m_webSocket = new WebSocketCodec;
+    connect(socket,&QTcpSocket::disconnected,this,&ServerWorker::disconnectedFromClient);
+    setDevice(socket);
+}
+
+bool ServerWorker::isWebSocket() const
+{
+    return m_webSocket != nullptr;
+}
+
+bool ServerWorker::isDeflateEnabled() const
+{
+    return m_deflateEnabled.load();
+}
+
+void ServerWorker::setDevice(QIODevice *device)
+{
+    m_serverSocket = device;
+    connect(m_serverSocket,&QIODevice::readyRead,this,&ServerWorker::onReadyRead);
+    // 接管之前已经到达的数据不会再触发 readyRead
+    if(m_serverSocket->bytesAvailable() > 0 || !m_inbound.isEmpty())
+        QMetaObject::invokeMethod(this,&ServerWorker::onReadyRead,Qt::QueuedConnection);
+}
+
+bool ServerWorker::isConnected() const
+{
+    if(const QAbstractSocket *socket = qobject_cast<const QAbstractSocket*>(m_serverSocket))
+        return socket->state() == QAbstractSocket::ConnectedState;
+    if(const QLocalSocket *socket = qobject_cast<const QLocalSocket*>(m_serverSocket))
+        return socket->state() == QLocalSocket::ConnectedState;
+    return m_serverSocket && m_serverSocket->isOpen();
+}
+
+bool ServerWorker::isLocal() const
+{
+    return qobject_cast<const QLocalSocket*>(m_serverSocket) != nullptr;
+}
+
+qintptr ServerWorker::socketDescriptor() const
+{
+    // 描述符在连接建立后就不变了，其他线程读也没关系
+    if(const QAbstractSocket *socket = qobject_cast<const QAbstractSocket*>(m_serverSocket))
+        return socket->socketDescriptor();
+    if(const QLocalSocket *socket = qobject_cast<const QLocalSocket*>(m_serverSocket))
+        return socket->socketDescriptor();
+    return -1;
+}
+
+QString ServerWorker::userName()
+{
+    QMutexLocker locker(&m_userNameMutex);
+    return m_userName;
+}
+
+void ServerWorker::setUserName(QString user)
+{
+    QMutexLocker locker(&m_userNameMutex);
+    m_userName=user;
+}
+
+quint32 ServerWorker::connectionId() const
+{
+    return m_connectionId;
+}
+
+void ServerWorker::setConnectionId(quint32 id)
+{
+    m_connectionId = id;
+}
+
+void ServerWorker::setCapture(TrafficCapture *capture)
+{
+    if(deferToIoThread([this,capture]{ setCapture(capture); }))
+        return;
+    m_capture = capture;
+}
+
+QString ServerWorker::room() const
+{
+    return m_room;
+}
+
+void ServerWorker::setRoom(const QString &room)
+{
+    m_room = room;
+}
+
+bool ServerWorker::isMulticastCapable() const
+{
+    return m_multicastCapable;
+}
+
+void ServerWorker::setMulticastCapable(bool capable)
+{
+    m_multicastCapable = capable;
+}
+
+QString ServerWorker::clientId() const
+{
+    return m_clientId;
+}
+
+void ServerWorker::setClientId(const QString &clientId)
+{
+    m_clientId = clientId;
+}
+
+void ServerWorker::setCompression(bool enabled)
+{
+    if(m_webSocket || enabled == m_compressionEnabled.load())
+        return;
+    m_compressionEnabled = enabled;
+    // 压缩器在 I/O 线程里创建和使用，标志先设好给统计用
+    if(deferToIoThread([this,enabled]{
+        delete m_compressor;
+        m_compressor = enabled ? new FrameCompressor : nullptr;
+    }))
+        return;
+    delete m_compressor;
+    m_compressor = enabled ? new FrameCompressor : nullptr;
+}
+
+bool ServerWorker::isCompressionEnabled() const
+{
+    return m_compressionEnabled.load();
+}
+
+void ServerWorker::suspend()
+{
+    if(m_shard && QThread::currentThread() != thread()){
+        runInIoThread([this]{ suspend(); });
+        return;
+    }
+    m_suspended = true;
+    // 先把发送缓冲区写完，等待期间读到的数据也一起收进 m_inbound
+    if(QAbstractSocket *socket = qobject_cast<QAbstractSocket*>(m_serverSocket)){
+        while(socket->bytesToWrite() > 0 && socket->waitForBytesWritten(500)){
+        }
+    }else if(QLocalSocket *socket = qobject_cast<QLocalSocket*>(m_serverSocket)){
+        while(socket->bytesToWrite() > 0 && socket->waitForBytesWritten(500)){
+        }
+    }
+    m_inbound.append(m_serverSocket->readAll());
+}
+
+void ServerWorker::resume()
+{
+    if(deferToIoThread([this]{ resume(); }))
+        return;
+    m_suspended = false;
+    flushLanes();
+    QMetaObject::invokeMethod(this,&ServerWorker::onReadyRead,Qt::QueuedConnection);
+}
+
+QByteArray ServerWorker::pendingInput() const
+{
+    QByteArray input;
+    const_cast<ServerWorker*>(this)->runInIoThread([this,&input]{ input = m_inbound; });
+    return input;
+}
+
+void ServerWorker::restorePendingInput(const QByteArray &data)
+{
+    if(deferToIoThread([this,data]{ restorePendingInput(data); }))
+        return;
+    m_inbound = data + m_inbound;
+    if(!m_inbound.isEmpty())
+        QMetaObject::invokeMethod(this,&ServerWorker::onReadyRead,Qt::QueuedConnection);
+}
+
+void ServerWorker::detach()
+{
+    if(deferToIoThread([this]{ detach(); }))
+        return;
+    m_serverSocket->disconnect(this);
+    // abort 只关闭本进程的描述符，不会调用 shutdown，对端感觉不到
+    if(QAbstractSocket *socket = qobject_cast<QAbstractSocket*>(m_serverSocket))
+        socket->abort();
+    else if(QLocalSocket *socket = qobject_cast<QLocalSocket*>(m_serverSocket))
+        socket->abort();
+}
+
+void ServerWorker::onReadyRead()
+{
+    if(m_suspended)
+        return;
+    if(Q_UNLIKELY(ChatTrace::isEnabled())){
+        m_readBeginNs = ChatTrace::now();
+        m_inbound.append(m_serverSocket->readAll());
+        m_readEndNs = ChatTrace::now();
+    }else{
+        m_readBeginNs = 0;
+        m_inbound.append(m_serverSocket->readAll());
+    }
+    processInbound();
+    publishCounters();
+}
+
+void ServerWorker::processInbound()
+{
+    if(m_webSocket){
+        processWebSocket();
+        return;
+    }
+    // 帧格式与 QDataStream(Qt_5_12) 写出的 QByteArray 相同：4 字节大端长度 + 内容
+    qsizetype offset = 0;
+    while(!m_suspended && m_inbound.size() - offset >= 4){
+        const quint32 length = qFromBigEndian<quint32>(m_inbound.constData() + offset);
+        if(length == 0xffffffffu){
+            offset += 4;
+            continue;
+        }
+        // 单帧超过上限就认为对端出错并断开
+        if(qint64(length) > config().maxFrameBytes){
+            emit logMessage(QString("帧长度%1超过上限，断开连接").arg(length));
+            m_inbound.clear();
+            m_serverSocket->close();
+            return;
+        }
+        if(m_inbound.size() - offset - 4 < qsizetype(length))
+            break;
+        const QByteArray jsonData = m_inbound.mid(offset + 4,length);
+        offset += 4 + length;
+        handleFrame(jsonData);
+    }
+    m_inbound.remove(0,offset);
+}
+
+void ServerWorker::processWebSocket()
+{
+    if(!m_webSocket->isOpen()){
+        QByteArray response;
+        QString error;
+        const bool accepted = m_webSocket->acceptHandshake(m_inbound,response,error);
+        if(!response.isEmpty())
+            m_serverSocket->write(response);
+        if(!error.isEmpty()){
+            emit logMessage(error);
+            m_inbound.clear();
+            m_serverSocket->close();
+            return;
+        }
+        if(!accepted)
+            return;
+        m_deflateEnabled = m_webSocket->isDeflateEnabled();
+    }
+
+    qsizetype offset = 0;
+    while(!m_suspended){
+        QByteArray message;
+        QByteArray reply;
+        QString error;
+        const WebSocketCodec::Status status = m_webSocket->readMessage(m_inbound,offset,config().maxFrameBytes,message,reply,error);
+        // ping 和 close 的应答不进通道，直接写
+        if(!reply.isEmpty())
+            m_serverSocket->write(reply);
+        if(status == WebSocketCodec::Message){
+            handleFrame(message);
+            continue;
+        }
+        if(status == WebSocketCodec::Failed){
+            emit logMessage(QString("%1，断开连接").arg(error));
+            m_serverSocket->write(WebSocketCodec::closeFrame(1002));
+        }
+        if(status != WebSocketCodec::NeedMore){
+            m_inbound.clear();
+            m_serverSocket->close();
+            return;
+        }
+        break;
+    }
+    m_inbound.remove(0,offset);
+}
+
+void ServerWorker::handleFrame(const QByteArray &jsonData)
+{
+    if(m_capture)
+        m_capture->recordFrame(m_connectionId,jsonData);
+    if(FileChunk::isChunk(jsonData)){
+        emit chunkReceived(this,jsonData);
+        return;
+    }
+
+    // 追踪关闭时 m_readBeginNs 总是 0
+    const quint64 traceId = m_readBeginNs != 0 ? ChatTrace::sample() : 0;
+    const qint64 parseBeginNs = traceId ? ChatTrace::now() : 0;
+    QJsonParseError parseError;
+    const QJsonDocument jsonDoc = QJsonDocument::fromJson(jsonData,&parseError);
+    if(parseError.error == QJsonParseError::NoError){
+        if(jsonDoc.isObject()){
+            // 探测帧在这里直接处理，不记日志也不交给服务器
+            if(handleProbe(jsonDoc.object()))
+                return;
+            if(shouldLog())
+                emit logMessage(QJsonDocument(jsonDoc).toJson(QJsonDocument::Compact));
+            if(traceId){
+                const qint64 dispatchBeginNs = ChatTrace::now();
+                ChatTrace::complete(traceId,"read",m_readBeginNs,m_readEndNs,m_connectionId);
+                ChatTrace::complete(traceId,"parse",parseBeginNs,dispatchBeginNs,m_connectionId);
+                emit jsonReceived(this,jsonDoc.object(),traceId);
+                ChatTrace::complete(traceId,"dispatch",dispatchBeginNs,ChatTrace::now(),m_connectionId);
+            }else{
+                emit jsonReceived(this,jsonDoc.object(),0);
+            }
+        }
+    }
+}
+
+bool ServerWorker::handleProbe(const QJsonObject &docObj)
+{
+    const QString type = docObj.value("type").toString();
+    if(type == "ping"){
+        // 客户端测自己的往返时延，时间戳原样带回去
+        QJsonObject pongMessage;
+        pongMessage["type"] = "pong";
+        pongMessage["t"] = docObj.value("t");
+        queueFrame(ControlLane,QJsonDocument(pongMessage).toJson(QJsonDocument::Compact));
+        return true;
+    }
+    if(type == "pong"){
+        const qint64 sentNs = docObj.value("t").toInteger();
+        const qint64 nowNs = ChatTrace::now();
+        if(sentNs > 0 && sentNs <= nowNs){
+            QMutexLocker locker(&m_rttMutex);
+            m_rtt.add((nowNs - sentNs) / 1000);
+        }
+        return true;
+    }
+    return false;
+}
+
+void ServerWorker::sendPing()
+{
+    if(deferToIoThread([this]{ sendPing(); }))
+        return;
+    // 交接中的 ping 会带着旧进程的时间戳到新进程，干脆不发
+    if(m_suspended)
+        return;
+    QJsonObject pingMessage;
+    pingMessage["type"] = "ping";
+    pingMessage["t"] = QJsonValue(ChatTrace::now());
+    queueFrame(ControlLane,QJsonDocument(pingMessage).toJson(QJsonDocument::Compact));
+}
+
+RttStats ServerWorker::rtt() const
+{
+    QMutexLocker locker(&m_rttMutex);
+    return m_rtt;
+}
+
+bool ServerWorker::takeMessageToken()
+{
+    // 在主线程里调用，不能动 I/O 线程的配置快照
+    const std::shared_ptr<const ServerConfig> current = ServerConfig::current();
+    const ServerConfig &cfg = *current;
+    if(cfg.messagesPerSecond <= 0)
+        return true;
+    const qint64 nowNs = ChatTrace::now();
+    if(m_messageTokens < 0){
+        m_messageTokens = cfg.messageBurst;
+    }else{
+        m_messageTokens = qMin(double(cfg.messageBurst),
+                               m_messageTokens + double(nowNs - m_tokensUpdatedNs) * cfg.messagesPerSecond / 1e9);
+    }
+    m_tokensUpdatedNs = nowNs;
+    if(m_messageTokens < 1.0)
+        return false;
+    m_messageTokens -= 1.0;
+    return true;
+}
+
+const ServerConfig &ServerWorker::config() const
+{
+    return ServerConfig::refresh(m_config);
+}
+
+bool ServerWorker::shouldLog()
+{
+    const int every = config().logSampleEvery;
+    return every > 0 && m_logCounter++ % quint64(every) == 0;
+}
+
+qint64 ServerWorker::inboundBytes() const
+{
+    return m_inboundBytes.load(std::memory_order_relaxed);
+}
+
+qint64 ServerWorker::queuedBytes() const
+{
+    return m_queuedBytes.load(std::memory_order_relaxed);
+}
+
+qint64 ServerWorker::socketBytes() const
+{
+    return m_socketBytes.load(std::memory_order_relaxed);
+}
+
+void ServerWorker::dropFileChunks()
+{
+    if(deferToIoThread([this]{ dropFileChunks(); }))
+        return;
+    LaneQueue &queue = m_lanes[BulkLane];
+    QQueue<QueuedFrame> kept;
+    qint64 dropped = 0;
+    for(const QueuedFrame &frame : std::as_const(queue.frames)){
+        if(FileChunk::isChunk(frame.data))
+            dropped += frame.data.size();
+        else
+            kept.enqueue(frame);
+    }
+    queue.frames.swap(kept);
+    queue.depth = queue.frames.size();
+    queue.bytes -= dropped;
+    if(queue.frames.isEmpty())
+        queue.deficit = 0;
+    m_queuedBytes -= dropped;
+}
+
+void ServerWorker::abortConnection(const QString &reason)
+{
+    if(deferToIoThread([this,reason]{ abortConnection(reason); }))
+        return;
+    if(m_dropping)
+        return;
+    m_dropping = true;
+    emit logMessage(QString("断开 %1：%2").arg(userName(),reason));
+    // 可能正在广播的循环里，等回到事件循环再断开；close 会等缓冲区写完，这里直接 abort
+    QMetaObject::invokeMethod(this,[this]{
+        if(QAbstractSocket *socket = qobject_cast<QAbstractSocket*>(m_serverSocket))
+            socket->abort();
+        else if(QLocalSocket *socket = qobject_cast<QLocalSocket*>(m_serverSocket))
+            socket->abort();
+    },Qt::QueuedConnection);
+}
+
+void ServerWorker::sendMessage(const QString &text, const QString &type)
+{
+    if(deferToIoThread([this,text,type]{ sendMessage(text,type); }))
+        return;
+    if(!isConnected())
+        return;
+
+    if(!text.isEmpty()){
+        QJsonObject message;
+        message["type"] = type;
+        message["text"] = text;
+        queueFrame(ChatLane,QJsonDocument(message).toJson());
+    }
+}
+
+void ServerWorker::sendJson(const QJsonObject &json, Lane lane)
+{
+    // 编码放在调用线程里做，I/O 线程只管写
+    if(m_shard && QThread::currentThread() != thread()){
+        const QByteArray jsonData = QJsonDocument(json).toJson(QJsonDocument::Compact);
+        deferToIoThread([this,lane,jsonData]{ queueFrame(lane,jsonData); });
+        return;
+    }
+    const QByteArray jsonData = QJsonDocument(json).toJson(QJsonDocument::Compact);
+    if(shouldLog())
+        emit logMessage(QLatin1String("Sending to") + userName() + QLatin1String(" - ")+QString::fromUtf8(jsonData));
+    queueFrame(lane,jsonData);
+}
+
+void ServerWorker::sendFrame(const QByteArray &jsonData, quint64 traceId)
+{
+    if(deferToIoThread([this,jsonData,traceId]{ sendFrame(jsonData,traceId); }))
+        return;
+    // 广播帧不用连接自己的上下文，接收者再多也只压缩一次；已经压缩过的帧（交接带过来的）原样发
+    if(m_compressor && jsonData.size() >= config().compressMinBytes && !FrameCompressor::isCompressed(jsonData)){
+        queueFrame(ChatLane,FrameCompressor::compressShared(jsonData),traceId);
+        return;
+    }
+    queueFrame(ChatLane,jsonData,traceId);
+}
+
+void ServerWorker::queueFrame(Lane lane, const QByteArray &frame, quint64 traceId)
+{
+    if(lane == BulkLane && deferToIoThread([this,frame,traceId]{
+            m_bulkPosted -= frame.size();
+            queueFrame(BulkLane,frame,traceId);
+        })){
+        m_bulkPosted += frame.size();
+        return;
+    }
+    if(deferToIoThread([this,lane,frame,traceId]{ queueFrame(lane,frame,traceId); }))
+        return;
+    // 握手还没完成的浏览器连接收不了消息
+    if(!m_serverSocket || (m_webSocket && !m_webSocket->isOpen()))
+        return;
+    QueuedFrame queued{frame,traceId,traceId ? ChatTrace::now() : 0};
+    // 控制帧不排队；各通道都空而且缓冲区有空间时直接写，不多一次拷贝
+    if(!m_suspended && (lane == ControlLane || (m_queuedBytes == 0 && m_serverSocket->bytesToWrite() < SocketHighWatermark))){
+        writeFrame(queued);
+        m_lanes[lane].sentFrames++;
+        publishCounters();
+        return;
+    }
+    // 对端长时间不读，排队超过上限时断开，不让一个慢连接占满内存
+    const qint64 maxQueuedBytes = config().maxQueuedBytes;
+    if(maxQueuedBytes > 0 && m_queuedBytes + frame.size() > maxQueuedBytes){
+        abortConnection(QString("发送队列超过上限（%1 字节）").arg(m_queuedBytes));
+        return;
+    }
+    LaneQueue &queue = m_lanes[lane];
+    queue.frames.enqueue(queued);
+    queue.depth++;
+    queue.bytes += frame.size();
+    m_queuedBytes += frame.size();
+    watchWrites();
+}
+
+void ServerWorker::writeFrame(const QueuedFrame &frame)
+{
+    if(m_webSocket){
+        m_serverSocket->write(m_webSocket->encodeMessage(frame.data));
+    }else if(m_compressor && frame.data.startsWith('{') && frame.data.size() >= config().compressMinBytes){
+        // 用连接自己的上下文压缩，必须按写出的顺序进行，所以放在这里而不是入队时
+        QDataStream socketStream(m_serverSocket);
+        socketStream.setVersion(QDataStream::Qt_5_12);
+        socketStream << m_compressor->compress(frame.data);
+    }else{
+        QDataStream socketStream(m_serverSocket);
+        socketStream.setVersion(QDataStream::Qt_5_12);
+        socketStream << frame.data;
+    }
+    if(!frame.traceId)
+        return;
+
+    // enqueue 包括在通道里排队的时间
+    const qint64 writtenNs = ChatTrace::now();
+    ChatTrace::complete(frame.traceId,"enqueue",frame.queuedNs,writtenNs,m_connectionId);
+    const qint64 remaining = m_serverSocket->bytesToWrite();
+    if(remaining <= 0){
+        ChatTrace::complete(frame.traceId,"flush",writtenNs,writtenNs,m_connectionId);
+        return;
+    }
+    watchWrites();
+    m_flushMarks.append(FlushMark{frame.traceId,writtenNs,remaining});
+}
+
+void ServerWorker::flushLanes()
+{
+    if(m_suspended || m_queuedBytes == 0)
+        return;
+    // 控制通道每一轮都先写完，不受水位线限制
+    LaneQueue &control = m_lanes[ControlLane];
+    while(!control.frames.isEmpty())
+        writeLaneFrame(ControlLane);
+
+    // 聊天和大块数据按权重轮流写（差额轮询），直到套接字缓冲区到水位线
+    while(m_queuedBytes > 0 && m_serverSocket->bytesToWrite() < SocketHighWatermark){
+        for(int lane = ChatLane; lane < LaneCount; lane++){
+            LaneQueue &queue = m_lanes[lane];
+            if(queue.frames.isEmpty()){
+                queue.deficit = 0;
+                continue;
+            }
+            queue.deficit += LaneQuantum[lane];
+            while(!queue.frames.isEmpty() && queue.frames.head().data.size() <= queue.deficit){
+                queue.deficit -= queue.frames.head().data.size();
+                writeLaneFrame(Lane(lane));
+            }
+        }
+    }
+}
+
+void ServerWorker::writeLaneFrame(Lane lane)
+{
+    LaneQueue &queue = m_lanes[lane];
+    const QueuedFrame frame = queue.frames.dequeue();
+    queue.depth--;
+    queue.bytes -= frame.data.size();
+    queue.sentFrames++;
+    m_queuedBytes -= frame.data.size();
+    writeFrame(frame);
+}
+
+int ServerWorker::laneDepth(Lane lane) const
+{
+    return m_lanes[lane].depth.load(std::memory_order_relaxed);
+}
+
+qint64 ServerWorker::laneBytes(Lane lane) const
+{
+    return m_lanes[lane].bytes;
+}
+
+quint64 ServerWorker::laneSentFrames(Lane lane) const
+{
+    return m_lanes[lane].sentFrames;
+}
+
+QList<QPair<quint8,QByteArray>> ServerWorker::unsentFrames() const
+{
+    // 大块通道里是文件数据，交接后下载不会继续，不用带过去；
+    // 其余的帧记下通道，新进程里控制帧还是插在聊天消息前面
+    QList<QPair<quint8,QByteArray>> frames;
+    const_cast<ServerWorker*>(this)->runInIoThread([this,&frames]{
+        for(int lane = ControlLane; lane < BulkLane; lane++){
+            for(const QueuedFrame &frame : m_lanes[lane].frames)
+                frames.append(qMakePair(quint8(lane),frame.data));
+        }
+    });
+    return frames;
+}
+
+bool ServerWorker::isBulkWritable() const
+{
+    // 文件传输在主线程里调用，读全局配置而不是本连接缓存的快照
+    return m_serverSocket && m_lanes[BulkLane].bytes.load() + m_bulkPosted.load() < ServerConfig::current()->bulkLaneBytes;
+}
+
+void ServerWorker::waitForBulkWritable()
+{
+    if(deferToIoThread([this]{ waitForBulkWritable(); }))
+        return;
+    // 交过来的块到这里都已经进了通道；要是已经写下去了，就不会再有 bytesWritten 叫醒文件传输
+    if(isBulkWritable()){
+        emit bulkWritable();
+        return;
+    }
+    watchWrites();
+    m_bulkWaiting = true;
+}
+
+void ServerWorker::watchWrites()
+{
+    // 需要时才监听 bytesWritten，普通连接不多一次回调
+    if(m_watchingWrites)
+        return;
+    m_watchingWrites = true;
+    connect(m_serverSocket,&QIODevice::bytesWritten,this,&ServerWorker::onBytesWritten);
+}
+
+void ServerWorker::onBytesWritten(qint64 bytes)
+{
+    if(!m_flushMarks.isEmpty()){
+        // 排在帧前面的数据写完之后这一帧才算进了内核
+        const qint64 nowNs = ChatTrace::now();
+        int done = 0;
+        for(FlushMark &mark : m_flushMarks){
+            mark.remaining -= bytes;
+            if(mark.remaining <= 0){
+                ChatTrace::complete(mark.traceId,"flush",mark.enqueuedNs,nowNs,m_connectionId);
+                done++;
+            }
+        }
+        m_flushMarks.remove(0,done);
+    }
+
+    flushLanes();
+    publishCounters();
+    if(m_bulkWaiting && isBulkWritable()){
+        m_bulkWaiting = false;
+        emit bulkWritable();
+    }
+}
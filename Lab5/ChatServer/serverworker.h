@@ -1,33 +1,204 @@
-#ifndef SERVERWORKER_H
-#define SERVERWORKER_H
-
-#include <QObject>
-#include <QTcpSocket>
-
-class ServerWorker : public QObject
-{
-    Q_OBJECT
-
-public:
-    explicit ServerWorker(QObject *parent = nullptr);
-    virtual bool setSocketDescriptor(qintptr socketDescriptor);
-    QString userName();
-    void setUserName(QString user);
-
-signals:
-    void logMessage(const QString &msg);
-    void jsonReceived(ServerWorker *sender,const QJsonObject &docObj);
-    void disconnectedFromClient();
-
-private:
-    QTcpSocket *m_serverSocket;
-    QString m_userName;
-
-public slots:
-    void onReadyRead();
-    void sendMessage(const QString &text,const QString &type = "message");
-    void sendJson(const QJsonObject &json);
-
-};
-
-#endif // SERVERWORKER_H
+#ifndef SERVERWORKER_H
+#define SERVERWORKER_H
+
+#include <QObject>
+#include <QTcpSocket>
+#include <QLocalSocket>
+#include <QSslSocket>
+#include <QVector>
+#include <QQueue>
+#include <QPair>
+#include <QMutex>
+#include <atomic>
+#include <functional>
+#include "rttstats.h"
+#include "serverconfig.h"
+
+class TrafficCapture;
+class WebSocketCodec;
+class FrameCompressor;
+class IoShard;
+
+class ServerWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    // 发送通道：控制帧最先发，聊天和大块数据（文件、历史）按权重轮流发
+    enum Lane {
+        ControlLane,
+        ChatLane,
+        BulkLane,
+        LaneCount
+    };
+
+    explicit ServerWorker(QObject *parent = nullptr);
+    ~ServerWorker();
+    // 当前存活的 ServerWorker 数，断开的连接没被释放时会一直涨
+    static int instanceCount();
+    // 所在的 I/O 线程，为空时在主线程。读写和通道只在这个线程里动，
+    // 其他线程调用发送、断开之类的方法时会自动转到这个线程按顺序执行
+    IoShard *shard() const;
+    void setShard(IoShard *shard);
+    virtual bool setSocketDescriptor(qintptr socketDescriptor);
+    // 同一台机器上的机器人和桥接程序走本地套接字，帧格式完全相同
+    void setLocalSocket(QLocalSocket *socket);
+    bool setLocalSocketDescriptor(qintptr socketDescriptor);
+    // 已经在握手线程里完成 TLS 握手的连接
+    void setSslSocket(QSslSocket *socket);
+    // 任意已经打开的 QIODevice 当作连接，基准测试里用内存设备代替套接字
+    void setDevice(QIODevice *device);
+    bool isEncrypted() const;
+    // 浏览器连接：先完成 HTTP 升级，之后每条 WebSocket 消息就是一帧
+    void setWebSocket(QTcpSocket *socket);
+    bool isWebSocket() const;
+    bool isDeflateEnabled() const;
+    bool isConnected() const;
+    bool isLocal() const;
+    qintptr socketDescriptor() const;
+    QString userName();
+    void setUserName(QString user);
+    quint32 connectionId() const;
+    void setConnectionId(quint32 id);
+    void setCapture(TrafficCapture *capture);
+    QString room() const;
+    void setRoom(const QString &room);
+    bool isMulticastCapable() const;
+    void setMulticastCapable(bool capable);
+    // 客户端登录时带的编号，离线队列里的消息按它去重；只在主线程用
+    QString clientId() const;
+    void setClientId(const QString &clientId);
+    // 客户端登录时声明能解压，之后大帧压缩发送；浏览器连接用 WebSocket 自己的压缩
+    void setCompression(bool enabled);
+    bool isCompressionEnabled() const;
+
+    // 不停机重启：暂停读取和通道发送，把套接字缓冲区写完，未解析的输入保留在 pendingInput 里
+    void suspend();
+    void resume();
+    QByteArray pendingInput() const;
+    void restorePendingInput(const QByteArray &data);
+    // 交接完成后关闭本进程里的描述符副本，连接本身由新进程继续持有
+    void detach();
+    void queueFrame(Lane lane,const QByteArray &frame,quint64 traceId = 0);
+    int laneDepth(Lane lane) const;
+    qint64 laneBytes(Lane lane) const;
+    quint64 laneSentFrames(Lane lane) const;
+    // 交接时还没写出去的控制帧和聊天帧，每一帧带着自己的通道
+    QList<QPair<quint8,QByteArray>> unsentFrames() const;
+    // 大块通道排队不多时才继续读文件，内存占用有上限
+    bool isBulkWritable() const;
+    // 大块通道降到上限以下时发出 bulkWritable
+    void waitForBulkWritable();
+    // 发一个带时间戳的 ping，客户端原样回 pong 时记下往返时延
+    void sendPing();
+    // 返回快照，可以在其他线程调用
+    RttStats rtt() const;
+    // 聊天消息的令牌桶限速，没有令牌时返回 false
+    bool takeMessageToken();
+    // 内存统计：未解析的入站数据（含压缩和解压的上下文）、各通道排队的数据、套接字缓冲区里的数据
+    qint64 inboundBytes() const;
+    qint64 queuedBytes() const;
+    qint64 socketBytes() const;
+    // 丢掉大块通道里还没发出的文件数据块；同一通道里补发的历史消息留着，客户端还在等
+    void dropFileChunks();
+    // 回到事件循环后断开，可以在广播循环里调用
+    void abortConnection(const QString &reason);
+
+signals:
+    void logMessage(const QString &msg);
+    // traceId 是这一帧的追踪 id，没被采样时为 0
+    void jsonReceived(ServerWorker *sender,const QJsonObject &docObj,quint64 traceId);
+    void disconnectedFromClient();
+    void chunkReceived(ServerWorker *sender,const QByteArray &frame);
+    void bulkWritable();
+
+private:
+    // 不在自己的 I/O 线程里时把 task 交给那个线程，返回 true 表示已经转交
+    bool deferToIoThread(std::function<void()> task);
+    // 在 I/O 线程里同步执行，交接时用
+    void runInIoThread(const std::function<void()> &task);
+    // 更新给其他线程读的内存计数
+    void publishCounters();
+    void processInbound();
+    void processWebSocket();
+    void handleFrame(const QByteArray &jsonData);
+    bool handleProbe(const QJsonObject &docObj);
+    const ServerConfig &config() const;
+    bool shouldLog();
+    struct QueuedFrame
+    {
+        QByteArray data;
+        quint64 traceId;
+        qint64 queuedNs;
+    };
+    struct LaneQueue
+    {
+        QQueue<QueuedFrame> frames;
+        // 计数会被主线程读（统计、内存预算），用原子变量
+        std::atomic<int> depth{0};
+        std::atomic<qint64> bytes{0};
+        int deficit = 0;
+        std::atomic<quint64> sentFrames{0};
+    };
+
+    void writeFrame(const QueuedFrame &frame);
+    void writeLaneFrame(Lane lane);
+    void flushLanes();
+    void watchWrites();
+    void onBytesWritten(qint64 bytes);
+
+    QIODevice *m_serverSocket;
+    IoShard *m_shard;
+    WebSocketCodec *m_webSocket;
+    FrameCompressor *m_compressor;
+    std::atomic<bool> m_compressionEnabled;
+    std::atomic<bool> m_deflateEnabled;
+    // 用户名由主线程设置，I/O 线程写日志时也会读
+    mutable QMutex m_userNameMutex;
+    QString m_userName;
+    quint32 m_connectionId;
+    TrafficCapture *m_capture;
+    QString m_room;
+    bool m_multicastCapable;
+    QString m_clientId;
+    QByteArray m_inbound;
+    bool m_suspended;
+
+    // 追踪：本次读取的时间，以及等待写进内核的已采样帧
+    struct FlushMark
+    {
+        quint64 traceId;
+        qint64 enqueuedNs;
+        qint64 remaining;
+    };
+    qint64 m_readBeginNs;
+    qint64 m_readEndNs;
+    QVector<FlushMark> m_flushMarks;
+    bool m_watchingWrites;
+    bool m_bulkWaiting;
+    LaneQueue m_lanes[LaneCount];
+    // 从主线程交给 I/O 线程、还没进大块通道的字节数，isBulkWritable 要算上，文件传输才停得下来
+    std::atomic<qint64> m_bulkPosted;
+    std::atomic<qint64> m_queuedBytes;
+    std::atomic<qint64> m_inboundBytes;
+    std::atomic<qint64> m_socketBytes;
+    mutable QMutex m_rttMutex;
+    RttStats m_rtt;
+    // 运行时参数的本地快照，版本号变了才重新取；只在 I/O 线程里用
+    mutable std::shared_ptr<const ServerConfig> m_config;
+    quint64 m_logCounter;
+    double m_messageTokens;
+    qint64 m_tokensUpdatedNs;
+    bool m_dropping;
+
+public slots:
+    void onReadyRead();
+    void sendMessage(const QString &text,const QString &type = "message");
+    // 单独发给一个连接的 JSON 默认走控制通道
+    void sendJson(const QJsonObject &json,Lane lane = ControlLane);
+    // 发送已经编码好的 JSON（聊天通道），广播时同一份数据给所有接收者共用
+    void sendFrame(const QByteArray &jsonData,quint64 traceId = 0);
+
+};
+
+#endif // SERVERWORKER_H
@@ -0,0 +1,162 @@
+#include "slotbitmap.h"
+#include <algorithm>
+
+// 桶内元素超过这个数时数组比位图更占内存
+static const int ArrayMaxCount = 4096;
+static const int BitmapWords = 65536 / 64;
+
+int SlotBitmap::findContainer(quint16 key) const
+{
+    auto it = std::lower_bound(m_containers.cbegin(),m_containers.cend(),key,[](const Container &container,quint16 k){
+        return container.key < k;
+    });
+    if(it == m_containers.cend() || it->key != key)
+        return -1;
+    return int(it - m_containers.cbegin());
+}
+
+void SlotBitmap::toBitmap(Container &container)
+{
+    container.bits.fill(0,BitmapWords);
+    for(quint16 low : std::as_const(container.array))
+        container.bits[low >> 6] |= quint64(1) << (low & 63);
+    container.array = QVector<quint16>();
+}
+
+void SlotBitmap::toArray(Container &container)
+{
+    container.array.reserve(container.count);
+    for(int word = 0; word < BitmapWords; word++){
+        quint64 bits = container.bits.at(word);
+        while(bits){
+            const int bit = qCountTrailingZeroBits(bits);
+            container.array.append(quint16(word * 64 + bit));
+            bits &= bits - 1;
+        }
+    }
+    container.bits = QVector<quint64>();
+}
+
+bool SlotBitmap::add(quint32 value)
+{
+    const quint16 key = quint16(value >> 16);
+    const quint16 low = quint16(value & 0xffff);
+    auto it = std::lower_bound(m_containers.begin(),m_containers.end(),key,[](const Container &container,quint16 k){
+        return container.key < k;
+    });
+    if(it == m_containers.end() || it->key != key){
+        Container container;
+        container.key = key;
+        it = m_containers.insert(it,container);
+    }
+
+    Container &container = *it;
+    if(!container.bits.isEmpty()){
+        quint64 &word = container.bits[low >> 6];
+        const quint64 mask = quint64(1) << (low & 63);
+        if(word & mask)
+            return false;
+        word |= mask;
+        container.count++;
+        return true;
+    }
+    auto pos = std::lower_bound(container.array.begin(),container.array.end(),low);
+    if(pos != container.array.end() && *pos == low)
+        return false;
+    container.array.insert(pos,low);
+    container.count++;
+    if(container.count > ArrayMaxCount)
+        toBitmap(container);
+    return true;
+}
+
+void SlotBitmap::remove(quint32 value)
+{
+    const int index = findContainer(quint16(value >> 16));
+    if(index < 0)
+        return;
+    Container &container = m_containers[index];
+    const quint16 low = quint16(value & 0xffff);
+    if(!container.bits.isEmpty()){
+        quint64 &word = container.bits[low >> 6];
+        const quint64 mask = quint64(1) << (low & 63);
+        if(!(word & mask))
+            return;
+        word &= ~mask;
+        container.count--;
+        if(container.count <= ArrayMaxCount)
+            toArray(container);
+    }else{
+        auto pos = std::lower_bound(container.array.begin(),container.array.end(),low);
+        if(pos == container.array.end() || *pos != low)
+            return;
+        container.array.erase(pos);
+        container.count--;
+    }
+    if(container.count == 0)
+        m_containers.removeAt(index);
+}
+
+bool SlotBitmap::contains(quint32 value) const
+{
+    const int index = findContainer(quint16(value >> 16));
+    if(index < 0)
+        return false;
+    const Container &container = m_containers.at(index);
+    const quint16 low = quint16(value & 0xffff);
+    if(!container.bits.isEmpty())
+        return container.bits.at(low >> 6) & (quint64(1) << (low & 63));
+    return std::binary_search(container.array.cbegin(),container.array.cend(),low);
+}
+
+int SlotBitmap::cardinality() const
+{
+    int count = 0;
+    for(const Container &container : m_containers)
+        count += container.count;
+    return count;
+}
+
+bool SlotBitmap::isEmpty() const
+{
+    return m_containers.isEmpty();
+}
+
+void SlotBitmap::clear()
+{
+    m_containers.clear();
+}
+
+QVector<quint32> SlotBitmap::values(int limit) const
+{
+    QVector<quint32> result;
+    for(const Container &container : m_containers){
+        const quint32 high = quint32(container.key) << 16;
+        if(container.bits.isEmpty()){
+            for(quint16 low : container.array){
+                if(result.size() >= limit)
+                    return result;
+                result.append(high | low);
+            }
+            continue;
+        }
+        for(int word = 0; word < BitmapWords; word++){
+            quint64 bits = container.bits.at(word);
+            while(bits){
+                if(result.size() >= limit)
+                    return result;
+                result.append(high | quint32(word * 64 + qCountTrailingZeroBits(bits)));
+                bits &= bits - 1;
+            }
+        }
+    }
+    return result;
+}
+
+qsizetype SlotBitmap::memoryUsage() const
+{
+    qsizetype bytes = m_containers.capacity() * qsizetype(sizeof(Container));
+    for(const Container &container : m_containers)
+        bytes += container.array.capacity() * qsizetype(sizeof(quint16)) + container.bits.capacity() * qsizetype(sizeof(quint64));
+    return bytes;
+}
@@ -0,0 +1,40 @@
+#ifndef SLOTBITMAP_H
+#define SLOTBITMAP_H
+
+#include <QVector>
+#include <QtGlobal>
+
+// 压缩位图（roaring 的简化版）：按高 16 位分桶，
+// 桶里元素少时存有序的 16 位数组，超过 4096 个换成 8KB 的位图
+class SlotBitmap
+{
+public:
+    // 新加入时返回 true
+    bool add(quint32 value);
+    void remove(quint32 value);
+    bool contains(quint32 value) const;
+    int cardinality() const;
+    bool isEmpty() const;
+    void clear();
+    // 最多取出 limit 个元素，按从小到大的顺序
+    QVector<quint32> values(int limit) const;
+    // 占用的堆内存字节数（近似）
+    qsizetype memoryUsage() const;
+
+private:
+    struct Container
+    {
+        quint16 key = 0;
+        int count = 0;
+        QVector<quint16> array;
+        QVector<quint64> bits;
+    };
+
+    int findContainer(quint16 key) const;
+    static void toBitmap(Container &container);
+    static void toArray(Container &container);
+
+    QVector<Container> m_containers;
+};
+
+#endif // SLOTBITMAP_H
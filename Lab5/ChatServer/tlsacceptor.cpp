@@ -0,0 +1,178 @@
+#include "tlsacceptor.h"
+#include "chattrace.h"
+#include "handoff.h"
+#include <QThread>
+#include <QTimer>
+#include <QFile>
+#include <QSslKey>
+#include <QSslCertificate>
+
+// 握手超时，半路停住的客户端不会一直占着握手线程
+static const int HandshakeTimeoutMs = 10000;
+
+TlsAcceptor::TlsAcceptor(QObject *parent)
+    : QObject{parent}
+    , m_enabled(false)
+    , m_threadCount(qBound(1,QThread::idealThreadCount() / 2,4))
+    , m_nextThread(0)
+    , m_inFlight(0)
+    , m_completed(0)
+    , m_failed(0)
+{
+}
+
+TlsAcceptor::~TlsAcceptor()
+{
+    for(int i = 0; i < m_threads.size(); i++){
+        m_threads.at(i)->quit();
+        m_threads.at(i)->wait();
+        // 线程已经停了，上下文对象连同还没握完手的套接字可以在这里删掉
+        delete m_contexts.at(i);
+        delete m_threads.at(i);
+    }
+}
+
+bool TlsAcceptor::setCertificate(const QString &certificateFile, const QString &keyFile, QString *error)
+{
+    if(!QSslSocket::supportsSsl()){
+        if(error)
+            *error = "Qt 没有可用的 TLS 后端";
+        return false;
+    }
+    const QList<QSslCertificate> chain = QSslCertificate::fromPath(certificateFile,QSsl::Pem);
+    if(chain.isEmpty()){
+        if(error)
+            *error = QString("无法读取证书 %1").arg(certificateFile);
+        return false;
+    }
+    QFile file(keyFile);
+    if(!file.open(QIODevice::ReadOnly)){
+        if(error)
+            *error = QString("无法读取私钥 %1").arg(keyFile);
+        return false;
+    }
+    const QByteArray pem = file.readAll();
+    QSslKey key(pem,QSsl::Rsa,QSsl::Pem);
+    if(key.isNull())
+        key = QSslKey(pem,QSsl::Ec,QSsl::Pem);
+    if(key.isNull()){
+        if(error)
+            *error = QString("私钥格式不对 %1").arg(keyFile);
+        return false;
+    }
+
+    m_configuration = QSslConfiguration::defaultConfiguration();
+    m_configuration.setLocalCertificateChain(chain);
+    m_configuration.setPrivateKey(key);
+    m_configuration.setProtocol(QSsl::TlsV1_2OrLater);
+    m_configuration.setPeerVerifyMode(QSslSocket::VerifyNone);
+    m_enabled = true;
+    return true;
+}
+
+bool TlsAcceptor::isEnabled() const
+{
+    return m_enabled;
+}
+
+void TlsAcceptor::setThreadCount(int count)
+{
+    if(m_threads.isEmpty())
+        m_threadCount = qMax(1,count);
+}
+
+void TlsAcceptor::startThreads()
+{
+    for(int i = 0; i < m_threadCount; i++){
+        QThread *thread = new QThread;
+        thread->setObjectName(QString("tls-%1").arg(i));
+        QObject *context = new QObject;
+        context->moveToThread(thread);
+        thread->start();
+        m_threads.append(thread);
+        m_contexts.append(context);
+    }
+}
+
+void TlsAcceptor::accept(qintptr socketDescriptor)
+{
+    if(m_threads.isEmpty())
+        startThreads();
+    QObject *context = m_contexts.at(m_nextThread);
+    m_nextThread = (m_nextThread + 1) % m_contexts.size();
+    m_inFlight++;
+    QMetaObject::invokeMethod(context,[this,context,socketDescriptor]{
+        handshake(context,socketDescriptor);
+    },Qt::QueuedConnection);
+}
+
+void TlsAcceptor::handshake(QObject *context, qintptr socketDescriptor)
+{
+    // 在握手线程里执行，套接字先挂在这个线程的上下文对象下面
+    const qint64 beginNs = ChatTrace::now();
+    QSslSocket *socket = new QSslSocket(context);
+    socket->setSslConfiguration(m_configuration);
+    if(!socket->setSocketDescriptor(socketDescriptor)){
+        Handoff::closeDescriptor(socketDescriptor);
+        delete socket;
+        m_inFlight--;
+        m_failed++;
+        return;
+    }
+    QTimer *timeout = new QTimer(socket);
+    timeout->setSingleShot(true);
+    connect(timeout,&QTimer::timeout,socket,[this,socket,timeout,beginNs]{
+        handshakeFinished(socket,timeout,beginNs,false);
+    });
+    connect(socket,&QSslSocket::encrypted,socket,[this,socket,timeout,beginNs]{
+        handshakeFinished(socket,timeout,beginNs,true);
+    });
+    connect(socket,&QSslSocket::errorOccurred,socket,[this,socket,timeout,beginNs]{
+        handshakeFinished(socket,timeout,beginNs,false);
+    });
+    connect(socket,&QSslSocket::sslErrors,socket,[this,socket,timeout,beginNs]{
+        handshakeFinished(socket,timeout,beginNs,false);
+    });
+    timeout->start(HandshakeTimeoutMs);
+    socket->startServerEncryption();
+}
+
+void TlsAcceptor::handshakeFinished(QSslSocket *socket, QTimer *timeout, qint64 beginNs, bool ok)
+{
+    // 断开所有连接之后，同一个套接字后续的报错和超时都不会再进来
+    socket->disconnect(socket);
+    timeout->stop();
+    timeout->setParent(nullptr);
+    timeout->deleteLater();
+    m_inFlight--;
+    if(!ok){
+        m_failed++;
+        socket->abort();
+        socket->deleteLater();
+        return;
+    }
+    m_completed++;
+    {
+        QMutexLocker locker(&m_statsMutex);
+        m_handshakeTime.add((ChatTrace::now() - beginNs) / 1000);
+    }
+    // 只能从套接字所在的线程把它推到主线程
+    socket->setParent(nullptr);
+    socket->moveToThread(thread());
+    QMetaObject::invokeMethod(this,[this,socket]{
+        emit ready(socket);
+    },Qt::QueuedConnection);
+}
+
+QJsonObject TlsAcceptor::stats() const
+{
+    QJsonObject json;
+    json["enabled"] = m_enabled;
+    json["threads"] = int(m_threads.size());
+    json["inFlight"] = m_inFlight.load();
+    json["handshakes"] = QJsonValue(qint64(m_completed.load()));
+    json["failed"] = QJsonValue(qint64(m_failed.load()));
+    QMutexLocker locker(&m_statsMutex);
+    json["handshakeTime"] = m_handshakeTime.toJson();
+    return json;
+}
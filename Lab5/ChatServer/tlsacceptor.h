@@ -0,0 +1,59 @@
+#ifndef TLSACCEPTOR_H
+#define TLSACCEPTOR_H
+
+#include <QObject>
+#include <QSslConfiguration>
+#include <QSslSocket>
+#include <QVector>
+#include <QMutex>
+#include <QJsonObject>
+#include <atomic>
+#include "rttstats.h"
+
+class QThread;
+class QTimer;
+
+// TLS 接入：握手放在单独的线程里做，完成后把套接字移回主线程交给 ServerWorker，
+// 重连风暴时大量完整握手不会卡住聊天消息的分发。
+// Qt 给每个套接字单独建 SSL_CTX，票据密钥不共享，服务端复用不了会话，重连都是完整握手
+class TlsAcceptor : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit TlsAcceptor(QObject *parent = nullptr);
+    ~TlsAcceptor();
+
+    bool setCertificate(const QString &certificateFile,const QString &keyFile,QString *error = nullptr);
+    bool isEnabled() const;
+    // 握手线程数，在 setCertificate 之后、第一次 accept 之前设置
+    void setThreadCount(int count);
+    // 主线程调用：把新连接的描述符交给一个握手线程
+    void accept(qintptr socketDescriptor);
+    QJsonObject stats() const;
+
+signals:
+    // 在主线程发出，套接字已经属于主线程，没有父对象
+    void ready(QSslSocket *socket);
+    void logMessage(const QString &msg);
+
+private:
+    void startThreads();
+    void handshake(QObject *context,qintptr socketDescriptor);
+    void handshakeFinished(QSslSocket *socket,QTimer *timeout,qint64 beginNs,bool ok);
+
+    QSslConfiguration m_configuration;
+    bool m_enabled;
+    int m_threadCount;
+    QVector<QThread*> m_threads;
+    QVector<QObject*> m_contexts;
+    int m_nextThread;
+
+    std::atomic<int> m_inFlight;
+    std::atomic<quint64> m_completed;
+    std::atomic<quint64> m_failed;
+    mutable QMutex m_statsMutex;
+    RttStats m_handshakeTime;
+};
+
+#endif // TLSACCEPTOR_H
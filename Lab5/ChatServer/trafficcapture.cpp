@@ -0,0 +1,112 @@
+#include "trafficcapture.h"
+#include <QDateTime>
+#include <algorithm>
+
+TrafficCapture::TrafficCapture(QObject *parent)
+    : QThread{parent}, m_stopping(true)
+{
+}
+
+TrafficCapture::~TrafficCapture()
+{
+    close();
+}
+
+bool TrafficCapture::open(const QString &fileName)
+{
+    close();
+    m_file.setFileName(fileName);
+    if(!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+    m_file.write(CaptureFile::header(QDateTime::currentMSecsSinceEpoch()));
+    m_clock.start();
+    m_stopping = false;
+    start(QThread::LowPriority);
+    return true;
+}
+
+void TrafficCapture::close()
+{
+    if(!isRunning())
+        return;
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stopping = true;
+        m_wakeUp.wakeOne();
+    }
+    wait();
+    m_file.close();
+}
+
+QString TrafficCapture::fileName() const
+{
+    return m_file.fileName();
+}
+
+void TrafficCapture::recordConnect(quint32 connectionId)
+{
+    append(CaptureFile::Connect,connectionId,QByteArray());
+}
+
+void TrafficCapture::recordFrame(quint32 connectionId, const QByteArray &frame)
+{
+    append(CaptureFile::Frame,connectionId,frame);
+}
+
+void TrafficCapture::recordDisconnect(quint32 connectionId)
+{
+    append(CaptureFile::Disconnect,connectionId,QByteArray());
+}
+
+void TrafficCapture::append(CaptureFile::RecordType type, quint32 connectionId, const QByteArray &frame)
+{
+    CaptureFile::Record record;
+    record.type = type;
+    record.connectionId = connectionId;
+    record.timestampNs = m_clock.nsecsElapsed();
+    record.frame = frame;
+
+    QMutexLocker locker(&m_mutex);
+    if(m_stopping)
+        return;
+    const bool wasEmpty = m_pending.isEmpty();
+    m_pending.append(record);
+    if(wasEmpty)
+        m_wakeUp.wakeOne();
+}
+
+void TrafficCapture::run()
+{
+    QVector<CaptureFile::Record> batch;
+    QByteArray buffer;
+    qint64 lastNs = 0;
+    for(;;){
+        bool stopping;
+        {
+            QMutexLocker locker(&m_mutex);
+            while(m_pending.isEmpty() && !m_stopping)
+                m_wakeUp.wait(&m_mutex);
+            batch.swap(m_pending);
+            stopping = m_stopping;
+        }
+
+        // 多个线程同时追加时时间戳可能轻微乱序，按时间排一下保证增量非负
+        std::stable_sort(batch.begin(),batch.end(),[](const CaptureFile::Record &a,const CaptureFile::Record &b){
+            return a.timestampNs < b.timestampNs;
+        });
+        buffer.clear();
+        for(const CaptureFile::Record &record : batch)
+            CaptureFile::appendRecord(buffer,record,lastNs);
+        batch.clear();
+        if(!buffer.isEmpty()){
+            m_file.write(buffer);
+            m_file.flush();
+        }
+
+        if(stopping){
+            QMutexLocker locker(&m_mutex);
+            if(m_pending.isEmpty())
+                return;
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef TRAFFICCAPTURE_H
+#define TRAFFICCAPTURE_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QVector>
+#include "capturefile.h"
+
+// 记录所有入站帧，写文件在单独的线程里完成，I/O 线程只做一次加锁追加
+class TrafficCapture : public QThread
+{
+    Q_OBJECT
+
+public:
+    explicit TrafficCapture(QObject *parent = nullptr);
+    ~TrafficCapture();
+
+    bool open(const QString &fileName);
+    void close();
+    QString fileName() const;
+
+    void recordConnect(quint32 connectionId);
+    void recordFrame(quint32 connectionId,const QByteArray &frame);
+    void recordDisconnect(quint32 connectionId);
+
+protected:
+    void run() override;
+
+private:
+    void append(CaptureFile::RecordType type,quint32 connectionId,const QByteArray &frame);
+
+    QFile m_file;
+    QElapsedTimer m_clock;
+    QMutex m_mutex;
+    QWaitCondition m_wakeUp;
+    QVector<CaptureFile::Record> m_pending;
+    bool m_stopping;
+};
+
+#endif // TRAFFICCAPTURE_H
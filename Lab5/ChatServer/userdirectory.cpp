@@ -0,0 +1,76 @@
+#include "userdirectory.h"
+#include "serverworker.h"
+#include "ioshards.h"
+
+UserDirectory::UserDirectory(QObject *parent)
+    : QObject{parent}
+{
+}
+
+int UserDirectory::shardOf(ServerWorker *worker)
+{
+    return worker->shard() ? worker->shard()->index() : 0;
+}
+
+void UserDirectory::addUser(ServerWorker *worker, const QString &userName)
+{
+    m_users.insert(userName,worker);
+}
+
+void UserDirectory::removeUser(ServerWorker *worker, const QString &userName)
+{
+    const auto it = m_users.constFind(userName);
+    if(it == m_users.constEnd() || it.value() != worker)
+        return;
+    m_users.remove(userName);
+}
+
+void UserDirectory::joinRoom(ServerWorker *worker, const QString &room)
+{
+    const int shard = shardOf(worker);
+    QVector<QVector<ServerWorker*>> &members = m_rooms[room];
+    if(members.size() <= shard)
+        members.resize(shard + 1);
+    members[shard].append(worker);
+}
+
+void UserDirectory::leaveRoom(ServerWorker *worker, const QString &room)
+{
+    auto it = m_rooms.find(room);
+    const int shard = shardOf(worker);
+    if(it == m_rooms.end() || shard >= it->size())
+        return;
+    (*it)[shard].removeOne(worker);
+    for(const QVector<ServerWorker*> &members : std::as_const(*it)){
+        if(!members.isEmpty())
+            return;
+    }
+    m_rooms.erase(it);
+}
+
+bool UserDirectory::containsUser(const QString &userName) const
+{
+    return m_users.contains(userName);
+}
+
+QStringList UserDirectory::userNames() const
+{
+    return m_users.keys();
+}
+
+const QVector<ServerWorker*> &UserDirectory::members(const QString &room, int shard) const
+{
+    static const QVector<ServerWorker*> none;
+    const auto it = m_rooms.constFind(room);
+    if(it == m_rooms.constEnd() || shard >= it->size())
+        return none;
+    return it->at(shard);
+}
+
+QJsonObject UserDirectory::stats() const
+{
+    QJsonObject json;
+    json["users"] = int(m_users.size());
+    json["rooms"] = int(m_rooms.size());
+    return json;
+}
@@ -0,0 +1,40 @@
+#ifndef USERDIRECTORY_H
+#define USERDIRECTORY_H
+
+#include <QObject>
+#include <QHash>
+#include <QVector>
+#include <QString>
+#include <QStringList>
+#include <QJsonObject>
+
+class ServerWorker;
+
+// 用户和房间成员的目录，只在主线程里读写：
+// 登录查重、广播取接收者都在主线程；I/O 线程只拿到投递任务时拷好的成员列表，不直接读这里
+class UserDirectory : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit UserDirectory(QObject *parent = nullptr);
+
+    void addUser(ServerWorker *worker,const QString &userName);
+    void removeUser(ServerWorker *worker,const QString &userName);
+    void joinRoom(ServerWorker *worker,const QString &room);
+    void leaveRoom(ServerWorker *worker,const QString &room);
+    bool containsUser(const QString &userName) const;
+    QStringList userNames() const;
+    // 房间成员按所在的 I/O 线程分开存，广播时每个线程的那一份直接拷进任务（只加引用计数）
+    const QVector<ServerWorker*> &members(const QString &room,int shard) const;
+
+    QJsonObject stats() const;
+
+private:
+    static int shardOf(ServerWorker *worker);
+
+    QHash<QString,ServerWorker*> m_users;
+    QHash<QString,QVector<QVector<ServerWorker*>>> m_rooms;
+};
+
+#endif // USERDIRECTORY_H
@@ -0,0 +1,428 @@
+#include "websocketcodec.h"
+#include "filechunk.h"
+#include <QCryptographicHash>
+#include <QList>
+#include <QHash>
+#include <QtEndian>
+#include <atomic>
+#include <zlib.h>
+
+static const QByteArray AcceptGuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+// 握手请求的上限，超过还没结束就当成恶意连接
+static const int MaxHandshakeBytes = 8 * 1024;
+// 太短的消息压缩不划算，直接发
+static const int MinDeflateBytes = 64;
+// 解压状态（32K 窗口加上 zlib 自己的结构）大约占的内存
+static const qint64 InflateStateBytes = 44 * 1024;
+
+enum Opcode {
+    ContinuationOpcode = 0x0,
+    TextOpcode = 0x1,
+    BinaryOpcode = 0x2,
+    CloseOpcode = 0x8,
+    PingOpcode = 0x9,
+    PongOpcode = 0xa
+};
+
+static std::atomic<quint64> encodedMessages{0};
+static std::atomic<quint64> sharedEncodes{0};
+static std::atomic<quint64> deflateInputBytes{0};
+static std::atomic<quint64> deflateOutputBytes{0};
+
+// 每个线程一份压缩器，按窗口大小分开；服务端不保留上下文，每条消息前 reset
+struct DeflateStreams
+{
+    z_stream *streams[16] = {};
+
+    ~DeflateStreams()
+    {
+        for(z_stream *stream : streams){
+            if(stream){
+                deflateEnd(stream);
+                delete stream;
+            }
+        }
+    }
+
+    z_stream *get(int windowBits)
+    {
+        z_stream *&stream = streams[windowBits];
+        if(!stream){
+            stream = new z_stream;
+            memset(stream,0,sizeof(z_stream));
+            // 负的窗口位数表示裸 deflate 流，不带 zlib 头尾
+            if(deflateInit2(stream,Z_DEFAULT_COMPRESSION,Z_DEFLATED,-windowBits,8,Z_DEFAULT_STRATEGY) != Z_OK){
+                delete stream;
+                stream = nullptr;
+            }
+        }
+        return stream;
+    }
+};
+
+// 最近一次编码的结果：广播时同一个 QByteArray 依次交给每个连接，浏览器连接共用这一份
+struct EncodeCache
+{
+    QByteArray payload;
+    int windowBits = -1;
+    QByteArray frame;
+};
+
+static thread_local DeflateStreams deflateStreams;
+static thread_local EncodeCache encodeCache;
+
+static QByteArray encodeFrame(int opcode,bool compressed,const QByteArray &payload)
+{
+    const qsizetype length = payload.size();
+    QByteArray frame;
+    frame.reserve(length + 10);
+    frame.append(char(0x80 | (compressed ? 0x40 : 0) | opcode));
+    if(length < 126){
+        frame.append(char(length));
+    }else if(length <= 0xffff){
+        char size[2];
+        qToBigEndian<quint16>(quint16(length),size);
+        frame.append(char(126));
+        frame.append(size,2);
+    }else{
+        char size[8];
+        qToBigEndian<quint64>(quint64(length),size);
+        frame.append(char(127));
+        frame.append(size,8);
+    }
+    frame.append(payload);
+    return frame;
+}
+
+static bool deflatePayload(const QByteArray &payload,int windowBits,QByteArray &compressed)
+{
+    z_stream *stream = deflateStreams.get(windowBits);
+    if(!stream || deflateReset(stream) != Z_OK)
+        return false;
+    compressed.resize(qsizetype(deflateBound(stream,uLong(payload.size()))) + 16);
+    stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(payload.constData()));
+    stream->avail_in = uInt(payload.size());
+    stream->next_out = reinterpret_cast<Bytef*>(compressed.data());
+    stream->avail_out = uInt(compressed.size());
+    if(deflate(stream,Z_SYNC_FLUSH) != Z_OK || stream->avail_in != 0)
+        return false;
+    compressed.resize(compressed.size() - qsizetype(stream->avail_out));
+    // RFC 7692：去掉同步刷新留下的 00 00 ff ff，接收方会自己补上
+    if(compressed.endsWith(QByteArrayLiteral("\x00\x00\xff\xff")))
+        compressed.chop(4);
+    return true;
+}
+
+WebSocketCodec::WebSocketCodec()
+    : m_open(false)
+    , m_deflate(false)
+    , m_serverWindowBits(15)
+    , m_clientNoContextTakeover(false)
+    , m_inflate(nullptr)
+    , m_fragmentOpcode(0)
+    , m_fragmentCompressed(false)
+{
+}
+
+WebSocketCodec::~WebSocketCodec()
+{
+    if(m_inflate){
+        inflateEnd(m_inflate);
+        delete m_inflate;
+    }
+}
+
+bool WebSocketCodec::isOpen() const
+{
+    return m_open;
+}
+
+bool WebSocketCodec::isDeflateEnabled() const
+{
+    return m_deflate;
+}
+
+// 从客户端的扩展列表里挑第一个能接受的 permessage-deflate 提议
+static QByteArray negotiateDeflate(const QByteArray &header,int &serverWindowBits,bool &clientNoContextTakeover)
+{
+    for(const QByteArray &offer : header.split(',')){
+        const QList<QByteArray> params = offer.split(';');
+        if(params.first().trimmed() != "permessage-deflate")
+            continue;
+        int windowBits = 15;
+        bool noContextTakeover = false;
+        bool acceptable = true;
+        for(qsizetype i = 1; i < params.size() && acceptable; i++){
+            const QByteArray param = params.at(i).trimmed();
+            const qsizetype equals = param.indexOf('=');
+            const QByteArray name = (equals < 0 ? param : param.left(equals)).trimmed();
+            const QByteArray value = equals < 0 ? QByteArray() : param.mid(equals + 1).trimmed().replace('"',"");
+            if(name == "server_no_context_takeover"){
+                // 服务端本来就不保留上下文
+            }else if(name == "client_no_context_takeover"){
+                noContextTakeover = true;
+            }else if(name == "server_max_window_bits"){
+                bool ok = false;
+                windowBits = value.toInt(&ok);
+                // zlib 的裸 deflate 不支持 8 位窗口
+                acceptable = ok && windowBits >= 9 && windowBits <= 15;
+            }else if(name == "client_max_window_bits"){
+                // 解压端总是用最大窗口，客户端用多大都能解
+            }else{
+                acceptable = false;
+            }
+        }
+        if(!acceptable)
+            continue;
+        serverWindowBits = windowBits;
+        clientNoContextTakeover = noContextTakeover;
+        QByteArray response = "permessage-deflate; server_no_context_takeover";
+        if(windowBits != 15)
+            response += "; server_max_window_bits=" + QByteArray::number(windowBits);
+        if(noContextTakeover)
+            response += "; client_no_context_takeover";
+        return response;
+    }
+    return QByteArray();
+}
+
+bool WebSocketCodec::acceptHandshake(QByteArray &input, QByteArray &response, QString &error)
+{
+    static const QByteArray badRequest = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+    const qsizetype end = input.indexOf("\r\n\r\n");
+    if(end < 0){
+        if(input.size() > MaxHandshakeBytes){
+            error = "WebSocket 握手请求太长";
+            response = badRequest;
+        }
+        return false;
+    }
+    const QList<QByteArray> lines = input.left(end).split('\n');
+    input.remove(0,end + 4);
+
+    QHash<QByteArray,QByteArray> headers;
+    for(qsizetype i = 1; i < lines.size(); i++){
+        const QByteArray &line = lines.at(i);
+        const qsizetype colon = line.indexOf(':');
+        if(colon <= 0)
+            continue;
+        const QByteArray name = line.left(colon).trimmed().toLower();
+        const QByteArray value = line.mid(colon + 1).trimmed();
+        // 重复的头按 HTTP 的规则用逗号拼起来
+        QByteArray &merged = headers[name];
+        merged = merged.isEmpty() ? value : merged + ", " + value;
+    }
+    const QByteArray requestLine = lines.first().trimmed();
+    const QByteArray key = headers.value("sec-websocket-key");
+    if(!requestLine.startsWith("GET ") || !requestLine.endsWith("HTTP/1.1")
+        || !headers.value("upgrade").toLower().contains("websocket")
+        || !headers.value("connection").toLower().contains("upgrade")
+        || headers.value("sec-websocket-version") != "13" || key.isEmpty()){
+        error = "不是合法的 WebSocket 握手请求";
+        response = badRequest;
+        return false;
+    }
+
+    const QByteArray accept = QCryptographicHash::hash(key + AcceptGuid,QCryptographicHash::Sha1).toBase64();
+    response = "HTTP/1.1 101 Switching Protocols\r\n"
+               "Upgrade: websocket\r\n"
+               "Connection: Upgrade\r\n"
+               "Sec-WebSocket-Accept: " + accept + "\r\n";
+    const QByteArray extension = negotiateDeflate(headers.value("sec-websocket-extensions"),m_serverWindowBits,m_clientNoContextTakeover);
+    if(!extension.isEmpty()){
+        m_deflate = true;
+        response += "Sec-WebSocket-Extensions: " + extension + "\r\n";
+    }
+    response += "\r\n";
+    m_open = true;
+    return true;
+}
+
+WebSocketCodec::Status WebSocketCodec::readMessage(const QByteArray &input, qsizetype &offset, qint64 maxMessageBytes,
+                                                   QByteArray &message, QByteArray &reply, QString &error)
+{
+    const uchar *data = reinterpret_cast<const uchar*>(input.constData());
+    for(;;){
+        const qsizetype available = input.size() - offset;
+        if(available < 2)
+            return NeedMore;
+        const uchar *frame = data + offset;
+        const bool fin = frame[0] & 0x80;
+        const bool compressed = frame[0] & 0x40;
+        const int opcode = frame[0] & 0x0f;
+        quint64 length = frame[1] & 0x7f;
+        qsizetype headerSize = 2;
+        if(length == 126){
+            if(available < 4)
+                return NeedMore;
+            length = qFromBigEndian<quint16>(frame + 2);
+            headerSize = 4;
+        }else if(length == 127){
+            if(available < 10)
+                return NeedMore;
+            length = qFromBigEndian<quint64>(frame + 2);
+            headerSize = 10;
+        }
+        // 浏览器发来的帧必须带掩码，保留位只有协商了压缩时才能用 RSV1
+        if(!(frame[1] & 0x80) || (frame[0] & 0x30) || (compressed && !m_deflate)){
+            error = "WebSocket 帧格式错误";
+            return Failed;
+        }
+        if(length > quint64(maxMessageBytes) || quint64(m_fragments.size()) + length > quint64(maxMessageBytes)){
+            error = QString("WebSocket 消息长度超过上限");
+            return Failed;
+        }
+        headerSize += 4;
+        if(quint64(available - headerSize) < length)
+            return NeedMore;
+
+        const uchar *mask = frame + headerSize - 4;
+        QByteArray payload(reinterpret_cast<const char*>(frame + headerSize),qsizetype(length));
+        char *bytes = payload.data();
+        for(qsizetype i = 0; i < payload.size(); i++)
+            bytes[i] ^= mask[i & 3];
+        offset += headerSize + qsizetype(length);
+
+        if(opcode >= CloseOpcode){
+            if(!fin || compressed || length > 125){
+                error = "WebSocket 控制帧格式错误";
+                return Failed;
+            }
+            if(opcode == CloseOpcode){
+                const quint16 code = payload.size() >= 2 ? qFromBigEndian<quint16>(payload.constData()) : 1000;
+                reply += closeFrame(code);
+                m_open = false;
+                return Closed;
+            }
+            if(opcode == PingOpcode)
+                reply += encodeFrame(PongOpcode,false,payload);
+            else if(opcode != PongOpcode){
+                error = "未知的 WebSocket 控制帧";
+                return Failed;
+            }
+            continue;
+        }
+
+        if(opcode == ContinuationOpcode){
+            if(m_fragmentOpcode == 0 || compressed){
+                error = "WebSocket 分片顺序错误";
+                return Failed;
+            }
+            m_fragments += payload;
+        }else if(opcode == TextOpcode || opcode == BinaryOpcode){
+            if(m_fragmentOpcode != 0){
+                error = "WebSocket 分片顺序错误";
+                return Failed;
+            }
+            m_fragmentOpcode = opcode;
+            m_fragmentCompressed = compressed;
+            m_fragments = payload;
+        }else{
+            error = "未知的 WebSocket 帧类型";
+            return Failed;
+        }
+        if(!fin)
+            continue;
+
+        const bool wasCompressed = m_fragmentCompressed;
+        QByteArray complete;
+        complete.swap(m_fragments);
+        m_fragmentOpcode = 0;
+        m_fragmentCompressed = false;
+        if(!wasCompressed){
+            message = complete;
+            return Message;
+        }
+        if(!inflateMessage(complete,maxMessageBytes,message)){
+            error = "WebSocket 消息解压失败";
+            return Failed;
+        }
+        return Message;
+    }
+}
+
+bool WebSocketCodec::inflateMessage(const QByteArray &compressed, qint64 maxMessageBytes, QByteArray &message)
+{
+    if(!m_inflate){
+        m_inflate = new z_stream;
+        memset(m_inflate,0,sizeof(z_stream));
+        if(inflateInit2(m_inflate,-15) != Z_OK){
+            delete m_inflate;
+            m_inflate = nullptr;
+            return false;
+        }
+    }
+    // 补回发送方去掉的 00 00 ff ff
+    const QByteArray input = compressed + QByteArrayLiteral("\x00\x00\xff\xff");
+    m_inflate->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.constData()));
+    m_inflate->avail_in = uInt(input.size());
+    message.clear();
+    char buffer[16 * 1024];
+    int result = Z_OK;
+    do{
+        m_inflate->next_out = reinterpret_cast<Bytef*>(buffer);
+        m_inflate->avail_out = sizeof(buffer);
+        result = inflate(m_inflate,Z_SYNC_FLUSH);
+        if(result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+            return false;
+        message.append(buffer,qsizetype(sizeof(buffer) - m_inflate->avail_out));
+        // 压缩炸弹：解出来的数据同样受单帧上限约束
+        if(message.size() > maxMessageBytes)
+            return false;
+    }while(result == Z_OK && (m_inflate->avail_in > 0 || m_inflate->avail_out == 0));
+    // 客户端用了结束块或者不保留上下文时，下一条消息从头开始
+    if(result == Z_STREAM_END || m_clientNoContextTakeover)
+        inflateReset(m_inflate);
+    return true;
+}
+
+QByteArray WebSocketCodec::encodeMessage(const QByteArray &payload) const
+{
+    encodedMessages++;
+    const int windowBits = m_deflate ? m_serverWindowBits : 0;
+    EncodeCache &cache = encodeCache;
+    // 缓存里留着一份 payload 的引用，数据指针相同就一定是同一份内容
+    if(cache.windowBits == windowBits && cache.payload.constData() == payload.constData()
+        && cache.payload.size() == payload.size() && !cache.frame.isEmpty()){
+        sharedEncodes++;
+        return cache.frame;
+    }
+
+    const int opcode = FileChunk::isChunk(payload) ? BinaryOpcode : TextOpcode;
+    QByteArray frame;
+    QByteArray compressed;
+    if(m_deflate && payload.size() >= MinDeflateBytes && deflatePayload(payload,m_serverWindowBits,compressed)
+        && compressed.size() < payload.size()){
+        deflateInputBytes += quint64(payload.size());
+        deflateOutputBytes += quint64(compressed.size());
+        frame = encodeFrame(opcode,true,compressed);
+    }else{
+        frame = encodeFrame(opcode,false,payload);
+    }
+    cache.payload = payload;
+    cache.windowBits = windowBits;
+    cache.frame = frame;
+    return frame;
+}
+
+QByteArray WebSocketCodec::closeFrame(quint16 code)
+{
+    char payload[2];
+    qToBigEndian<quint16>(code,payload);
+    return encodeFrame(CloseOpcode,false,QByteArray(payload,2));
+}
+
+qint64 WebSocketCodec::bufferedBytes() const
+{
+    return m_fragments.size() + (m_inflate ? InflateStateBytes : 0);
+}
+
+QJsonObject WebSocketCodec::stats()
+{
+    QJsonObject json;
+    json["encoded"] = QJsonValue(qint64(encodedMessages.load()));
+    json["sharedEncodes"] = QJsonValue(qint64(sharedEncodes.load()));
+    json["deflateInBytes"] = QJsonValue(qint64(deflateInputBytes.load()));
+    json["deflateOutBytes"] = QJsonValue(qint64(deflateOutputBytes.load()));
+    return json;
+}
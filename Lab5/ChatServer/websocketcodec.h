@@ -0,0 +1,59 @@
+#ifndef WEBSOCKETCODEC_H
+#define WEBSOCKETCODEC_H
+
+#include <QByteArray>
+#include <QString>
+#include <QJsonObject>
+
+typedef struct z_stream_s z_stream;
+
+// 浏览器连接用的 WebSocket 编解码（RFC 6455），支持 permessage-deflate（RFC 7692）
+// 帧里的内容和 TCP 连接的 QDataStream 帧完全一样：JSON 走文本消息，文件块走二进制消息
+class WebSocketCodec
+{
+public:
+    enum Status {
+        NeedMore,
+        Message,
+        Closed,
+        Failed
+    };
+
+    WebSocketCodec();
+    ~WebSocketCodec();
+    WebSocketCodec(const WebSocketCodec &) = delete;
+    WebSocketCodec &operator=(const WebSocketCodec &) = delete;
+
+    // 握手完成之后才能收发消息
+    bool isOpen() const;
+    bool isDeflateEnabled() const;
+    // 解析 input 开头的 HTTP 升级请求，完整时从 input 里去掉并在 response 里给出应答；
+    // 请求不完整时返回 false 且 error 为空，请求不合法时 error 非空，response 是要回的 400
+    bool acceptHandshake(QByteArray &input,QByteArray &response,QString &error);
+    // 从 input 的 offset 处取下一条完整消息，分片会拼起来；ping 和 close 的应答放进 reply
+    Status readMessage(const QByteArray &input,qsizetype &offset,qint64 maxMessageBytes,
+                       QByteArray &message,QByteArray &reply,QString &error);
+    // 编码一条发给浏览器的消息；服务端不保留压缩上下文，同一份数据在所有连接上编码结果相同，
+    // 广播时只压缩一次
+    QByteArray encodeMessage(const QByteArray &payload) const;
+    static QByteArray closeFrame(quint16 code);
+    // 分片拼接和解压缓冲占用的内存
+    qint64 bufferedBytes() const;
+
+    static QJsonObject stats();
+
+private:
+    bool inflateMessage(const QByteArray &compressed,qint64 maxMessageBytes,QByteArray &message);
+
+    bool m_open;
+    bool m_deflate;
+    // 协商出来的服务端窗口大小和客户端是否保留压缩上下文
+    int m_serverWindowBits;
+    bool m_clientNoContextTakeover;
+    z_stream *m_inflate;
+    QByteArray m_fragments;
+    int m_fragmentOpcode;
+    bool m_fragmentCompressed;
+};
+
+#endif // WEBSOCKETCODEC_H
@@ -0,0 +1,15 @@
+# WebSocket 的 permessage-deflate 和连接压缩直接用 zlib，服务端、客户端和测试都包含这个文件
+# Linux 和 macOS 上用系统自带的 zlib。Qt 的 Windows 安装包（包括 MinGW 套件）不带可以链接的 zlib，
+# 需要另外装一份（比如 MSYS2 的 mingw-w64-x86_64-zlib），再用 qmake ZLIB_DIR=<目录> 或者同名环境变量指过去，
+# 目录下要有 include/zlib.h 和 lib/ 里的库文件
+win32 {
+    isEmpty(ZLIB_DIR): ZLIB_DIR = $$(ZLIB_DIR)
+    isEmpty(ZLIB_DIR): error("需要 zlib：运行 qmake ZLIB_DIR=<zlib 安装目录>，目录下要有 include/zlib.h")
+    !exists($$ZLIB_DIR/include/zlib.h): error("$$ZLIB_DIR/include 下没有 zlib.h")
+    INCLUDEPATH += $$ZLIB_DIR/include
+    LIBS += -L$$ZLIB_DIR/lib
+    msvc: LIBS += -lzlib
+    else: LIBS += -lz
+} else {
+    LIBS += -lz
+}
@@ -1,5 +1,9 @@
-TEMPLATE = subdirs
-
-SUBDIRS += \
-    ChatClient \
-    ChatServer
+TEMPLATE = subdirs
+
+SUBDIRS += \
+    ChatClient \
+    ChatLoad \
+    ChatRelay \
+    ChatReplay \
+    ChatServer \
+    tests
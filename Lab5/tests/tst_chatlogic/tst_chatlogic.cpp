@@ -0,0 +1,580 @@
+#include <QtTest>
+#include <QCoreApplication>
+#include <QBuffer>
+#include <QDataStream>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QtEndian>
+#include <zlib.h>
+#include "capturefile.h"
+#include "framecompressor.h"
+#include "idempotencywindow.h"
+#include "searchindex.h"
+#include "slotbitmap.h"
+#include "websocketcodec.h"
+
+// tst_chatperf 只计时，这里检查结果对不对
+
+// 浏览器发的帧：带掩码，compressed 时置 RSV1
+static QByteArray clientFrame(int opcode, const QByteArray &payload, bool compressed = false, bool fin = true)
+{
+    static const char mask[4] = {0x12,0x34,0x56,0x78};
+    QByteArray frame;
+    frame.append(char((fin ? 0x80 : 0) | (compressed ? 0x40 : 0) | opcode));
+    if(payload.size() < 126){
+        frame.append(char(0x80 | payload.size()));
+    }else{
+        char size[2];
+        qToBigEndian<quint16>(quint16(payload.size()),size);
+        frame.append(char(0x80 | 126));
+        frame.append(size,2);
+    }
+    frame.append(mask,4);
+    for(qsizetype i = 0; i < payload.size(); i++)
+        frame.append(char(payload.at(i) ^ mask[i & 3]));
+    return frame;
+}
+
+// 服务端发的帧不带掩码，拆出 RSV1 和内容
+static bool parseServerFrame(const QByteArray &frame, int &opcode, bool &compressed, QByteArray &payload)
+{
+    if(frame.size() < 2 || (frame.at(1) & 0x80))
+        return false;
+    const uchar *data = reinterpret_cast<const uchar*>(frame.constData());
+    opcode = data[0] & 0x0f;
+    compressed = data[0] & 0x40;
+    qsizetype length = data[1] & 0x7f;
+    qsizetype headerSize = 2;
+    if(length == 126){
+        length = qFromBigEndian<quint16>(data + 2);
+        headerSize = 4;
+    }else if(length == 127){
+        length = qsizetype(qFromBigEndian<quint64>(data + 2));
+        headerSize = 10;
+    }
+    if(frame.size() != headerSize + length)
+        return false;
+    payload = frame.mid(headerSize);
+    return true;
+}
+
+// RFC 7692 的裸 deflate：同步刷新后去掉末尾的 00 00 ff ff
+static QByteArray rawDeflate(const QByteArray &data)
+{
+    z_stream stream;
+    memset(&stream,0,sizeof(stream));
+    if(deflateInit2(&stream,Z_DEFAULT_COMPRESSION,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY) != Z_OK)
+        return QByteArray();
+    QByteArray out(qsizetype(deflateBound(&stream,uLong(data.size()))) + 16,Qt::Uninitialized);
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.constData()));
+    stream.avail_in = uInt(data.size());
+    stream.next_out = reinterpret_cast<Bytef*>(out.data());
+    stream.avail_out = uInt(out.size());
+    deflate(&stream,Z_SYNC_FLUSH);
+    out.resize(out.size() - qsizetype(stream.avail_out));
+    deflateEnd(&stream);
+    if(out.endsWith(QByteArrayLiteral("\x00\x00\xff\xff")))
+        out.chop(4);
+    return out;
+}
+
+static QByteArray rawInflate(const QByteArray &data)
+{
+    z_stream stream;
+    memset(&stream,0,sizeof(stream));
+    if(inflateInit2(&stream,-15) != Z_OK)
+        return QByteArray();
+    const QByteArray input = data + QByteArrayLiteral("\x00\x00\xff\xff");
+    QByteArray out(64 * 1024,Qt::Uninitialized);
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.constData()));
+    stream.avail_in = uInt(input.size());
+    stream.next_out = reinterpret_cast<Bytef*>(out.data());
+    stream.avail_out = uInt(out.size());
+    inflate(&stream,Z_SYNC_FLUSH);
+    out.resize(out.size() - qsizetype(stream.avail_out));
+    inflateEnd(&stream);
+    return out;
+}
+
+static QByteArray handshakeRequest(const QByteArray &extensions = QByteArray())
+{
+    QByteArray request = "GET /chat HTTP/1.1\r\n"
+                         "Host: localhost\r\n"
+                         "Upgrade: websocket\r\n"
+                         "Connection: Upgrade\r\n"
+                         "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                         "Sec-WebSocket-Version: 13\r\n";
+    if(!extensions.isEmpty())
+        request += "Sec-WebSocket-Extensions: " + extensions + "\r\n";
+    return request + "\r\n";
+}
+
+// 一条够长、压得动的消息，超过 websocketcodec.cpp 里不压缩的下限
+static QByteArray longMessage()
+{
+    return QByteArray("{\"type\":\"message\",\"room\":\"lobby\",\"text\":\"")
+           + QByteArray("hello hello hello hello ").repeated(8) + "\"}";
+}
+
+class tst_ChatLogic : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void idempotencyAccept();
+    void idempotencyForget();
+    void idempotencySaveLoad();
+    void webSocketHandshake();
+    void webSocketRoundTrip();
+    void webSocketControlFrames();
+    void webSocketDeflate();
+    void slotBitmap();
+    void slotBitmapConversion();
+    void searchTokenize();
+    void searchBigrams();
+    void frameCompressorReset();
+    void captureDeltaClamp();
+};
+
+void tst_ChatLogic::idempotencyAccept()
+{
+    IdempotencyWindow window;
+    QCOMPARE(window.accept(1),IdempotencyWindow::Fresh);
+    QCOMPARE(window.accept(1),IdempotencyWindow::InFlight);
+    window.finish(1);
+    QCOMPARE(window.accept(1),IdempotencyWindow::Duplicate);
+    // 跳号：中间的序号还没来过，之后来了算新消息
+    QCOMPARE(window.accept(5),IdempotencyWindow::Fresh);
+    QCOMPARE(window.highest(),quint64(5));
+    QCOMPARE(window.accept(3),IdempotencyWindow::Fresh);
+    QCOMPARE(window.accept(0),IdempotencyWindow::Duplicate);
+
+    // 窗口滑过去以后旧序号分不清，报 Stale
+    const quint64 far = 5 + IdempotencyWindow::WindowSize;
+    QCOMPARE(window.accept(far),IdempotencyWindow::Fresh);
+    QCOMPARE(window.accept(5),IdempotencyWindow::Stale);
+    QCOMPARE(window.accept(far - IdempotencyWindow::WindowSize + 1),IdempotencyWindow::Fresh);
+}
+
+void tst_ChatLogic::idempotencyForget()
+{
+    IdempotencyWindow window;
+    QCOMPARE(window.accept(1),IdempotencyWindow::Fresh);
+    window.forget(1);
+    QCOMPARE(window.accept(1),IdempotencyWindow::Fresh);
+    window.finish(1);
+
+    QCOMPARE(window.accept(2),IdempotencyWindow::Fresh);
+    window.dropInFlight();
+    QCOMPARE(window.accept(2),IdempotencyWindow::Fresh);
+    QCOMPARE(window.accept(1),IdempotencyWindow::Duplicate);
+}
+
+void tst_ChatLogic::idempotencySaveLoad()
+{
+    IdempotencyWindow window;
+    QCOMPARE(window.accept(1),IdempotencyWindow::Fresh);
+    QCOMPARE(window.accept(2),IdempotencyWindow::Fresh);
+    window.finish(1);
+
+    QByteArray data;
+    {
+        QDataStream out(&data,QIODevice::WriteOnly);
+        window.save(out);
+    }
+    IdempotencyWindow restored;
+    QDataStream in(data);
+    restored.load(in);
+    QCOMPARE(in.status(),QDataStream::Ok);
+    QCOMPARE(restored.highest(),quint64(2));
+    QCOMPARE(restored.accept(1),IdempotencyWindow::Duplicate);
+    // 交接时还在处理的按没收到保存，重发的要能收下
+    QCOMPARE(restored.accept(2),IdempotencyWindow::Fresh);
+    QCOMPARE(restored.accept(3),IdempotencyWindow::Fresh);
+}
+
+void tst_ChatLogic::webSocketHandshake()
+{
+    WebSocketCodec codec;
+    QByteArray input = handshakeRequest();
+    QByteArray response;
+    QString error;
+    // 还没读到空行就等更多数据
+    QByteArray partial = input.left(20);
+    QVERIFY(!codec.acceptHandshake(partial,response,error));
+    QVERIFY(response.isEmpty());
+
+    input += clientFrame(0x1,"after");
+    QVERIFY(codec.acceptHandshake(input,response,error));
+    QVERIFY(codec.isOpen());
+    QVERIFY(!codec.isDeflateEnabled());
+    QVERIFY(response.startsWith("HTTP/1.1 101 "));
+    // RFC 6455 第 1.3 节的例子
+    QVERIFY(response.contains("Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"));
+    QVERIFY(!response.contains("Sec-WebSocket-Extensions"));
+    // 握手后面紧跟的帧留在 input 里
+    QCOMPARE(input,clientFrame(0x1,"after"));
+
+    WebSocketCodec bad;
+    QByteArray post = handshakeRequest().replace("GET ","POST ");
+    QVERIFY(!bad.acceptHandshake(post,response,error));
+    QVERIFY(response.startsWith("HTTP/1.1 400 "));
+    QVERIFY(!error.isEmpty());
+}
+
+void tst_ChatLogic::webSocketRoundTrip()
+{
+    WebSocketCodec codec;
+    QByteArray input = handshakeRequest();
+    QByteArray response;
+    QString error;
+    QVERIFY(codec.acceptHandshake(input,response,error));
+
+    const QByteArray text = "{\"type\":\"message\",\"text\":\"你好\"}";
+    const QByteArray big(300,'x');
+    input = clientFrame(0x1,text) + clientFrame(0x1,big.left(100),false,false) + clientFrame(0x0,big.mid(100));
+    qsizetype offset = 0;
+    QByteArray message;
+    QByteArray reply;
+    QCOMPARE(codec.readMessage(input,offset,1024,message,reply,error),WebSocketCodec::Message);
+    QCOMPARE(message,text);
+    // 分片拼回一条
+    QCOMPARE(codec.readMessage(input,offset,1024,message,reply,error),WebSocketCodec::Message);
+    QCOMPARE(message,big);
+    QCOMPARE(offset,input.size());
+    QCOMPARE(codec.readMessage(input,offset,1024,message,reply,error),WebSocketCodec::NeedMore);
+    QVERIFY(reply.isEmpty());
+
+    // 只收到半帧
+    const QByteArray frame = clientFrame(0x1,text);
+    const QByteArray half = frame.left(frame.size() / 2);
+    offset = 0;
+    QCOMPARE(codec.readMessage(half,offset,1024,message,reply,error),WebSocketCodec::NeedMore);
+    QCOMPARE(offset,qsizetype(0));
+
+    // 服务端发出去的不带掩码，内容原样
+    int opcode = 0;
+    bool compressed = true;
+    QByteArray payload;
+    QVERIFY(parseServerFrame(codec.encodeMessage(text),opcode,compressed,payload));
+    QCOMPARE(opcode,0x1);
+    QVERIFY(!compressed);
+    QCOMPARE(payload,text);
+
+    // 超过上限的消息直接拒绝
+    WebSocketCodec limited;
+    input = handshakeRequest();
+    QVERIFY(limited.acceptHandshake(input,response,error));
+    input = clientFrame(0x1,big);
+    offset = 0;
+    QCOMPARE(limited.readMessage(input,offset,100,message,reply,error),WebSocketCodec::Failed);
+}
+
+void tst_ChatLogic::webSocketControlFrames()
+{
+    WebSocketCodec codec;
+    QByteArray input = handshakeRequest();
+    QByteArray response;
+    QString error;
+    QVERIFY(codec.acceptHandshake(input,response,error));
+
+    // ping 就地回 pong，不打断后面的消息
+    input = clientFrame(0x9,"hi") + clientFrame(0x1,"text");
+    qsizetype offset = 0;
+    QByteArray message;
+    QByteArray reply;
+    QCOMPARE(codec.readMessage(input,offset,1024,message,reply,error),WebSocketCodec::Message);
+    QCOMPARE(message,QByteArray("text"));
+    int opcode = 0;
+    bool compressed = false;
+    QByteArray payload;
+    QVERIFY(parseServerFrame(reply,opcode,compressed,payload));
+    QCOMPARE(opcode,0xa);
+    QCOMPARE(payload,QByteArray("hi"));
+
+    char code[2];
+    qToBigEndian<quint16>(1001,code);
+    input = clientFrame(0x8,QByteArray(code,2));
+    offset = 0;
+    reply.clear();
+    QCOMPARE(codec.readMessage(input,offset,1024,message,reply,error),WebSocketCodec::Closed);
+    QVERIFY(!codec.isOpen());
+    QCOMPARE(reply,WebSocketCodec::closeFrame(1001));
+
+    // 浏览器发来不带掩码的帧是协议错误
+    WebSocketCodec strict;
+    input = handshakeRequest();
+    QVERIFY(strict.acceptHandshake(input,response,error));
+    QByteArray unmasked = clientFrame(0x1,"x");
+    unmasked[1] = char(unmasked.at(1) & 0x7f);
+    unmasked.remove(2,4);
+    offset = 0;
+    QCOMPARE(strict.readMessage(unmasked,offset,1024,message,reply,error),WebSocketCodec::Failed);
+    // 没协商压缩却置了 RSV1
+    WebSocketCodec plain;
+    input = handshakeRequest();
+    QVERIFY(plain.acceptHandshake(input,response,error));
+    input = clientFrame(0x1,rawDeflate("x"),true);
+    offset = 0;
+    QCOMPARE(plain.readMessage(input,offset,1024,message,reply,error),WebSocketCodec::Failed);
+}
+
+void tst_ChatLogic::webSocketDeflate()
+{
+    WebSocketCodec codec;
+    QByteArray input = handshakeRequest("x-unknown, permessage-deflate; server_max_window_bits=10; client_max_window_bits");
+    QByteArray response;
+    QString error;
+    QVERIFY(codec.acceptHandshake(input,response,error));
+    QVERIFY(codec.isDeflateEnabled());
+    QVERIFY(response.contains("Sec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover; server_max_window_bits=10\r\n"));
+
+    // 客户端压缩的消息，连着两条共用上下文
+    const QByteArray first = longMessage();
+    const QByteArray second = "{\"type\":\"ping\"}";
+    z_stream stream;
+    memset(&stream,0,sizeof(stream));
+    QCOMPARE(deflateInit2(&stream,Z_DEFAULT_COMPRESSION,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY),Z_OK);
+    const auto compressNext = [&stream](const QByteArray &data){
+        QByteArray out(4096,Qt::Uninitialized);
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.constData()));
+        stream.avail_in = uInt(data.size());
+        stream.next_out = reinterpret_cast<Bytef*>(out.data());
+        stream.avail_out = uInt(out.size());
+        deflate(&stream,Z_SYNC_FLUSH);
+        out.resize(out.size() - qsizetype(stream.avail_out));
+        out.chop(4);
+        return out;
+    };
+    input = clientFrame(0x1,compressNext(first),true) + clientFrame(0x1,compressNext(second),true);
+    deflateEnd(&stream);
+    qsizetype offset = 0;
+    QByteArray message;
+    QByteArray reply;
+    QCOMPARE(codec.readMessage(input,offset,1024,message,reply,error),WebSocketCodec::Message);
+    QCOMPARE(message,first);
+    QCOMPARE(codec.readMessage(input,offset,1024,message,reply,error),WebSocketCodec::Message);
+    QCOMPARE(message,second);
+
+    // 解出来超过上限的同样拒绝
+    WebSocketCodec limited;
+    input = handshakeRequest("permessage-deflate");
+    QVERIFY(limited.acceptHandshake(input,response,error));
+    input = clientFrame(0x1,rawDeflate(QByteArray(4096,'a')),true);
+    offset = 0;
+    QCOMPARE(limited.readMessage(input,offset,1024,message,reply,error),WebSocketCodec::Failed);
+
+    // 服务端：长消息压缩发出，短消息原样
+    int opcode = 0;
+    bool compressed = false;
+    QByteArray payload;
+    QVERIFY(parseServerFrame(codec.encodeMessage(first),opcode,compressed,payload));
+    QCOMPARE(opcode,0x1);
+    QVERIFY(compressed);
+    QVERIFY(payload.size() < first.size());
+    QCOMPARE(rawInflate(payload),first);
+    QVERIFY(parseServerFrame(codec.encodeMessage(second),opcode,compressed,payload));
+    QVERIFY(!compressed);
+    QCOMPARE(payload,second);
+}
+
+void tst_ChatLogic::slotBitmap()
+{
+    SlotBitmap bitmap;
+    QVERIFY(bitmap.isEmpty());
+    QVERIFY(bitmap.add(7));
+    QVERIFY(!bitmap.add(7));
+    QVERIFY(bitmap.add(3));
+    // 不同的高 16 位落在不同的桶
+    QVERIFY(bitmap.add(0x30001));
+    QCOMPARE(bitmap.cardinality(),3);
+    QVERIFY(bitmap.contains(7));
+    QVERIFY(!bitmap.contains(8));
+    QVERIFY(!bitmap.contains(0x20001));
+    QCOMPARE(bitmap.values(10),QVector<quint32>({3,7,0x30001}));
+    QCOMPARE(bitmap.values(2),QVector<quint32>({3,7}));
+
+    bitmap.remove(7);
+    bitmap.remove(8);
+    QCOMPARE(bitmap.cardinality(),2);
+    QVERIFY(!bitmap.contains(7));
+    bitmap.remove(3);
+    bitmap.remove(0x30001);
+    QVERIFY(bitmap.isEmpty());
+    QCOMPARE(bitmap.values(10),QVector<quint32>());
+
+    bitmap.add(1);
+    bitmap.clear();
+    QVERIFY(bitmap.isEmpty());
+    QVERIFY(!bitmap.contains(1));
+}
+
+void tst_ChatLogic::slotBitmapConversion()
+{
+    // 一个桶里超过 4096 个换成位图，删到 4096 个以下换回数组，内容都不能变
+    SlotBitmap bitmap;
+    for(quint32 i = 0; i <= 4096; i++)
+        QVERIFY(bitmap.add(i * 2));
+    QVERIFY(bitmap.memoryUsage() >= 8192);
+    QCOMPARE(bitmap.cardinality(),4097);
+    QVERIFY(bitmap.contains(8192));
+    QVERIFY(!bitmap.contains(8191));
+    QVERIFY(!bitmap.add(8192));
+    QCOMPARE(bitmap.values(3),QVector<quint32>({0,2,4}));
+
+    bitmap.remove(1);
+    QCOMPARE(bitmap.cardinality(),4097);
+    bitmap.remove(0);
+    QCOMPARE(bitmap.cardinality(),4096);
+    QVERIFY(!bitmap.contains(0));
+    QVERIFY(bitmap.contains(2));
+    const QVector<quint32> values = bitmap.values(5000);
+    QCOMPARE(values.size(),4096);
+    for(int i = 0; i < values.size(); i++)
+        QCOMPARE(values.at(i),quint32(i + 1) * 2);
+}
+
+void tst_ChatLogic::searchTokenize()
+{
+    QCOMPARE(SearchIndex::tokenize("你好世界"),QStringList({"你","好","世","界","你好","好世","世界"}));
+    // 查询时单字已经被两字词覆盖
+    QCOMPARE(SearchIndex::tokenize("你好世界",true),QStringList({"你好","好世","世界"}));
+    QCOMPARE(SearchIndex::tokenize("锅",true),QStringList({"锅"}));
+    QCOMPARE(SearchIndex::tokenize("Hello你好, World!"),QStringList({"hello","你","好","你好","world"}));
+    QCOMPARE(SearchIndex::tokenize("안녕하세요",true),QStringList({"안녕","녕하","하세","세요"}));
+}
+
+void tst_ChatLogic::searchBigrams()
+{
+    SearchIndex index;
+    QSignalSpy spy(&index,&SearchIndex::searchFinished);
+    index.add("lobby",1,"alice","今天晚上一起去吃火锅吗");
+    index.add("lobby",2,"bob","锅火不是一个词");
+    index.add("lobby",3,"carol","火锅店七点见 see you");
+    index.add("other",4,"dave","火锅");
+
+    const auto run = [&](quint64 id,const QString &room,const QString &query,qint64 before,int limit){
+        index.search(id,room,query,before,limit);
+        if(spy.isEmpty())
+            spy.wait(5000);
+        return spy.isEmpty() ? QJsonObject() : spy.takeFirst().at(1).toJsonObject();
+    };
+    const auto seqs = [](const QJsonObject &result){
+        QList<qint64> list;
+        for(const QJsonValue &item : result.value("results").toArray())
+            list.append(item.toObject().value("seq").toInteger());
+        return list;
+    };
+
+    // 按两字词查，"锅火" 不算 "火锅"；新的在前，别的房间的不算
+    QJsonObject result = run(1,"lobby","火锅",-1,10);
+    QCOMPARE(result.value("total").toInt(),2);
+    QCOMPARE(seqs(result),QList<qint64>({3,1}));
+    // 单字查询用单字倒排表
+    result = run(2,"lobby","锅",-1,10);
+    QCOMPARE(seqs(result),QList<qint64>({3,2,1}));
+    // 中英混合，所有词都要出现
+    result = run(3,"lobby","火锅 SEE",-1,10);
+    QCOMPARE(seqs(result),QList<qint64>({3}));
+    result = run(4,"lobby","吃火锅",-1,10);
+    QCOMPARE(seqs(result),QList<qint64>({1}));
+    result = run(5,"lobby","涮羊肉",-1,10);
+    QCOMPARE(result.value("total").toInt(),0);
+
+    // 翻页：next 接着往前取
+    result = run(6,"lobby","锅",-1,2);
+    QCOMPARE(seqs(result),QList<qint64>({3,2}));
+    QVERIFY(result.contains("next"));
+    result = run(7,"lobby","锅",result.value("next").toInteger(),2);
+    QCOMPARE(seqs(result),QList<qint64>({1}));
+    QVERIFY(!result.contains("next"));
+}
+
+void tst_ChatLogic::frameCompressorReset()
+{
+    const QByteArray first = longMessage();
+    const QByteArray second = longMessage().replace("lobby","other");
+
+    // 连接上下文：第一帧带重置标志，之后的接着用上下文
+    FrameCompressor compressor;
+    const QByteArray a = compressor.compress(first);
+    const QByteArray b = compressor.compress(second);
+    QVERIFY(FrameCompressor::isCompressed(a));
+    QVERIFY(a.at(1) & FrameCompressor::StreamFlag);
+    QVERIFY(a.at(1) & FrameCompressor::ResetFlag);
+    QVERIFY(!(b.at(1) & FrameCompressor::ResetFlag));
+    QVERIFY(compressor.memoryUsage() > 0);
+
+    FrameDecompressor decompressor;
+    QByteArray result;
+    QVERIFY(decompressor.decompress(a,1024 * 1024,result));
+    QCOMPARE(result,first);
+    QVERIFY(decompressor.decompress(b,1024 * 1024,result));
+    QCOMPARE(result,second);
+
+    // 换了一个压缩器（比如重连），重置标志让解压端丢掉旧上下文
+    FrameCompressor fresh;
+    const QByteArray c = fresh.compress(second);
+    QVERIFY(c.at(1) & FrameCompressor::ResetFlag);
+    QVERIFY(decompressor.decompress(c,1024 * 1024,result));
+    QCOMPARE(result,second);
+
+    // 共享压缩的帧不带上下文，插在中间也不影响连接上下文
+    const QByteArray shared = FrameCompressor::compressShared(first);
+    QVERIFY(FrameCompressor::isCompressed(shared));
+    QCOMPARE(int(shared.at(1)),0);
+    QCOMPARE(FrameCompressor::compressShared(first),shared);
+    QVERIFY(decompressor.decompress(shared,1024 * 1024,result));
+    QCOMPARE(result,first);
+    QVERIFY(decompressor.decompress(fresh.compress(first),1024 * 1024,result));
+    QCOMPARE(result,first);
+
+    // 解出来超过上限算失败
+    QVERIFY(!decompressor.decompress(FrameCompressor::compressShared(QByteArray(4096,'a')),1024,result));
+    QVERIFY(!decompressor.decompress(first,1024 * 1024,result));
+}
+
+void tst_ChatLogic::captureDeltaClamp()
+{
+    QByteArray data = CaptureFile::header(1700000000000);
+    qint64 lastNs = 0;
+    CaptureFile::Record record;
+    record.type = CaptureFile::Connect;
+    record.connectionId = 1;
+    record.timestampNs = 1000;
+    CaptureFile::appendRecord(data,record,lastNs);
+    // 多线程写入时时间戳可能倒退，增量按 0 记，时间不能往回走
+    record.type = CaptureFile::Frame;
+    record.timestampNs = 400;
+    record.frame = "frame";
+    CaptureFile::appendRecord(data,record,lastNs);
+    QCOMPARE(lastNs,qint64(1000));
+    record.type = CaptureFile::Disconnect;
+    record.timestampNs = 2500;
+    record.frame.clear();
+    CaptureFile::appendRecord(data,record,lastNs);
+    QCOMPARE(lastNs,qint64(2500));
+
+    QBuffer buffer(&data);
+    QVERIFY(buffer.open(QIODevice::ReadOnly));
+    CaptureFile::Reader reader(&buffer);
+    QVERIFY(reader.readHeader());
+    QCOMPARE(reader.startMs(),qint64(1700000000000));
+    CaptureFile::Record read;
+    QVERIFY(reader.next(read));
+    QCOMPARE(read.type,CaptureFile::Connect);
+    QCOMPARE(read.timestampNs,qint64(1000));
+    QVERIFY(reader.next(read));
+    QCOMPARE(read.type,CaptureFile::Frame);
+    QCOMPARE(read.connectionId,quint32(1));
+    QCOMPARE(read.timestampNs,qint64(1000));
+    QCOMPARE(read.frame,QByteArray("frame"));
+    QVERIFY(reader.next(read));
+    QCOMPARE(read.type,CaptureFile::Disconnect);
+    QCOMPARE(read.timestampNs,qint64(2500));
+    QVERIFY(!reader.next(read));
+}
+
+QTEST_GUILESS_MAIN(tst_ChatLogic)
+
+#include "tst_chatlogic.moc"
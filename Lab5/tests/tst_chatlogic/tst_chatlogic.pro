@@ -0,0 +1,34 @@
+QT       += core testlib
+QT       -= gui
+
+CONFIG += c++17 console testcase
+CONFIG -= app_bundle
+
+TEMPLATE = app
+TARGET = tst_chatlogic
+
+# 只编不依赖网络和服务器对象的那几个单元
+INCLUDEPATH += ../../ChatServer
+
+SOURCES += \
+    tst_chatlogic.cpp \
+    ../../ChatServer/capturefile.cpp \
+    ../../ChatServer/chattrace.cpp \
+    ../../ChatServer/framecompressor.cpp \
+    ../../ChatServer/idempotencywindow.cpp \
+    ../../ChatServer/searchindex.cpp \
+    ../../ChatServer/slotbitmap.cpp \
+    ../../ChatServer/websocketcodec.cpp
+
+HEADERS += \
+    ../../ChatServer/capturefile.h \
+    ../../ChatServer/chattrace.h \
+    ../../ChatServer/filechunk.h \
+    ../../ChatServer/framecompressor.h \
+    ../../ChatServer/idempotencywindow.h \
+    ../../ChatServer/mpscqueue.h \
+    ../../ChatServer/searchindex.h \
+    ../../ChatServer/slotbitmap.h \
+    ../../ChatServer/websocketcodec.h
+
+include(../../ChatServer/zlib.pri)
@@ -0,0 +1,445 @@
+#include <QtTest>
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QCborValue>
+#include <QCborMap>
+#include "chatserver.h"
+#include "serverworker.h"
+#include "userdirectory.h"
+#include "framecompressor.h"
+#include "filterpipeline.h"
+#include "messagefilter.h"
+
+// 内存里的假套接字：写出去的只计字节数，读的是 feed 进来的数据
+class MemorySocket : public QIODevice
+{
+public:
+    explicit MemorySocket(QObject *parent = nullptr)
+        : QIODevice(parent)
+    {
+        open(QIODevice::ReadWrite);
+    }
+
+    bool isSequential() const override { return true; }
+    qint64 bytesAvailable() const override { return m_inbound.size() + QIODevice::bytesAvailable(); }
+    qint64 written() const { return m_written; }
+
+    void feed(const QByteArray &data)
+    {
+        m_inbound.append(data);
+        emit readyRead();
+    }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override
+    {
+        const qint64 size = qMin(maxSize,qint64(m_inbound.size()));
+        memcpy(data,m_inbound.constData(),size_t(size));
+        m_inbound.remove(0,size);
+        return size;
+    }
+
+    qint64 writeData(const char *data, qint64 size) override
+    {
+        Q_UNUSED(data);
+        m_written += size;
+        return size;
+    }
+
+private:
+    QByteArray m_inbound;
+    qint64 m_written = 0;
+};
+
+// broadcast 和 m_clients 是受保护的，测试里直接往连接表里加假连接
+class BenchServer : public chatServer
+{
+public:
+    using chatServer::broadcast;
+
+    void addClient(ServerWorker *worker)
+    {
+        m_clients.append(worker);
+    }
+};
+
+enum Encoding
+{
+    JsonCompact,
+    JsonIndented,       // ServerWorker::sendMessage 和客户端 sendMessage 用的格式
+    Cbor,
+    Deflate             // 压缩帧，和广播时一样用不带上下文的压缩
+};
+Q_DECLARE_METATYPE(Encoding)
+
+static QJsonObject chatMessage()
+{
+    QJsonObject message;
+    message["type"] = "message";
+    message["text"] = QString("今天晚上一起去吃火锅吗？七点在老地方见 see you at 7pm");
+    message["sender"] = "alice";
+    message["room"] = "lobby";
+    message["seq"] = QJsonValue(qint64(123456));
+    return message;
+}
+
+static QJsonObject userListMessage(int users)
+{
+    QJsonArray userlist;
+    for(int i = 0; i < users; i++)
+        userlist.append(QString("user%1").arg(i));
+    QJsonObject message;
+    message["type"] = "userlist";
+    message["userlist"] = userlist;
+    return message;
+}
+
+// 编码成线上的帧：QDataStream(Qt_5_12) 写出的 QByteArray，4 字节长度前缀加内容
+static QByteArray encodeFrame(const QJsonObject &message, Encoding encoding)
+{
+    QByteArray payload;
+    switch(encoding){
+    case JsonCompact:
+        payload = QJsonDocument(message).toJson(QJsonDocument::Compact);
+        break;
+    case JsonIndented:
+        payload = QJsonDocument(message).toJson();
+        break;
+    case Cbor:
+        payload = QCborValue::fromJsonValue(message).toCbor();
+        break;
+    case Deflate:
+        // 每次都是新编码出来的数据，不会命中共享压缩的缓存
+        payload = FrameCompressor::compressShared(QJsonDocument(message).toJson(QJsonDocument::Compact));
+        break;
+    }
+    QByteArray frame;
+    QDataStream stream(&frame,QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_12);
+    stream << payload;
+    return frame;
+}
+
+static QJsonObject decodeFrame(const QByteArray &frame, Encoding encoding, FrameDecompressor &decompressor)
+{
+    QByteArray payload;
+    QDataStream stream(frame);
+    stream.setVersion(QDataStream::Qt_5_12);
+    stream >> payload;
+    switch(encoding){
+    case JsonCompact:
+    case JsonIndented:
+        return QJsonDocument::fromJson(payload).object();
+    case Cbor:
+        return QCborValue::fromCbor(payload).toMap().toJsonObject();
+    case Deflate:{
+        // 压不小的帧原样发出，和客户端一样按普通 JSON 解析
+        if(!FrameCompressor::isCompressed(payload))
+            return QJsonDocument::fromJson(payload).object();
+        QByteArray json;
+        if(!decompressor.decompress(payload,64 * 1024 * 1024,json))
+            return QJsonObject();
+        return QJsonDocument::fromJson(json).object();
+    }
+    }
+    return QJsonObject();
+}
+
+// MemorySocket 没有 Q_OBJECT，不能用 findChild 找回来，建的时候顺便交出去
+static ServerWorker *newWorker(QObject *parent, MemorySocket **socket = nullptr)
+{
+    ServerWorker *worker = new ServerWorker(parent);
+    MemorySocket *device = new MemorySocket(worker);
+    worker->setDevice(device);
+    if(socket)
+        *socket = device;
+    return worker;
+}
+
+// 服务器的登录路径每次都打一条 qDebug，计时期间丢掉，免得测进去的是控制台输出
+static QtMessageHandler previousMessageHandler = nullptr;
+
+static void dropDebugMessages(QtMsgType type, const QMessageLogContext &context, const QString &message)
+{
+    if(type != QtDebugMsg && previousMessageHandler)
+        previousMessageHandler(type,context,message);
+}
+
+static QJsonObject loginMessage(const QString &userName)
+{
+    QJsonObject message;
+    message["type"] = "login";
+    message["text"] = userName;
+    return message;
+}
+
+class tst_ChatPerf : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void encodeFrame_data();
+    void encodeFrame();
+    void decodeFrame_data();
+    void decodeFrame();
+    void inboundFrames();
+    void isUsernameTaken_data();
+    void isUsernameTaken();
+    void login_data();
+    void login();
+    void broadcast_data();
+    void broadcast();
+    void filter_data();
+    void filter();
+
+private:
+    void addEncodingRows();
+    void addUserRows();
+};
+
+void tst_ChatPerf::addEncodingRows()
+{
+    QTest::addColumn<Encoding>("encoding");
+    QTest::addColumn<QJsonObject>("message");
+    const QList<QPair<const char*,Encoding>> encodings = {
+        {"json",JsonCompact},
+        {"json-indented",JsonIndented},
+        {"cbor",Cbor},
+        {"deflate",Deflate}
+    };
+    for(const auto &encoding : encodings){
+        QTest::addRow("%s/chat",encoding.first) << encoding.second << chatMessage();
+        QTest::addRow("%s/userlist-1000",encoding.first) << encoding.second << userListMessage(1000);
+    }
+}
+
+void tst_ChatPerf::encodeFrame_data()
+{
+    addEncodingRows();
+}
+
+void tst_ChatPerf::encodeFrame()
+{
+    QFETCH(Encoding,encoding);
+    QFETCH(QJsonObject,message);
+    qint64 bytes = 0;
+    QBENCHMARK{
+        bytes += ::encodeFrame(message,encoding).size();
+    }
+    QVERIFY(bytes > 0);
+}
+
+void tst_ChatPerf::decodeFrame_data()
+{
+    addEncodingRows();
+}
+
+void tst_ChatPerf::decodeFrame()
+{
+    QFETCH(Encoding,encoding);
+    QFETCH(QJsonObject,message);
+    const QByteArray frame = ::encodeFrame(message,encoding);
+    FrameDecompressor decompressor;
+    QCOMPARE(decodeFrame(frame,encoding,decompressor),message);
+    QBENCHMARK{
+        decodeFrame(frame,encoding,decompressor);
+    }
+}
+
+void tst_ChatPerf::inboundFrames()
+{
+    // 服务器真实的读路径：从设备读出、拆帧、解析 JSON、发出 jsonReceived，每轮 100 帧
+    const int framesPerRound = 100;
+    QByteArray batch;
+    for(int i = 0; i < framesPerRound; i++)
+        batch += ::encodeFrame(chatMessage(),JsonCompact);
+    MemorySocket *socket = nullptr;
+    ServerWorker *worker = newWorker(nullptr,&socket);
+    int received = 0;
+    connect(worker,&ServerWorker::jsonReceived,this,[&received]{ received++; });
+    QBENCHMARK{
+        socket->feed(batch);
+    }
+    QVERIFY(received >= framesPerRound);
+    delete worker;
+}
+
+void tst_ChatPerf::addUserRows()
+{
+    QTest::addColumn<int>("users");
+    QTest::newRow("1k") << 1000;
+    QTest::newRow("10k") << 10000;
+    QTest::newRow("100k") << 100000;
+}
+
+void tst_ChatPerf::isUsernameTaken_data()
+{
+    addUserRows();
+}
+
+void tst_ChatPerf::isUsernameTaken()
+{
+    QFETCH(int,users);
+    // 目录里的用户都指向同一个占位连接，查重只看名字
+    ServerWorker placeholder;
+    chatServer server;
+    for(int i = 0; i < users; i++)
+        server.directory()->addUser(&placeholder,QString("user%1").arg(i));
+
+    // 一半查得到一半查不到
+    QStringList names;
+    for(int i = 0; i < 1024; i++)
+        names.append(i % 2 ? QString("user%1").arg(qint64(i) * 7919 % users) : QString("nobody%1").arg(i));
+    int index = 0;
+    int taken = 0;
+    QBENCHMARK{
+        taken += server.isUsernameTaken(names.at(index++ & 1023));
+    }
+    QVERIFY(taken > 0 || index < 2);
+}
+
+void tst_ChatPerf::login_data()
+{
+    addUserRows();
+}
+
+void tst_ChatPerf::login()
+{
+    QFETCH(int,users);
+    ServerWorker placeholder;
+    chatServer server;
+    for(int i = 0; i < users; i++)
+        server.directory()->addUser(&placeholder,QString("user%1").arg(i));
+
+    // 包括查重、登记目录、给新用户发完整的用户列表、进大厅。登录过的连接都留在大厅里，
+    // 大厅每轮多一个人，迭代次数多时进房间的开销会跟着变大；
+    // 新连接没加进服务器的连接表，上线通知没有接收者，这里不算广播的开销
+    QVector<ServerWorker*> workers;
+    previousMessageHandler = qInstallMessageHandler(dropDebugMessages);
+    QBENCHMARK{
+        ServerWorker *worker = newWorker(nullptr);
+        server.jsonReceived(worker,loginMessage(QString("bench%1").arg(workers.size())),0);
+        workers.append(worker);
+    }
+    qInstallMessageHandler(previousMessageHandler);
+    QVERIFY(!workers.first()->userName().isEmpty());
+    for(ServerWorker *worker : std::as_const(workers))
+        server.userDisconnected(worker);
+    QCoreApplication::sendPostedEvents(nullptr,QEvent::DeferredDelete);
+}
+
+void tst_ChatPerf::broadcast_data()
+{
+    QTest::addColumn<int>("clients");
+    QTest::newRow("10") << 10;
+    QTest::newRow("100") << 100;
+    QTest::newRow("1000") << 1000;
+    QTest::newRow("10000") << 10000;
+}
+
+void tst_ChatPerf::broadcast()
+{
+    QFETCH(int,clients);
+    BenchServer server;
+    QVector<MemorySocket*> sockets;
+    for(int i = 0; i < clients; i++){
+        MemorySocket *socket = nullptr;
+        server.addClient(newWorker(&server,&socket));
+        sockets.append(socket);
+    }
+    const QJsonObject message = chatMessage();
+    QBENCHMARK{
+        server.broadcast(message,nullptr);
+    }
+    QVERIFY(sockets.first()->written() > 0);
+    QCOMPARE(sockets.last()->written(),sockets.first()->written());
+}
+
+// 100 个敏感词里命中一个，另外带一条白名单里的链接，三个过滤器都要走完整条路径
+static QList<MessageFilter*> benchFilters()
+{
+    QStringList words;
+    for(int i = 0; i < 99; i++)
+        words.append(QString("badword%1").arg(i));
+    words.append("火锅");
+    return {new WordListFilter(words),new LinkFilter({"example.com"}),new DuplicateFilter};
+}
+
+void tst_ChatPerf::filter_data()
+{
+    // 单个过滤器在调用线程里直接跑；pipeline 是提交到线程池再回到主线程的整个往返
+    QTest::addColumn<QString>("filter");
+    QTest::newRow("words") << "words";
+    QTest::newRow("links") << "links";
+    QTest::newRow("duplicates") << "duplicates";
+    QTest::newRow("pipeline") << "pipeline";
+}
+
+void tst_ChatPerf::filter()
+{
+    QFETCH(QString,filter);
+    const QString text = chatMessage().value("text").toString() + " https://example.com/menu";
+    // 每轮换一个后缀，刷屏检测不会拦下
+    int round = 0;
+
+    if(filter != "pipeline"){
+        QScopedPointer<MessageFilter> target;
+        for(MessageFilter *candidate : benchFilters()){
+            if(candidate->name() == filter && !target)
+                target.reset(candidate);
+            else
+                delete candidate;
+        }
+        QVERIFY(target);
+        int rejected = 0;
+        QBENCHMARK{
+            QString copy = text + QString::number(round++);
+            QString reason;
+            rejected += target->filter("alice",copy,reason) == MessageFilter::Reject;
+        }
+        QCOMPARE(rejected,0);
+        return;
+    }
+
+    FilterPipeline pipeline;
+    for(MessageFilter *candidate : benchFilters())
+        pipeline.addFilter(candidate);
+    ServerWorker *worker = newWorker(nullptr);
+    QEventLoop loop;
+    int accepted = 0;
+    int rejected = 0;
+    connect(&pipeline,&FilterPipeline::messageAccepted,&loop,[&]{ accepted++; loop.quit(); });
+    connect(&pipeline,&FilterPipeline::messageRejected,&loop,[&]{ rejected++; loop.quit(); });
+    QJsonObject message = chatMessage();
+    QBENCHMARK{
+        message["text"] = text + QString::number(round++);
+        pipeline.submit(worker,message);
+        loop.exec();
+    }
+    QCOMPARE(rejected,0);
+    QCOMPARE(accepted,round);
+    pipeline.forgetSender(worker);
+    delete worker;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc,argv);
+    tst_ChatPerf test;
+    // 没指定输出时额外写一份 CSV（tst_chatperf.csv），每次提交跑一遍对比，性能回退一眼就能看出来
+    QStringList arguments = app.arguments();
+    bool hasOutput = false;
+    for(const QString &argument : std::as_const(arguments)){
+        if(argument == "-o" || argument == "-csv" || argument == "-xml" || argument == "-junitxml"
+                || argument == "-lightxml" || argument == "-teamcity" || argument == "-tap")
+            hasOutput = true;
+    }
+    if(!hasOutput)
+        arguments << "-o" << "tst_chatperf.csv,csv" << "-o" << "-,txt";
+    return QTest::qExec(&test,arguments);
+}
+
+#include "tst_chatperf.moc"
@@ -0,0 +1,69 @@
+QT       += core network testlib
+QT       -= gui
+
+CONFIG += c++17 console testcase
+CONFIG -= app_bundle
+
+TEMPLATE = app
+TARGET = tst_chatperf
+
+# 服务端的代码直接编进来，测的就是服务器实际跑的那份
+INCLUDEPATH += ../../ChatServer
+
+SOURCES += \
+    tst_chatperf.cpp \
+    ../../ChatServer/capturefile.cpp \
+    ../../ChatServer/chatroom.cpp \
+    ../../ChatServer/chatserver.cpp \
+    ../../ChatServer/chattrace.cpp \
+    ../../ChatServer/clusterlink.cpp \
+    ../../ChatServer/configreloader.cpp \
+    ../../ChatServer/filetransfer.cpp \
+    ../../ChatServer/framecompressor.cpp \
+    ../../ChatServer/filterpipeline.cpp \
+    ../../ChatServer/handoff.cpp \
+    ../../ChatServer/idempotencywindow.cpp \
+    ../../ChatServer/ioshards.cpp \
+    ../../ChatServer/memorybudget.cpp \
+    ../../ChatServer/messagefilter.cpp \
+    ../../ChatServer/multicastfanout.cpp \
+    ../../ChatServer/rttstats.cpp \
+    ../../ChatServer/searchindex.cpp \
+    ../../ChatServer/serverconfig.cpp \
+    ../../ChatServer/serverworker.cpp \
+    ../../ChatServer/slotbitmap.cpp \
+    ../../ChatServer/tlsacceptor.cpp \
+    ../../ChatServer/trafficcapture.cpp \
+    ../../ChatServer/userdirectory.cpp \
+    ../../ChatServer/websocketcodec.cpp
+
+HEADERS += \
+    ../../ChatServer/capturefile.h \
+    ../../ChatServer/chatroom.h \
+    ../../ChatServer/chatserver.h \
+    ../../ChatServer/chattrace.h \
+    ../../ChatServer/clusterlink.h \
+    ../../ChatServer/configreloader.h \
+    ../../ChatServer/filechunk.h \
+    ../../ChatServer/filetransfer.h \
+    ../../ChatServer/filterpipeline.h \
+    ../../ChatServer/framecompressor.h \
+    ../../ChatServer/handoff.h \
+    ../../ChatServer/idempotencywindow.h \
+    ../../ChatServer/ioshards.h \
+    ../../ChatServer/memorybudget.h \
+    ../../ChatServer/messagefilter.h \
+    ../../ChatServer/mpscqueue.h \
+    ../../ChatServer/multicastfanout.h \
+    ../../ChatServer/rttstats.h \
+    ../../ChatServer/searchindex.h \
+    ../../ChatServer/serverconfig.h \
+    ../../ChatServer/serverworker.h \
+    ../../ChatServer/slotbitmap.h \
+    ../../ChatServer/tlsacceptor.h \
+    ../../ChatServer/trafficcapture.h \
+    ../../ChatServer/userdirectory.h \
+    ../../ChatServer/websocketcodec.h
+
+include(../../ChatServer/zlib.pri)
+win32: LIBS += -lws2_32